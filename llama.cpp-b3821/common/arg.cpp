@@ -435,7 +435,7 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
                 params.draft_cpuparams.n_threads = std::thread::hardware_concurrency();
             }
         }
-    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE}));
+    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_SERVER}));
     add_opt(llama_arg(
         {"-tbd", "--threads-batch-draft"}, "N",
         "number of threads to use during batch and prompt processing (default: same as --threads-draft)",
@@ -445,7 +445,7 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
                 params.draft_cpuparams_batch.n_threads = std::thread::hardware_concurrency();
             }
         }
-    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE}));
+    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_SERVER}));
     add_opt(llama_arg(
         {"-C", "--cpu-mask"}, "M",
         "CPU affinity mask: arbitrarily long hex. Complements cpu-range (default: \"\")",
@@ -628,7 +628,7 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
         [](gpt_params & params, int value) {
             params.n_draft = value;
         }
-    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_LOOKUP}));
+    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_LOOKUP, LLAMA_EXAMPLE_SERVER}));
     add_opt(llama_arg(
         {"-ps", "--p-split"}, "N",
         format("speculative decoding split probability (default: %.1f)", (double)params.p_split),
@@ -642,7 +642,7 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
         [](gpt_params & params, const std::string & value) {
             params.lookup_cache_static = value;
         }
-    ).set_examples({LLAMA_EXAMPLE_LOOKUP}));
+    ).set_examples({LLAMA_EXAMPLE_LOOKUP, LLAMA_EXAMPLE_SERVER}));
     add_opt(llama_arg(
         {"-lcd", "--lookup-cache-dynamic"}, "FNAME",
         "path to dynamic lookup cache to use for lookup decoding (updated by generation)",
@@ -692,6 +692,13 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
             params.ctx_shift = false;
         }
     ).set_examples({LLAMA_EXAMPLE_MAIN, LLAMA_EXAMPLE_SERVER}));
+    add_opt(llama_arg(
+        {"--ctx-shift-sinks"},
+        format("on context shift, keep the first n_keep tokens as attention sinks next to a rolling window and move only the sinks forward, instead of moving the whole window back (default: %s)", params.ctx_shift_sinks ? "enabled" : "disabled"),
+        [](gpt_params & params) {
+            params.ctx_shift_sinks = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CTX_SHIFT_SINKS"));
     add_opt(llama_arg(
         {"--chunks"}, "N",
         format("max number of chunks to process (default: %d, -1 = all)", params.n_chunks),
@@ -723,6 +730,20 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
             params.sparams.no_perf = true;
         }
     ).set_env("LLAMA_ARG_NO_PERF"));
+    add_opt(llama_arg(
+        {"--profile"},
+        format("print the time, bandwidth and FLOPs of each op of the CPU graphs at exit (default: %s)", params.profile ? "true" : "false"),
+        [](gpt_params & params) {
+            params.profile = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_MAIN}));
+    add_opt(llama_arg(
+        {"--profile-trace"}, "FNAME",
+        "write the time of each node of the CPU graphs on each thread to FNAME at exit, in the Chrome trace format",
+        [](gpt_params & params, const std::string & value) {
+            params.profile_trace = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_MAIN}));
     add_opt(llama_arg(
         {"-f", "--file"}, "FNAME",
         "a file containing the prompt (default: none)",
@@ -1306,6 +1327,27 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
             params.defrag_thold = std::stof(value);
         }
     ).set_env("LLAMA_ARG_DEFRAG_THOLD"));
+    add_opt(llama_arg(
+        {"-kvb", "--kv-block-size"}, "N",
+        format("KV cache block size in cells for the paged cache (default: %d, 0 = contiguous)", params.kv_block_size),
+        [](gpt_params & params, int value) {
+            params.kv_block_size = value;
+        }
+    ).set_env("LLAMA_ARG_KV_BLOCK_SIZE"));
+    add_opt(llama_arg(
+        {"--swa-full"},
+        format("keep the full context in the KV cache of the sliding-window attention layers, allows rewinding sequences by more than a batch (default: %s)", params.swa_full ? "enabled" : "disabled"),
+        [](gpt_params & params) {
+            params.swa_full = true;
+        }
+    ).set_env("LLAMA_ARG_SWA_FULL"));
+    add_opt(llama_arg(
+        {"--lazy-rope"},
+        format("cache K before RoPE and rotate it when attending, context shifts no longer rotate the KV cache (default: %s)", params.lazy_rope ? "enabled" : "disabled"),
+        [](gpt_params & params) {
+            params.lazy_rope = true;
+        }
+    ).set_env("LLAMA_ARG_LAZY_ROPE"));
     add_opt(llama_arg(
         {"-np", "--parallel"}, "N",
         format("number of parallel sequences to decode (default: %d)", params.n_parallel),
@@ -1377,15 +1419,32 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
         "- distribute: spread execution evenly over all nodes\n"
         "- isolate: only spawn threads on CPUs on the node that execution started on\n"
         "- numactl: use the CPU map provided by numactl\n"
+        "- split: distribute, and split the rows of each weight matrix across the nodes (disables mmap)\n"
         "if run without this previously, it is recommended to drop the system page cache before using this\n"
         "see https://github.com/ggerganov/llama.cpp/issues/1437",
         [](gpt_params & params, const std::string & value) {
             /**/ if (value == "distribute" || value == "") { params.numa = GGML_NUMA_STRATEGY_DISTRIBUTE; }
             else if (value == "isolate") { params.numa = GGML_NUMA_STRATEGY_ISOLATE; }
             else if (value == "numactl") { params.numa = GGML_NUMA_STRATEGY_NUMACTL; }
+            else if (value == "split")   { params.numa = GGML_NUMA_STRATEGY_SPLIT; }
             else { throw std::invalid_argument("invalid value"); }
         }
     ));
+    add_opt(llama_arg(
+        {"--pipeline-stages"}, "N",
+        format("split the layers across N CPU stages with threads of their own, the ubatches of a batch are pipelined through them\n"
+               "with --numa, each stage runs on its own node (default: %d, 0 = disabled)", params.n_pipeline_stages),
+        [](gpt_params & params, int value) {
+            params.n_pipeline_stages = value;
+        }
+    ).set_env("LLAMA_ARG_PIPELINE_STAGES"));
+    add_opt(llama_arg(
+        {"--async-decode"},
+        format("compute the graphs on a CPU thread of their own, overlapped with sampling and output (default: %s)", params.async_decode ? "enabled" : "disabled"),
+        [](gpt_params & params) {
+            params.async_decode = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_MAIN, LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_ASYNC_DECODE"));
     add_opt(llama_arg(
         {"-ngl", "--gpu-layers", "--n-gpu-layers"}, "N",
         "number of layers to store in VRAM",
@@ -1407,7 +1466,7 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
                 fprintf(stderr, "warning: see main README.md for information on enabling GPU BLAS support\n");
             }
         }
-    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE}));
+    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_SERVER}));
     add_opt(llama_arg(
         {"-sm", "--split-mode"}, "{none,layer,row}",
         "how to split the model across multiple GPUs, one of:\n"
@@ -1552,7 +1611,7 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
         [](gpt_params & params, const std::string & value) {
             params.model_draft = value;
         }
-    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE}));
+    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_SERVER}));
     add_opt(llama_arg(
         {"-mu", "--model-url"}, "MODEL_URL",
         "model download url (default: unused)",
@@ -1867,6 +1926,71 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
             params.slot_prompt_similarity = std::stof(value);
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(llama_arg(
+        {"--kv-store-ram"}, "N",
+        format("host memory in MiB for the KV cache of conversations evicted from their slot, restored when a prompt continues them (default: %d, 0 = disabled)", params.kv_store_ram),
+        [](gpt_params & params, int value) {
+            params.kv_store_ram = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_STORE_RAM"));
+    add_opt(llama_arg(
+        {"--kv-store-path"}, "PATH",
+        "directory to spill the KV store to when it exceeds --kv-store-ram (default: disabled)",
+        [](gpt_params & params, const std::string & value) {
+            params.kv_store_path = value;
+            // if doesn't end with DIRECTORY_SEPARATOR, add it
+            if (!params.kv_store_path.empty() && params.kv_store_path[params.kv_store_path.size() - 1] != DIRECTORY_SEPARATOR) {
+                params.kv_store_path += DIRECTORY_SEPARATOR;
+            }
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(llama_arg(
+        {"--kv-store-disk"}, "N",
+        format("disk space in MiB for the spilled KV store (default: %d, 0 = unlimited)", params.kv_store_disk),
+        [](gpt_params & params, int value) {
+            params.kv_store_disk = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(llama_arg(
+        {"--park-ram"}, "N",
+        format("host memory in MiB for the KV cache of preempted requests, beyond it they go to the KV store or process their prompt again when they resume (default: %d, 0 = none)", params.park_ram),
+        [](gpt_params & params, int value) {
+            params.park_ram = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PARK_RAM"));
+    add_opt(llama_arg(
+        {"--no-prefix-cache"},
+        "disable sharing the KV cache of the longest cached prompt prefix with a slot that starts a new prompt (default: enabled)",
+        [](gpt_params & params) {
+            params.prefix_cache = false;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_NO_PREFIX_CACHE"));
+    add_opt(llama_arg(
+        {"--decode-latency"}, "MS",
+        format("target time in ms of a decode step while slots generate, long prompts are processed in chunks that fit in it (default: %.1f, 0.0 = prompts fill the batch)", (double) params.decode_latency),
+        [](gpt_params & params, const std::string & value) {
+            params.decode_latency = std::stof(value);
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_DECODE_LATENCY"));
+    add_opt(llama_arg(
+        {"--tenant-weight"}, "NAME", "WEIGHT",
+        "weight of tenant NAME when waiting requests are scheduled, a tenant with twice the weight gets twice the tokens (default: 1.0)\n"
+        "note: this argument can be repeated to weight multiple tenants",
+        [](gpt_params & params, const std::string & name, const std::string & weight) {
+            const float w = std::stof(weight);
+            if (w <= 0.0f) {
+                throw std::invalid_argument("error: tenant weight must be positive\n");
+            }
+            params.tenant_weights.push_back({ name, w });
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(llama_arg(
+        {"--lookup"},
+        format("speculative decoding without a draft model, draft the tokens that followed the last tokens earlier in the prompt and the generated text (default: %s)", params.lookup ? "enabled" : "disabled"),
+        [](gpt_params & params) {
+            params.lookup = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_LOOKUP"));
     add_opt(llama_arg(
         {"--lora-init-without-apply"},
         format("load LoRA adapters without applying them (apply later via POST /lora-adapters) (default: %s)", params.lora_init_without_apply ? "enabled" : "disabled"),
@@ -1019,11 +1019,17 @@ struct llama_context_params llama_context_params_from_gpt_params(const gpt_param
     cparams.pooling_type      = params.pooling_type;
     cparams.attention_type    = params.attention_type;
     cparams.defrag_thold      = params.defrag_thold;
+    cparams.kv_block_size     = params.kv_block_size;
+    cparams.n_pipeline_stages = params.n_pipeline_stages;
+    cparams.n_swa_keep        = params.n_keep >= 0 ? params.n_keep + 1 : 0; // the BOS token is kept on top of n_keep
     cparams.cb_eval           = params.cb_eval;
     cparams.cb_eval_user_data = params.cb_eval_user_data;
     cparams.offload_kqv       = !params.no_kv_offload;
     cparams.flash_attn        = params.flash_attn;
     cparams.no_perf           = params.no_perf;
+    cparams.swa_full          = params.swa_full;
+    cparams.lazy_rope         = params.lazy_rope;
+    cparams.async_decode      = params.async_decode;
 
     cparams.type_k = kv_cache_type_from_str(params.cache_type_k);
     cparams.type_v = kv_cache_type_from_str(params.cache_type_v);
@@ -167,6 +167,8 @@ struct gpt_params {
     float   yarn_beta_slow        =  1.0f; // YaRN high correction dim
     int32_t yarn_orig_ctx         =     0; // YaRN original context length
     float   defrag_thold          = -1.0f; // KV cache defragmentation threshold
+    int32_t kv_block_size         =     0; // KV cache block size for the paged cache (0 = contiguous)
+    int32_t n_pipeline_stages     =     0; // number of CPU pipeline stages the layers are split across (0 = disabled)
 
     struct cpu_params cpuparams;
     struct cpu_params cpuparams_batch;
@@ -201,6 +203,7 @@ struct gpt_params {
     std::string lookup_cache_static  = ""; // path of static ngram cache file for lookup decoding           // NOLINT
     std::string lookup_cache_dynamic = ""; // path of dynamic ngram cache file for lookup decoding          // NOLINT
     std::string logits_file          = ""; // file for saving *all* logits                                  // NOLINT
+    std::string profile_trace        = ""; // file for saving a Chrome trace of the CPU graphs              // NOLINT
     std::string rpc_servers          = ""; // comma separated list of RPC servers                           // NOLINT
 
     std::vector<std::string> in_files;   // all input files
@@ -246,7 +249,12 @@ struct gpt_params {
     bool cont_batching     = true;  // insert new sequences for decoding on-the-fly
     bool flash_attn        = false; // flash attention
     bool no_perf           = false; // disable performance metrics
+    bool profile           = false; // print the time spent in each op of the CPU graphs
+    bool swa_full          = false; // full-size KV cache for the sliding-window attention layers
+    bool lazy_rope         = false; // cache K before RoPE and rotate it when attending
+    bool async_decode      = false; // compute the graphs on a CPU thread of their own and overlap them with sampling
     bool ctx_shift         = true;  // context shift on inifinite text generation
+    bool ctx_shift_sinks   = false; // context shift keeps the n_keep tokens as attention sinks and moves them forward (StreamingLLM)
 
     bool input_prefix_bos  = false; // prefix BOS to user inputs, preceding input_prefix
     bool logits_all        = false; // return logits for all tokens in the batch
@@ -298,6 +306,20 @@ struct gpt_params {
 
     float slot_prompt_similarity = 0.5f;
 
+    int32_t     kv_store_ram  = 0;  // host memory for the KV of evicted conversations in MiB (0 = disabled)
+    int32_t     kv_store_disk = 0;  // disk space for spilled conversations in MiB (0 = unlimited)
+    std::string kv_store_path = ""; // directory for spilled conversations (empty = no disk tier) // NOLINT
+
+    int32_t park_ram = 256; // host memory for the KV of preempted tasks in MiB, beyond it they are re-prefilled (0 = never kept)
+
+    bool prefix_cache = true; // share the KV cells of the longest cached prompt prefix between the slots
+
+    float decode_latency = 0.0f; // target time of a decode step in ms while slots generate, sizes the prompt chunks (0 = prompts fill the batch)
+
+    std::vector<std::pair<std::string, float>> tenant_weights; // share of the slots for each tenant when requests wait (default weight 1.0)
+
+    bool lookup = false; // draft tokens for speculative decoding from the n-grams of the context of each slot
+
     // batched-bench params
     bool is_pp_shared = false;
 
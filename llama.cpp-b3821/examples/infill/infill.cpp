@@ -375,7 +375,11 @@ int main(int argc, char ** argv) {
                 LOG_DBG("context full, swapping: n_past = %d, n_left = %d, n_ctx = %d, n_keep = %d, n_discard = %d\n",
                     n_past, n_left, n_ctx, params.n_keep, n_discard);
 
-                llama_kv_cache_seq_rm (ctx, 0, params.n_keep + 1            , params.n_keep + n_discard + 1);
+                if (!llama_kv_cache_seq_rm(ctx, 0, params.n_keep + 1, params.n_keep + n_discard + 1)) {
+                    // the sliding-window cache no longer has the cells that the shift brings back into the window
+                    LOG_ERR("\n\n%s: context full and the KV cache cannot be shifted with n_keep = %d (try --swa-full) => stopping\n", __func__, params.n_keep);
+                    break;
+                }
                 llama_kv_cache_seq_add(ctx, 0, params.n_keep + 1 + n_discard, n_past, -n_discard);
 
                 n_past -= n_discard;
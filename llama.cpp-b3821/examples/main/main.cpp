@@ -41,6 +41,22 @@ static std::vector<llama_token> * g_output_tokens;
 static bool is_interacting  = false;
 static bool need_insert_eot = false;
 
+static void print_threadpool_stats(const char * name, struct ggml_threadpool * threadpool) {
+    if (threadpool == nullptr) {
+        return;
+    }
+
+    ggml_threadpool_stats stats;
+    ggml_threadpool_get_stats(threadpool, &stats);
+
+    LOG_INF("%s: %6lld graphs, compute = %10.2f ms, idle = %10.2f ms\n", name,
+            (long long) stats.n_graphs, 1e-3 * stats.t_compute_us, 1e-3 * stats.t_idle_us);
+    LOG_INF("%s: worker wait: spin = %10.2f ms (%6lld wakeups), yield = %10.2f ms (%6lld wakeups), sleep = %10.2f ms (%6lld wakeups)\n", name,
+            1e-3 * stats.t_spin_us,  (long long) stats.n_spin_wakeups,
+            1e-3 * stats.t_yield_us, (long long) stats.n_yield_wakeups,
+            1e-3 * stats.t_sleep_us, (long long) stats.n_sleep_wakeups);
+}
+
 static void print_usage(int argc, char ** argv) {
     (void) argc;
 
@@ -236,6 +252,13 @@ int main(int argc, char ** argv) {
 
     llama_attach_threadpool(ctx, threadpool, threadpool_batch);
 
+    struct ggml_profiler * profiler = nullptr;
+    if (params.profile || !params.profile_trace.empty()) {
+        // the trace keeps one event per node and thread, ~100 bytes each
+        profiler = ggml_profiler_new(params.profile_trace.empty() ? 0 : 1024*1024);
+        llama_attach_profiler(ctx, profiler);
+    }
+
     const int n_ctx_train = llama_n_ctx_train(model);
     const int n_ctx = llama_n_ctx(ctx);
 
@@ -345,7 +368,13 @@ int main(int argc, char ** argv) {
         }
 
         // remove any "future" tokens that we might have inherited from the previous session
-        llama_kv_cache_seq_rm(ctx, -1, n_matching_session_tokens, -1);
+        if (!llama_kv_cache_seq_rm(ctx, -1, n_matching_session_tokens, -1)) {
+            // the sliding-window cache cannot be rewound that far
+            LOG_WRN("%s: the session cannot be rewound to %zu tokens, the prompt will be reevaluated\n", __func__, n_matching_session_tokens);
+            llama_kv_cache_clear(ctx);
+            session_tokens.clear();
+            n_matching_session_tokens = 0;
+        }
     }
 
     LOG_DBG("recalculate the cached logits (check): embd_inp.size() %zu, n_matching_session_tokens %zu, embd_inp.size() %zu, session_tokens.size() %zu\n",
@@ -505,6 +534,8 @@ int main(int argc, char ** argv) {
     int n_consumed         = 0;
     int n_session_consumed = 0;
 
+    bool decode_submitted = false; // the last sampled token is being decoded by llama_decode_async()
+
     std::vector<int>   input_tokens;  g_input_tokens  = &input_tokens;
     std::vector<int>   output_tokens; g_output_tokens = &output_tokens;
     std::ostringstream output_ss;     g_output_ss     = &output_ss;
@@ -544,7 +575,13 @@ int main(int argc, char ** argv) {
 
     while ((n_remain != 0 && !is_antiprompt) || params.interactive) {
         // predict
-        if (!embd.empty()) {
+        if (decode_submitted) {
+            decode_submitted = false;
+            if (llama_decode_wait(ctx)) {
+                LOG_ERR("%s : failed to eval\n", __func__);
+                return 1;
+            }
+        } else if (!embd.empty()) {
             // Note: (n_ctx - 4) here is to match the logic for commandline prompt handling via
             // --prompt or --file which uses the same value.
             int max_embd_size = n_ctx - 4;
@@ -581,7 +618,11 @@ int main(int argc, char ** argv) {
                         LOG_DBG("context full, swapping: n_past = %d, n_left = %d, n_ctx = %d, n_keep = %d, n_discard = %d\n",
                                 n_past, n_left, n_ctx, params.n_keep, n_discard);
 
-                        llama_kv_cache_seq_rm (ctx, 0, params.n_keep            , params.n_keep + n_discard);
+                        if (!llama_kv_cache_seq_rm(ctx, 0, params.n_keep, params.n_keep + n_discard)) {
+                            // the sliding-window cache no longer has the cells that the shift brings back into the window
+                            LOG_ERR("\n\n%s: context full and the KV cache cannot be shifted with n_keep = %d (try --swa-full) => stopping\n", __func__, params.n_keep);
+                            break;
+                        }
                         llama_kv_cache_seq_add(ctx, 0, params.n_keep + n_discard, n_past, -n_discard);
 
                         n_past -= n_discard;
@@ -694,6 +735,19 @@ int main(int argc, char ** argv) {
             --n_remain;
 
             LOG_DBG("n_remain: %d\n", n_remain);
+
+            // decode the token while it is displayed and checked for a reverse prompt, when it does not need a context shift
+            if (params.async_decode && ga_n == 1 && path_session.empty() && n_past + 1 < n_ctx &&
+                !llama_token_is_eog(model, id) && (n_remain != 0 || params.interactive)) {
+                if (llama_decode_async(ctx, llama_batch_get_one(&embd[0], 1, n_past, 0))) {
+                    LOG_ERR("%s : failed to eval\n", __func__);
+                    return 1;
+                }
+
+                n_past += 1;
+
+                decode_submitted = true;
+            }
         } else {
             // some user input remains from prompt or interaction, forward it to processing
             LOG_DBG("embd_inp.size(): %d, n_consumed: %d\n", (int) embd_inp.size(), n_consumed);
@@ -919,6 +973,14 @@ int main(int argc, char ** argv) {
         }
     }
 
+    // the last token may still be decoded in the background when a reverse prompt ends the generation
+    if (decode_submitted) {
+        decode_submitted = false;
+        if (llama_decode_wait(ctx)) {
+            LOG_ERR("%s : failed to eval\n", __func__);
+        }
+    }
+
     if (!path_session.empty() && params.prompt_cache_all && !params.prompt_cache_ro) {
         LOG("\n%s: saving final output to session file '%s'\n", __func__, path_session.c_str());
         llama_state_save_file(ctx, path_session.c_str(), session_tokens.data(), session_tokens.size());
@@ -926,6 +988,18 @@ int main(int argc, char ** argv) {
 
     LOG("\n\n");
     gpt_perf_print(ctx, smpl);
+    print_threadpool_stats("threadpool      ", threadpool);
+    print_threadpool_stats("threadpool_batch", threadpool_batch);
+    if (params.profile) {
+        ggml_profiler_print(profiler, stderr);
+    }
+    if (!params.profile_trace.empty()) {
+        if (ggml_profiler_write_trace(profiler, params.profile_trace.c_str())) {
+            LOG_INF("%s: profile trace written to '%s'\n", __func__, params.profile_trace.c_str());
+        } else {
+            LOG_ERR("%s: failed to write the profile trace to '%s'\n", __func__, params.profile_trace.c_str());
+        }
+    }
     write_logfile(ctx, params, model, input_tokens, output_ss.str(), output_tokens);
 
     gpt_sampler_free(smpl);
@@ -937,6 +1011,7 @@ int main(int argc, char ** argv) {
 
     ggml_threadpool_free(threadpool);
     ggml_threadpool_free(threadpool_batch);
+    ggml_profiler_free(profiler);
 
     return 0;
 }
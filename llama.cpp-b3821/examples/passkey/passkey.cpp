@@ -164,7 +164,10 @@ int main(int argc, char ** argv) {
 
         LOG_INF("%s: shifting KV cache with %d\n", __func__, n_discard);
 
-        llama_kv_cache_seq_rm (ctx, 0, n_keep            , n_keep + n_discard);
+        if (!llama_kv_cache_seq_rm(ctx, 0, n_keep, n_keep + n_discard)) {
+            LOG_ERR("%s: failed to shift the KV cache with n_keep = %d (try --swa-full)\n", __func__, n_keep);
+            return 1;
+        }
         llama_kv_cache_seq_add(ctx, 0, n_keep + n_discard, n_ctx,  -n_discard);
       //llama_kv_cache_defrag (ctx);
         llama_kv_cache_update (ctx);
@@ -195,7 +198,10 @@ int main(int argc, char ** argv) {
         if (n_discard > 0) {
             LOG_INF("%s: shifting KV cache with %d to free space for the answer\n", __func__, n_discard);
 
-            llama_kv_cache_seq_rm (ctx, 0, n_keep            , n_keep + n_discard);
+            if (!llama_kv_cache_seq_rm(ctx, 0, n_keep, n_keep + n_discard)) {
+                LOG_ERR("%s: failed to shift the KV cache with n_keep = %d (try --swa-full)\n", __func__, n_keep);
+                return 1;
+            }
             llama_kv_cache_seq_add(ctx, 0, n_keep + n_discard, n_ctx,  -n_discard);
           //llama_kv_cache_defrag (ctx);
             llama_kv_cache_update (ctx);
@@ -4,6 +4,7 @@
 #include "common.h"
 #include "log.h"
 #include "sampling.h"
+#include "ngram-cache.h"
 #include "json-schema-to-grammar.h"
 #include "llama.h"
 
@@ -35,7 +36,11 @@
 #include <condition_variable>
 #include <cstddef>
 #include <cinttypes>
+#include <cstring>
 #include <deque>
+#include <fstream>
+#include <future>
+#include <list>
 #include <memory>
 #include <mutex>
 #include <signal.h>
@@ -43,6 +48,12 @@
 #include <unordered_map>
 #include <unordered_set>
 
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
 #define SLT_INF(slot, fmt, ...) LOG_INF("slot %12.*s: id %2d | task %d | " fmt, 12, __func__, (slot).id, (slot).id_task, __VA_ARGS__)
 #define SLT_WRN(slot, fmt, ...) LOG_WRN("slot %12.*s: id %2d | task %d | " fmt, 12, __func__, (slot).id, (slot).id_task, __VA_ARGS__)
 #define SLT_ERR(slot, fmt, ...) LOG_ERR("slot %12.*s: id %2d | task %d | " fmt, 12, __func__, (slot).id, (slot).id_task, __VA_ARGS__)
@@ -58,6 +69,10 @@
 #define QUE_ERR(fmt, ...) LOG_ERR("que  %12.*s: " fmt, 12, __func__, __VA_ARGS__)
 #define QUE_DBG(fmt, ...) LOG_DBG("que  %12.*s: " fmt, 12, __func__, __VA_ARGS__)
 
+// the draft model has to tokenize like the target model
+#define SPEC_VOCAB_MAX_SIZE_DIFFERENCE  100
+#define SPEC_VOCAB_CHECK_START_TOKEN_ID 5
+
 using json = nlohmann::ordered_json;
 
 enum stop_type {
@@ -104,6 +119,8 @@ struct server_task {
 
     server_task_cmpl_type cmpl_type = SERVER_TASK_CMPL_TYPE_NORMAL;
 
+    int64_t t_posted = 0; // us, when the request entered the queue
+
     // utility function
     static std::unordered_set<int> get_list_id(const std::vector<server_task> & tasks) {
         std::unordered_set<int> ids(tasks.size());
@@ -131,6 +148,11 @@ struct slot_params {
     int32_t  n_discard =  0; // number of tokens after n_keep that may be discarded when shifting context, 0 defaults to half
     int32_t  n_predict = -1; // new tokens to predict
 
+    int32_t  n_draft   =  0; // max number of tokens drafted for each decode step (0 = no speculative decoding)
+
+    int32_t     priority = 0; // a waiting task with a higher priority preempts the slots of lower ones
+    std::string tenant;       // weighted-fair share of the slots among the waiting tasks
+
     std::vector<std::string> antiprompt;
 
     json input_prefix;
@@ -177,6 +199,9 @@ struct server_slot {
     bool stopped_eos    = false;
     bool stopped_word   = false;
     bool stopped_limit  = false;
+    bool resumed        = false; // the task continues a generation that was preempted
+
+    json task_data; // request of the task, to resume it after a preemption
 
     bool oaicompat = false;
 
@@ -197,13 +222,32 @@ struct server_slot {
 
     int32_t n_past_se = 0; // self-extend
 
+    int32_t pos_shift = 0; // offset of the positions of the cached tokens, grows when context shifts move the attention sinks forward
+
+    // speculative decoding
+    int32_t n_draft = 0; // draft length of the next step, adapts to the number of accepted drafts
+
+    std::vector<llama_token> drafted;          // drafts that follow the sampled token in the batch
+    std::vector<llama_token> cache_tokens_dft; // tokens in the sequence of the slot in the draft context
+
+    llama_ngram_cache        ngram_cache;  // n-grams of the context of the slot for lookup decoding
+    std::vector<llama_token> ngram_tokens; // the context the n-gram cache was built from
+
+    size_t n_spec_checked = 0; // leading tokens of the context known to be in the draft sequence / n-gram cache
+
+    int32_t n_draft_total    = 0;
+    int32_t n_draft_accepted = 0;
+
     // stats
     size_t n_sent_text = 0; // number of sent text character
     size_t n_sent_token_probs = 0;
 
+    int64_t t_posted; // the request entered the queue
+    int64_t t_start_task;
     int64_t t_start_process_prompt;
     int64_t t_start_generation;
 
+    double t_first_token;       // ms, from the arrival of the request to its first token (TTFT)
     double t_prompt_processing; // ms
     double t_token_generation; // ms
 
@@ -218,6 +262,7 @@ struct server_slot {
         stopped_eos        = false;
         stopped_word       = false;
         stopped_limit      = false;
+        resumed            = false;
         stopping_word      = "";
         n_past             = 0;
         n_sent_text        = 0;
@@ -225,10 +270,17 @@ struct server_slot {
         cmpl_type          = SERVER_TASK_CMPL_TYPE_NORMAL;
         ga_i               = 0;
         n_past_se          = 0;
+        n_draft_total      = 0;
+        n_draft_accepted   = 0;
 
         generated_token_probs.clear();
     }
 
+    // the tokens of the sequence are followed in cache_tokens when the prompt is cached or the slot drafts from them
+    bool has_cache_tokens() const {
+        return params.cache_prompt || params.n_draft > 0;
+    }
+
     bool has_budget(gpt_params &global_params) {
         if (params.n_predict == -1 && global_params.n_predict == -1) {
             return true; // limitless
@@ -259,14 +311,19 @@ struct server_slot {
 
     void release() {
         if (is_processing()) {
-            SLT_INF(*this, "stop processing: n_past = %d, truncated = %d\n", n_past, truncated);
-
-            t_token_generation = (ggml_time_us() - t_start_generation) / 1e3;
-            state = SLOT_STATE_IDLE;
+            stop();
             callback_on_release(id);
         }
     }
 
+    // stop processing without notifying the server, the slot is handed over to another task right away
+    void stop() {
+        SLT_INF(*this, "stop processing: n_past = %d, truncated = %d\n", n_past, truncated);
+
+        t_token_generation = (ggml_time_us() - t_start_generation) / 1e3;
+        state = SLOT_STATE_IDLE;
+    }
+
     json get_formated_timings() const {
         return json {
             {"prompt_n",               n_prompt_tokens_processed},
@@ -278,9 +335,20 @@ struct server_slot {
             {"predicted_ms",           t_token_generation},
             {"predicted_per_token_ms", t_token_generation / n_decoded},
             {"predicted_per_second",   1e3 / t_token_generation * n_decoded},
+
+            {"ttft_ms",                t_first_token},
+            {"tpot_ms",                get_tpot()},
+
+            {"draft_n",                n_draft_total},
+            {"draft_n_accepted",       n_draft_accepted},
         };
     }
 
+    // ms per output token after the first one (TPOT)
+    double get_tpot() const {
+        return n_decoded > 1 ? t_token_generation / (n_decoded - 1) : 0.0;
+    }
+
     size_t find_stopping_strings(const std::string & text, const size_t last_token_size, const stop_type type) {
         size_t stop_pos = std::string::npos;
 
@@ -320,10 +388,17 @@ struct server_slot {
                 "\n"
                 "\rprompt eval time = %10.2f ms / %5d tokens (%8.2f ms per token, %8.2f tokens per second)\n"
                 "\r       eval time = %10.2f ms / %5d tokens (%8.2f ms per token, %8.2f tokens per second)\n"
-                "\r      total time = %10.2f ms / %5d tokens\n",
+                "\r      total time = %10.2f ms / %5d tokens\n"
+                "\r            ttft = %10.2f ms, tpot = %8.2f ms\n",
                 t_prompt_processing, n_prompt_tokens_processed, t_prompt, n_prompt_second,
                 t_token_generation, n_decoded, t_gen, n_gen_second,
-                t_prompt_processing + t_token_generation, n_prompt_tokens_processed + n_decoded);
+                t_prompt_processing + t_token_generation, n_prompt_tokens_processed + n_decoded,
+                t_first_token, get_tpot());
+
+        if (n_draft_total > 0) {
+            SLT_INF(*this, "draft acceptance = %5.1f %% (%d accepted / %d drafted)\n",
+                    100.0 * n_draft_accepted / n_draft_total, n_draft_accepted, n_draft_total);
+        }
     }
 };
 
@@ -341,9 +416,18 @@ struct server_metrics {
     uint64_t n_tokens_predicted  = 0;
     uint64_t t_tokens_generation = 0;
 
+    uint64_t n_first_token = 0; // requests that got their first token
+    uint64_t t_first_token = 0; // ms, sum of their TTFT
+    uint64_t n_tpot_tokens = 0; // output tokens after the first, t_tokens_generation is spent on them
+
     uint64_t n_decode_total     = 0;
     uint64_t n_busy_slots_total = 0;
 
+    uint64_t n_preempted_total = 0; // tasks that gave up their slot to a task with a higher priority
+
+    uint64_t n_draft_total          = 0; // tokens drafted for speculative decoding
+    uint64_t n_draft_accepted_total = 0; // drafted tokens that the target model sampled as well
+
     void init() {
         t_start = ggml_time_us();
     }
@@ -353,6 +437,12 @@ struct server_metrics {
         n_prompt_tokens_processed       += slot.n_prompt_tokens_processed;
         t_prompt_processing             += slot.t_prompt_processing;
         t_prompt_processing_total       += slot.t_prompt_processing;
+
+        // the first token of a preempted task was counted before it was preempted
+        if (!slot.resumed) {
+            n_first_token++;
+            t_first_token += slot.t_first_token;
+        }
     }
 
     void on_prediction(const server_slot & slot) {
@@ -360,6 +450,13 @@ struct server_metrics {
         n_tokens_predicted         += slot.n_decoded;
         t_tokens_generation        += slot.t_token_generation;
         t_tokens_generation_total  += slot.t_token_generation;
+
+        n_tpot_tokens += std::max(slot.n_decoded - 1, 0);
+    }
+
+    void on_draft(int32_t n_drafted, int32_t n_accepted) {
+        n_draft_total          += n_drafted;
+        n_draft_accepted_total += n_accepted;
     }
 
     void on_decoded(const std::vector<server_slot> & slots) {
@@ -376,1153 +473,2483 @@ struct server_metrics {
         t_prompt_processing       = 0;
         n_tokens_predicted        = 0;
         t_tokens_generation       = 0;
+        n_first_token             = 0;
+        t_first_token             = 0;
+        n_tpot_tokens             = 0;
     }
 };
 
-struct server_queue {
-    int id = 0;
-    bool running;
+// sizes the prompt chunks that share a batch with generating slots, so that a decode step stays within the latency target
+// the time of a step is modeled as t_decode + n_prefill*t_token, both learned from the measured steps
+struct server_prefill_sched {
+    double t_target = 0.0; // ms, 0 = the prompts fill the batch
 
-    // queues
-    std::deque<server_task> queue_tasks;
-    std::deque<server_task> queue_tasks_deferred;
+    double t_decode = 0.0; // ms, step without prompt tokens
+    double t_token  = 0.0; // ms per prompt token
 
-    std::mutex mutex_tasks;
-    std::condition_variable condition_tasks;
+    bool has_decode = false;
+    bool has_token  = false;
 
-    // callback functions
-    std::function<void(server_task&)> callback_new_task;
-    std::function<void(void)>         callback_update_slots;
+    // prompts advance by at least this many tokens per step, whatever the target
+    static constexpr int32_t n_min = 16;
 
-    // Add a new task to the end of the queue
-    int post(server_task task, bool front = false) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        if (task.id == -1) {
-            task.id = id++;
-        }
-        QUE_DBG("new task, id = %d, front = %d\n", task.id, front);
-        if (front) {
-            queue_tasks.push_front(std::move(task));
-        } else {
-            queue_tasks.push_back(std::move(task));
+    // weight of the last step in the estimates
+    static constexpr double alpha = 0.2;
+
+    // max number of prompt tokens in a step with n_gen generating slots
+    int32_t n_prefill_max(int32_t n_gen, int32_t n_batch) const {
+        if (t_target <= 0.0 || n_gen == 0) {
+            return n_batch;
         }
-        condition_tasks.notify_one();
-        return task.id;
-    }
 
-    // multi-task version of post()
-    int post(std::vector<server_task> & tasks, bool front = false) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        for (auto & task : tasks) {
-            if (task.id == -1) {
-                task.id = id++;
-            }
-            QUE_DBG("new task, id = %d/%d, front = %d\n", task.id, (int) tasks.size(), front);
-            if (front) {
-                queue_tasks.push_front(std::move(task));
-            } else {
-                queue_tasks.push_back(std::move(task));
-            }
+        // small steps until the cost of the prompt tokens is known
+        if (!has_token) {
+            return n_min;
         }
-        condition_tasks.notify_one();
-        return 0;
-    }
 
-    // Add a new task, but defer until one slot is available
-    void defer(server_task task) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        QUE_DBG("defer task, id = %d\n", task.id);
-        queue_tasks_deferred.push_back(std::move(task));
-        condition_tasks.notify_one();
-    }
+        const double n = (t_target - t_decode) / t_token;
 
-    // Get the next id for creating a new task
-    int get_new_id() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        int new_id = id++;
-        return new_id;
+        return std::max(n_min, (int32_t) std::min(n, (double) n_batch));
     }
 
-    // Register function to process a new task
-    void on_new_task(std::function<void(server_task &)> callback) {
-        callback_new_task = std::move(callback);
-    }
+    // a step with n_prefill prompt tokens took t_step ms
+    void on_step(int32_t n_prefill, double t_step) {
+        if (n_prefill == 0) {
+            t_decode   = has_decode ? (1.0 - alpha)*t_decode + alpha*t_step : t_step;
+            has_decode = true;
+            return;
+        }
 
-    // Register the function to be called when all slots data is ready to be processed
-    void on_update_slots(std::function<void(void)> callback) {
-        callback_update_slots = std::move(callback);
-    }
+        const double t = std::max(t_step - (has_decode ? t_decode : 0.0), 0.0) / n_prefill;
 
-    // Call when the state of one slot is changed, it will move one task from deferred to main queue
-    void pop_deferred_task() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        if (!queue_tasks_deferred.empty()) {
-            queue_tasks.emplace_back(std::move(queue_tasks_deferred.front()));
-            queue_tasks_deferred.pop_front();
-        }
-        condition_tasks.notify_one();
+        t_token   = has_token ? (1.0 - alpha)*t_token + alpha*t : t;
+        has_token = true;
     }
+};
 
-    // end the start_loop routine
-    void terminate() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        running = false;
-        condition_tasks.notify_all();
-    }
+// KV state of conversations that were evicted from their slot, kept in host memory and spilled to disk
+// the state is the llama_state_seq_get_data() serialization of the slot sequence
+struct server_kv_store {
+    struct entry {
+        uint64_t id;
 
-    /**
-     * Main loop consists of these steps:
-     * - Wait until a new task arrives
-     * - Process the task (i.e. maybe copy data into slot)
-     * - Check if multitask is finished
-     * - Update all slots
-     */
-    void start_loop() {
-        running = true;
+        std::vector<llama_token> tokens; // cache_tokens of the slot at the time it was stored
 
-        while (true) {
-            QUE_DBG("%s", "processing new tasks\n");
+        std::shared_ptr<const std::vector<uint8_t>> data; // serialized sequence state, nullptr when spilled to disk
+        std::string path; // spill file, set once the file is written and synced
 
-            while (true) {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
-                if (queue_tasks.empty()) {
-                    lock.unlock();
-                    break;
-                }
-                server_task task = queue_tasks.front();
-                queue_tasks.pop_front();
-                lock.unlock();
+        bool spilling = false; // queued for the writer thread, the state stays resident until the file is written
 
-                QUE_DBG("processing task, id = %d\n", task.id);
-                callback_new_task(task);
-            }
+        size_t size;
+    };
 
-            // all tasks in the current loop is processed, slots data is now ready
-            QUE_DBG("%s", "update slots\n");
+    // a spill file for the writer thread, returned with the result of the write
+    struct spill_job {
+        uint64_t    id;
+        std::string path;
 
-            callback_update_slots();
+        std::shared_ptr<const std::vector<uint8_t>> data;
 
-            QUE_DBG("%s", "waiting for new tasks\n");
-            {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
-                if (queue_tasks.empty()) {
-                    if (!running) {
-                        QUE_DBG("%s", "terminate\n");
-                        return;
-                    }
-                    condition_tasks.wait(lock, [&]{
-                        return (!queue_tasks.empty() || !running);
-                    });
-                }
-            }
-        }
-    }
-};
+        size_t size;
+        bool   ok = false;
+    };
 
-struct server_response {
-    // for keeping track of all tasks waiting for the result
-    std::unordered_set<int> waiting_task_ids;
+    std::list<entry> entries; // most recently used first
 
-    // the main result queue
-    std::vector<server_task_result> queue_results;
+    size_t max_ram  = 0; // bytes, 0 = disabled
+    size_t max_disk = 0; // bytes, 0 = unlimited
 
-    std::mutex mutex_results;
-    std::condition_variable condition_results;
+    std::string path; // directory for spill files, empty = no disk tier
 
-    // add the id_task to the list of tasks waiting for response
-    void add_waiting_task_id(int id_task) {
-        SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task, (int) waiting_task_ids.size());
+    size_t n_ram_bytes   = 0; // resident states, including those being spilled
+    size_t n_disk_bytes  = 0; // written spill files
+    size_t n_spill_bytes = 0; // states queued for the writer thread
+    int    n_files       = 0;
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.insert(id_task);
-    }
+    uint64_t n_ids = 0;
 
-    void add_waiting_tasks(const std::vector<server_task> & tasks) {
-        std::unique_lock<std::mutex> lock(mutex_results);
+    std::string file_prefix; // unique to the server, so that servers can share the directory
 
-        for (const auto & task : tasks) {
-            SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", task.id, (int) waiting_task_ids.size());
-            waiting_task_ids.insert(task.id);
+    // stats
+    uint64_t n_stored   = 0;
+    uint64_t n_restored = 0;
+    uint64_t n_dropped  = 0;
+
+    // the spill files are written by a single thread, the slots wait for it only when the queue is full
+    static constexpr size_t n_jobs_max = 4;
+
+    std::thread             writer;
+    std::mutex              mutex;
+    std::condition_variable cv_jobs;  // a job is queued or the store is destroyed
+    std::condition_variable cv_space; // a job left the queue
+    std::deque<spill_job>   jobs;
+    std::vector<spill_job>  done;
+    bool                    stop = false;
+
+    ~server_kv_store() {
+        if (writer.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            cv_jobs.notify_one();
+            writer.join();
         }
-    }
 
-    // when the request is finished, we can remove task associated with it
-    void remove_waiting_task_id(int id_task) {
-        SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
+        // the files written for the entries that are about to be dropped
+        for (const auto & job : done) {
+            if (job.ok) {
+                std::remove(job.path.c_str());
+            }
+        }
+        done.clear();
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.erase(id_task);
+        clear();
     }
 
-    void remove_waiting_task_ids(const std::unordered_set<int> & id_tasks) {
-        std::unique_lock<std::mutex> lock(mutex_results);
+    bool enabled() const {
+        return max_ram > 0;
+    }
 
-        for (const auto & id_task : id_tasks) {
-            SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
-            waiting_task_ids.erase(id_task);
+    void clear() {
+        while (!entries.empty()) {
+            drop(entries.begin());
         }
     }
 
-    // This function blocks the thread until there is a response for one of the id_tasks
-    server_task_result recv(const std::unordered_set<int> & id_tasks) {
-        while (true) {
-            std::unique_lock<std::mutex> lock(mutex_results);
-            condition_results.wait(lock, [&]{
-                return !queue_results.empty();
-            });
+    // the entry with the longest common prefix with the tokens
+    std::list<entry>::iterator find(const std::vector<llama_token> & tokens, size_t & n_common) {
+        auto best = entries.end();
 
-            for (int i = 0; i < (int) queue_results.size(); i++) {
-                if (id_tasks.find(queue_results[i].id) != id_tasks.end()) {
-                    server_task_result res = queue_results[i];
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
-                }
+        n_common = 0;
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            const size_t n = common_part(it->tokens, tokens);
+            if (n > n_common) {
+                n_common = n;
+                best = it;
             }
         }
 
-        // should never reach here
-    }
-
-    // single-task version of recv()
-    server_task_result recv(int id_task) {
-        std::unordered_set<int> id_tasks = {id_task};
-        return recv(id_tasks);
+        return best;
     }
 
-    // Send a new result to a waiting id_task
-    void send(server_task_result & result) {
-        SRV_DBG("sending result for task id = %d\n", result.id);
-
-        std::unique_lock<std::mutex> lock(mutex_results);
-        for (const auto & id_task : waiting_task_ids) {
-            if (result.id == id_task) {
-                SRV_DBG("task id = %d moved to result queue\n", result.id);
+    // park the state of seq_id, entries that are a prefix of the tokens are superseded by it
+    bool store(llama_context * ctx, llama_seq_id seq_id, const std::vector<llama_token> & tokens) {
+        collect();
 
-                queue_results.push_back(std::move(result));
-                condition_results.notify_all();
-                return;
+        for (auto it = entries.begin(); it != entries.end(); ) {
+            const size_t n = common_part(it->tokens, tokens);
+            if (n == tokens.size()) {
+                // already stored, possibly with more tokens
+                entries.splice(entries.begin(), entries, it);
+                return true;
+            }
+            if (n == it->tokens.size()) {
+                auto next = std::next(it);
+                drop(it);
+                it = next;
+                continue;
             }
+            ++it;
         }
-    }
-};
 
-struct server_context {
-    llama_model * model = nullptr;
-    llama_context * ctx = nullptr;
-    std::vector<llama_lora_adapter_container> loras;
+        const size_t size = llama_state_seq_get_size(ctx, seq_id);
+        if (size == 0 || size > max_ram) {
+            return false;
+        }
 
-    gpt_params params;
+        auto data = std::make_shared<std::vector<uint8_t>>(size);
 
-    llama_batch batch = {};
+        entry e;
+        e.id     = n_ids++;
+        e.tokens = tokens;
+        e.size   = llama_state_seq_get_data(ctx, data->data(), size, seq_id);
+        e.data   = std::move(data);
 
-    bool clean_kv_cache = true;
-    bool add_bos_token  = true;
-    bool has_eos_token  = false;
+        if (e.size == 0) {
+            return false;
+        }
 
-    int32_t n_ctx; // total context for all clients / slots
+        n_ram_bytes += e.data->size();
+        n_stored++;
 
-    // system prompt
-    bool system_need_update = false;
+        // most recently used first
+        entries.push_front(std::move(e));
 
-    std::string              system_prompt;
-    std::vector<llama_token> system_tokens;
+        evict();
 
-    // slots / clients
-    std::vector<server_slot> slots;
-    json default_generation_settings_for_props;
+        return true;
+    }
 
-    server_queue    queue_tasks;
-    server_response queue_results;
+    // load the entry into seq_id, the caller must have cleared seq_id
+    // the entry stays in the store, so that the conversation survives if the new prompt diverges from it
+    bool restore(llama_context * ctx, llama_seq_id seq_id, std::list<entry>::iterator it) {
+        std::vector<uint8_t> buf;
 
-    server_metrics metrics;
+        if (it->data == nullptr && !load(*it, buf)) {
+            drop(it);
+            return false;
+        }
 
-    // Necessary similarity of prompt for slot selection
-    float slot_prompt_similarity = 0.0f;
+        const uint8_t * data = it->data != nullptr ? it->data->data() : buf.data();
 
-    ~server_context() {
-        if (ctx) {
-            llama_free(ctx);
-            ctx = nullptr;
+        if (llama_state_seq_set_data(ctx, data, it->size, seq_id) == 0) {
+            return false;
         }
 
-        if (model) {
-            llama_free_model(model);
-            model = nullptr;
+        entries.splice(entries.begin(), entries, it);
+        n_restored++;
+
+        return true;
+    }
+
+    // move the entries whose spill file is written to the disk tier, drop those whose file could not be written
+    void collect() {
+        std::vector<spill_job> results;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            results.swap(done);
         }
 
-        // Clear any sampling context
-        for (server_slot & slot : slots) {
-            if (slot.smpl != nullptr) {
-                gpt_sampler_free(slot.smpl);
+        if (results.empty()) {
+            return;
+        }
+
+        for (auto & job : results) {
+            auto it = std::find_if(entries.begin(), entries.end(), [&](const entry & e) { return e.id == job.id; });
+            if (it == entries.end()) {
+                // the entry was dropped while its file was being written
+                if (job.ok) {
+                    std::remove(job.path.c_str());
+                }
+                continue;
+            }
+
+            it->spilling   = false;
+            n_spill_bytes -= it->data->size();
+
+            if (!job.ok) {
+                n_ram_bytes -= it->data->size();
+                n_dropped++;
+
+                entries.erase(it);
+                continue;
             }
+
+            n_ram_bytes  -= it->data->size();
+            n_disk_bytes += it->size;
+
+            it->data.reset();
+            it->path = job.path;
         }
 
-        llama_batch_free(batch);
+        evict();
     }
 
-    bool load_model(const gpt_params & params_) {
-        params = params_;
+private:
+    void drop(std::list<entry>::iterator it) {
+        if (it->data != nullptr) {
+            n_ram_bytes -= it->data->size();
+            if (it->spilling) {
+                // the file of the job is removed when the job comes back
+                n_spill_bytes -= it->data->size();
+            }
+        } else {
+            n_disk_bytes -= it->size;
+            std::remove(it->path.c_str());
+        }
 
-        // dedicate one sequence to the system prompt
-        params.n_parallel += 1;
+        entries.erase(it);
+    }
 
-        llama_init_result llama_init = llama_init_from_gpt_params(params);
+    // move the least recently used entries to disk, or drop them, until the budgets are met
+    // the states being spilled count against the disk budget already
+    void evict() {
+        auto it = entries.end();
+        while (n_ram_bytes - n_spill_bytes > max_ram && it != entries.begin()) {
+            --it;
 
-        model = llama_init.model;
-        ctx   = llama_init.context;
-        loras = llama_init.lora_adapters;
+            if (it->data == nullptr || it->spilling) {
+                continue;
+            }
 
-        params.n_parallel -= 1; // but be sneaky about it
+            if (!path.empty() && (max_disk == 0 || it->size <= max_disk)) {
+                spill(*it);
+                continue;
+            }
 
-        if (model == nullptr) {
-            SRV_ERR("failed to load model, '%s'\n", params.model.c_str());
-            return false;
-        }
+            n_ram_bytes -= it->data->size();
+            n_dropped++;
 
-        n_ctx = llama_n_ctx(ctx);
+            it = entries.erase(it);
+        }
 
-        add_bos_token = llama_add_bos_token(model);
-        has_eos_token = !llama_add_eos_token(model);
+        while (max_disk > 0 && n_disk_bytes + n_spill_bytes > max_disk) {
+            auto rit = std::find_if(entries.rbegin(), entries.rend(), [](const entry & e) { return e.data == nullptr; });
+            if (rit == entries.rend()) {
+                // only files still being written, checked again when they are done
+                break;
+            }
 
-        return true;
+            drop(std::next(rit).base());
+            n_dropped++;
+        }
     }
 
-    bool validate_model_chat_template() const {
-        llama_chat_message chat[] = {{"user", "test"}};
+    // queue the state for the writer thread, the entry stays resident until its file is written and synced
+    void spill(entry & e) {
+        if (file_prefix.empty()) {
+            std::random_device rd;
 
-        const int res = llama_chat_apply_template(model, nullptr, chat, 1, true, nullptr, 0);
+            char buf[32];
+            snprintf(buf, sizeof(buf), "kv-store-%08x%08x-", rd(), rd());
+            file_prefix = buf;
+        }
 
-        return res > 0;
-    }
+        if (!writer.joinable()) {
+            writer = std::thread(&server_kv_store::write_loop, this);
+        }
 
-    void init() {
-        const int32_t n_ctx_slot = n_ctx / params.n_parallel;
+        spill_job job;
+        job.id   = e.id;
+        job.path = path + file_prefix + std::to_string(n_files++) + ".bin";
+        job.data = e.data;
+        job.size = e.size;
 
-        SRV_INF("initializing slots, n_slots = %d\n", params.n_parallel);
+        e.spilling     = true;
+        n_spill_bytes += e.data->size();
 
-        for (int i = 0; i < params.n_parallel; i++) {
-            server_slot slot;
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_space.wait(lock, [&] { return jobs.size() < n_jobs_max; });
 
-            slot.id = i;
-            slot.n_ctx = n_ctx_slot;
-            slot.n_predict = params.n_predict;
+        jobs.push_back(std::move(job));
+        cv_jobs.notify_one();
+    }
 
-            SLT_INF(slot, "new slot n_ctx_slot = %d\n", slot.n_ctx);
+    void write_loop() {
+        std::unique_lock<std::mutex> lock(mutex);
 
-            const int ga_n = params.grp_attn_n;
-            const int ga_w = params.grp_attn_w;
+        while (true) {
+            cv_jobs.wait(lock, [&] { return stop || !jobs.empty(); });
+            if (stop) {
+                break;
+            }
 
-            if (ga_n != 1) {
-                GGML_ASSERT(ga_n > 0                    && "ga_n must be positive");                       // NOLINT
-                GGML_ASSERT(ga_w % ga_n == 0            && "ga_w must be a multiple of ga_n");             // NOLINT
-                //GGML_ASSERT(n_ctx_train % ga_w == 0     && "n_ctx_train must be a multiple of ga_w");    // NOLINT
-                //GGML_ASSERT(n_ctx >= n_ctx_train * ga_n && "n_ctx must be at least n_ctx_train * ga_n"); // NOLINT
+            spill_job job = std::move(jobs.front());
+            jobs.pop_front();
+            cv_space.notify_one();
 
-                SLT_INF(slot, "slot self-extend: ga_n = %d, ga_w = %d\n", ga_n, ga_w);
+            lock.unlock();
+
+            job.ok = write_file(job.path, job.data->data(), job.size);
+            if (!job.ok) {
+                LOG_WRN("srv  %12.*s: failed to write '%s'\n", 12, "spill", job.path.c_str());
+                std::remove(job.path.c_str());
             }
+            job.data.reset();
 
-            slot.ga_i = 0;
-            slot.ga_n = ga_n;
-            slot.ga_w = ga_w;
+            lock.lock();
 
-            slot.sparams = params.sparams;
+            done.push_back(std::move(job));
+        }
+    }
 
-            slot.callback_on_release = [this](int) {
-                queue_tasks.pop_deferred_task();
-            };
+    // the file is synced, so that an entry never points to a file that a crash could truncate
+    static bool write_file(const std::string & fname, const uint8_t * data, size_t size) {
+        FILE * f = std::fopen(fname.c_str(), "wb");
+        if (f == nullptr) {
+            return false;
+        }
 
-            slot.reset();
+        bool ok = std::fwrite(data, 1, size, f) == size && std::fflush(f) == 0;
+#if defined(_WIN32)
+        ok = ok && _commit(_fileno(f)) == 0;
+#else
+        ok = ok && fsync(fileno(f)) == 0;
+#endif
 
-            slots.push_back(slot);
+        return std::fclose(f) == 0 && ok;
+    }
+
+    bool load(const entry & e, std::vector<uint8_t> & buf) {
+        buf.resize(e.size);
+
+        std::ifstream f(e.path, std::ios::binary);
+        if (!f || !f.read((char *) buf.data(), e.size)) {
+            LOG_WRN("srv  %12.*s: failed to read '%s'\n", 12, __func__, e.path.c_str());
+            return false;
         }
 
-        default_generation_settings_for_props = get_formated_generation(slots.front());
-        default_generation_settings_for_props["seed"] = -1;
+        return true;
+    }
+};
 
-        // the update_slots() logic will always submit a maximum of n_batch or n_parallel tokens
-        // note that n_batch can be > n_ctx (e.g. for non-causal attention models such as BERT where the KV cache is not used)
-        {
-            const int32_t n_batch = llama_n_batch(ctx);
+// a task that was preempted keeps the KV state of its sequence and its sampler until it resumes in a slot
+struct server_parked_task {
+    std::vector<llama_token> tokens; // cache_tokens of the slot
+    std::vector<uint8_t>     state;  // llama_state_seq_get_data() of the slot sequence, empty if it was lost
 
-            // only a single seq_id per token is needed
-            batch = llama_batch_init(std::max(n_batch, params.n_parallel), 0, 1);
+    struct gpt_sampler * smpl = nullptr; // RNG, penalty and grammar state of a generation, nullptr for a prompt
+
+    server_parked_task() = default;
+    server_parked_task(const server_parked_task &) = delete;
+    server_parked_task & operator=(const server_parked_task &) = delete;
+
+    ~server_parked_task() {
+        if (smpl != nullptr) {
+            gpt_sampler_free(smpl);
         }
+    }
+};
 
-        metrics.init();
+// radix tree over the tokens cached in the sequences of the slots, finds the slots holding the longest prefix of a prompt
+// a slot is registered only with tokens whose KV cells are in its sequence - it must be erased before they change
+struct server_prefix_cache {
+    struct node {
+        std::vector<llama_token> tokens; // edge from the parent
+
+        std::unordered_map<llama_token, std::unique_ptr<node>> children; // by their first token
+        std::unordered_set<int> ids; // the slots holding all the tokens up to the end of the edge
+
+        node * parent = nullptr;
+    };
+
+    struct entry {
+        node * last;     // the node where the tokens of the slot end
+        size_t n_tokens;
+    };
+
+    node root;
+
+    std::unordered_map<int, entry> entries; // by slot id
+
+    // stats
+    uint64_t n_attached      = 0;
+    uint64_t n_tokens_shared = 0;
+
+    void clear() {
+        root.children.clear();
+        entries.clear();
     }
 
-    std::vector<llama_token> tokenize(const json & json_prompt, bool add_special) const {
-        // TODO: currently, we tokenize using special tokens by default
-        //       this is not always correct (see https://github.com/ggerganov/llama.cpp/pull/4160#issuecomment-1824826216)
-        //       but it's better compared to completely ignoring ChatML and other chat templates
-        const bool TMP_FORCE_SPECIAL = true;
+    // register the tokens cached by slot id, a slot that is already registered must still hold its previous tokens
+    void insert(int id, const std::vector<llama_token> & tokens) {
+        auto it = entries.find(id);
+        if (it != entries.end() && it->second.n_tokens > tokens.size()) {
+            erase(id);
+            it = entries.end();
+        }
 
-        // If `add_bos` is true, we only add BOS, when json_prompt is a string,
-        // or the first element of the json_prompt array is a string.
-        std::vector<llama_token> prompt_tokens;
+        node * cur = it == entries.end() ? &root : it->second.last;
+        size_t n   = it == entries.end() ? 0     : it->second.n_tokens;
 
-        if (json_prompt.is_array()) {
-            bool first = true;
-            for (const auto & p : json_prompt) {
-                if (p.is_string()) {
-                    auto s = p.template get<std::string>();
+        if (n == tokens.size()) {
+            return;
+        }
 
-                    std::vector<llama_token> p;
-                    if (first) {
-                        p = ::llama_tokenize(ctx, s, add_special, TMP_FORCE_SPECIAL);
-                        first = false;
-                    } else {
-                        p = ::llama_tokenize(ctx, s, false, TMP_FORCE_SPECIAL);
-                    }
+        // a generating slot owns the leaf it grows
+        if (cur != &root && cur->children.empty() && cur->ids.size() == 1) {
+            cur->tokens.insert(cur->tokens.end(), tokens.begin() + n, tokens.end());
+            n = tokens.size();
+        }
 
-                    prompt_tokens.insert(prompt_tokens.end(), p.begin(), p.end());
-                } else {
-                    if (first) {
-                        first = false;
-                    }
+        while (n < tokens.size()) {
+            auto child = cur->children.find(tokens[n]);
+            if (child == cur->children.end()) {
+                auto leaf = std::unique_ptr<node>(new node);
+                leaf->tokens.assign(tokens.begin() + n, tokens.end());
+                leaf->ids.insert(id);
+                leaf->parent = cur;
 
-                    prompt_tokens.push_back(p.template get<llama_token>());
-                }
+                cur = cur->children.emplace(tokens[n], std::move(leaf)).first->second.get();
+                n   = tokens.size();
+                break;
             }
-        } else {
-            auto s = json_prompt.template get<std::string>();
-            prompt_tokens = ::llama_tokenize(ctx, s, add_special, TMP_FORCE_SPECIAL);
-        }
 
-        return prompt_tokens;
-    }
+            node * next = child->second.get();
 
-    server_slot * get_slot_by_id(int id) {
-        for (server_slot & slot : slots) {
-            if (slot.id == id) {
-                return &slot;
+            size_t k = 0;
+            while (k < next->tokens.size() && n + k < tokens.size() && next->tokens[k] == tokens[n + k]) {
+                k++;
+            }
+
+            if (k < next->tokens.size()) {
+                next = split(next, k);
             }
+
+            next->ids.insert(id);
+
+            cur = next;
+            n  += k;
         }
 
-        return nullptr;
+        entries[id] = { cur, n };
     }
 
-    server_slot * get_available_slot(const std::string & prompt) {
-        server_slot * ret = nullptr;
+    void erase(int id) {
+        auto it = entries.find(id);
+        if (it == entries.end()) {
+            return;
+        }
 
-        // find the slot that has at least n% prompt similarity
-        if (ret == nullptr && slot_prompt_similarity != 0.0f && !prompt.empty()) {
-            int max_lcp_len = 0;
-            float similarity = 0;
+        node * cur = it->second.last;
+        entries.erase(it);
 
-            for (server_slot & slot : slots) {
-                // skip the slot if it is not available
-                if (slot.is_processing()) {
-                    continue;
-                }
+        while (cur != &root) {
+            node * parent = cur->parent;
 
-                // skip the slot if it does not contains prompt
-                if (!slot.prompt.is_string()) {
-                    continue;
-                }
+            cur->ids.erase(id);
+            if (cur->ids.empty()) {
+                // no slot holds the edge, so none holds the subtree either
+                parent->children.erase(cur->tokens[0]);
+            }
 
-                // current slot's prompt
-                std::string slot_prompt = slot.prompt.get<std::string>();
+            cur = parent;
+        }
+    }
 
-                // length of the current slot's prompt
-                int slot_prompt_len = slot_prompt.size();
+    // length of the longest prefix of the tokens held by a slot, the slots holding it are returned in ids
+    size_t find(const std::vector<llama_token> & tokens, std::vector<int> & ids) const {
+        const node * cur = &root;
 
-                // length of the Longest Common Prefix between the current slot's prompt and the input prompt
-                int lcp_len = common_part(slot_prompt, prompt);
+        size_t n = 0;
 
-                // fraction of the common substring length compared to the current slot's prompt length
-                similarity = static_cast<float>(lcp_len) / slot_prompt_len;
+        ids.clear();
 
-                // select the current slot if the criteria match
-                if (lcp_len > max_lcp_len && similarity > slot_prompt_similarity) {
-                    max_lcp_len = lcp_len;
-                    ret = &slot;
-                }
+        while (n < tokens.size()) {
+            auto child = cur->children.find(tokens[n]);
+            if (child == cur->children.end()) {
+                break;
             }
 
-            if (ret != nullptr) {
-                SLT_DBG(*ret, "selected slot by lcp similarity, max_lcp_len = %d, similarity = %f\n", max_lcp_len, similarity);
+            const node * next = child->second.get();
+
+            size_t k = 0;
+            while (k < next->tokens.size() && n + k < tokens.size() && next->tokens[k] == tokens[n + k]) {
+                k++;
             }
-        }
 
-        // find the slot that has been least recently used
-        if (ret == nullptr) {
-            int64_t t_last = ggml_time_us();
-            for (server_slot & slot : slots) {
-                // skip the slot if it is not available
-                if (slot.is_processing()) {
-                    continue;
-                }
+            n += k;
+            ids.assign(next->ids.begin(), next->ids.end());
 
-                // select the current slot if the criteria match
-                if (slot.t_last_used < t_last) {
-                    t_last = slot.t_last_used;
-                    ret = &slot;
-                }
+            if (k < next->tokens.size()) {
+                break;
             }
 
-            if (ret != nullptr) {
-                SLT_DBG(*ret, "selected slot by lru, t_last = %" PRId64 "\n", t_last);
-            }
+            cur = next;
         }
 
-        return ret;
+        return n;
     }
 
-    bool launch_slot_with_task(server_slot & slot, const server_task & task) {
-        slot_params default_params;
-        // Sampling parameter defaults are loaded from the global server context (but individual requests can still override them)
-        auto default_sparams = params.sparams;
-        const auto & data = task.data;
+private:
+    // cut the edge of the node after k tokens, returns the new node holding the first k tokens
+    node * split(node * nd, size_t k) {
+        node * parent = nd->parent;
 
-        if (data.count("__oaicompat") != 0) {
-            slot.oaicompat = true;
-            slot.oaicompat_model = json_value(data, "model", std::string(DEFAULT_OAICOMPAT_MODEL));
-        } else {
-            slot.oaicompat = false;
-            slot.oaicompat_model = "";
-        }
+        auto head = std::unique_ptr<node>(new node);
+        head->tokens.assign(nd->tokens.begin(), nd->tokens.begin() + k);
+        head->ids    = nd->ids;
+        head->parent = parent;
 
-        slot.params.stream             = json_value(data, "stream",            false);
-        slot.params.cache_prompt       = json_value(data, "cache_prompt",      false);
-        slot.params.n_predict          = json_value(data, "n_predict",         json_value(data, "max_tokens", default_params.n_predict));
-        slot.sparams.top_k             = json_value(data, "top_k",             default_sparams.top_k);
-        slot.sparams.top_p             = json_value(data, "top_p",             default_sparams.top_p);
-        slot.sparams.min_p             = json_value(data, "min_p",             default_sparams.min_p);
-        slot.sparams.tfs_z             = json_value(data, "tfs_z",             default_sparams.tfs_z);
-        slot.sparams.typ_p             = json_value(data, "typical_p",         default_sparams.typ_p);
-        slot.sparams.temp              = json_value(data, "temperature",       default_sparams.temp);
-        slot.sparams.dynatemp_range    = json_value(data, "dynatemp_range",    default_sparams.dynatemp_range);
-        slot.sparams.dynatemp_exponent = json_value(data, "dynatemp_exponent", default_sparams.dynatemp_exponent);
-        slot.sparams.penalty_last_n    = json_value(data, "repeat_last_n",     default_sparams.penalty_last_n);
-        slot.sparams.penalty_repeat    = json_value(data, "repeat_penalty",    default_sparams.penalty_repeat);
-        slot.sparams.penalty_freq      = json_value(data, "frequency_penalty", default_sparams.penalty_freq);
-        slot.sparams.penalty_present   = json_value(data, "presence_penalty",  default_sparams.penalty_present);
-        slot.sparams.mirostat          = json_value(data, "mirostat",          default_sparams.mirostat);
-        slot.sparams.mirostat_tau      = json_value(data, "mirostat_tau",      default_sparams.mirostat_tau);
-        slot.sparams.mirostat_eta      = json_value(data, "mirostat_eta",      default_sparams.mirostat_eta);
-        slot.sparams.penalize_nl       = json_value(data, "penalize_nl",       default_sparams.penalize_nl);
-        slot.params.n_keep             = json_value(data, "n_keep",            slot.params.n_keep);
-        slot.params.n_discard          = json_value(data, "n_discard",         default_params.n_discard);
-        slot.sparams.seed              = json_value(data, "seed",              default_sparams.seed);
-        slot.sparams.n_probs           = json_value(data, "n_probs",           default_sparams.n_probs);
-        slot.sparams.min_keep          = json_value(data, "min_keep",          default_sparams.min_keep);
-
-        // process "json_schema" and "grammar"
-        if (data.contains("json_schema") && !data.at("json_schema").is_null() && data.contains("grammar") && !data.at("grammar").is_null()) {
-            send_error(task, "Either \"json_schema\" or \"grammar\" can be specified, but not both", ERROR_TYPE_INVALID_REQUEST);
-            return false;
-        }
-        if (data.contains("json_schema") && !data.contains("grammar")) {
-            try {
-                auto schema                = json_value(data, "json_schema", json::object());
-                slot.sparams.grammar       = json_schema_to_grammar(schema);
-            } catch (const std::exception & e) {
-                send_error(task, std::string("\"json_schema\": ") + e.what(), ERROR_TYPE_INVALID_REQUEST);
-                return false;
-            }
-        } else {
-            slot.sparams.grammar       = json_value(data, "grammar",           default_sparams.grammar);
-        }
+        auto & slot = parent->children[nd->tokens[0]];
+        std::unique_ptr<node> tail = std::move(slot);
 
-        if (slot.params.cache_prompt && slot.ga_n != 1) {
-            slot.params.cache_prompt = false;
-            SLT_WRN(slot, "%s", "group-attention is not supported with prompt caching. disabling cache\n");
-        }
-
-        if (slot.n_predict > 0 && slot.params.n_predict > slot.n_predict) {
-            // Might be better to reject the request with a 400 ?
-            slot.params.n_predict = slot.n_predict;
-            SLT_WRN(slot, "n_predict = %d exceeds server configuration, setting to %d", slot.n_predict, slot.n_predict);
-        }
-
-        // infill
-        slot.params.input_prefix = json_value(data, "input_prefix", default_params.input_prefix);
-        slot.params.input_suffix = json_value(data, "input_suffix", default_params.input_suffix);
+        tail->tokens.erase(tail->tokens.begin(), tail->tokens.begin() + k);
+        tail->parent = head.get();
+        head->children.emplace(tail->tokens[0], std::move(tail));
 
-        // get prompt
-        if (task.cmpl_type != SERVER_TASK_CMPL_TYPE_INFILL) {
-            const auto & prompt = data.find("prompt");
-            if (prompt == data.end()) {
-                send_error(task, "\"prompt\" must be provided", ERROR_TYPE_INVALID_REQUEST);
-                return false;
-            }
+        slot = std::move(head);
 
-            if ((prompt->is_string()) ||
-                (prompt->is_array() &&  prompt->size() == 1 && prompt->at(0).is_string()) ||
-                (prompt->is_array() && !prompt->empty()     && prompt->at(0).is_number_integer())) {
-                slot.prompt = *prompt;
-            } else if (prompt->is_array() && prompt->size() == 1 && prompt->at(0).is_array()) {
-                slot.prompt = prompt->at(0);
-            } else {
-                send_error(task, "\"prompt\" must be a string or an array of integers", ERROR_TYPE_INVALID_REQUEST);
-                return false;
-            }
-        }
+        return slot.get();
+    }
+};
 
-        {
-            slot.sparams.logit_bias.clear();
+struct server_queue {
+    int id = 0;
+    bool running;
 
-            if (json_value(data, "ignore_eos", false) && has_eos_token) {
-                slot.sparams.logit_bias.push_back({llama_token_eos(model), -INFINITY});
-            }
+    // queues
+    std::deque<server_task> queue_tasks;
+    std::deque<server_task> queue_tasks_deferred;
 
-            const auto & logit_bias = data.find("logit_bias");
-            if (logit_bias != data.end() && logit_bias->is_array()) {
-                const int n_vocab = llama_n_vocab(model);
-                for (const auto & el : *logit_bias) {
-                    // TODO: we may want to throw errors here, in case "el" is incorrect
-                    if (el.is_array() && el.size() == 2) {
-                        float bias;
-                        if (el[1].is_number()) {
-                            bias = el[1].get<float>();
-                        } else if (el[1].is_boolean() && !el[1].get<bool>()) {
-                            bias = -INFINITY;
-                        } else {
-                            continue;
-                        }
+    std::mutex mutex_tasks;
+    std::condition_variable condition_tasks;
 
-                        if (el[0].is_number_integer()) {
-                            llama_token tok = el[0].get<llama_token>();
-                            if (tok >= 0 && tok < n_vocab) {
-                                slot.sparams.logit_bias.push_back({tok, bias});
-                            }
-                        } else if (el[0].is_string()) {
-                            auto toks = llama_tokenize(model, el[0].get<std::string>(), false);
-                            for (auto tok : toks) {
-                                slot.sparams.logit_bias.push_back({tok, bias});
-                            }
-                        }
-                    }
-                }
-            }
-        }
+    // weighted-fair scheduling of the deferred tasks: a tenant accumulates virtual time as its tasks consume tokens,
+    // scaled by 1/weight, and among waiting tasks of the same priority the tenant that is furthest behind goes first
+    std::unordered_map<std::string, float>  tenant_weights;
+    std::unordered_map<std::string, double> tenant_vtime;
+    double vtime = 0.0; // virtual time of the last scheduled task, idle tenants cannot fall behind it
 
-        {
-            slot.params.antiprompt.clear();
+    // callback functions
+    std::function<void(server_task&)> callback_new_task;
+    std::function<void(void)>         callback_update_slots;
 
-            const auto & stop = data.find("stop");
-            if (stop != data.end() && stop->is_array()) {
-                for (const auto & word : *stop) {
-                    if (!word.empty()) {
-                        slot.params.antiprompt.push_back(word);
-                    }
-                }
-            }
+    // Add a new task to the end of the queue
+    int post(server_task task, bool front = false) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        if (task.id == -1) {
+            task.id = id++;
         }
-
-        {
-            const auto & samplers = data.find("samplers");
-            if (samplers != data.end() && samplers->is_array()) {
-                std::vector<std::string> sampler_names;
-                for (const auto & name : *samplers) {
-                    if (name.is_string()) {
-                        sampler_names.emplace_back(name);
-                    }
-                }
-                slot.sparams.samplers = gpt_sampler_types_from_names(sampler_names, false);
-            } else {
-                slot.sparams.samplers = default_sparams.samplers;
-            }
+        task.t_posted = ggml_time_us();
+        QUE_DBG("new task, id = %d, front = %d\n", task.id, front);
+        if (front) {
+            queue_tasks.push_front(std::move(task));
+        } else {
+            queue_tasks.push_back(std::move(task));
         }
+        condition_tasks.notify_one();
+        return task.id;
+    }
 
-        {
-            if (slot.smpl != nullptr) {
-                gpt_sampler_free(slot.smpl);
+    // multi-task version of post()
+    int post(std::vector<server_task> & tasks, bool front = false) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        for (auto & task : tasks) {
+            if (task.id == -1) {
+                task.id = id++;
             }
-
-            slot.smpl = gpt_sampler_init(model, slot.sparams);
-            if (slot.smpl == nullptr) {
-                // for now, the only error that may happen here is invalid grammar
-                send_error(task, "Failed to parse grammar", ERROR_TYPE_INVALID_REQUEST);
-                return false;
+            task.t_posted = ggml_time_us();
+            QUE_DBG("new task, id = %d/%d, front = %d\n", task.id, (int) tasks.size(), front);
+            if (front) {
+                queue_tasks.push_front(std::move(task));
+            } else {
+                queue_tasks.push_back(std::move(task));
             }
         }
-
-        slot.state = SLOT_STATE_PROCESSING_PROMPT;
-        slot.prompt_tokens.clear();
-
-        SLT_INF(slot, "%s", "processing task\n");
-
-        return true;
+        condition_tasks.notify_one();
+        return 0;
     }
 
-    void kv_cache_clear() {
-        SRV_DBG("%s", "clearing KV cache\n");
+    // Add a new task, but defer until one slot is available
+    void defer(server_task task) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        QUE_DBG("defer task, id = %d\n", task.id);
+        queue_tasks_deferred.push_back(std::move(task));
+        condition_tasks.notify_one();
+    }
 
-        // clear the entire KV cache
-        llama_kv_cache_clear(ctx);
-        clean_kv_cache = false;
+    // Get the next id for creating a new task
+    int get_new_id() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        int new_id = id++;
+        return new_id;
     }
 
-    void system_prompt_update() {
-        SRV_DBG("updating system prompt: '%s'\n", system_prompt.c_str());
+    // Register function to process a new task
+    void on_new_task(std::function<void(server_task &)> callback) {
+        callback_new_task = std::move(callback);
+    }
 
-        kv_cache_clear();
-        system_tokens.clear();
+    // Register the function to be called when all slots data is ready to be processed
+    void on_update_slots(std::function<void(void)> callback) {
+        callback_update_slots = std::move(callback);
+    }
 
-        if (!system_prompt.empty()) {
-            system_tokens = ::llama_tokenize(ctx, system_prompt, true);
+    // Call when the state of one slot is changed, it will move one task from deferred to main queue
+    // the task with the highest priority is picked, ties go to the tenant with the least virtual time, then FIFO
+    void pop_deferred_task() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        if (!queue_tasks_deferred.empty()) {
+            size_t i_best = 0;
+            for (size_t i = 1; i < queue_tasks_deferred.size(); ++i) {
+                const server_task & cur  = queue_tasks_deferred[i];
+                const server_task & best = queue_tasks_deferred[i_best];
 
-            const int32_t n_batch = llama_n_batch(ctx);
-            const int32_t n_tokens_prompt = system_tokens.size();
+                const int p_cur  = task_priority(cur);
+                const int p_best = task_priority(best);
 
-            for (int32_t i = 0; i < n_tokens_prompt; i += n_batch) {
-                const int32_t n_tokens = std::min(n_batch, n_tokens_prompt - i);
+                if (p_cur > p_best || (p_cur == p_best && get_vtime(task_tenant(cur)) < get_vtime(task_tenant(best)))) {
+                    i_best = i;
+                }
+            }
 
-                llama_batch_clear(batch);
+            vtime = get_vtime(task_tenant(queue_tasks_deferred[i_best]));
 
-                for (int32_t j = 0; j < n_tokens; ++j) {
-                    llama_batch_add(batch, system_tokens[i + j], i + j, { 0 }, false);
-                }
+            QUE_DBG("pop deferred task, id = %d, n_deferred = %d\n", queue_tasks_deferred[i_best].id, (int) queue_tasks_deferred.size());
 
-                if (llama_decode(ctx, batch) != 0) {
-                    SRV_ERR("%s", "llama_decode() failed\n");
-                    return;
-                }
-            }
+            queue_tasks.emplace_back(std::move(queue_tasks_deferred[i_best]));
+            queue_tasks_deferred.erase(queue_tasks_deferred.begin() + i_best);
+        }
+        condition_tasks.notify_one();
+    }
 
-            // assign the system KV cache to all parallel sequences
-            for (int32_t i = 1; i <= params.n_parallel; ++i) {
-                llama_kv_cache_seq_cp(ctx, 0, i, -1, -1);
+    // Drop a deferred task, e.g. a preempted task whose client went away
+    void remove_deferred_task(int id_task) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        for (auto it = queue_tasks_deferred.begin(); it != queue_tasks_deferred.end(); ++it) {
+            if (it->id == id_task) {
+                QUE_DBG("remove deferred task, id = %d\n", id_task);
+                queue_tasks_deferred.erase(it);
+                break;
             }
         }
-
-        system_need_update = false;
     }
 
-    bool system_prompt_set(const std::string & sys_prompt) {
-        SRV_DBG("system prompt set: '%s'\n", system_prompt.c_str());
+    // Charge a tenant for the tokens that one of its tasks consumed
+    void charge_tenant(const std::string & tenant, int n_tokens) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        const auto it = tenant_weights.find(tenant);
+        const float weight = it != tenant_weights.end() ? it->second : 1.0f;
 
-        system_prompt = sys_prompt;
+        tenant_vtime[tenant] = get_vtime(tenant) + n_tokens/weight;
+    }
 
-        // release all slots
-        for (server_slot & slot : slots) {
-            slot.release();
-        }
+    static int task_priority(const server_task & task) {
+        return json_value(task.data, "priority", 0);
+    }
 
-        system_need_update = true;
-        return true;
+    static std::string task_tenant(const server_task & task) {
+        return json_value(task.data, "tenant", std::string());
     }
 
-    bool process_token(completion_token_output & result, server_slot & slot) {
-        // remember which tokens were sampled - used for repetition penalties during sampling
-        const std::string token_str = llama_token_to_piece(ctx, result.tok, params.special);
-        slot.sampled = result.tok;
+    // virtual time of a tenant, requires mutex_tasks
+    double get_vtime(const std::string & tenant) const {
+        const auto it = tenant_vtime.find(tenant);
+        return it != tenant_vtime.end() ? std::max(it->second, vtime) : vtime;
+    }
 
-        // search stop word and delete it
-        slot.generated_text += token_str;
+    // end the start_loop routine
+    void terminate() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        running = false;
+        condition_tasks.notify_all();
+    }
+
+    /**
+     * Main loop consists of these steps:
+     * - Wait until a new task arrives
+     * - Process the task (i.e. maybe copy data into slot)
+     * - Check if multitask is finished
+     * - Update all slots
+     */
+    void start_loop() {
+        running = true;
+
+        while (true) {
+            QUE_DBG("%s", "processing new tasks\n");
+
+            while (true) {
+                std::unique_lock<std::mutex> lock(mutex_tasks);
+                if (queue_tasks.empty()) {
+                    lock.unlock();
+                    break;
+                }
+                server_task task = queue_tasks.front();
+                queue_tasks.pop_front();
+                lock.unlock();
+
+                QUE_DBG("processing task, id = %d\n", task.id);
+                callback_new_task(task);
+            }
+
+            // all tasks in the current loop is processed, slots data is now ready
+            QUE_DBG("%s", "update slots\n");
+
+            callback_update_slots();
+
+            QUE_DBG("%s", "waiting for new tasks\n");
+            {
+                std::unique_lock<std::mutex> lock(mutex_tasks);
+                if (queue_tasks.empty()) {
+                    if (!running) {
+                        QUE_DBG("%s", "terminate\n");
+                        return;
+                    }
+                    condition_tasks.wait(lock, [&]{
+                        return (!queue_tasks.empty() || !running);
+                    });
+                }
+            }
+        }
+    }
+};
+
+struct server_response {
+    // for keeping track of all tasks waiting for the result
+    std::unordered_set<int> waiting_task_ids;
+
+    // the main result queue
+    std::vector<server_task_result> queue_results;
+
+    std::mutex mutex_results;
+    std::condition_variable condition_results;
+
+    // add the id_task to the list of tasks waiting for response
+    void add_waiting_task_id(int id_task) {
+        SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task, (int) waiting_task_ids.size());
+
+        std::unique_lock<std::mutex> lock(mutex_results);
+        waiting_task_ids.insert(id_task);
+    }
+
+    void add_waiting_tasks(const std::vector<server_task> & tasks) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+
+        for (const auto & task : tasks) {
+            SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", task.id, (int) waiting_task_ids.size());
+            waiting_task_ids.insert(task.id);
+        }
+    }
+
+    // when the request is finished, we can remove task associated with it
+    void remove_waiting_task_id(int id_task) {
+        SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
+
+        std::unique_lock<std::mutex> lock(mutex_results);
+        waiting_task_ids.erase(id_task);
+    }
+
+    void remove_waiting_task_ids(const std::unordered_set<int> & id_tasks) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+
+        for (const auto & id_task : id_tasks) {
+            SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
+            waiting_task_ids.erase(id_task);
+        }
+    }
+
+    // This function blocks the thread until there is a response for one of the id_tasks
+    server_task_result recv(const std::unordered_set<int> & id_tasks) {
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex_results);
+            condition_results.wait(lock, [&]{
+                return !queue_results.empty();
+            });
+
+            for (int i = 0; i < (int) queue_results.size(); i++) {
+                if (id_tasks.find(queue_results[i].id) != id_tasks.end()) {
+                    server_task_result res = queue_results[i];
+                    queue_results.erase(queue_results.begin() + i);
+                    return res;
+                }
+            }
+        }
+
+        // should never reach here
+    }
+
+    // single-task version of recv()
+    server_task_result recv(int id_task) {
+        std::unordered_set<int> id_tasks = {id_task};
+        return recv(id_tasks);
+    }
+
+    // Send a new result to a waiting id_task
+    void send(server_task_result & result) {
+        SRV_DBG("sending result for task id = %d\n", result.id);
+
+        std::unique_lock<std::mutex> lock(mutex_results);
+        for (const auto & id_task : waiting_task_ids) {
+            if (result.id == id_task) {
+                SRV_DBG("task id = %d moved to result queue\n", result.id);
+
+                queue_results.push_back(std::move(result));
+                condition_results.notify_all();
+                return;
+            }
+        }
+    }
+};
+
+struct server_context {
+    llama_model * model = nullptr;
+    llama_context * ctx = nullptr;
+    std::vector<llama_lora_adapter_container> loras;
+
+    gpt_params params;
+
+    llama_batch batch = {};
+
+    // draft model for speculative decoding, each slot drafts in the sequence slot.id of its context
+    llama_model   * model_dft = nullptr;
+    llama_context * ctx_dft   = nullptr;
+
+    llama_batch batch_dft = {};
+
+    // lookup decoding drafts from the n-grams of the slot, then of these caches
+    llama_ngram_cache ngram_cache_static; // loaded from --lookup-cache-static
+
+    bool clean_kv_cache = true;
+    bool add_bos_token  = true;
+    bool has_eos_token  = false;
+
+    int32_t n_ctx; // total context for all clients / slots
+
+    // system prompt
+    bool system_need_update = false;
+
+    std::string              system_prompt;
+    std::vector<llama_token> system_tokens;
+
+    // slots / clients
+    std::vector<server_slot> slots;
+    json default_generation_settings_for_props;
+
+    server_queue    queue_tasks;
+    server_response queue_results;
+
+    server_metrics metrics;
+
+    server_kv_store kv_store;
+
+    server_prefix_cache prefix_cache;
+
+    std::unordered_map<int, std::unique_ptr<server_parked_task>> parked_tasks; // by task id
+
+    size_t park_max = 0; // bytes of parked sequence states
+
+    server_prefill_sched prefill_sched;
+
+    // Necessary similarity of prompt for slot selection
+    float slot_prompt_similarity = 0.0f;
+
+    ~server_context() {
+        if (ctx) {
+            llama_free(ctx);
+            ctx = nullptr;
+        }
+
+        if (model) {
+            llama_free_model(model);
+            model = nullptr;
+        }
+
+        if (ctx_dft) {
+            llama_free(ctx_dft);
+            ctx_dft = nullptr;
+        }
+
+        if (model_dft) {
+            llama_free_model(model_dft);
+            model_dft = nullptr;
+        }
+
+        llama_batch_free(batch_dft);
+
+        // Clear any sampling context
+        for (server_slot & slot : slots) {
+            if (slot.smpl != nullptr) {
+                gpt_sampler_free(slot.smpl);
+            }
+        }
+
+        llama_batch_free(batch);
+    }
+
+    bool load_model(const gpt_params & params_) {
+        params = params_;
+
+        // dedicate one sequence to the system prompt
+        params.n_parallel += 1;
+
+        llama_init_result llama_init = llama_init_from_gpt_params(params);
+
+        model = llama_init.model;
+        ctx   = llama_init.context;
+        loras = llama_init.lora_adapters;
+
+        params.n_parallel -= 1; // but be sneaky about it
+
+        if (model == nullptr) {
+            SRV_ERR("failed to load model, '%s'\n", params.model.c_str());
+            return false;
+        }
+
+        n_ctx = llama_n_ctx(ctx);
+
+        add_bos_token = llama_add_bos_token(model);
+        has_eos_token = !llama_add_eos_token(model);
+
+        if (!params.model_draft.empty()) {
+            if (!load_model_draft()) {
+                return false;
+            }
+        }
+
+        // lookup decoding is disabled with a draft model
+        if (params.lookup && !ctx_dft && !params.lookup_cache_static.empty()) {
+            try {
+                ngram_cache_static = llama_ngram_cache_load(params.lookup_cache_static);
+            } catch (std::ifstream::failure const &) {
+                SRV_ERR("failed to open static lookup cache, '%s'\n", params.lookup_cache_static.c_str());
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool load_model_draft() {
+        SRV_INF("loading draft model '%s'\n", params.model_draft.c_str());
+
+        gpt_params params_dft = params;
+
+        params_dft.model        = params.model_draft;
+        params_dft.n_gpu_layers = params.n_gpu_layers_draft;
+
+        // the draft model is a local file, the download options are those of the target model
+        params_dft.model_url.clear();
+        params_dft.hf_repo.clear();
+        params_dft.hf_file.clear();
+        params_dft.hf_token.clear();
+
+        params_dft.n_parallel   = params.n_parallel;
+        params_dft.lora_adapters.clear();
+        params_dft.control_vectors.clear();
+
+        // the draft sequences do not share the system prompt, and hold the drafts on top of the context of the slot
+        params_dft.n_ctx = n_ctx + params.n_parallel*(params.n_draft + 1);
+
+        if (params.draft_cpuparams.n_threads > 0) {
+            params_dft.cpuparams.n_threads = params.draft_cpuparams.n_threads;
+        }
+        if (params.draft_cpuparams_batch.n_threads > 0) {
+            params_dft.cpuparams_batch.n_threads = params.draft_cpuparams_batch.n_threads;
+        }
+
+        llama_init_result llama_init_dft = llama_init_from_gpt_params(params_dft);
+
+        model_dft = llama_init_dft.model;
+        ctx_dft   = llama_init_dft.context;
+
+        if (model_dft == nullptr) {
+            SRV_ERR("failed to load draft model, '%s'\n", params.model_draft.c_str());
+            return false;
+        }
+
+        if (llama_vocab_type(model) != llama_vocab_type(model_dft)) {
+            SRV_ERR("draft model vocab type must match the target model, %d != %d\n", llama_vocab_type(model_dft), llama_vocab_type(model));
+            return false;
+        }
+
+        if (llama_add_bos_token(model) != llama_add_bos_token(model_dft) ||
+            llama_add_eos_token(model) != llama_add_eos_token(model_dft) ||
+            llama_token_bos(model)     != llama_token_bos(model_dft)     ||
+            llama_token_eos(model)     != llama_token_eos(model_dft)) {
+            SRV_ERR("%s", "draft model special tokens must match the target model\n");
+            return false;
+        }
+
+        const int n_vocab_tgt = llama_n_vocab(model);
+        const int n_vocab_dft = llama_n_vocab(model_dft);
+
+        if (std::abs(n_vocab_tgt - n_vocab_dft) > SPEC_VOCAB_MAX_SIZE_DIFFERENCE) {
+            SRV_ERR("draft model vocab must closely match the target model, n_vocab = %d != %d\n", n_vocab_dft, n_vocab_tgt);
+            return false;
+        }
+
+        for (int i = SPEC_VOCAB_CHECK_START_TOKEN_ID; i < std::min(n_vocab_tgt, n_vocab_dft); ++i) {
+            if (std::strcmp(llama_token_get_text(model, i), llama_token_get_text(model_dft, i)) != 0) {
+                SRV_ERR("draft model token %d ('%s') does not match the target model ('%s')\n", i,
+                        llama_token_get_text(model_dft, i), llama_token_get_text(model, i));
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool validate_model_chat_template() const {
+        llama_chat_message chat[] = {{"user", "test"}};
+
+        const int res = llama_chat_apply_template(model, nullptr, chat, 1, true, nullptr, 0);
+
+        return res > 0;
+    }
+
+    void init() {
+        const int32_t n_ctx_slot = n_ctx / params.n_parallel;
+
+        SRV_INF("initializing slots, n_slots = %d\n", params.n_parallel);
+
+        for (int i = 0; i < params.n_parallel; i++) {
+            server_slot slot;
+
+            slot.id = i;
+            slot.n_ctx = n_ctx_slot;
+            slot.n_predict = params.n_predict;
+
+            SLT_INF(slot, "new slot n_ctx_slot = %d\n", slot.n_ctx);
+
+            const int ga_n = params.grp_attn_n;
+            const int ga_w = params.grp_attn_w;
+
+            if (ga_n != 1) {
+                GGML_ASSERT(ga_n > 0                    && "ga_n must be positive");                       // NOLINT
+                GGML_ASSERT(ga_w % ga_n == 0            && "ga_w must be a multiple of ga_n");             // NOLINT
+                //GGML_ASSERT(n_ctx_train % ga_w == 0     && "n_ctx_train must be a multiple of ga_w");    // NOLINT
+                //GGML_ASSERT(n_ctx >= n_ctx_train * ga_n && "n_ctx must be at least n_ctx_train * ga_n"); // NOLINT
+
+                SLT_INF(slot, "slot self-extend: ga_n = %d, ga_w = %d\n", ga_n, ga_w);
+            }
+
+            slot.ga_i = 0;
+            slot.ga_n = ga_n;
+            slot.ga_w = ga_w;
+
+            slot.sparams = params.sparams;
+
+            slot.callback_on_release = [this](int id) {
+                const server_slot & slot = slots[id];
+                queue_tasks.charge_tenant(slot.params.tenant, slot.n_prompt_tokens_processed + slot.n_decoded);
+                queue_tasks.pop_deferred_task();
+            };
+
+            slot.reset();
+
+            slots.push_back(slot);
+        }
+
+        for (const auto & tw : params.tenant_weights) {
+            queue_tasks.tenant_weights[tw.first] = tw.second;
+        }
+
+        kv_store.max_ram  = (size_t) std::max(0, params.kv_store_ram)  * 1024 * 1024;
+        kv_store.max_disk = (size_t) std::max(0, params.kv_store_disk) * 1024 * 1024;
+        kv_store.path     = params.kv_store_path;
+
+        park_max = (size_t) std::max(0, params.park_ram) * 1024 * 1024;
+
+        if (kv_store.enabled()) {
+            SRV_INF("kv store: ram = %d MiB, path = '%s'\n", params.kv_store_ram, kv_store.path.c_str());
+        }
+
+        prefill_sched.t_target = params.decode_latency;
+
+        if (prefill_sched.t_target > 0.0) {
+            SRV_INF("prompts are processed in chunks while slots generate, decode latency target = %.1f ms\n", prefill_sched.t_target);
+        }
+
+        // the state of a recurrent model cannot be shared from the middle of a sequence
+        if (params.prefix_cache && llama_model_is_recurrent(model)) {
+            SRV_WRN("%s", "prefix cache is not supported by recurrent models, disabling\n");
+            params.prefix_cache = false;
+        }
+
+        if (ctx_dft && params.lookup) {
+            SRV_WRN("%s", "lookup decoding is not used with a draft model, disabling\n");
+            params.lookup = false;
+        }
+
+        // nor can the rejected drafts be removed from it
+        if ((ctx_dft || params.lookup) && (llama_model_is_recurrent(model) || (ctx_dft && llama_model_is_recurrent(model_dft)))) {
+            SRV_WRN("%s", "speculative decoding is not supported by recurrent models, disabling\n");
+            params.n_draft = 0;
+        }
+
+        if (ctx_dft && params.n_draft > 0) {
+            SRV_INF("speculative decoding with draft model '%s', n_draft = %d\n", params.model_draft.c_str(), params.n_draft);
+        }
+
+        if (params.lookup && params.n_draft > 0) {
+            SRV_INF("speculative decoding with n-gram lookup, n_draft = %d, static cache = %zu n-grams\n", params.n_draft, ngram_cache_static.size());
+        }
+
+        default_generation_settings_for_props = get_formated_generation(slots.front());
+        default_generation_settings_for_props["seed"] = -1;
+
+        // the update_slots() logic will always submit a maximum of n_batch or n_parallel tokens
+        // note that n_batch can be > n_ctx (e.g. for non-causal attention models such as BERT where the KV cache is not used)
+        {
+            const int32_t n_batch = llama_n_batch(ctx);
+
+            // only a single seq_id per token is needed
+            batch = llama_batch_init(std::max(n_batch, params.n_parallel), 0, 1);
+
+            if (ctx_dft) {
+                batch_dft = llama_batch_init(std::max(n_batch, params.n_parallel), 0, 1);
+            }
+        }
+
+        metrics.init();
+    }
+
+    std::vector<llama_token> tokenize(const json & json_prompt, bool add_special) const {
+        // TODO: currently, we tokenize using special tokens by default
+        //       this is not always correct (see https://github.com/ggerganov/llama.cpp/pull/4160#issuecomment-1824826216)
+        //       but it's better compared to completely ignoring ChatML and other chat templates
+        const bool TMP_FORCE_SPECIAL = true;
+
+        // If `add_bos` is true, we only add BOS, when json_prompt is a string,
+        // or the first element of the json_prompt array is a string.
+        std::vector<llama_token> prompt_tokens;
+
+        if (json_prompt.is_array()) {
+            bool first = true;
+            for (const auto & p : json_prompt) {
+                if (p.is_string()) {
+                    auto s = p.template get<std::string>();
+
+                    std::vector<llama_token> p;
+                    if (first) {
+                        p = ::llama_tokenize(ctx, s, add_special, TMP_FORCE_SPECIAL);
+                        first = false;
+                    } else {
+                        p = ::llama_tokenize(ctx, s, false, TMP_FORCE_SPECIAL);
+                    }
+
+                    prompt_tokens.insert(prompt_tokens.end(), p.begin(), p.end());
+                } else {
+                    if (first) {
+                        first = false;
+                    }
+
+                    prompt_tokens.push_back(p.template get<llama_token>());
+                }
+            }
+        } else {
+            auto s = json_prompt.template get<std::string>();
+            prompt_tokens = ::llama_tokenize(ctx, s, add_special, TMP_FORCE_SPECIAL);
+        }
+
+        return prompt_tokens;
+    }
+
+    server_slot * get_slot_by_id(int id) {
+        for (server_slot & slot : slots) {
+            if (slot.id == id) {
+                return &slot;
+            }
+        }
+
+        return nullptr;
+    }
+
+    server_slot * get_available_slot(const std::string & prompt) {
+        server_slot * ret = nullptr;
+
+        // find the slot that has at least n% prompt similarity
+        if (ret == nullptr && slot_prompt_similarity != 0.0f && !prompt.empty()) {
+            int max_lcp_len = 0;
+            float similarity = 0;
+
+            for (server_slot & slot : slots) {
+                // skip the slot if it is not available
+                if (slot.is_processing()) {
+                    continue;
+                }
+
+                // skip the slot if it does not contains prompt
+                if (!slot.prompt.is_string()) {
+                    continue;
+                }
+
+                // current slot's prompt
+                std::string slot_prompt = slot.prompt.get<std::string>();
+
+                // length of the current slot's prompt
+                int slot_prompt_len = slot_prompt.size();
+
+                // length of the Longest Common Prefix between the current slot's prompt and the input prompt
+                int lcp_len = common_part(slot_prompt, prompt);
+
+                // fraction of the common substring length compared to the current slot's prompt length
+                similarity = static_cast<float>(lcp_len) / slot_prompt_len;
+
+                // select the current slot if the criteria match
+                if (lcp_len > max_lcp_len && similarity > slot_prompt_similarity) {
+                    max_lcp_len = lcp_len;
+                    ret = &slot;
+                }
+            }
+
+            if (ret != nullptr) {
+                SLT_DBG(*ret, "selected slot by lcp similarity, max_lcp_len = %d, similarity = %f\n", max_lcp_len, similarity);
+            }
+        }
+
+        // find the slot that has been least recently used
+        if (ret == nullptr) {
+            int64_t t_last = ggml_time_us();
+            for (server_slot & slot : slots) {
+                // skip the slot if it is not available
+                if (slot.is_processing()) {
+                    continue;
+                }
+
+                // select the current slot if the criteria match
+                if (slot.t_last_used < t_last) {
+                    t_last = slot.t_last_used;
+                    ret = &slot;
+                }
+            }
+
+            if (ret != nullptr) {
+                SLT_DBG(*ret, "selected slot by lru, t_last = %" PRId64 "\n", t_last);
+            }
+        }
+
+        return ret;
+    }
+
+    bool launch_slot_with_task(server_slot & slot, const server_task & task) {
+        slot_params default_params;
+        // Sampling parameter defaults are loaded from the global server context (but individual requests can still override them)
+        auto default_sparams = params.sparams;
+        const auto & data = task.data;
+
+        if (data.count("__oaicompat") != 0) {
+            slot.oaicompat = true;
+            slot.oaicompat_model = json_value(data, "model", std::string(DEFAULT_OAICOMPAT_MODEL));
+        } else {
+            slot.oaicompat = false;
+            slot.oaicompat_model = "";
+        }
+
+        slot.params.stream             = json_value(data, "stream",            false);
+        slot.params.cache_prompt       = json_value(data, "cache_prompt",      false);
+        slot.params.n_predict          = json_value(data, "n_predict",         json_value(data, "max_tokens", default_params.n_predict));
+        slot.params.priority           = json_value(data, "priority",          default_params.priority);
+        slot.params.tenant             = json_value(data, "tenant",            default_params.tenant);
+        slot.sparams.top_k             = json_value(data, "top_k",             default_sparams.top_k);
+        slot.sparams.top_p             = json_value(data, "top_p",             default_sparams.top_p);
+        slot.sparams.min_p             = json_value(data, "min_p",             default_sparams.min_p);
+        slot.sparams.tfs_z             = json_value(data, "tfs_z",             default_sparams.tfs_z);
+        slot.sparams.typ_p             = json_value(data, "typical_p",         default_sparams.typ_p);
+        slot.sparams.temp              = json_value(data, "temperature",       default_sparams.temp);
+        slot.sparams.dynatemp_range    = json_value(data, "dynatemp_range",    default_sparams.dynatemp_range);
+        slot.sparams.dynatemp_exponent = json_value(data, "dynatemp_exponent", default_sparams.dynatemp_exponent);
+        slot.sparams.penalty_last_n    = json_value(data, "repeat_last_n",     default_sparams.penalty_last_n);
+        slot.sparams.penalty_repeat    = json_value(data, "repeat_penalty",    default_sparams.penalty_repeat);
+        slot.sparams.penalty_freq      = json_value(data, "frequency_penalty", default_sparams.penalty_freq);
+        slot.sparams.penalty_present   = json_value(data, "presence_penalty",  default_sparams.penalty_present);
+        slot.sparams.mirostat          = json_value(data, "mirostat",          default_sparams.mirostat);
+        slot.sparams.mirostat_tau      = json_value(data, "mirostat_tau",      default_sparams.mirostat_tau);
+        slot.sparams.mirostat_eta      = json_value(data, "mirostat_eta",      default_sparams.mirostat_eta);
+        slot.sparams.penalize_nl       = json_value(data, "penalize_nl",       default_sparams.penalize_nl);
+        slot.params.n_keep             = json_value(data, "n_keep",            slot.params.n_keep);
+        slot.params.n_discard          = json_value(data, "n_discard",         default_params.n_discard);
+        slot.sparams.seed              = json_value(data, "seed",              default_sparams.seed);
+        slot.sparams.n_probs           = json_value(data, "n_probs",           default_sparams.n_probs);
+        slot.sparams.min_keep          = json_value(data, "min_keep",          default_sparams.min_keep);
+
+        // process "json_schema" and "grammar"
+        if (data.contains("json_schema") && !data.at("json_schema").is_null() && data.contains("grammar") && !data.at("grammar").is_null()) {
+            send_error(task, "Either \"json_schema\" or \"grammar\" can be specified, but not both", ERROR_TYPE_INVALID_REQUEST);
+            return false;
+        }
+        if (data.contains("json_schema") && !data.contains("grammar")) {
+            try {
+                auto schema                = json_value(data, "json_schema", json::object());
+                slot.sparams.grammar       = json_schema_to_grammar(schema);
+            } catch (const std::exception & e) {
+                send_error(task, std::string("\"json_schema\": ") + e.what(), ERROR_TYPE_INVALID_REQUEST);
+                return false;
+            }
+        } else {
+            slot.sparams.grammar       = json_value(data, "grammar",           default_sparams.grammar);
+        }
+
+        if (slot.params.cache_prompt && slot.ga_n != 1) {
+            slot.params.cache_prompt = false;
+            SLT_WRN(slot, "%s", "group-attention is not supported with prompt caching. disabling cache\n");
+        }
+
+        // the draft context is sized for at most params.n_draft drafts per slot
+        slot.params.n_draft = (ctx_dft || params.lookup) && slot.ga_n == 1 ? std::min(std::max(0, json_value(data, "n_draft", params.n_draft)), params.n_draft) : 0;
+        slot.n_draft        = slot.params.n_draft;
+
+        if (slot.n_predict > 0 && slot.params.n_predict > slot.n_predict) {
+            // Might be better to reject the request with a 400 ?
+            slot.params.n_predict = slot.n_predict;
+            SLT_WRN(slot, "n_predict = %d exceeds server configuration, setting to %d", slot.n_predict, slot.n_predict);
+        }
+
+        // infill
+        slot.params.input_prefix = json_value(data, "input_prefix", default_params.input_prefix);
+        slot.params.input_suffix = json_value(data, "input_suffix", default_params.input_suffix);
+
+        // get prompt
+        if (task.cmpl_type != SERVER_TASK_CMPL_TYPE_INFILL) {
+            const auto & prompt = data.find("prompt");
+            if (prompt == data.end()) {
+                send_error(task, "\"prompt\" must be provided", ERROR_TYPE_INVALID_REQUEST);
+                return false;
+            }
+
+            if ((prompt->is_string()) ||
+                (prompt->is_array() &&  prompt->size() == 1 && prompt->at(0).is_string()) ||
+                (prompt->is_array() && !prompt->empty()     && prompt->at(0).is_number_integer())) {
+                slot.prompt = *prompt;
+            } else if (prompt->is_array() && prompt->size() == 1 && prompt->at(0).is_array()) {
+                slot.prompt = prompt->at(0);
+            } else {
+                send_error(task, "\"prompt\" must be a string or an array of integers", ERROR_TYPE_INVALID_REQUEST);
+                return false;
+            }
+        }
+
+        {
+            slot.sparams.logit_bias.clear();
+
+            if (json_value(data, "ignore_eos", false) && has_eos_token) {
+                slot.sparams.logit_bias.push_back({llama_token_eos(model), -INFINITY});
+            }
+
+            const auto & logit_bias = data.find("logit_bias");
+            if (logit_bias != data.end() && logit_bias->is_array()) {
+                const int n_vocab = llama_n_vocab(model);
+                for (const auto & el : *logit_bias) {
+                    // TODO: we may want to throw errors here, in case "el" is incorrect
+                    if (el.is_array() && el.size() == 2) {
+                        float bias;
+                        if (el[1].is_number()) {
+                            bias = el[1].get<float>();
+                        } else if (el[1].is_boolean() && !el[1].get<bool>()) {
+                            bias = -INFINITY;
+                        } else {
+                            continue;
+                        }
+
+                        if (el[0].is_number_integer()) {
+                            llama_token tok = el[0].get<llama_token>();
+                            if (tok >= 0 && tok < n_vocab) {
+                                slot.sparams.logit_bias.push_back({tok, bias});
+                            }
+                        } else if (el[0].is_string()) {
+                            auto toks = llama_tokenize(model, el[0].get<std::string>(), false);
+                            for (auto tok : toks) {
+                                slot.sparams.logit_bias.push_back({tok, bias});
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        {
+            slot.params.antiprompt.clear();
+
+            const auto & stop = data.find("stop");
+            if (stop != data.end() && stop->is_array()) {
+                for (const auto & word : *stop) {
+                    if (!word.empty()) {
+                        slot.params.antiprompt.push_back(word);
+                    }
+                }
+            }
+        }
+
+        {
+            const auto & samplers = data.find("samplers");
+            if (samplers != data.end() && samplers->is_array()) {
+                std::vector<std::string> sampler_names;
+                for (const auto & name : *samplers) {
+                    if (name.is_string()) {
+                        sampler_names.emplace_back(name);
+                    }
+                }
+                slot.sparams.samplers = gpt_sampler_types_from_names(sampler_names, false);
+            } else {
+                slot.sparams.samplers = default_sparams.samplers;
+            }
+        }
+
+        {
+            if (slot.smpl != nullptr) {
+                gpt_sampler_free(slot.smpl);
+            }
+
+            slot.smpl = gpt_sampler_init(model, slot.sparams);
+            if (slot.smpl == nullptr) {
+                // for now, the only error that may happen here is invalid grammar
+                send_error(task, "Failed to parse grammar", ERROR_TYPE_INVALID_REQUEST);
+                return false;
+            }
+        }
+
+        // a preempted task continues with the text it has already generated and sent
+        if (data.contains("__resume")) {
+            const json & resume = data.at("__resume");
+
+            slot.resumed        = true;
+            slot.generated_text = json_value(resume, "generated_text", std::string());
+            slot.n_sent_text    = json_value(resume, "n_sent_text",    (size_t) 0);
+            slot.t_first_token  = json_value(resume, "t_first_token",  0.0);
+        }
+
+        slot.task_data = data;
+
+        slot.state = SLOT_STATE_PROCESSING_PROMPT;
+        slot.prompt_tokens.clear();
+
+        slot.t_start_task = ggml_time_us();
+        slot.t_posted     = task.t_posted > 0 ? task.t_posted : slot.t_start_task;
+
+        SLT_INF(slot, "%s", "processing task\n");
+
+        return true;
+    }
+
+    void kv_cache_clear() {
+        SRV_DBG("%s", "clearing KV cache\n");
+
+        // clear the entire KV cache
+        llama_kv_cache_clear(ctx);
+        prefix_cache.clear();
+
+        if (ctx_dft) {
+            llama_kv_cache_clear(ctx_dft);
+            for (server_slot & slot : slots) {
+                slot.cache_tokens_dft.clear();
+            }
+        }
+        clean_kv_cache = false;
+    }
+
+    // before a new prompt takes over the slot, park the conversation held in its sequence and bring back the
+    // stored conversation that shares the longest prefix with the prompt, if it beats what the slot already has
+    void kv_store_swap(server_slot & slot, const std::vector<llama_token> & prompt_tokens) {
+        const size_t n_own = common_part(slot.cache_tokens, prompt_tokens);
+
+        size_t n_stored = 0;
+        auto it = kv_store.find(prompt_tokens, n_stored);
+
+        // restoring copies the whole entry, it has to pay off
+        const bool use_stored = n_stored > n_own && 2*n_stored >= it->tokens.size();
+
+        // the slot keeps most of its conversation - nothing to do
+        if (!use_stored && 2*n_own >= slot.cache_tokens.size()) {
+            return;
+        }
+
+        if (!slot.cache_tokens.empty()) {
+            if (kv_store.store(ctx, slot.id + 1, slot.cache_tokens)) {
+                SLT_INF(slot, "stored %d tokens in the kv store\n", (int) slot.cache_tokens.size());
+            }
+        }
+
+        if (!use_stored) {
+            return;
+        }
+
+        // the entry may have been evicted while storing the slot's state
+        it = kv_store.find(prompt_tokens, n_stored);
+        if (it == kv_store.entries.end() || n_stored <= n_own) {
+            return;
+        }
+
+        std::vector<llama_token> tokens = it->tokens;
+
+        llama_kv_cache_seq_rm(ctx, slot.id + 1, -1, -1);
+        slot.cache_tokens.clear();
+
+        if (!kv_store.restore(ctx, slot.id + 1, it)) {
+            SLT_WRN(slot, "%s", "failed to restore from the kv store\n");
+            return;
+        }
+
+        slot.cache_tokens = std::move(tokens);
+        slot_update_pos_shift(slot);
+
+        SLT_INF(slot, "restored %d tokens from the kv store, n_common = %d\n", (int) slot.cache_tokens.size(), (int) n_stored);
+    }
+
+    // load the parked sequence of a preempted task into the slot, the conversation held by the slot goes to the kv store
+    bool slot_restore_parked(server_slot & slot, const server_parked_task & parked) {
+        if (parked.state.empty()) {
+            return false;
+        }
+
+        if (kv_store.enabled() && !slot.cache_tokens.empty() && kv_store.store(ctx, slot.id + 1, slot.cache_tokens)) {
+            SLT_INF(slot, "stored %d tokens in the kv store\n", (int) slot.cache_tokens.size());
+        }
+
+        llama_kv_cache_seq_rm(ctx, slot.id + 1, -1, -1);
+        slot.cache_tokens.clear();
+        slot.pos_shift = 0;
+
+        if (llama_state_seq_set_data(ctx, parked.state.data(), parked.state.size(), slot.id + 1) == 0) {
+            SLT_WRN(slot, "%s", "failed to restore the parked sequence\n");
+
+            // the system prompt was part of the sequence
+            llama_kv_cache_seq_rm(ctx, slot.id + 1, -1, -1);
+            llama_kv_cache_seq_cp(ctx, 0, slot.id + 1, -1, -1);
+            return false;
+        }
+
+        slot.cache_tokens = parked.tokens;
+        slot_update_pos_shift(slot);
+
+        SLT_INF(slot, "restored %d parked tokens\n", (int) slot.cache_tokens.size());
+
+        return true;
+    }
+
+    // attach the slot to the longest prefix of the prompt cached in the sequence of another slot, if it beats what the
+    // slot already has - the cells of the prefix are shared with llama_kv_cache_seq_cp instead of being computed again
+    void prefix_cache_attach(server_slot & slot, const std::vector<llama_token> & prompt_tokens) {
+        const size_t n_own = common_part(slot.cache_tokens, prompt_tokens);
+
+        std::vector<int> ids;
+        const size_t n_cached = prefix_cache.find(prompt_tokens, ids);
+
+        if (n_cached <= n_own) {
+            return;
+        }
+
+        // the slot itself is not registered while it takes a new prompt
+        const server_slot & donor = slots[ids.front()];
+
+        const int n_system = (int) system_tokens.size();
+        const int p0       = n_system + donor.pos_shift;
+
+        // drop the tokens of the slot, the system prompt stays
+        if (!llama_kv_cache_seq_rm(ctx, slot.id + 1, n_system, -1)) {
+            return;
+        }
+
+        slot.cache_tokens.clear();
+        slot.pos_shift = 0;
+
+        llama_kv_cache_seq_cp(ctx, donor.id + 1, slot.id + 1, p0, -1);
+
+        if (!llama_kv_cache_seq_rm(ctx, slot.id + 1, p0 + n_cached, -1)) {
+            // the sliding-window cells at the end of the prefix are no longer in the sequence of the donor
+            llama_kv_cache_seq_rm(ctx, slot.id + 1, n_system, -1);
+
+            SLT_WRN(slot, "cannot share the prefix cached by slot %d, n_cached = %d\n", donor.id, (int) n_cached);
+            return;
+        }
+
+        slot.cache_tokens.assign(prompt_tokens.begin(), prompt_tokens.begin() + n_cached);
+        slot.pos_shift = donor.pos_shift;
+
+        prefix_cache.n_attached++;
+        prefix_cache.n_tokens_shared += n_cached - n_own;
+
+        SLT_INF(slot, "attached to the prefix cached by slot %d, n_cached = %d, n_own = %d\n", donor.id, (int) n_cached, (int) n_own);
+    }
+
+    // derive the position offset of the tokens cached in the slot's sequence from its cells, e.g. after a restore
+    void slot_update_pos_shift(server_slot & slot) {
+        slot.pos_shift = 0;
+
+        if (!slot.cache_tokens.empty()) {
+            slot.pos_shift = llama_kv_cache_seq_pos_max(ctx, slot.id + 1) + 1 - (int) (system_tokens.size() + slot.cache_tokens.size());
+        }
+    }
+
+    void system_prompt_update() {
+        SRV_DBG("updating system prompt: '%s'\n", system_prompt.c_str());
+
+        kv_cache_clear();
+        system_tokens.clear();
+
+        // the stored states contain the cells of the old system prompt
+        kv_store.clear();
+
+        for (auto & parked : parked_tasks) {
+            parked.second->state.clear();
+        }
+
+        if (!system_prompt.empty()) {
+            system_tokens = ::llama_tokenize(ctx, system_prompt, true);
+
+            const int32_t n_batch = llama_n_batch(ctx);
+            const int32_t n_tokens_prompt = system_tokens.size();
+
+            for (int32_t i = 0; i < n_tokens_prompt; i += n_batch) {
+                const int32_t n_tokens = std::min(n_batch, n_tokens_prompt - i);
+
+                llama_batch_clear(batch);
+
+                for (int32_t j = 0; j < n_tokens; ++j) {
+                    llama_batch_add(batch, system_tokens[i + j], i + j, { 0 }, false);
+                }
+
+                if (llama_decode(ctx, batch) != 0) {
+                    SRV_ERR("%s", "llama_decode() failed\n");
+                    return;
+                }
+            }
+
+            // assign the system KV cache to all parallel sequences
+            for (int32_t i = 1; i <= params.n_parallel; ++i) {
+                llama_kv_cache_seq_cp(ctx, 0, i, -1, -1);
+            }
+        }
+
+        system_need_update = false;
+    }
+
+    bool system_prompt_set(const std::string & sys_prompt) {
+        SRV_DBG("system prompt set: '%s'\n", system_prompt.c_str());
+
+        system_prompt = sys_prompt;
+
+        // release all slots
+        for (server_slot & slot : slots) {
+            slot.release();
+        }
+
+        system_need_update = true;
+        return true;
+    }
+
+    bool process_token(completion_token_output & result, server_slot & slot) {
+        // remember which tokens were sampled - used for repetition penalties during sampling
+        const std::string token_str = llama_token_to_piece(ctx, result.tok, params.special);
+        slot.sampled = result.tok;
+
+        // search stop word and delete it
+        slot.generated_text += token_str;
         slot.has_next_token = true;
 
-        // check if there is incomplete UTF-8 character at the end
-        bool incomplete = false;
-        for (unsigned i = 1; i < 5 && i <= slot.generated_text.size(); ++i) {
-            unsigned char c = slot.generated_text[slot.generated_text.size() - i];
-            if ((c & 0xC0) == 0x80) {
-                // continuation byte: 10xxxxxx
+        // check if there is incomplete UTF-8 character at the end
+        bool incomplete = false;
+        for (unsigned i = 1; i < 5 && i <= slot.generated_text.size(); ++i) {
+            unsigned char c = slot.generated_text[slot.generated_text.size() - i];
+            if ((c & 0xC0) == 0x80) {
+                // continuation byte: 10xxxxxx
+                continue;
+            }
+            if ((c & 0xE0) == 0xC0) {
+                // 2-byte character: 110xxxxx ...
+                incomplete = i < 2;
+            } else if ((c & 0xF0) == 0xE0) {
+                // 3-byte character: 1110xxxx ...
+                incomplete = i < 3;
+            } else if ((c & 0xF8) == 0xF0) {
+                // 4-byte character: 11110xxx ...
+                incomplete = i < 4;
+            }
+            // else 1-byte character or invalid byte
+            break;
+        }
+
+        if (!incomplete) {
+            size_t pos = std::min(slot.n_sent_text, slot.generated_text.size());
+
+            const std::string str_test = slot.generated_text.substr(pos);
+            bool is_stop_full = false;
+
+            size_t stop_pos = slot.find_stopping_strings(str_test, token_str.size(), STOP_TYPE_FULL);
+            if (stop_pos != std::string::npos) {
+                is_stop_full = true;
+                slot.generated_text.erase(
+                    slot.generated_text.begin() + pos + stop_pos,
+                    slot.generated_text.end());
+                pos = std::min(slot.n_sent_text, slot.generated_text.size());
+            } else {
+                is_stop_full = false;
+                stop_pos = slot.find_stopping_strings(str_test, token_str.size(), STOP_TYPE_PARTIAL);
+            }
+
+            // check if there is any token to predict
+            if (stop_pos == std::string::npos || (!slot.has_next_token && !is_stop_full && stop_pos > 0)) {
+                // no send the stop word in the response
+                result.text_to_send = slot.generated_text.substr(pos, std::string::npos);
+                slot.n_sent_text += result.text_to_send.size();
+                // add the token to slot queue and cache
+            }
+
+            slot.add_token(result);
+            if (slot.params.stream) {
+                send_partial_response(slot, result);
+            }
+        }
+
+        if (incomplete) {
+            slot.has_next_token = true;
+        }
+
+        // check the limits
+        if (slot.n_decoded > 0 && slot.has_next_token && !slot.has_budget(params)) {
+            slot.stopped_limit  = true;
+            slot.has_next_token = false;
+
+            SLT_DBG(slot, "stopped by limit, n_decoded = %d, n_predict = %d\n", slot.n_decoded, slot.params.n_predict);
+        }
+
+        // if context shift is disabled, we stop when it reaches the context limit
+        if (!params.ctx_shift && slot.n_decoded >= slot.n_ctx) {
+            slot.truncated      = true;
+            slot.stopped_limit  = true;
+            slot.has_next_token = false;
+
+            SLT_DBG(slot, "stopped due to running out of context capacity, n_decoded = %d, n_ctx = %d\n", slot.n_decoded, slot.n_ctx);
+        }
+
+        if (llama_token_is_eog(model, result.tok)) {
+            slot.stopped_eos    = true;
+            slot.has_next_token = false;
+
+            SLT_DBG(slot, "%s", "stopped by EOS\n");
+        }
+
+        const auto n_ctx_train = llama_n_ctx_train(model);
+
+        if (slot.params.n_predict < 1 && slot.n_predict < 1 && slot.ga_n == 1 && slot.n_prompt_tokens + slot.n_decoded >= n_ctx_train) {
+            slot.truncated      = true;
+            slot.stopped_limit  = true;
+            slot.has_next_token = false; // stop prediction
+
+            SLT_WRN(slot,
+                    "n_predict (%d) is not set and self-context extend is disabled. "
+                    "Limiting generated tokens to n_ctx_train (%d) to avoid EOS-less generation infinite loop\n",
+                    slot.params.n_predict, n_ctx_train);
+        }
+
+        SLT_DBG(slot, "n_decoded = %d, n_remaining = %d, next token: '%s'\n", slot.n_decoded, slot.n_remaining, token_str.c_str());
+
+        return slot.has_next_token; // continue
+    }
+
+    json get_formated_generation(const server_slot & slot) const {
+        std::vector<std::string> samplers;
+        samplers.reserve(slot.sparams.samplers.size());
+        for (const auto & sampler : slot.sparams.samplers) {
+            samplers.emplace_back(gpt_sampler_type_to_str(sampler));
+        }
+
+        return json {
+            {"n_ctx",                     slot.n_ctx},
+            {"n_predict",                 slot.n_predict},     // Server configured n_predict
+            {"model",                     params.model_alias},
+            {"seed",                      slot.sparams.seed},
+            {"seed_cur",                  slot.smpl ? gpt_sampler_get_seed(slot.smpl) : 0},
+            {"temperature",               slot.sparams.temp},
+            {"dynatemp_range",            slot.sparams.dynatemp_range},
+            {"dynatemp_exponent",         slot.sparams.dynatemp_exponent},
+            {"top_k",                     slot.sparams.top_k},
+            {"top_p",                     slot.sparams.top_p},
+            {"min_p",                     slot.sparams.min_p},
+            {"tfs_z",                     slot.sparams.tfs_z},
+            {"typical_p",                 slot.sparams.typ_p},
+            {"repeat_last_n",             slot.sparams.penalty_last_n},
+            {"repeat_penalty",            slot.sparams.penalty_repeat},
+            {"presence_penalty",          slot.sparams.penalty_present},
+            {"frequency_penalty",         slot.sparams.penalty_freq},
+            {"mirostat",                  slot.sparams.mirostat},
+            {"mirostat_tau",              slot.sparams.mirostat_tau},
+            {"mirostat_eta",              slot.sparams.mirostat_eta},
+            {"penalize_nl",               slot.sparams.penalize_nl},
+            {"stop",                      slot.params.antiprompt},
+            {"max_tokens",                slot.params.n_predict}, // User configured n_predict
+            {"n_keep",                    slot.params.n_keep},
+            {"n_discard",                 slot.params.n_discard},
+            {"n_draft",                   slot.params.n_draft},
+            {"ignore_eos",                slot.sparams.ignore_eos},
+            {"stream",                    slot.params.stream},
+          //{"logit_bias",                slot.sparams.logit_bias},
+            {"n_probs",                   slot.sparams.n_probs},
+            {"min_keep",                  slot.sparams.min_keep},
+            {"grammar",                   slot.sparams.grammar},
+            {"samplers",                  samplers},
+        };
+    }
+
+    void send_error(const server_task & task, const std::string & error, const enum error_type type = ERROR_TYPE_SERVER) {
+        send_error(task.id, error, type);
+    }
+
+    void send_error(const server_slot & slot, const std::string & error, const enum error_type type = ERROR_TYPE_SERVER) {
+        send_error(slot.id_task, error, type);
+    }
+
+    void send_error(const int id_task, const std::string & error, const enum error_type type = ERROR_TYPE_SERVER) {
+        SRV_ERR("task id = %d, error: %s\n", id_task, error.c_str());
+
+        server_task_result res;
+        res.id       = id_task;
+        res.stop     = false;
+        res.error    = true;
+        res.data     = format_error_response(error, type);
+
+        queue_results.send(res);
+    }
+
+    void send_partial_response(server_slot & slot, completion_token_output tkn) {
+        server_task_result res;
+        res.id       = slot.id_task;
+        res.error    = false;
+        res.stop     = false;
+        res.data     = json {
+            {"content",    tkn.text_to_send},
+            {"stop",       false},
+            {"id_slot",    slot.id},
+            {"multimodal", false},
+            {"index",      slot.index},
+        };
+
+        if (slot.sparams.n_probs > 0) {
+            const std::vector<llama_token> to_send_toks = llama_tokenize(ctx, tkn.text_to_send, false);
+            const size_t probs_pos      = std::min(slot.n_sent_token_probs,                       slot.generated_token_probs.size());
+            const size_t probs_stop_pos = std::min(slot.n_sent_token_probs + to_send_toks.size(), slot.generated_token_probs.size());
+
+            std::vector<completion_token_output> probs_output;
+            if (probs_pos < probs_stop_pos) {
+                probs_output = std::vector<completion_token_output>(
+                        slot.generated_token_probs.begin() + probs_pos,
+                        slot.generated_token_probs.begin() + probs_stop_pos);
+            }
+            slot.n_sent_token_probs = probs_stop_pos;
+
+            res.data["completion_probabilities"] = probs_vector_to_json(ctx, probs_output);
+        }
+
+        if (slot.oaicompat) {
+            res.data["oaicompat_token_ctr"] = slot.n_decoded;
+            res.data["model"] = slot.oaicompat_model;
+        }
+
+        queue_results.send(res);
+    }
+
+    void send_final_response(const server_slot & slot) {
+        server_task_result res;
+        res.id       = slot.id_task;
+        res.error    = false;
+        res.stop     = true;
+        res.data     = json {
+            {"content",             !slot.params.stream ? slot.generated_text : ""},
+            {"id_slot",             slot.id},
+            {"stop",                true},
+            {"model",               params.model_alias},
+            {"tokens_predicted",    slot.n_decoded},
+            {"tokens_evaluated",    slot.n_prompt_tokens},
+            {"generation_settings", get_formated_generation(slot)},
+            {"prompt",              slot.prompt},
+            {"truncated",           slot.truncated},
+            {"stopped_eos",         slot.stopped_eos},
+            {"stopped_word",        slot.stopped_word},
+            {"stopped_limit",       slot.stopped_limit},
+            {"stopping_word",       slot.stopping_word},
+            {"tokens_cached",       slot.n_past},
+            {"timings",             slot.get_formated_timings()},
+            {"index",               slot.index},
+        };
+
+        if (slot.sparams.n_probs > 0) {
+            std::vector<completion_token_output> probs;
+            if (!slot.params.stream && slot.stopped_word) {
+                const std::vector<llama_token> stop_word_toks = llama_tokenize(ctx, slot.stopping_word, false);
+
+                size_t safe_offset = std::min(slot.generated_token_probs.size(), stop_word_toks.size());
+                probs = std::vector<completion_token_output>(
+                        slot.generated_token_probs.begin(),
+                        slot.generated_token_probs.end() - safe_offset);
+            } else {
+                probs = std::vector<completion_token_output>(
+                        slot.generated_token_probs.begin(),
+                        slot.generated_token_probs.end());
+            }
+
+            res.data["completion_probabilities"] = probs_vector_to_json(ctx, probs);
+        }
+
+        if (slot.oaicompat) {
+            res.data["oaicompat_token_ctr"] = slot.n_decoded;
+            res.data["model"] = slot.oaicompat_model;
+        }
+
+        queue_results.send(res);
+    }
+
+    void send_embedding(const server_slot & slot, const llama_batch & batch) {
+        server_task_result res;
+        res.id       = slot.id_task;
+        res.error    = false;
+        res.stop     = true;
+
+        const int n_embd = llama_n_embd(model);
+
+        std::vector<float> embd_res(n_embd, 0.0f);
+
+        for (int i = 0; i < batch.n_tokens; ++i) {
+            if (!batch.logits[i] || batch.seq_id[i][0] != slot.id + 1) {
                 continue;
             }
-            if ((c & 0xE0) == 0xC0) {
-                // 2-byte character: 110xxxxx ...
-                incomplete = i < 2;
-            } else if ((c & 0xF0) == 0xE0) {
-                // 3-byte character: 1110xxxx ...
-                incomplete = i < 3;
-            } else if ((c & 0xF8) == 0xF0) {
-                // 4-byte character: 11110xxx ...
-                incomplete = i < 4;
+
+            const float * embd = llama_get_embeddings_seq(ctx, batch.seq_id[i][0]);
+            if (embd == NULL) {
+                embd = llama_get_embeddings_ith(ctx, i);
+            }
+
+            if (embd == NULL) {
+                SLT_ERR(slot, "failed to get embeddings, token = %d, seq_id = %d\n", batch.token[i], batch.seq_id[i][0]);
+
+                res.data = json {
+                    {"embedding", std::vector<float>(n_embd, 0.0f)},
+                };
+
+                continue;
+            }
+
+            llama_embd_normalize(embd, embd_res.data(), n_embd);
+
+            res.data = json {
+                {"embedding", embd_res},
+                {"index",     slot.index},
+            };
+        }
+
+        SLT_DBG(slot, "%s", "sending embeddings\n");
+
+        queue_results.send(res);
+    }
+
+    //
+    // Functions to create new task(s) and receive result(s)
+    //
+
+    std::vector<server_task> create_tasks_cmpl(json data, server_task_cmpl_type cmpl_type) {
+        std::vector<server_task> tasks;
+        auto create_task = [&](json & task_data, bool replace_prompt, json prompt) {
+            server_task task;
+            task.id        = queue_tasks.get_new_id();
+            task.cmpl_type = cmpl_type;
+            task.type      = SERVER_TASK_TYPE_COMPLETION;
+            if (replace_prompt) {
+                task.data  = task_data;
+                task.data["prompt"] = std::move(prompt);
+            } else {
+                task.data  = std::move(task_data);
+            }
+            tasks.push_back(std::move(task));
+        };
+
+        static constexpr const char * error_msg = "\"prompt\" must be a string, an array of token ids or an array of prompts";
+        if (!data.contains("prompt")) {
+            throw std::runtime_error(error_msg);
+        }
+
+        json prompt = data.at("prompt");
+
+        // if the prompt is a singleton (i.e. a string or a list of tokens), we only need to create single task
+        if (prompt.is_string() || json_is_array_of_numbers(prompt)) {
+            data["index"] = 0;
+            create_task(data, false, nullptr);
+        }
+        // otherwise, it's a multiple-prompt task, we break it into smaller tasks
+        else if (prompt.is_array()) {
+            std::vector<json> prompts = prompt;
+            for (size_t i = 0; i < prompts.size(); i++) {
+                const auto & e = prompts[i];
+                if (e.is_string() || json_is_array_of_numbers(e)) {
+                    data["index"] = i;
+                    create_task(data, true, e);
+                } else {
+                    throw std::runtime_error(error_msg);
+                }
+            }
+        }
+        // invalid case
+        else {
+            throw std::runtime_error(error_msg);
+        }
+
+        return tasks;
+    }
+
+    void cancel_tasks(const std::unordered_set<int> & id_tasks) {
+        std::vector<server_task> cancel_tasks;
+        cancel_tasks.reserve(id_tasks.size());
+        for (const auto & id_task : id_tasks) {
+            SRV_WRN("cancel task, id_task = %d\n", id_task);
+
+            server_task task;
+            task.type      = SERVER_TASK_TYPE_CANCEL;
+            task.id_target = id_task;
+            cancel_tasks.push_back(task);
+            queue_results.remove_waiting_task_id(id_task);
+        }
+        // push to beginning of the queue, so it has highest priority
+        queue_tasks.post(cancel_tasks, true);
+    }
+
+    // receive the results from task(s) created by create_tasks_cmpl
+    void receive_cmpl_results(
+            const std::unordered_set<int> & id_tasks,
+            const std::function<void(std::vector<server_task_result>&)> & result_handler,
+            const std::function<void(json)> & error_handler) {
+        // TODO: currently, there is no way to detect the client has cancelled the request
+        std::vector<server_task_result> results(id_tasks.size());
+        for (size_t i = 0; i < id_tasks.size(); i++) {
+            server_task_result result = queue_results.recv(id_tasks);
+
+            if (result.error) {
+                error_handler(result.data);
+                cancel_tasks(id_tasks);
+                return;
+            }
+
+            size_t idx = result.data["index"];
+            results[idx] = result;
+        }
+        result_handler(results);
+    }
+
+    // receive the results from task(s) created by create_tasks_cmpl, in stream mode
+    void receive_cmpl_results_stream(
+            const std::unordered_set<int> & id_tasks, const
+            std::function<bool(server_task_result&)> & result_handler, const
+            std::function<void(json)> & error_handler) {
+        size_t n_finished = 0;
+        while (true) {
+            server_task_result result = queue_results.recv(id_tasks);
+            if (!result_handler(result)) {
+                cancel_tasks(id_tasks);
+                break;
+            }
+
+            if (result.error) {
+                error_handler(result.data);
+                cancel_tasks(id_tasks);
+                break;
+            }
+
+            if (result.stop) {
+                if (++n_finished == id_tasks.size()) {
+                    break;
+                }
             }
-            // else 1-byte character or invalid byte
-            break;
         }
+    }
 
-        if (!incomplete) {
-            size_t pos = std::min(slot.n_sent_text, slot.generated_text.size());
+    // draft the tokens that follow the sampled token of each generating slot with the draft model - the slots draft
+    // together, each decode of the draft context extends the drafts of all slots by one token
+    // without a draft model the drafts are looked up in the n-gram caches instead
+    void speculative_draft(int32_t n_batch) {
+        struct draft_seq {
+            server_slot * slot;
 
-            const std::string str_test = slot.generated_text.substr(pos);
-            bool is_stop_full = false;
+            int32_t n_draft;
+            int32_t i_batch = -1;
+        };
 
-            size_t stop_pos = slot.find_stopping_strings(str_test, token_str.size(), STOP_TYPE_FULL);
-            if (stop_pos != std::string::npos) {
-                is_stop_full = true;
-                slot.generated_text.erase(
-                    slot.generated_text.begin() + pos + stop_pos,
-                    slot.generated_text.end());
-                pos = std::min(slot.n_sent_text, slot.generated_text.size());
-            } else {
-                is_stop_full = false;
-                stop_pos = slot.find_stopping_strings(str_test, token_str.size(), STOP_TYPE_PARTIAL);
+        std::vector<draft_seq> seqs;
+
+        int32_t n_gen = 0;
+        for (const server_slot & slot : slots) {
+            if (slot.state == SLOT_STATE_GENERATING) {
+                n_gen++;
             }
+        }
 
-            // check if there is any token to predict
-            if (stop_pos == std::string::npos || (!slot.has_next_token && !is_stop_full && stop_pos > 0)) {
-                // no send the stop word in the response
-                result.text_to_send = slot.generated_text.substr(pos, std::string::npos);
-                slot.n_sent_text += result.text_to_send.size();
-                // add the token to slot queue and cache
+        // the sampled tokens and the drafts of all slots have to fit in one batch view of the target, and in the free
+        // cells of its KV cache - a ubatch takes a contiguous run of cells of the ring cache, which the fragmented free
+        // cells may not have, so only half of them are counted on; the paged cache takes any free cell, but a slot that
+        // continues a block shared with other sequences copies that block first
+        const int32_t n_free = llama_n_ctx(ctx) - llama_get_kv_cache_used_cells(ctx);
+        const int32_t n_free_cells = params.kv_block_size > 0 ? n_free - n_gen*params.kv_block_size : n_free/2;
+
+        int32_t n_budget = std::min(n_batch - n_gen, n_free_cells - n_gen);
+
+        for (server_slot & slot : slots) {
+            slot.drafted.clear();
+
+            if (slot.state != SLOT_STATE_GENERATING || slot.n_draft <= 0) {
+                continue;
             }
 
-            slot.add_token(result);
-            if (slot.params.stream) {
-                send_partial_response(slot, result);
+            // the drafts have to fit in the context of the slot and there is no use in drafting past its budget
+            int32_t n_draft = std::min(slot.n_draft, slot.n_ctx - 2 - ((int32_t) system_tokens.size() + slot.n_past));
+            if (slot.params.n_predict != -1 || params.n_predict != -1) {
+                slot.has_budget(params);
+                n_draft = std::min(n_draft, slot.n_remaining - 1);
             }
-        }
+            n_draft = std::min(n_draft, n_budget);
 
-        if (incomplete) {
-            slot.has_next_token = true;
-        }
+            if (n_draft <= 0) {
+                continue;
+            }
 
-        // check the limits
-        if (slot.n_decoded > 0 && slot.has_next_token && !slot.has_budget(params)) {
-            slot.stopped_limit  = true;
-            slot.has_next_token = false;
+            if (!ctx_dft) {
+                lookup_draft(slot, n_draft);
+                n_budget -= slot.drafted.size();
+                continue;
+            }
 
-            SLT_DBG(slot, "stopped by limit, n_decoded = %d, n_predict = %d\n", slot.n_decoded, slot.params.n_predict);
-        }
+            n_budget -= n_draft;
 
-        // if context shift is disabled, we stop when it reaches the context limit
-        if (slot.n_decoded >= slot.n_ctx) {
-            slot.truncated      = true;
-            slot.stopped_limit  = true;
-            slot.has_next_token = false;
+            // keep the common part of the draft sequence, the last token is decoded again for its logits
+            const size_t n_common = std::min(slot_context_common(slot, slot.cache_tokens_dft), slot_context_size(slot) - 1);
 
-            SLT_DBG(slot, "stopped due to running out of context capacity, n_decoded = %d, n_ctx = %d\n", slot.n_decoded, slot.n_ctx);
-        }
+            llama_kv_cache_seq_rm(ctx_dft, slot.id, n_common, -1);
+            slot.cache_tokens_dft.resize(n_common);
 
-        if (llama_token_is_eog(model, result.tok)) {
-            slot.stopped_eos    = true;
-            slot.has_next_token = false;
+            draft_seq seq;
+            seq.slot    = &slot;
+            seq.n_draft = n_draft;
 
-            SLT_DBG(slot, "%s", "stopped by EOS\n");
+            seqs.push_back(seq);
         }
 
-        const auto n_ctx_train = llama_n_ctx_train(model);
+        if (seqs.empty()) {
+            return;
+        }
 
-        if (slot.params.n_predict < 1 && slot.n_predict < 1 && slot.ga_n == 1 && slot.n_prompt_tokens + slot.n_decoded >= n_ctx_train) {
-            slot.truncated      = true;
-            slot.stopped_limit  = true;
-            slot.has_next_token = false; // stop prediction
+        const auto decode_dft = [&]() {
+            if (batch_dft.n_tokens == 0) {
+                return true;
+            }
 
-            SLT_WRN(slot,
-                    "n_predict (%d) is not set and self-context extend is disabled. "
-                    "Limiting generated tokens to n_ctx_train (%d) to avoid EOS-less generation infinite loop\n",
-                    slot.params.n_predict, n_ctx_train);
-        }
+            const int ret = llama_decode(ctx_dft, batch_dft);
+            llama_batch_clear(batch_dft);
 
-        SLT_DBG(slot, "n_decoded = %d, n_remaining = %d, next token: '%s'\n", slot.n_decoded, slot.n_remaining, token_str.c_str());
+            if (ret != 0) {
+                SRV_WRN("failed to decode the draft batch, ret = %d, clearing the draft context\n", ret);
 
-        return slot.has_next_token; // continue
-    }
+                llama_kv_cache_clear(ctx_dft);
+                for (server_slot & slot : slots) {
+                    slot.cache_tokens_dft.clear();
+                    slot.drafted.clear();
+                }
 
-    json get_formated_generation(const server_slot & slot) const {
-        std::vector<std::string> samplers;
-        samplers.reserve(slot.sparams.samplers.size());
-        for (const auto & sampler : slot.sparams.samplers) {
-            samplers.emplace_back(gpt_sampler_type_to_str(sampler));
-        }
+                return false;
+            }
 
-        return json {
-            {"n_ctx",                     slot.n_ctx},
-            {"n_predict",                 slot.n_predict},     // Server configured n_predict
-            {"model",                     params.model_alias},
-            {"seed",                      slot.sparams.seed},
-            {"seed_cur",                  slot.smpl ? gpt_sampler_get_seed(slot.smpl) : 0},
-            {"temperature",               slot.sparams.temp},
-            {"dynatemp_range",            slot.sparams.dynatemp_range},
-            {"dynatemp_exponent",         slot.sparams.dynatemp_exponent},
-            {"top_k",                     slot.sparams.top_k},
-            {"top_p",                     slot.sparams.top_p},
-            {"min_p",                     slot.sparams.min_p},
-            {"tfs_z",                     slot.sparams.tfs_z},
-            {"typical_p",                 slot.sparams.typ_p},
-            {"repeat_last_n",             slot.sparams.penalty_last_n},
-            {"repeat_penalty",            slot.sparams.penalty_repeat},
-            {"presence_penalty",          slot.sparams.penalty_present},
-            {"frequency_penalty",         slot.sparams.penalty_freq},
-            {"mirostat",                  slot.sparams.mirostat},
-            {"mirostat_tau",              slot.sparams.mirostat_tau},
-            {"mirostat_eta",              slot.sparams.mirostat_eta},
-            {"penalize_nl",               slot.sparams.penalize_nl},
-            {"stop",                      slot.params.antiprompt},
-            {"max_tokens",                slot.params.n_predict}, // User configured n_predict
-            {"n_keep",                    slot.params.n_keep},
-            {"n_discard",                 slot.params.n_discard},
-            {"ignore_eos",                slot.sparams.ignore_eos},
-            {"stream",                    slot.params.stream},
-          //{"logit_bias",                slot.sparams.logit_bias},
-            {"n_probs",                   slot.sparams.n_probs},
-            {"min_keep",                  slot.sparams.min_keep},
-            {"grammar",                   slot.sparams.grammar},
-            {"samplers",                  samplers},
+            return true;
         };
-    }
 
-    void send_error(const server_task & task, const std::string & error, const enum error_type type = ERROR_TYPE_SERVER) {
-        send_error(task.id, error, type);
-    }
+        // catch the draft context up with the new tokens of the slots, e.g. the prompt - the generating slots wait for
+        // it, so it takes at most as many tokens per step as a prompt of the target, and a slot drafts once it is done
+        int32_t n_catch_up = prefill_sched.n_prefill_max(n_gen, n_batch);
 
-    void send_error(const server_slot & slot, const std::string & error, const enum error_type type = ERROR_TYPE_SERVER) {
-        send_error(slot.id_task, error, type);
-    }
+        std::vector<draft_seq *> active;
 
-    void send_error(const int id_task, const std::string & error, const enum error_type type = ERROR_TYPE_SERVER) {
-        SRV_ERR("task id = %d, error: %s\n", id_task, error.c_str());
+        llama_batch_clear(batch_dft);
 
-        server_task_result res;
-        res.id       = id_task;
-        res.stop     = false;
-        res.error    = true;
-        res.data     = format_error_response(error, type);
+        for (draft_seq & seq : seqs) {
+            std::vector<llama_token> & cache_tokens_dft = seq.slot->cache_tokens_dft;
 
-        queue_results.send(res);
-    }
+            const size_t n_tokens = slot_context_size(*seq.slot);
 
-    void send_partial_response(server_slot & slot, completion_token_output tkn) {
-        server_task_result res;
-        res.id       = slot.id_task;
-        res.error    = false;
-        res.stop     = false;
-        res.data     = json {
-            {"content",    tkn.text_to_send},
-            {"stop",       false},
-            {"id_slot",    slot.id},
-            {"multimodal", false},
-            {"index",      slot.index},
-        };
+            while (cache_tokens_dft.size() + 1 < n_tokens && n_catch_up > 0) {
+                const size_t pos = cache_tokens_dft.size();
+                const llama_token id = slot_context_token(*seq.slot, pos);
 
-        if (slot.sparams.n_probs > 0) {
-            const std::vector<llama_token> to_send_toks = llama_tokenize(ctx, tkn.text_to_send, false);
-            const size_t probs_pos      = std::min(slot.n_sent_token_probs,                       slot.generated_token_probs.size());
-            const size_t probs_stop_pos = std::min(slot.n_sent_token_probs + to_send_toks.size(), slot.generated_token_probs.size());
+                llama_batch_add(batch_dft, id, pos, { seq.slot->id }, false);
+                cache_tokens_dft.push_back(id);
 
-            std::vector<completion_token_output> probs_output;
-            if (probs_pos < probs_stop_pos) {
-                probs_output = std::vector<completion_token_output>(
-                        slot.generated_token_probs.begin() + probs_pos,
-                        slot.generated_token_probs.begin() + probs_stop_pos);
+                n_catch_up--;
+
+                if (batch_dft.n_tokens == n_batch && !decode_dft()) {
+                    return;
+                }
             }
-            slot.n_sent_token_probs = probs_stop_pos;
 
-            res.data["completion_probabilities"] = probs_vector_to_json(ctx, probs_output);
+            // the drafts follow the tokens of the context in the draft sequence
+            seq.slot->n_spec_checked = cache_tokens_dft.size();
+
+            if (cache_tokens_dft.size() + 1 == n_tokens) {
+                active.push_back(&seq);
+            }
         }
 
-        if (slot.oaicompat) {
-            res.data["oaicompat_token_ctr"] = slot.n_decoded;
-            res.data["model"] = slot.oaicompat_model;
+        if (!decode_dft()) {
+            return;
         }
 
-        queue_results.send(res);
-    }
+        // draft greedily, one token per slot and decode
+        const int32_t n_vocab_tgt = llama_n_vocab(model);
+        const int32_t n_vocab_dft = llama_n_vocab(model_dft);
 
-    void send_final_response(const server_slot & slot) {
-        server_task_result res;
-        res.id       = slot.id_task;
-        res.error    = false;
-        res.stop     = true;
-        res.data     = json {
-            {"content",             !slot.params.stream ? slot.generated_text : ""},
-            {"id_slot",             slot.id},
-            {"stop",                true},
-            {"model",               params.model_alias},
-            {"tokens_predicted",    slot.n_decoded},
-            {"tokens_evaluated",    slot.n_prompt_tokens},
-            {"generation_settings", get_formated_generation(slot)},
-            {"prompt",              slot.prompt},
-            {"truncated",           slot.truncated},
-            {"stopped_eos",         slot.stopped_eos},
-            {"stopped_word",        slot.stopped_word},
-            {"stopped_limit",       slot.stopped_limit},
-            {"stopping_word",       slot.stopping_word},
-            {"tokens_cached",       slot.n_past},
-            {"timings",             slot.get_formated_timings()},
-            {"index",               slot.index},
-        };
+        while (!active.empty()) {
+            for (draft_seq * seq : active) {
+                std::vector<llama_token> & cache_tokens_dft = seq->slot->cache_tokens_dft;
 
-        if (slot.sparams.n_probs > 0) {
-            std::vector<completion_token_output> probs;
-            if (!slot.params.stream && slot.stopped_word) {
-                const std::vector<llama_token> stop_word_toks = llama_tokenize(ctx, slot.stopping_word, false);
+                const llama_token id = seq->slot->drafted.empty() ? seq->slot->sampled : seq->slot->drafted.back();
 
-                size_t safe_offset = std::min(slot.generated_token_probs.size(), stop_word_toks.size());
-                probs = std::vector<completion_token_output>(
-                        slot.generated_token_probs.begin(),
-                        slot.generated_token_probs.end() - safe_offset);
-            } else {
-                probs = std::vector<completion_token_output>(
-                        slot.generated_token_probs.begin(),
-                        slot.generated_token_probs.end());
+                seq->i_batch = batch_dft.n_tokens;
+
+                llama_batch_add(batch_dft, id, cache_tokens_dft.size(), { seq->slot->id }, true);
+                cache_tokens_dft.push_back(id);
             }
 
-            res.data["completion_probabilities"] = probs_vector_to_json(ctx, probs);
+            if (!decode_dft()) {
+                return;
+            }
+
+            std::vector<draft_seq *> next;
+
+            for (draft_seq * seq : active) {
+                const float * logits = llama_get_logits_ith(ctx_dft, seq->i_batch);
+
+                const llama_token id = std::max_element(logits, logits + n_vocab_dft) - logits;
+                if (id >= n_vocab_tgt) {
+                    continue;
+                }
+
+                seq->slot->drafted.push_back(id);
+
+                if ((int32_t) seq->slot->drafted.size() < seq->n_draft) {
+                    next.push_back(seq);
+                }
+            }
+
+            active = std::move(next);
         }
+    }
 
-        if (slot.oaicompat) {
-            res.data["oaicompat_token_ctr"] = slot.n_decoded;
-            res.data["model"] = slot.oaicompat_model;
+    // draft the tokens that followed the last tokens of the slot earlier in its context - the n-gram cache of the slot
+    // only has to be updated with the new tokens, unless the context changed in the middle (new prompt, context shift)
+    void lookup_draft(server_slot & slot, int32_t n_draft) {
+        const size_t n_tokens = slot_context_size(slot);
+
+        if (slot_context_common(slot, slot.ngram_tokens) < slot.ngram_tokens.size()) {
+            slot.ngram_cache.clear();
+            slot.ngram_tokens.clear();
         }
 
-        queue_results.send(res);
+        const size_t n_new = n_tokens - slot.ngram_tokens.size();
+        for (size_t i = slot.ngram_tokens.size(); i < n_tokens; ++i) {
+            slot.ngram_tokens.push_back(slot_context_token(slot, i));
+        }
+
+        llama_ngram_cache_update(slot.ngram_cache, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.ngram_tokens, n_new, false);
+
+        // the sampled token enters the cached tokens of the slot only with the next step
+        slot.n_spec_checked = n_tokens - 1;
+
+        // the server does not collect n-grams across generations, the dynamic cache stays empty
+        llama_ngram_cache ngram_cache_dynamic;
+
+        std::vector<llama_token> draft = { slot.sampled };
+        llama_ngram_cache_draft(slot.ngram_tokens, draft, n_draft, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.ngram_cache, ngram_cache_dynamic, ngram_cache_static);
+
+        slot.drafted.assign(draft.begin() + 1, draft.end());
     }
 
-    void send_embedding(const server_slot & slot, const llama_batch & batch) {
-        server_task_result res;
-        res.id       = slot.id_task;
-        res.error    = false;
-        res.stop     = true;
+    // the context of a generating slot: the system prompt, the cached tokens and the sampled token
+    size_t slot_context_size(const server_slot & slot) const {
+        return system_tokens.size() + slot.cache_tokens.size() + 1;
+    }
+
+    llama_token slot_context_token(const server_slot & slot, size_t i) const {
+        if (i < system_tokens.size()) {
+            return system_tokens[i];
+        }
+        i -= system_tokens.size();
+
+        return i < slot.cache_tokens.size() ? slot.cache_tokens[i] : slot.sampled;
+    }
+
+    // the number of leading tokens of the context of the slot that the tokens share - between context shifts the context
+    // of a generating slot only grows, so the tokens checked in the previous step are not compared again
+    size_t slot_context_common(const server_slot & slot, const std::vector<llama_token> & tokens) const {
+        const size_t n = std::min(tokens.size(), slot_context_size(slot));
+
+        size_t i = std::min(slot.n_spec_checked, n);
+        while (i < n && tokens[i] == slot_context_token(slot, i)) {
+            i++;
+        }
+
+        return i;
+    }
 
-        const int n_embd = llama_n_embd(model);
+    size_t parked_bytes() const {
+        size_t n = 0;
+        for (const auto & parked : parked_tasks) {
+            n += parked.second->state.size();
+        }
+        return n;
+    }
 
-        std::vector<float> embd_res(n_embd, 0.0f);
+    // free a slot for a task by preempting the slot with the lowest priority below the task's - the preempted task is
+    // deferred with the tokens and the text it has generated so far, its sequence and sampler are parked, and it
+    // continues from them once a slot becomes available
+    server_slot * preempt_slot(const server_task & task, int id_slot) {
+        const int priority = json_value(task.data, "priority", 0);
 
-        for (int i = 0; i < batch.n_tokens; ++i) {
-            if (!batch.logits[i] || batch.seq_id[i][0] != slot.id + 1) {
+        server_slot * victim = nullptr;
+
+        for (server_slot & slot : slots) {
+            if (id_slot != -1 && slot.id != id_slot) {
                 continue;
             }
 
-            const float * embd = llama_get_embeddings_seq(ctx, batch.seq_id[i][0]);
-            if (embd == NULL) {
-                embd = llama_get_embeddings_ith(ctx, i);
+            if (!slot.is_processing() || slot.params.priority >= priority || slot.cmpl_type == SERVER_TASK_CMPL_TYPE_EMBEDDING) {
+                continue;
             }
 
-            if (embd == NULL) {
-                SLT_ERR(slot, "failed to get embeddings, token = %d, seq_id = %d\n", batch.token[i], batch.seq_id[i][0]);
-
-                res.data = json {
-                    {"embedding", std::vector<float>(n_embd, 0.0f)},
-                };
-
+            // a generation can only be resumed if the slot remembers its tokens
+            if (slot.state == SLOT_STATE_GENERATING && !slot.params.cache_prompt) {
                 continue;
             }
 
-            llama_embd_normalize(embd, embd_res.data(), n_embd);
+            if (slot.state != SLOT_STATE_PROCESSING_PROMPT && slot.state != SLOT_STATE_GENERATING) {
+                continue;
+            }
 
-            res.data = json {
-                {"embedding", embd_res},
-                {"index",     slot.index},
-            };
+            // the lowest priority first, then the task that started last as it loses the least work
+            if (victim == nullptr || slot.params.priority < victim->params.priority ||
+               (slot.params.priority == victim->params.priority && slot.t_start_task > victim->t_start_task)) {
+                victim = &slot;
+            }
         }
 
-        SLT_DBG(slot, "%s", "sending embeddings\n");
+        if (victim == nullptr) {
+            return nullptr;
+        }
 
-        queue_results.send(res);
-    }
+        server_task resume;
+        resume.id        = victim->id_task;
+        resume.type      = SERVER_TASK_TYPE_COMPLETION;
+        resume.cmpl_type = victim->cmpl_type;
+        resume.data      = victim->task_data;
 
-    //
-    // Functions to create new task(s) and receive result(s)
-    //
+        if (victim->state == SLOT_STATE_GENERATING) {
+            // the last sampled token is not in the KV cache yet
+            std::vector<llama_token> tokens = victim->cache_tokens;
+            tokens.push_back(victim->sampled);
 
-    std::vector<server_task> create_tasks_cmpl(json data, server_task_cmpl_type cmpl_type) {
-        std::vector<server_task> tasks;
-        auto create_task = [&](json & task_data, bool replace_prompt, json prompt) {
-            server_task task;
-            task.id        = queue_tasks.get_new_id();
-            task.cmpl_type = cmpl_type;
-            task.type      = SERVER_TASK_TYPE_COMPLETION;
-            if (replace_prompt) {
-                task.data  = task_data;
-                task.data["prompt"] = std::move(prompt);
-            } else {
-                task.data  = std::move(task_data);
+            int32_t n_predict = victim->params.n_predict != -1 ? victim->params.n_predict : params.n_predict;
+            if (n_predict != -1) {
+                n_predict = std::max(n_predict - victim->n_decoded, 0);
             }
-            tasks.push_back(std::move(task));
-        };
 
-        static constexpr const char * error_msg = "\"prompt\" must be a string, an array of token ids or an array of prompts";
-        if (!data.contains("prompt")) {
-            throw std::runtime_error(error_msg);
+            resume.cmpl_type = SERVER_TASK_CMPL_TYPE_NORMAL;
+            resume.data["prompt"]    = tokens;
+            resume.data["n_predict"] = n_predict;
+            resume.data["__resume"]  = json {
+                {"generated_text", victim->generated_text},
+                {"n_sent_text",    victim->n_sent_text},
+                {"t_first_token",  victim->t_first_token},
+            };
         }
 
-        json prompt = data.at("prompt");
+        // the preempting task overwrites the sequence of the slot
+        if (victim->params.cache_prompt && !victim->cache_tokens.empty()) {
+            auto parked = std::unique_ptr<server_parked_task>(new server_parked_task);
 
-        // if the prompt is a singleton (i.e. a string or a list of tokens), we only need to create single task
-        if (prompt.is_string() || json_is_array_of_numbers(prompt)) {
-            data["index"] = 0;
-            create_task(data, false, nullptr);
-        }
-        // otherwise, it's a multiple-prompt task, we break it into smaller tasks
-        else if (prompt.is_array()) {
-            std::vector<json> prompts = prompt;
-            for (size_t i = 0; i < prompts.size(); i++) {
-                const auto & e = prompts[i];
-                if (e.is_string() || json_is_array_of_numbers(e)) {
-                    data["index"] = i;
-                    create_task(data, true, e);
-                } else {
-                    throw std::runtime_error(error_msg);
-                }
+            parked->tokens = victim->cache_tokens;
+
+            // beyond the budget, the sequence goes to the kv store, or the task processes its prompt again
+            const size_t size = llama_state_seq_get_size(ctx, victim->id + 1);
+            if (parked_bytes() + size <= park_max) {
+                parked->state.resize(size);
+                parked->state.resize(llama_state_seq_get_data(ctx, parked->state.data(), parked->state.size(), victim->id + 1));
+            } else if (kv_store.enabled() && kv_store.store(ctx, victim->id + 1, victim->cache_tokens)) {
+                SLT_INF(*victim, "stored %d tokens in the kv store\n", (int) victim->cache_tokens.size());
             }
-        }
-        // invalid case
-        else {
-            throw std::runtime_error(error_msg);
-        }
 
-        return tasks;
-    }
+            if (victim->state == SLOT_STATE_GENERATING) {
+                parked->smpl = gpt_sampler_clone(victim->smpl);
+            }
 
-    void cancel_tasks(const std::unordered_set<int> & id_tasks) {
-        std::vector<server_task> cancel_tasks;
-        cancel_tasks.reserve(id_tasks.size());
-        for (const auto & id_task : id_tasks) {
-            SRV_WRN("cancel task, id_task = %d\n", id_task);
+            SLT_INF(*victim, "parked %d tokens, %zu bytes\n", (int) parked->tokens.size(), parked->state.size());
 
-            server_task task;
-            task.type      = SERVER_TASK_TYPE_CANCEL;
-            task.id_target = id_task;
-            cancel_tasks.push_back(task);
-            queue_results.remove_waiting_task_id(id_task);
+            parked_tasks[victim->id_task] = std::move(parked);
         }
-        // push to beginning of the queue, so it has highest priority
-        queue_tasks.post(cancel_tasks, true);
-    }
 
-    // receive the results from task(s) created by create_tasks_cmpl
-    void receive_cmpl_results(
-            const std::unordered_set<int> & id_tasks,
-            const std::function<void(std::vector<server_task_result>&)> & result_handler,
-            const std::function<void(json)> & error_handler) {
-        // TODO: currently, there is no way to detect the client has cancelled the request
-        std::vector<server_task_result> results(id_tasks.size());
-        for (size_t i = 0; i < id_tasks.size(); i++) {
-            server_task_result result = queue_results.recv(id_tasks);
+        SLT_INF(*victim, "preempted by task %d, priority = %d > %d, n_decoded = %d\n", task.id, priority, victim->params.priority, victim->n_decoded);
 
-            if (result.error) {
-                error_handler(result.data);
-                cancel_tasks(id_tasks);
-                return;
-            }
+        metrics.n_preempted_total++;
 
-            size_t idx = result.data["index"];
-            results[idx] = result;
-        }
-        result_handler(results);
-    }
+        // the tenant pays for the work done so far, the resumed task only for what it computes itself - the slot goes
+        // to the preempting task, so no deferred task is popped for it
+        queue_tasks.charge_tenant(victim->params.tenant, victim->n_prompt_tokens_processed + victim->n_decoded);
 
-    // receive the results from task(s) created by create_tasks_cmpl, in stream mode
-    void receive_cmpl_results_stream(
-            const std::unordered_set<int> & id_tasks, const
-            std::function<bool(server_task_result&)> & result_handler, const
-            std::function<void(json)> & error_handler) {
-        size_t n_finished = 0;
-        while (true) {
-            server_task_result result = queue_results.recv(id_tasks);
-            if (!result_handler(result)) {
-                cancel_tasks(id_tasks);
-                break;
-            }
+        victim->stop();
 
-            if (result.error) {
-                error_handler(result.data);
-                cancel_tasks(id_tasks);
-                break;
-            }
+        queue_tasks.defer(resume);
 
-            if (result.stop) {
-                if (++n_finished == id_tasks.size()) {
-                    break;
-                }
-            }
-        }
+        return victim;
     }
 
     //
@@ -1548,6 +2975,14 @@ struct server_context {
                         slot = get_available_slot(prompt);
                     }
 
+                    // a task with a higher priority takes the slot of a running one
+                    if (slot == nullptr || slot->is_processing()) {
+                        server_slot * preempted = preempt_slot(task, id_slot);
+                        if (preempted != nullptr) {
+                            slot = preempted;
+                        }
+                    }
+
                     if (slot == nullptr) {
                         // if no slot is available, we defer this task for processing later
                         SRV_DBG("no slot is available, defer task, id_task = %d\n", task.id);
@@ -1568,6 +3003,7 @@ struct server_context {
                         for (server_slot & slot : slots) {
                             slot.n_past    = 0;
                             slot.n_past_se = 0;
+                            slot.pos_shift = 0;
                         }
                     }
 
@@ -1591,6 +3027,10 @@ struct server_context {
                             break;
                         }
                     }
+
+                    // the task may be waiting for a slot
+                    queue_tasks.remove_deferred_task(task.id_target);
+                    parked_tasks.erase(task.id_target);
                 } break;
             case SERVER_TASK_TYPE_NEXT_RESPONSE:
                 {
@@ -1598,6 +3038,12 @@ struct server_context {
                 } break;
             case SERVER_TASK_TYPE_METRICS:
                 {
+                    // the spill files written since the last store
+                    kv_store.collect();
+
+                    // the preempted tasks that are over the budget wait without their sequence
+                    const size_t n_parked = std::count_if(parked_tasks.begin(), parked_tasks.end(), [](const auto & parked) { return !parked.second->state.empty(); });
+
                     json slots_data = json::array();
 
                     int n_idle_slots       = 0;
@@ -1648,13 +3094,29 @@ struct server_context {
                         { "t_prompt_processing",             metrics.t_prompt_processing},
                         { "n_tokens_predicted",              metrics.n_tokens_predicted},
                         { "t_tokens_generation",             metrics.t_tokens_generation},
+                        { "n_first_token",                   metrics.n_first_token},
+                        { "t_first_token",                   metrics.t_first_token},
+                        { "n_tpot_tokens",                   metrics.n_tpot_tokens},
 
                         { "n_decode_total",                  metrics.n_decode_total},
                         { "n_busy_slots_total",              metrics.n_busy_slots_total},
+                        { "n_preempted_total",               metrics.n_preempted_total},
+                        { "n_parked",                        n_parked},
+                        { "n_parked_bytes",                  parked_bytes()},
+                        { "n_draft_total",                   metrics.n_draft_total},
+                        { "n_draft_accepted_total",          metrics.n_draft_accepted_total},
 
                         { "kv_cache_tokens_count",           llama_get_kv_cache_token_count(ctx)},
                         { "kv_cache_used_cells",             llama_get_kv_cache_used_cells(ctx)},
 
+                        { "kv_store_entries",                kv_store.entries.size()},
+                        { "kv_store_ram_bytes",              kv_store.n_ram_bytes},
+                        { "kv_store_disk_bytes",             kv_store.n_disk_bytes},
+                        { "kv_store_restored_total",         kv_store.n_restored},
+
+                        { "prefix_cache_attached_total",     prefix_cache.n_attached},
+                        { "prefix_cache_tokens_total",       prefix_cache.n_tokens_shared},
+
                         { "slots",                           slots_data },
                     };
 
@@ -1724,6 +3186,8 @@ struct server_context {
                     std::string filename = task.data.at("filename");
                     std::string filepath = task.data.at("filepath");
 
+                    prefix_cache.erase(slot->id);
+
                     slot->cache_tokens.resize(slot->n_ctx);
                     size_t token_count = 0;
                     size_t nread = llama_state_seq_load_file(ctx, filepath.c_str(), slot->id + 1, slot->cache_tokens.data(), slot->cache_tokens.size(), &token_count);
@@ -1733,6 +3197,11 @@ struct server_context {
                         break;
                     }
                     slot->cache_tokens.resize(token_count);
+                    slot_update_pos_shift(*slot);
+
+                    if (params.prefix_cache) {
+                        prefix_cache.insert(slot->id, slot->cache_tokens);
+                    }
 
                     const int64_t t_end = ggml_time_us();
                     const double t_restore_ms = (t_end - t_start) / 1000.0;
@@ -1769,8 +3238,10 @@ struct server_context {
 
                     // Erase token cache
                     const size_t n_erased = slot->cache_tokens.size();
+                    prefix_cache.erase(slot->id);
                     llama_kv_cache_seq_rm(ctx, slot->id + 1, -1, -1);
                     slot->cache_tokens.clear();
+                    slot->pos_shift = 0;
 
                     server_task_result result;
                     result.id = task.id;
@@ -1847,14 +3318,39 @@ struct server_context {
                     // Shift context
                     const int n_keep    = slot.params.n_keep + add_bos_token;
                     const int n_left    = (int) system_tokens.size() + slot.n_past - n_keep;
-                    const int n_discard = slot.params.n_discard ? slot.params.n_discard : (n_left / 2);
+                    const int p0        = slot.pos_shift;
+
+                    // the sinks are moved instead of the rest of the context, the cells of the system prompt are shared by all slots
+                    const bool shift_sinks = params.ctx_shift_sinks && system_tokens.empty();
+
+                    // with sinks, the window rolls in smaller steps - each step only rotates the n_keep sink tokens
+                    const int n_discard = slot.params.n_discard ? slot.params.n_discard : (shift_sinks ? std::max(n_left / 8, 1) : (n_left / 2));
+
+                    SLT_WRN(slot, "slot context shift, n_keep = %d, n_left = %d, n_discard = %d, sinks = %d\n", n_keep, n_left, n_discard, shift_sinks);
+
+                    // the slot registers its tokens again after the next decode
+                    prefix_cache.erase(slot.id);
+
+                    // the tokens before the discarded ones stay in place
+                    slot.n_spec_checked = std::min(slot.n_spec_checked, system_tokens.size() + n_keep);
+
+                    if (!llama_kv_cache_seq_rm(ctx, slot.id + 1, p0 + n_keep, p0 + n_keep + n_discard)) {
+                        // the sliding-window cache no longer has the cells that the shift brings back into the window
+                        slot.release();
+                        send_error(slot, "context shift is not possible with the sliding-window KV cache, increase the context size", ERROR_TYPE_SERVER);
+                        continue;
+                    }
 
-                    SLT_WRN(slot, "slot context shift, n_keep = %d, n_left = %d, n_discard = %d\n", n_keep, n_left, n_discard);
+                    if (shift_sinks) {
+                        // StreamingLLM: the rest of the context keeps its positions, the sinks move up to sit right before it
+                        llama_kv_cache_seq_add(ctx, slot.id + 1, p0, p0 + n_keep, n_discard);
 
-                    llama_kv_cache_seq_rm (ctx, slot.id + 1, n_keep            , n_keep + n_discard);
-                    llama_kv_cache_seq_add(ctx, slot.id + 1, n_keep + n_discard, system_tokens.size() + slot.n_past, -n_discard);
+                        slot.pos_shift += n_discard;
+                    } else {
+                        llama_kv_cache_seq_add(ctx, slot.id + 1, p0 + n_keep + n_discard, p0 + system_tokens.size() + slot.n_past, -n_discard);
+                    }
 
-                    if (slot.params.cache_prompt) {
+                    if (slot.has_cache_tokens()) {
                         for (size_t i = n_keep + n_discard; i < slot.cache_tokens.size(); i++) {
                             slot.cache_tokens[i - n_discard] = slot.cache_tokens[i];
                         }
@@ -1862,6 +3358,15 @@ struct server_context {
                         slot.cache_tokens.resize(slot.cache_tokens.size() - n_discard);
                     }
 
+                    // the draft sequence follows, so that it does not have to be computed again
+                    const size_t d0 = system_tokens.size() + n_keep;
+                    if (ctx_dft && slot.cache_tokens_dft.size() >= d0 + n_discard) {
+                        llama_kv_cache_seq_rm (ctx_dft, slot.id, d0, d0 + n_discard);
+                        llama_kv_cache_seq_add(ctx_dft, slot.id, d0 + n_discard, -1, -n_discard);
+
+                        slot.cache_tokens_dft.erase(slot.cache_tokens_dft.begin() + d0, slot.cache_tokens_dft.begin() + d0 + n_discard);
+                    }
+
                     slot.n_past -= n_discard;
 
                     slot.truncated = true;
@@ -1869,6 +3374,10 @@ struct server_context {
             }
         }
 
+        if (ctx_dft || params.lookup) {
+            speculative_draft(llama_n_batch(ctx));
+        }
+
         // start populating the batch for this iteration
         llama_batch_clear(batch);
 
@@ -1884,14 +3393,19 @@ struct server_context {
 
             // TODO: we always have to take into account the "system_tokens"
             //       this is not great and needs to be improved somehow
-            llama_batch_add(batch, slot.sampled, system_tokens.size() + slot_npast, { slot.id + 1 }, true);
+            llama_batch_add(batch, slot.sampled, system_tokens.size() + slot.pos_shift + slot_npast, { slot.id + 1 }, true);
 
             slot.n_past += 1;
 
-            if (slot.params.cache_prompt) {
+            if (slot.has_cache_tokens()) {
                 slot.cache_tokens.push_back(slot.sampled);
             }
 
+            // the drafts are verified by sampling after each of them, they enter the context only once accepted
+            for (size_t j = 0; j < slot.drafted.size(); ++j) {
+                llama_batch_add(batch, slot.drafted[j], system_tokens.size() + slot.pos_shift + slot.n_past + j, { slot.id + 1 }, true);
+            }
+
             SLT_DBG(slot, "slot decode token, n_ctx = %d, n_past = %d, n_system_tokens = %d, n_cache_tokens = %d, truncated = %d\n",
                     slot.n_ctx, slot.n_past, (int) system_tokens.size(), (int) slot.cache_tokens.size(), slot.truncated);
         }
@@ -1905,6 +3419,10 @@ struct server_context {
         // -1: none, 0: non-embedding, 1: embedding
         int32_t batch_type = batch.n_tokens > 0 ? 0 : -1;
 
+        // the generating slots wait for the prompt tokens of the step - cap them to keep the latency of the step
+        const int32_t n_gen         = batch.n_tokens;
+        const int32_t n_prefill_max = n_gen + prefill_sched.n_prefill_max(n_gen, n_batch);
+
         // next, batch any pending prompts without exceeding n_batch
         if (params.cont_batching || batch.n_tokens == 0) {
             for (auto & slot : slots) {
@@ -1958,6 +3476,10 @@ struct server_context {
                         slot.n_past = 0;
                         slot.n_prompt_tokens = prompt_tokens.size();
 
+                        // the sequence of the slot is about to change
+                        prefix_cache.erase(slot.id);
+                        slot.n_spec_checked = 0;
+
                         SLT_INF(slot, "prompt tokenized, n_ctx_slot = %d, n_keep = %d, n_prompt_tokens = %d\n", slot.n_ctx, slot.params.n_keep, slot.n_prompt_tokens);
 
                         // empty prompt passed -> release the slot and send empty response
@@ -2025,12 +3547,39 @@ struct server_context {
                             } else {
                                 GGML_ASSERT(slot.ga_n == 1);
 
+                                // a preempted task continues from its parked sequence and sampler
+                                std::unique_ptr<server_parked_task> parked;
+                                {
+                                    const auto it = parked_tasks.find(slot.id_task);
+                                    if (it != parked_tasks.end()) {
+                                        parked = std::move(it->second);
+                                        parked_tasks.erase(it);
+                                    }
+                                }
+
+                                if (!parked || !slot_restore_parked(slot, *parked)) {
+                                    if (kv_store.enabled()) {
+                                        kv_store_swap(slot, prompt_tokens);
+                                    }
+
+                                    if (params.prefix_cache) {
+                                        prefix_cache_attach(slot, prompt_tokens);
+                                    }
+                                }
+
                                 // reuse any previously computed tokens that are common with the new prompt
                                 slot.n_past = common_part(slot.cache_tokens, prompt_tokens);
 
-                                // push the prompt into the sampling context (do not apply grammar)
-                                for (int i = 0; i < slot.n_past; ++i) {
-                                    gpt_sampler_accept(slot.smpl, slot.cache_tokens[i], false);
+                                if (parked && parked->smpl != nullptr) {
+                                    // the parked sampler has seen the whole generation
+                                    gpt_sampler_free(slot.smpl);
+                                    slot.smpl = parked->smpl;
+                                    parked->smpl = nullptr;
+                                } else {
+                                    // push the prompt into the sampling context (do not apply grammar)
+                                    for (int i = 0; i < slot.n_past; ++i) {
+                                        gpt_sampler_accept(slot.smpl, slot.cache_tokens[i], false);
+                                    }
                                 }
                             }
                         }
@@ -2064,7 +3613,7 @@ struct server_context {
                     }
 
                     // keep only the common part
-                    int p0 = (int) system_tokens.size() + slot.n_past;
+                    int p0 = (int) system_tokens.size() + slot.pos_shift + slot.n_past;
                     if (!llama_kv_cache_seq_rm(ctx, slot.id + 1, p0, -1)) {
                         // could not partially delete (likely using a non-Transformer model)
                         llama_kv_cache_seq_rm(ctx, slot.id + 1, -1, -1);
@@ -2078,6 +3627,7 @@ struct server_context {
                         // there is no common part left (except for the system prompt)
                         slot.n_past = 0;
                         slot.n_past_se = 0;
+                        slot.pos_shift = 0;
                         slot.ga_i = 0;
                         // TODO: is the system prompt ever in the sampling context?
                         gpt_sampler_reset(slot.smpl);
@@ -2086,6 +3636,15 @@ struct server_context {
                     // remove the non-common part from the cache
                     slot.cache_tokens.resize(slot.n_past);
 
+                    if (params.prefix_cache && slot.params.cache_prompt) {
+                        prefix_cache.insert(slot.id, slot.cache_tokens);
+                    }
+
+                    // nothing of the slot is left in its sequence, start again from position 0
+                    if (slot.n_past == 0) {
+                        slot.pos_shift = 0;
+                    }
+
                     SLT_INF(slot, "kv cache rm [%d, end)\n", p0);
 
                     int32_t slot_npast = slot.n_past_se > 0 ? slot.n_past_se : slot.n_past;
@@ -2096,7 +3655,7 @@ struct server_context {
 
                     // add prompt tokens for processing in the current batch
                     // TODO: the self-extend stuff here is a mess - simplify and/or abstract it somehow
-                    for (; slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch; ++slot.n_past) {
+                    for (; slot.n_past < slot.n_prompt_tokens && batch.n_tokens < std::min(n_batch, n_prefill_max); ++slot.n_past) {
                         if (slot.ga_n != 1) {
                             while (slot_npast >= ga_i + ga_w) {
                                 const int bd = (ga_w/ga_n)*(ga_n - 1);
@@ -2105,9 +3664,9 @@ struct server_context {
                             }
                         }
 
-                        llama_batch_add(batch, prompt_tokens[slot.n_past], system_tokens.size() + slot_npast, { slot.id + 1 }, false);
+                        llama_batch_add(batch, prompt_tokens[slot.n_past], system_tokens.size() + slot.pos_shift + slot_npast, { slot.id + 1 }, false);
 
-                        if (slot.params.cache_prompt) {
+                        if (slot.has_cache_tokens()) {
                             slot.cache_tokens.push_back(prompt_tokens[slot.n_past]);
                         }
 
@@ -2133,7 +3692,7 @@ struct server_context {
                     }
                 }
 
-                if (batch.n_tokens >= n_batch) {
+                if (batch.n_tokens >= std::min(n_batch, n_prefill_max)) {
                     break;
                 }
             }
@@ -2149,6 +3708,20 @@ struct server_context {
         // make sure we're in the right embedding mode
         llama_set_embeddings(ctx, batch_type == 1);
 
+        // with async decode, the view whose slots are sampled during the compute of the next one
+        llama_batch view_prev     = {};
+        int32_t     i_prev        = 0;
+        bool        has_view_prev = false;
+
+        const int64_t t_start_step = ggml_time_us();
+
+        bool has_drafts = false;
+        for (const server_slot & slot : slots) {
+            has_drafts = has_drafts || !slot.drafted.empty();
+        }
+
+        bool defragged = false;
+
         // process the created batch of tokens
         for (int32_t i = 0; i < batch.n_tokens; i += n_batch) {
             const int32_t n_tokens = std::min(n_batch, batch.n_tokens - i);
@@ -2192,7 +3765,7 @@ struct server_context {
                 0, 0, 0, // unused
             };
 
-            const int ret = llama_decode(ctx, batch_view);
+            const int ret = params.async_decode ? llama_decode_async(ctx, batch_view) : llama_decode(ctx, batch_view);
             metrics.on_decoded(slots);
 
             if (ret != 0) {
@@ -2206,6 +3779,18 @@ struct server_context {
                     break; // break loop of n_batch
                 }
 
+                // the rejected drafts leave holes in the KV cache - compact it once before splitting the batch
+                if (has_drafts && !defragged) {
+                    SRV_DBG("%s", "failed to find free space in the KV cache, defragmenting it\n");
+
+                    llama_kv_cache_defrag(ctx);
+                    defragged = true;
+
+                    i -= n_batch;
+
+                    continue; // continue loop of n_batch
+                }
+
                 // retry with half the batch size to try to find a free slot in the KV cache
                 n_batch /= 2;
                 i -= n_batch;
@@ -2215,34 +3800,96 @@ struct server_context {
                 continue; // continue loop of n_batch
             }
 
-            for (auto & slot : slots) {
-                if (slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
-                    continue; // continue loop of slots
+            if (params.async_decode) {
+                // the slots of the previous view are sampled while this one is computed
+                if (has_view_prev) {
+                    sample_batch_view(view_prev, i_prev);
                 }
 
-                if (slot.state == SLOT_STATE_DONE_PROMPT) {
-                    if (slot.cmpl_type == SERVER_TASK_CMPL_TYPE_EMBEDDING) {
-                        // prompt evaluated for embedding
-                        send_embedding(slot, batch_view);
-                        slot.release();
-                        slot.i_batch = -1;
-                        continue; // continue loop of slots
-                    }
+                view_prev     = batch_view;
+                i_prev        = i;
+                has_view_prev = true;
+
+                continue; // continue loop of n_batch
+            }
 
-                    // prompt evaluated for next-token prediction
-                    slot.state = SLOT_STATE_GENERATING;
-                } else if (slot.state != SLOT_STATE_GENERATING) {
+            sample_batch_view(batch_view, i);
+        }
+
+        if (has_view_prev) {
+            const int ret = llama_decode_wait(ctx);
+
+            if (ret != 0) {
+                SRV_ERR("failed to compute the batch, ret = %d\n", ret);
+                for (auto & slot : slots) {
+                    slot.release();
+                    send_error(slot, "Failed to compute the batch.", ERROR_TYPE_SERVER);
+                }
+            } else {
+                sample_batch_view(view_prev, i_prev);
+            }
+        }
+
+        // remove the rejected drafts from the sequences, the accepted ones are part of n_past
+        for (server_slot & slot : slots) {
+            if (slot.drafted.empty()) {
+                continue;
+            }
+
+            llama_kv_cache_seq_rm(ctx, slot.id + 1, system_tokens.size() + slot.pos_shift + slot.n_past, -1);
+
+            slot.drafted.clear();
+        }
+
+        prefill_sched.on_step(batch.n_tokens - n_gen, (ggml_time_us() - t_start_step) / 1e3);
+
+        SRV_DBG("%s", "run slots completed\n");
+    }
+
+    // sample the slots whose next token is predicted by the batch view that starts at i of the batch
+    void sample_batch_view(const llama_batch & batch_view, int32_t i) {
+        for (auto & slot : slots) {
+            if (slot.i_batch < (int) i || slot.i_batch >= (int) (i + batch_view.n_tokens)) {
+                continue; // continue loop of slots
+            }
+
+            if (slot.state == SLOT_STATE_DONE_PROMPT) {
+                if (slot.cmpl_type == SERVER_TASK_CMPL_TYPE_EMBEDDING) {
+                    // prompt evaluated for embedding
+                    send_embedding(slot, batch_view);
+                    slot.release();
+                    slot.i_batch = -1;
                     continue; // continue loop of slots
                 }
 
+                // prompt evaluated for next-token prediction
+                slot.state = SLOT_STATE_GENERATING;
+            } else if (slot.state != SLOT_STATE_GENERATING) {
+                continue; // continue loop of slots
+            }
+
+            // the tokens of the slot are in its sequence now, other slots can share them
+            if (params.prefix_cache && slot.params.cache_prompt) {
+                prefix_cache.insert(slot.id, slot.cache_tokens);
+            }
+
+            // the drafts follow the sampled token in the batch - a draft is accepted when the target samples it as
+            // well, and the sampling continues after it, the first token that differs is the next one to decode
+            size_t n_accepted = 0;
+            bool   stop       = false;
+
+            while (true) {
                 completion_token_output result;
-                const llama_token id = gpt_sampler_sample(slot.smpl, ctx, slot.i_batch - i);
+                const llama_token id = gpt_sampler_sample(slot.smpl, ctx, slot.i_batch + n_accepted - i);
 
                 gpt_sampler_accept(slot.smpl, id, true);
 
                 slot.n_decoded += 1;
                 if (slot.n_decoded == 1) {
                     slot.t_start_generation = ggml_time_us();
+                    if (!slot.resumed) {
+                        slot.t_first_token = (slot.t_start_generation - slot.t_posted) / 1e3;
+                    }
                     slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
                     metrics.on_prompt_eval(slot);
                 }
@@ -2259,18 +3906,45 @@ struct server_context {
                 }
 
                 if (!process_token(result, slot)) {
-                    // release slot because of stop condition
-                    slot.release();
-                    slot.print_timings();
-                    send_final_response(slot);
-                    metrics.on_prediction(slot);
+                    stop = true;
+                    break;
+                }
+
+                // the logits of the next draft have to be in this view
+                if (n_accepted == slot.drafted.size() || id != slot.drafted[n_accepted] ||
+                    slot.i_batch + (int) n_accepted + 1 >= (int) (i + batch_view.n_tokens)) {
+                    break;
+                }
+
+                // the accepted draft is in the KV cache already
+                slot.n_past += 1;
+                if (slot.has_cache_tokens()) {
+                    slot.cache_tokens.push_back(id);
                 }
 
-                slot.i_batch = -1;
+                n_accepted++;
             }
-        }
 
-        SRV_DBG("%s", "run slots completed\n");
+            if (!slot.drafted.empty()) {
+                slot.n_draft_total    += slot.drafted.size();
+                slot.n_draft_accepted += n_accepted;
+
+                metrics.on_draft(slot.drafted.size(), n_accepted);
+
+                // draft one more token after a fully accepted draft, otherwise one more than was accepted
+                slot.n_draft = n_accepted == slot.drafted.size() ? std::min(slot.n_draft + 1, slot.params.n_draft) : n_accepted + 1;
+            }
+
+            if (stop) {
+                // release slot because of stop condition
+                slot.release();
+                slot.print_timings();
+                send_final_response(slot);
+                metrics.on_prediction(slot);
+            }
+
+            slot.i_batch = -1;
+        }
     }
 
     json model_meta() const {
@@ -2571,9 +4245,16 @@ int main(int argc, char ** argv) {
         const uint64_t n_tokens_predicted  = data.at("n_tokens_predicted");
         const uint64_t t_tokens_generation = data.at("t_tokens_generation");
 
+        const uint64_t n_first_token = data.at("n_first_token");
+        const uint64_t t_first_token = data.at("t_first_token");
+        const uint64_t n_tpot_tokens = data.at("n_tpot_tokens");
+
         const uint64_t n_decode_total     = data.at("n_decode_total");
         const uint64_t n_busy_slots_total = data.at("n_busy_slots_total");
 
+        const uint64_t n_draft_total          = data.at("n_draft_total");
+        const uint64_t n_draft_accepted_total = data.at("n_draft_accepted_total");
+
         const int32_t kv_cache_used_cells = data.at("kv_cache_used_cells");
 
         // metrics definition: https://prometheus.io/docs/practices/naming/#metric-names
@@ -2602,6 +4283,30 @@ int main(int argc, char ** argv) {
                     {"name",  "n_busy_slots_per_decode"},
                     {"help",  "Average number of busy slots per llama_decode() call"},
                     {"value",  (float) n_busy_slots_total / (float) n_decode_total}
+            }, {
+                    {"name",  "kv_store_restored_total"},
+                    {"help",  "Number of conversations restored from the KV store."},
+                    {"value",  (uint64_t) data.at("kv_store_restored_total")}
+            }, {
+                    {"name",  "prefix_cache_attached_total"},
+                    {"help",  "Number of prompts that shared a prefix cached by another slot."},
+                    {"value",  (uint64_t) data.at("prefix_cache_attached_total")}
+            }, {
+                    {"name",  "prefix_cache_tokens_total"},
+                    {"help",  "Number of prompt tokens shared from other slots instead of being processed."},
+                    {"value",  (uint64_t) data.at("prefix_cache_tokens_total")}
+            }, {
+                    {"name",  "requests_preempted_total"},
+                    {"help",  "Number of requests that gave up their slot to a request with a higher priority."},
+                    {"value",  (uint64_t) data.at("n_preempted_total")}
+            }, {
+                    {"name",  "draft_tokens_total"},
+                    {"help",  "Number of tokens drafted for speculative decoding."},
+                    {"value",  n_draft_total}
+            }, {
+                    {"name",  "draft_tokens_accepted_total"},
+                    {"help",  "Number of drafted tokens accepted by the target model."},
+                    {"value",  n_draft_accepted_total}
             }}},
             {"gauge", {{
                     {"name",  "prompt_tokens_seconds"},
@@ -2611,6 +4316,14 @@ int main(int argc, char ** argv) {
                     {"name",  "predicted_tokens_seconds"},
                     {"help",  "Average generation throughput in tokens/s."},
                     {"value",  n_tokens_predicted ? 1.e3 / t_tokens_generation * n_tokens_predicted : 0.}
+            },{
+                    {"name",  "time_to_first_token_seconds"},
+                    {"help",  "Average time from the arrival of a request to its first token, including the wait for a slot."},
+                    {"value",  n_first_token ? 1.e-3 * t_first_token / n_first_token : 0.}
+            },{
+                    {"name",  "time_per_output_token_seconds"},
+                    {"help",  "Average time per generated token after the first."},
+                    {"value",  n_tpot_tokens ? 1.e-3 * t_tokens_generation / n_tpot_tokens : 0.}
             },{
                     {"name",  "kv_cache_usage_ratio"},
                     {"help",  "KV-cache usage. 1 means 100 percent usage."},
@@ -2627,6 +4340,30 @@ int main(int argc, char ** argv) {
                     {"name",  "requests_deferred"},
                     {"help",  "Number of request deferred."},
                     {"value",  (uint64_t) data.at("deferred")}
+            },{
+                    {"name",  "requests_parked"},
+                    {"help",  "Number of preempted requests waiting with their KV cache in host memory."},
+                    {"value",  (uint64_t) data.at("n_parked")}
+            },{
+                    {"name",  "requests_parked_bytes"},
+                    {"help",  "Host memory used by the KV cache of the parked requests."},
+                    {"value",  (uint64_t) data.at("n_parked_bytes")}
+            },{
+                    {"name",  "kv_store_entries"},
+                    {"help",  "Number of conversations in the KV store."},
+                    {"value",  (uint64_t) data.at("kv_store_entries")}
+            },{
+                    {"name",  "kv_store_ram_bytes"},
+                    {"help",  "Host memory used by the KV store."},
+                    {"value",  (uint64_t) data.at("kv_store_ram_bytes")}
+            },{
+                    {"name",  "kv_store_disk_bytes"},
+                    {"help",  "Disk space used by the KV store."},
+                    {"value",  (uint64_t) data.at("kv_store_disk_bytes")}
+            },{
+                    {"name",  "draft_acceptance_ratio"},
+                    {"help",  "Fraction of the drafted tokens accepted by the target model."},
+                    {"value",  n_draft_total ? 1. * n_draft_accepted_total / n_draft_total : 0.}
             }}}
         };
 
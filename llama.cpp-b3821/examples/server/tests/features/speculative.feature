@@ -0,0 +1,63 @@
+@llama.cpp
+@speculative
+Feature: llama.cpp server speculative decoding
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   a model file test-model.gguf
+    And   a model alias tinyllama-2
+    And   BOS token is 1
+    And   42 as server seed
+    And   256 KV cache size
+    And   32 as batch size
+    # the target verifies the drafts with the kernels that computed them
+    And   1 as ubatch size
+    And   2 slots
+    And   8 as draft
+    And   64 max tokens to predict
+    And   prometheus compatible metrics exposed
+
+  Scenario: Drafts of the target model do not change the greedy completion
+    Given a draft model file test-model.gguf
+    And   0.0 temperature
+    Then  the server is starting
+    Then  the server is healthy
+    Given a prompt:
+    """
+    Once upon a time
+    """
+    And   0 draft tokens requested
+    And   a completion request with no api error
+    Given a prompt:
+    """
+    Once upon a time
+    """
+    And   8 draft tokens requested
+    And   a completion request with no api error
+    Then  all predictions are equal
+    And   prometheus metrics are exposed
+    And   metric llamacpp:draft_tokens is positive
+    And   metric llamacpp:draft_tokens_accepted is positive
+    And   metric llamacpp:draft_acceptance_ratio is positive
+
+  Scenario: Lookup decoding does not change the greedy completion
+    Given lookup decoding
+    And   0.0 temperature
+    Then  the server is starting
+    Then  the server is healthy
+    Given a prompt:
+    """
+    Once upon a time, there was a little girl. Once upon a time, there was a little boy. Once upon a time
+    """
+    And   0 draft tokens requested
+    And   a completion request with no api error
+    Given a prompt:
+    """
+    Once upon a time, there was a little girl. Once upon a time, there was a little boy. Once upon a time
+    """
+    And   8 draft tokens requested
+    And   a completion request with no api error
+    Then  all predictions are equal
+    And   prometheus metrics are exposed
+    And   metric llamacpp:draft_tokens is positive
@@ -72,6 +72,9 @@ def step_server_config(context, server_fqdn: str, server_port: str):
     context.server_process = None
     context.seed = None
     context.draft = None
+    context.model_draft = None
+    context.lookup = False
+    context.n_draft = None
     context.server_seed = None
     context.user_api_key = None
     context.response_format = None
@@ -137,6 +140,21 @@ def step_draft(context, draft: int):
     context.draft = draft
 
 
+@step('a draft model file {model_draft}')
+def step_model_draft(context, model_draft: str):
+    context.model_draft = model_draft
+
+
+@step('lookup decoding')
+def step_lookup(context):
+    context.lookup = True
+
+
+@step('{n_draft:d} draft tokens requested')
+def step_n_draft(context, n_draft: int):
+    context.n_draft = n_draft
+
+
 @step('{n_ctx:d} KV cache size')
 def step_n_ctx(context, n_ctx: int):
     context.n_ctx = n_ctx
@@ -272,7 +290,8 @@ async def step_request_completion(context, api_error: Literal['raised'] | str):
                                           id_slot=context.id_slot,
                                           expect_api_error=expect_api_error,
                                           user_api_key=context.user_api_key,
-                                          temperature=context.temperature)
+                                          temperature=context.temperature,
+                                          n_draft=context.n_draft)
     context.tasks_result.append(completion)
     if context.debug:
         print(f"Completion response: {completion}")
@@ -828,6 +847,13 @@ def step_assert_metric_value(context, metric_name, metric_value):
     assert context.metrics[metric_name].samples[0].value == metric_value, f"metric: {context.metrics[metric_name]}"
 
 
+@step('metric {metric_name} is positive')
+def step_assert_metric_positive(context, metric_name):
+    if metric_name not in context.metrics:
+        assert False, f"no metric {metric_name} in {context.metrics.keys()}"
+    assert context.metrics[metric_name].samples[0].value > 0, f"metric: {context.metrics[metric_name]}"
+
+
 @step('available models')
 def step_available_models(context):
     # openai client always expects an api_key
@@ -928,7 +954,8 @@ async def request_completion(prompt,
                              id_slot=None,
                              expect_api_error=None,
                              user_api_key=None,
-                             temperature=None) -> int | dict[str, Any]:
+                             temperature=None,
+                             n_draft=None) -> int | dict[str, Any]:
     if debug:
         print(f"Sending completion request: {prompt}")
     origin = "my.super.domain"
@@ -952,6 +979,7 @@ async def request_completion(prompt,
                                     "seed": seed if seed is not None else 42,
                                     "temperature": temperature if temperature is not None else 0.8,
                                     "n_probs": 2,
+                                    **({"n_draft": n_draft} if n_draft is not None else {}),
                                 },
                                 headers=headers) as response:
             if expect_api_error is None or not expect_api_error:
@@ -1358,6 +1386,10 @@ def start_server_background(context):
         server_args.extend(['--n-gpu-layers', context.n_gpu_layer])
     if context.draft is not None:
         server_args.extend(['--draft', context.draft])
+    if context.model_draft:
+        server_args.extend(['--model-draft', context.model_draft])
+    if context.lookup:
+        server_args.append('--lookup')
     if context.server_continuous_batching:
         server_args.append('--cont-batching')
     if context.server_embeddings:
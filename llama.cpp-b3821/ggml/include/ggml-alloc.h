@@ -66,6 +66,13 @@ GGML_API bool ggml_gallocr_alloc_graph(ggml_gallocr_t galloc, struct ggml_cgraph
 
 GGML_API size_t ggml_gallocr_get_buffer_size(ggml_gallocr_t galloc, int buffer_id);
 
+// memory usage of the graph from the last reserve, e.g. to choose the batch size for the available memory
+// peak size: largest amount of memory that is live at the same time, a lower bound of the buffer size
+// live size: memory that is live while computing the node node_id of the graph
+// shared buffers are only reported for the first buffer_id that uses them, like ggml_gallocr_get_buffer_size
+GGML_API size_t ggml_gallocr_get_peak_size(ggml_gallocr_t galloc, int buffer_id);
+GGML_API size_t ggml_gallocr_get_live_size(ggml_gallocr_t galloc, int buffer_id, int node_id);
+
 // Utils
 // Create a buffer and allocate all the tensors in a ggml_context
 GGML_API struct ggml_backend_buffer * ggml_backend_alloc_ctx_tensors_from_buft(struct ggml_context * ctx, ggml_backend_buffer_type_t buft);
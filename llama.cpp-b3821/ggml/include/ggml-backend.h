@@ -105,7 +105,21 @@ extern "C" {
     GGML_API GGML_CALL bool ggml_backend_is_cpu                (ggml_backend_t backend);
     GGML_API           void ggml_backend_cpu_set_n_threads     (ggml_backend_t backend_cpu, int n_threads);
     GGML_API           void ggml_backend_cpu_set_threadpool    (ggml_backend_t backend_cpu, ggml_threadpool_t threadpool);
+    GGML_API           void ggml_backend_cpu_set_priority      (ggml_backend_t backend_cpu, int32_t priority); // see ggml_cplan.priority
+    GGML_API           void ggml_backend_cpu_set_fuse_ops      (ggml_backend_t backend_cpu, bool fuse_ops);    // see ggml_cplan.fuse_ops, enabled by default
     GGML_API           void ggml_backend_cpu_set_abort_callback(ggml_backend_t backend_cpu, ggml_abort_callback abort_callback, void * abort_callback_data);
+    GGML_API           void ggml_backend_cpu_set_profiler      (ggml_backend_t backend_cpu, struct ggml_profiler * profiler); // see ggml_cplan.profiler
+
+    // CPU pipeline stage
+    // the graphs are computed asynchronously on a thread of the backend, in the order they are submitted, and the compute buffers
+    // are of a buffer type of its own, so that a scheduler with pipeline parallelism can run several stages on consecutive graphs
+    // e.g. split the layers of a model between stages with their own threadpool, each on a NUMA node (see ggml_threadpool_params.numa_node)
+    GGML_API ggml_backend_t ggml_backend_cpu_stage_init(int stage);
+    GGML_API GGML_CALL bool ggml_backend_cpu_is_stage  (ggml_backend_t backend);
+    GGML_API           bool ggml_backend_cpu_stage_is_idle(ggml_backend_t backend); // all the submitted work is done
+    // the first error of the graphs computed by the stage since it was last reported (here or by ggml_backend_graph_compute), and
+    // resets it - synchronizing a stage does not report errors, and the stage skips the graphs submitted after a failed one until it is reported
+    GGML_API enum ggml_status ggml_backend_cpu_stage_get_status(ggml_backend_t backend);
 
     // Create a backend buffer from an existing pointer
     GGML_API GGML_CALL ggml_backend_buffer_t ggml_backend_cpu_buffer_from_ptr(void * ptr, size_t size);
@@ -195,6 +209,8 @@ extern "C" {
     GGML_API int                  ggml_backend_sched_get_n_copies(ggml_backend_sched_t sched);
 
     GGML_API size_t               ggml_backend_sched_get_buffer_size(ggml_backend_sched_t sched, ggml_backend_t backend);
+    // Largest amount of compute memory used at the same time by the last reserved graph
+    GGML_API size_t               ggml_backend_sched_get_peak_size(ggml_backend_sched_t sched, ggml_backend_t backend);
 
     GGML_API void                 ggml_backend_sched_set_tensor_backend(ggml_backend_sched_t sched, struct ggml_tensor * node, ggml_backend_t backend);
     GGML_API ggml_backend_t       ggml_backend_sched_get_tensor_backend(ggml_backend_sched_t sched, struct ggml_tensor * node);
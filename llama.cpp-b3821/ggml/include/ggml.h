@@ -487,6 +487,7 @@ extern "C" {
         GGML_OP_TRANSPOSE,
         GGML_OP_GET_ROWS,
         GGML_OP_GET_ROWS_BACK,
+        GGML_OP_SET_ROWS,
         GGML_OP_DIAG,
         GGML_OP_DIAG_MASK_INF,
         GGML_OP_DIAG_MASK_ZERO,
@@ -579,6 +580,7 @@ extern "C" {
         GGML_TENSOR_FLAG_OUTPUT   = 2, // ...is an output for the GGML compute graph
         GGML_TENSOR_FLAG_PARAM    = 4, // ...contains trainable parameters
         GGML_TENSOR_FLAG_LOSS     = 8, // ...defines loss for numerical optimization (multiple loss tensors add up)
+        GGML_TENSOR_FLAG_NUMA     = 16, // ...has its rows split across the NUMA nodes (see ggml_numa_split_tensor)
     };
 
     // n-dimensional tensor
@@ -640,15 +642,37 @@ extern "C" {
         bool                cpumask[GGML_MAX_N_THREADS]; // mask of cpu cores (all-zeros means use default affinity settings)
         int                 n_threads;                   // number of threads
         enum ggml_sched_priority prio;                   // thread priority
-        uint32_t            poll;                        // polling level (0 - no polling, 100 - aggressive polling)
+        uint32_t            poll;                        // polling level (0 - no polling, 100 - aggressive polling), see ggml_threadpool_stats
         bool                strict_cpu;                  // strict cpu placement
         bool                paused;                      // start in paused state
+        int32_t             numa_node;                   // run the threads on this NUMA node, modulo the number of nodes (-1 - follow the NUMA strategy)
     };
 
     struct ggml_threadpool;     // forward declaration, see ggml.c
 
+    // Threadpool activity counters
+    // Idle worker threads spin, then yield, then sleep until the next graph. How long they spin and
+    // yield is adapted to the average idle time between graphs, up to limits that scale with the poll level.
+    // The wait counters are summed over the worker threads and stay 0 when ggml is built with OpenMP.
+    struct ggml_threadpool_stats {
+        int64_t n_graphs;        // number of graphs computed
+        int64_t t_compute_us;    // wall time spent computing graphs
+        int64_t t_idle_us;       // wall time between graphs
+        int64_t t_spin_us;       // time spent spinning while waiting for work
+        int64_t t_yield_us;      // time spent yielding the CPU while waiting for work
+        int64_t t_sleep_us;      // time spent sleeping while waiting for work
+        int64_t n_spin_wakeups;  // number of waits that ended while spinning
+        int64_t n_yield_wakeups; // number of waits that ended while yielding
+        int64_t n_sleep_wakeups; // number of waits that ended while sleeping
+    };
+
     typedef struct ggml_threadpool * ggml_threadpool_t;
 
+    // per-node profile of ggml_graph_compute, see ggml_cplan.profiler
+    // each thread measures the time it spends in every node (busy) and in the barrier that follows it (wait)
+    // the bytes and FLOPs of a node are estimated from its shape and the shapes of its sources
+    struct ggml_profiler; // forward declaration, see ggml.c
+
     // the compute plan that needs to be prepared for ggml_graph_compute()
     // since https://github.com/ggerganov/ggml/issues/287
     struct ggml_cplan {
@@ -658,9 +682,19 @@ extern "C" {
         int n_threads;
         struct ggml_threadpool * threadpool;
 
+        // callers sharing a threadpool compute their graphs one at a time, the highest priority first
+        int32_t priority;
+
+        // compute pairs of ops like RMS_NORM -> MUL with fused kernels
+        // the results of the first op of each pair are not written, unless the tensor is flagged as an output
+        bool fuse_ops;
+
         // abort ggml_graph_compute when true
         ggml_abort_callback abort_callback;
         void *              abort_callback_data;
+
+        // record the time of each node, NULL to disable
+        struct ggml_profiler * profiler;
     };
 
     // scratch buffer
@@ -684,6 +718,7 @@ extern "C" {
         GGML_NUMA_STRATEGY_ISOLATE    = 2,
         GGML_NUMA_STRATEGY_NUMACTL    = 3,
         GGML_NUMA_STRATEGY_MIRROR     = 4,
+        GGML_NUMA_STRATEGY_SPLIT      = 5, // distribute threads and split the rows of the weights across nodes
         GGML_NUMA_STRATEGY_COUNT
     };
 
@@ -710,6 +745,12 @@ extern "C" {
 
     GGML_API void    ggml_numa_init(enum ggml_numa_strategy numa); // call once for better performance on NUMA systems
     GGML_API bool    ggml_is_numa(void); // true if init detected that system has >1 NUMA node
+    GGML_API bool    ggml_is_numa_split(void); // true if the SPLIT strategy is used on a system with >1 NUMA node
+
+    // place the rows of a 2D tensor on the NUMA nodes whose threads compute them in ggml_mul_mat
+    // call before the data is written so that the pages are allocated on the right node
+    // returns false if the tensor was not split (not in SPLIT mode, too small, or the memory policy could not be set)
+    GGML_API bool    ggml_numa_split_tensor(struct ggml_tensor * tensor);
 
     GGML_API void    ggml_print_object (const struct ggml_object * obj);
     GGML_API void    ggml_print_objects(const struct ggml_context * ctx);
@@ -1417,6 +1458,14 @@ extern "C" {
             struct ggml_tensor  * b,
             struct ggml_tensor  * c);
 
+    // a[c[i]] = b[i] for the rows of the F32 matrix b and the I32 vector c, converted to the type of a
+    // the rows of a may be strided (e.g. a transposed view), return view(a)
+    GGML_API struct ggml_tensor * ggml_set_rows(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b,
+            struct ggml_tensor  * c);
+
     GGML_API struct ggml_tensor * ggml_diag(
         struct ggml_context     * ctx,
         struct ggml_tensor      * a);
@@ -2103,6 +2152,24 @@ extern "C" {
     GGML_API void                          ggml_threadpool_pause        (struct ggml_threadpool * threadpool);
     GGML_API void                          ggml_threadpool_resume       (struct ggml_threadpool * threadpool);
 
+    // should only be called while no graph is being computed
+    GGML_API void                          ggml_threadpool_get_stats    (struct ggml_threadpool * threadpool, struct ggml_threadpool_stats * stats);
+    GGML_API void                          ggml_threadpool_reset_stats  (struct ggml_threadpool * threadpool);
+
+    // true if the threads synchronize after node i of the last graph computed on the threadpool, false if they go on to
+    // the next node without waiting for each other - should only be called while no graph is being computed
+    GGML_API bool                          ggml_threadpool_node_synced  (struct ggml_threadpool * threadpool, int i);
+
+    // a profiler can be shared by graphs computed at the same time on different threadpools
+    // the trace keeps up to n_trace_events node timings (one per node and thread), 0 to only keep the summary
+    GGML_API struct ggml_profiler *        ggml_profiler_new            (int64_t n_trace_events);
+    GGML_API void                          ggml_profiler_free           (struct ggml_profiler * profiler);
+    GGML_API void                          ggml_profiler_reset          (struct ggml_profiler * profiler);
+    // time, bandwidth and FLOPs of each op sorted by time, and the busy and wait time of each thread
+    GGML_API void                          ggml_profiler_print          (struct ggml_profiler * profiler, FILE * stream);
+    // Chrome trace event format, can be opened with chrome://tracing or Perfetto
+    GGML_API bool                          ggml_profiler_write_trace    (struct ggml_profiler * profiler, const char * fname);
+
     // ggml_graph_plan() has to be called before ggml_graph_compute()
     // when plan.work_size > 0, caller must allocate memory for plan.work_data
     GGML_API struct ggml_cplan ggml_graph_plan(
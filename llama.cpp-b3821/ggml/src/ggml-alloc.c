@@ -339,6 +339,18 @@ struct hash_node {
     int buffer_id;
     size_t offset; // offset within the buffer
     bool allocated;
+    int block_id; // index + 1 of the block that holds the data in galloc->blocks, 0 = none
+};
+
+// a range of memory and the nodes during which it is live
+// the blocks are packed again after the graph has been allocated, see ggml_gallocr_plan_blocks
+struct alloc_block {
+    int buffer_id;
+    size_t size;
+    int start; // first node that uses the block
+    int end;   // last node that uses the block
+    size_t offset;      // offset given by the dynamic allocator
+    size_t plan_offset; // offset given by the planner
 };
 
 struct tensor_alloc {
@@ -371,6 +383,14 @@ struct ggml_gallocr {
 
     struct leaf_alloc * leaf_allocs; // [n_leafs]
     int n_leafs;
+
+    struct alloc_block * blocks; // [n_blocks]
+    int n_blocks;
+    int blocks_size;
+
+    size_t * live_sizes; // [n_buffers][n_live_nodes] memory in use while computing each node
+    size_t * peak_sizes; // [n_buffers]
+    int n_live_nodes;
 };
 
 ggml_gallocr_t ggml_gallocr_new_n(ggml_backend_buffer_type_t * bufts, int n_bufs) {
@@ -405,6 +425,9 @@ ggml_gallocr_t ggml_gallocr_new_n(ggml_backend_buffer_type_t * bufts, int n_bufs
     }
     galloc->n_buffers = n_bufs;
 
+    galloc->peak_sizes = calloc(n_bufs, sizeof(size_t));
+    GGML_ASSERT(galloc->peak_sizes != NULL);
+
     return galloc;
 }
 
@@ -453,6 +476,9 @@ void ggml_gallocr_free(ggml_gallocr_t galloc) {
     free(galloc->buf_tallocs);
     free(galloc->node_allocs);
     free(galloc->leaf_allocs);
+    free(galloc->blocks);
+    free(galloc->live_sizes);
+    free(galloc->peak_sizes);
     free(galloc);
 }
 
@@ -478,7 +504,36 @@ static bool ggml_gallocr_is_allocated(ggml_gallocr_t galloc, struct ggml_tensor
     return t->data != NULL || ggml_gallocr_hash_get(galloc, t)->allocated;
 }
 
-static void ggml_gallocr_allocate_node(ggml_gallocr_t galloc, struct ggml_tensor * node, int buffer_id) {
+static int ggml_gallocr_new_block(ggml_gallocr_t galloc, int buffer_id, size_t size, size_t offset, int node_id) {
+    if (galloc->n_blocks == galloc->blocks_size) {
+        galloc->blocks_size = MAX(2*galloc->blocks_size, 256);
+        galloc->blocks = realloc(galloc->blocks, galloc->blocks_size * sizeof(struct alloc_block));
+        GGML_ASSERT(galloc->blocks != NULL);
+    }
+
+    struct alloc_block * block = &galloc->blocks[galloc->n_blocks++];
+    block->buffer_id   = buffer_id;
+    block->size        = aligned_offset(NULL, size, galloc->buf_tallocs[buffer_id]->alignment);
+    block->start       = node_id;
+    block->end         = INT_MAX; // never freed
+    block->offset      = offset;
+    block->plan_offset = offset;
+
+    return galloc->n_blocks;
+}
+
+// count the sources of node that are parent, an op that is the last user of a tensor may use it more than once
+static int ggml_gallocr_n_uses(const struct ggml_tensor * node, const struct ggml_tensor * parent) {
+    int n = 0;
+    for (int i = 0; i < GGML_MAX_SRC; i++) {
+        if (node->src[i] == parent) {
+            n++;
+        }
+    }
+    return n;
+}
+
+static void ggml_gallocr_allocate_node(ggml_gallocr_t galloc, struct ggml_tensor * node, int buffer_id, int node_id) {
     struct hash_node * hn = ggml_gallocr_hash_get(galloc, node);
 
     if (!ggml_gallocr_is_allocated(galloc, node) && !ggml_is_view(node)) {
@@ -510,8 +565,9 @@ static void ggml_gallocr_allocate_node(ggml_gallocr_t galloc, struct ggml_tensor
                     continue;
                 }
 
+                // the parent can be overwritten if this node is its last user
                 struct hash_node * p_hn = ggml_gallocr_hash_get(galloc, parent);
-                if (p_hn->n_children == 1 && p_hn->n_views == 0) {
+                if (p_hn->n_children == ggml_gallocr_n_uses(node, parent) && p_hn->n_views == 0) {
                     if (ggml_is_view(parent)) {
                         struct ggml_tensor * view_src = parent->view_src;
                         struct hash_node * view_src_hn = ggml_gallocr_hash_get(galloc, view_src);
@@ -520,6 +576,7 @@ static void ggml_gallocr_allocate_node(ggml_gallocr_t galloc, struct ggml_tensor
                             assert(view_src_hn->offset == p_hn->offset);
                             hn->buffer_id = p_hn->buffer_id;
                             hn->offset = p_hn->offset;
+                            hn->block_id = view_src_hn->block_id;
                             p_hn->allocated = false; // avoid freeing the parent
                             view_src_hn->allocated = false;
                             return;
@@ -528,6 +585,7 @@ static void ggml_gallocr_allocate_node(ggml_gallocr_t galloc, struct ggml_tensor
                         AT_PRINTF("reusing parent %s for %s\n", parent->name, node->name);
                         hn->buffer_id = p_hn->buffer_id;
                         hn->offset = p_hn->offset;
+                        hn->block_id = p_hn->block_id;
                         p_hn->allocated = false; // avoid freeing the parent
                         return;
                     }
@@ -541,11 +599,12 @@ static void ggml_gallocr_allocate_node(ggml_gallocr_t galloc, struct ggml_tensor
         size_t offset = ggml_dyn_tallocr_alloc(alloc, size, node);
         hn->buffer_id = buffer_id;
         hn->offset = offset;
+        hn->block_id = ggml_gallocr_new_block(galloc, buffer_id, size, offset, node_id);
         return;
     }
 }
 
-static void ggml_gallocr_free_node(ggml_gallocr_t galloc, struct ggml_tensor * node) {
+static void ggml_gallocr_free_node(ggml_gallocr_t galloc, struct ggml_tensor * node, int node_id) {
     // graph outputs are never freed
     if (node->flags & GGML_TENSOR_FLAG_OUTPUT) {
         AT_PRINTF("not freeing output %s\n", node->name);
@@ -560,6 +619,9 @@ static void ggml_gallocr_free_node(ggml_gallocr_t galloc, struct ggml_tensor * n
     size_t size = ggml_backend_buft_get_alloc_size(buft, node);
     ggml_dyn_tallocr_free_tensor(alloc, offset, size, node);
     hn->allocated = false;
+    if (hn->block_id > 0) {
+        galloc->blocks[hn->block_id - 1].end = node_id;
+    }
 }
 
 static int get_node_buffer_id(const int * node_buffer_ids, int i) {
@@ -570,12 +632,13 @@ static void ggml_gallocr_alloc_graph_impl(ggml_gallocr_t galloc, struct ggml_cgr
     // clear hash tables
     ggml_hash_set_reset(&galloc->hash_set);
     memset(galloc->hash_values, 0, sizeof(struct hash_node) * galloc->hash_set.size);
+    galloc->n_blocks = 0;
 
     // allocate leafs
     // these may be tensors that the application is not using in the graph, but may still want to allocate for other purposes
     for (int i = 0; i < graph->n_leafs; i++) {
         struct ggml_tensor * leaf = graph->leafs[i];
-        ggml_gallocr_allocate_node(galloc, leaf, get_node_buffer_id(leaf_buffer_ids, i));
+        ggml_gallocr_allocate_node(galloc, leaf, get_node_buffer_id(leaf_buffer_ids, i), 0);
     }
 
     // count number of children and views
@@ -593,7 +656,7 @@ static void ggml_gallocr_alloc_graph_impl(ggml_gallocr_t galloc, struct ggml_cgr
         }
 
         if (node->flags & GGML_TENSOR_FLAG_INPUT) {
-            ggml_gallocr_allocate_node(galloc, graph->nodes[i], get_node_buffer_id(node_buffer_ids, i));
+            ggml_gallocr_allocate_node(galloc, graph->nodes[i], get_node_buffer_id(node_buffer_ids, i), 0);
         }
 
         for (int j = 0; j < GGML_MAX_SRC; j++) {
@@ -606,7 +669,7 @@ static void ggml_gallocr_alloc_graph_impl(ggml_gallocr_t galloc, struct ggml_cgr
 
             // allocate explicit inputs
             if (src->flags & GGML_TENSOR_FLAG_INPUT) {
-                ggml_gallocr_allocate_node(galloc, src, get_node_buffer_id(node_buffer_ids, i));
+                ggml_gallocr_allocate_node(galloc, src, get_node_buffer_id(node_buffer_ids, i), 0);
             }
         }
     }
@@ -622,11 +685,11 @@ static void ggml_gallocr_alloc_graph_impl(ggml_gallocr_t galloc, struct ggml_cgr
             if (parent == NULL) {
                 continue;
             }
-            ggml_gallocr_allocate_node(galloc, parent, buffer_id);
+            ggml_gallocr_allocate_node(galloc, parent, buffer_id, i);
         }
 
         // allocate node
-        ggml_gallocr_allocate_node(galloc, node, buffer_id);
+        ggml_gallocr_allocate_node(galloc, node, buffer_id, i);
 
         AT_PRINTF("exec: %s (%s) <= ", ggml_op_desc(node), node->name);
         for (int j = 0; j < GGML_MAX_SRC; j++) {
@@ -661,11 +724,11 @@ static void ggml_gallocr_alloc_graph_impl(ggml_gallocr_t galloc, struct ggml_cgr
                     AT_PRINTF("view_src %s: %d children, %d views\n",
                         view_src->name, view_src_hn->n_children, view_src_hn->n_views);
                     if (view_src_hn->n_views == 0 && view_src_hn->n_children == 0 && view_src_hn->allocated) {
-                        ggml_gallocr_free_node(galloc, view_src);
+                        ggml_gallocr_free_node(galloc, view_src, i);
                     }
                 }
                 else if (p_hn->allocated) {
-                    ggml_gallocr_free_node(galloc, parent);
+                    ggml_gallocr_free_node(galloc, parent, i);
                 }
             }
             AT_PRINTF("\n");
@@ -673,6 +736,144 @@ static void ggml_gallocr_alloc_graph_impl(ggml_gallocr_t galloc, struct ggml_cgr
     }
 }
 
+// liveness-based planner
+// the dynamic allocator places the tensors in the order in which they are allocated, which can leave holes that are too
+// small for the tensors allocated later. once the lifetime of every block is known, the blocks are packed again from the
+// largest to the smallest, each one in the smallest gap left by the blocks that are live at the same time
+
+static bool ggml_gallocr_blocks_overlap(const struct alloc_block * a, const struct alloc_block * b) {
+    return a->start <= b->end && b->start <= a->end;
+}
+
+static int ggml_gallocr_block_cmp(const void * a, const void * b) {
+    const struct alloc_block * ba = *(const struct alloc_block * const *) a;
+    const struct alloc_block * bb = *(const struct alloc_block * const *) b;
+    if (ba->size != bb->size) {
+        return ba->size > bb->size ? -1 : 1;
+    }
+    if (ba->start != bb->start) {
+        return ba->start < bb->start ? -1 : 1;
+    }
+    return ba < bb ? -1 : (ba > bb ? 1 : 0);
+}
+
+// returns the size of the buffer with the planned offsets
+static size_t ggml_gallocr_plan_buffer(struct alloc_block ** blocks, int n_blocks, struct alloc_block ** placed) {
+    qsort(blocks, n_blocks, sizeof(struct alloc_block *), ggml_gallocr_block_cmp);
+
+    size_t max_size = 0;
+    int n_placed = 0; // sorted by offset
+    for (int i = 0; i < n_blocks; i++) {
+        struct alloc_block * block = blocks[i];
+
+        size_t best_offset = SIZE_MAX;
+        size_t best_gap = SIZE_MAX;
+        size_t prev_end = 0;
+        for (int j = 0; j < n_placed; j++) {
+            const struct alloc_block * other = placed[j];
+            if (!ggml_gallocr_blocks_overlap(block, other)) {
+                continue;
+            }
+            if (other->plan_offset > prev_end) {
+                size_t gap = other->plan_offset - prev_end;
+                if (gap >= block->size && gap < best_gap) {
+                    best_gap = gap;
+                    best_offset = prev_end;
+                }
+            }
+            prev_end = MAX(prev_end, other->plan_offset + other->size);
+        }
+        if (best_offset == SIZE_MAX) {
+            // no gap is large enough, place it after the last live block
+            best_offset = prev_end;
+        }
+
+        block->plan_offset = best_offset;
+        max_size = MAX(max_size, best_offset + block->size);
+
+        int pos = n_placed++;
+        while (pos > 0 && placed[pos - 1]->plan_offset > best_offset) {
+            placed[pos] = placed[pos - 1];
+            pos--;
+        }
+        placed[pos] = block;
+    }
+
+    return max_size;
+}
+
+// first buffer that uses the same allocator as buffer_id
+static int ggml_gallocr_buffer_owner(ggml_gallocr_t galloc, int buffer_id) {
+    for (int i = 0; i < buffer_id; i++) {
+        if (galloc->buf_tallocs[i] == galloc->buf_tallocs[buffer_id]) {
+            return i;
+        }
+    }
+    return buffer_id;
+}
+
+static void ggml_gallocr_plan_blocks(ggml_gallocr_t galloc, int n_nodes) {
+    struct alloc_block ** blocks = malloc(2 * MAX(galloc->n_blocks, 1) * sizeof(struct alloc_block *)); // [n_blocks] + placed [n_blocks]
+    GGML_ASSERT(blocks != NULL);
+
+    for (int i = 0; i < galloc->n_buffers; i++) {
+        if (ggml_gallocr_buffer_owner(galloc, i) != i) {
+            continue;
+        }
+
+        int n = 0;
+        for (int j = 0; j < galloc->n_blocks; j++) {
+            if (galloc->buf_tallocs[galloc->blocks[j].buffer_id] == galloc->buf_tallocs[i]) {
+                blocks[n++] = &galloc->blocks[j];
+            }
+        }
+
+        // keep the layout of the dynamic allocator if the planner does not improve it
+        struct ggml_dyn_tallocr * alloc = galloc->buf_tallocs[i];
+        size_t plan_size = ggml_gallocr_plan_buffer(blocks, n, blocks + galloc->n_blocks);
+        if (plan_size < ggml_dyn_tallocr_max_size(alloc)) {
+            AT_PRINTF("%s: buffer %d: planned size %zu, dynamic allocator %zu\n", __func__, i, plan_size, ggml_dyn_tallocr_max_size(alloc));
+            alloc->max_size = plan_size;
+        } else {
+            for (int j = 0; j < n; j++) {
+                blocks[j]->plan_offset = blocks[j]->offset;
+            }
+        }
+    }
+
+    free(blocks);
+
+    for (size_t i = 0; i < galloc->hash_set.size; i++) {
+        struct hash_node * hn = &galloc->hash_values[i];
+        if (hn->block_id > 0) {
+            hn->offset = galloc->blocks[hn->block_id - 1].plan_offset;
+        }
+    }
+
+    // memory in use while computing each node
+    if (galloc->live_sizes == NULL || galloc->n_live_nodes < n_nodes) {
+        free(galloc->live_sizes);
+        galloc->live_sizes = malloc(galloc->n_buffers * MAX(n_nodes, 1) * sizeof(size_t));
+        GGML_ASSERT(galloc->live_sizes != NULL);
+    }
+    galloc->n_live_nodes = n_nodes;
+    memset(galloc->live_sizes, 0, galloc->n_buffers * n_nodes * sizeof(size_t));
+    memset(galloc->peak_sizes, 0, galloc->n_buffers * sizeof(size_t));
+
+    for (int i = 0; i < galloc->n_blocks; i++) {
+        const struct alloc_block * block = &galloc->blocks[i];
+        size_t * live = galloc->live_sizes + ggml_gallocr_buffer_owner(galloc, block->buffer_id) * n_nodes;
+        for (int j = block->start; j < n_nodes && j <= block->end; j++) {
+            live[j] += block->size;
+        }
+    }
+    for (int i = 0; i < galloc->n_buffers; i++) {
+        for (int j = 0; j < n_nodes; j++) {
+            galloc->peak_sizes[i] = MAX(galloc->peak_sizes[i], galloc->live_sizes[i * n_nodes + j]);
+        }
+    }
+}
+
 bool ggml_gallocr_reserve_n(ggml_gallocr_t galloc, struct ggml_cgraph * graph, const int * node_buffer_ids, const int * leaf_buffer_ids) {
     size_t min_hash_size = graph->n_nodes + graph->n_leafs;
     // add 25% margin to avoid hash collisions
@@ -697,6 +898,9 @@ bool ggml_gallocr_reserve_n(ggml_gallocr_t galloc, struct ggml_cgraph * graph, c
     // allocate in hash table
     ggml_gallocr_alloc_graph_impl(galloc, graph, node_buffer_ids, leaf_buffer_ids);
 
+    // pack the blocks by their lifetime
+    ggml_gallocr_plan_blocks(galloc, graph->n_nodes);
+
     // set the node_allocs from the hash table
     if (galloc->n_nodes < graph->n_nodes) {
         free(galloc->node_allocs);
@@ -931,6 +1135,19 @@ size_t ggml_gallocr_get_buffer_size(ggml_gallocr_t galloc, int buffer_id) {
     return ggml_backend_buffer_get_size(galloc->buffers[buffer_id]);
 }
 
+size_t ggml_gallocr_get_peak_size(ggml_gallocr_t galloc, int buffer_id) {
+    GGML_ASSERT(buffer_id >= 0 && buffer_id < galloc->n_buffers);
+
+    return galloc->peak_sizes[buffer_id];
+}
+
+size_t ggml_gallocr_get_live_size(ggml_gallocr_t galloc, int buffer_id, int node_id) {
+    GGML_ASSERT(buffer_id >= 0 && buffer_id < galloc->n_buffers);
+    GGML_ASSERT(node_id >= 0 && node_id < galloc->n_live_nodes);
+
+    return galloc->live_sizes[buffer_id * galloc->n_live_nodes + node_id];
+}
+
 // utils
 
 static bool alloc_tensor_range(struct ggml_context * ctx,
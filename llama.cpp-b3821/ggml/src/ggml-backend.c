@@ -9,6 +9,15 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#ifndef NOMINMAX
+#   define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
@@ -745,17 +754,112 @@ ggml_backend_buffer_type_t ggml_backend_cpu_hbm_buffer_type(void) {
 }
 #endif
 
+// CPU pipeline stage threading
+
+#if defined(_WIN32)
+
+typedef HANDLE             ggml_stage_thread_t;
+typedef SRWLOCK            ggml_stage_mutex_t;
+typedef CONDITION_VARIABLE ggml_stage_cond_t;
+
+#define ggml_stage_mutex_init(m)     InitializeSRWLock(m)
+#define ggml_stage_mutex_destroy(m)
+#define ggml_stage_mutex_lock(m)     AcquireSRWLockExclusive(m)
+#define ggml_stage_mutex_unlock(m)   ReleaseSRWLockExclusive(m)
+
+#define ggml_stage_cond_init(c)      InitializeConditionVariable(c)
+#define ggml_stage_cond_destroy(c)
+#define ggml_stage_cond_wait(c, m)   SleepConditionVariableSRW(c, m, INFINITE, 0)
+#define ggml_stage_cond_broadcast(c) WakeAllConditionVariable(c)
+
+#else
+
+typedef pthread_t          ggml_stage_thread_t;
+typedef pthread_mutex_t    ggml_stage_mutex_t;
+typedef pthread_cond_t     ggml_stage_cond_t;
+
+#define ggml_stage_mutex_init(m)     pthread_mutex_init(m, NULL)
+#define ggml_stage_mutex_destroy(m)  pthread_mutex_destroy(m)
+#define ggml_stage_mutex_lock(m)     pthread_mutex_lock(m)
+#define ggml_stage_mutex_unlock(m)   pthread_mutex_unlock(m)
+
+#define ggml_stage_cond_init(c)      pthread_cond_init(c, NULL)
+#define ggml_stage_cond_destroy(c)   pthread_cond_destroy(c)
+#define ggml_stage_cond_wait(c, m)   pthread_cond_wait(c, m)
+#define ggml_stage_cond_broadcast(c) pthread_cond_broadcast(c)
+
+#endif
+
+enum ggml_backend_cpu_job_type {
+    GGML_BACKEND_CPU_JOB_COMPUTE, // compute a graph
+    GGML_BACKEND_CPU_JOB_COPY,    // copy memory, e.g. the result of another stage to the input of a graph
+    GGML_BACKEND_CPU_JOB_WAIT,    // wait until another stage is done with the jobs submitted to it before this one
+};
+
 struct ggml_backend_cpu_context {
     int                 n_threads;
     ggml_threadpool_t   threadpool;
+    int32_t             priority;
+    bool                fuse_ops;
 
     void *              work_data;
     size_t              work_size;
 
     ggml_abort_callback abort_callback;
     void *              abort_callback_data;
+
+    struct ggml_profiler * profiler;
+
+    struct ggml_backend_cpu_stage * stage; // NULL for the synchronous CPU backend
 };
 
+struct ggml_backend_cpu_job {
+    enum ggml_backend_cpu_job_type type;
+
+    // compute
+    struct ggml_cgraph                graph;    // see ggml_backend_cpu_graph_dup
+    struct ggml_tensor             ** nodes;
+    struct ggml_backend_cpu_context   settings; // n_threads, threadpool, ... when the graph was submitted
+
+    // copy
+    void       * dst;
+    const void * src;
+    size_t       size;
+
+    // wait
+    struct ggml_backend_cpu_stage * stage;
+    uint64_t                        n_jobs;
+
+    struct ggml_backend_cpu_job * next;
+};
+
+struct ggml_backend_cpu_stage {
+    char name[16];
+
+    // the compute buffers of the stage are only used by the stage, so that the graphs of the other stages get copies of their inputs
+    struct ggml_backend_buffer_type buft;
+
+    ggml_stage_thread_t thrd;
+    ggml_stage_mutex_t  mutex;
+    ggml_stage_cond_t   cond; // signaled when a job is submitted or done
+
+    // jobs in submission order, the head is being processed
+    struct ggml_backend_cpu_job * head;
+    struct ggml_backend_cpu_job * tail;
+
+    uint64_t n_submitted;
+    uint64_t n_done;
+    bool     stop;
+
+    enum ggml_status ec; // first error since it was last reported, the graphs submitted after it are not computed
+};
+
+GGML_CALL static const char * ggml_backend_cpu_stage_buffer_type_get_name(ggml_backend_buffer_type_t buft) {
+    struct ggml_backend_cpu_context * cpu_ctx = (struct ggml_backend_cpu_context *)buft->context;
+
+    return cpu_ctx->stage->name;
+}
+
 GGML_CALL static const char * ggml_backend_cpu_name(ggml_backend_t backend) {
     return "CPU";
 
@@ -796,8 +900,11 @@ GGML_CALL static ggml_backend_graph_plan_t ggml_backend_cpu_graph_plan_create(gg
         }
     }
 
+    cpu_plan->cplan.priority            = cpu_ctx->priority;
+    cpu_plan->cplan.fuse_ops            = cpu_ctx->fuse_ops;
     cpu_plan->cplan.abort_callback      = cpu_ctx->abort_callback;
     cpu_plan->cplan.abort_callback_data = cpu_ctx->abort_callback_data;
+    cpu_plan->cplan.profiler            = cpu_ctx->profiler;
 
     return cpu_plan;
 }
@@ -819,10 +926,9 @@ GGML_CALL static enum ggml_status ggml_backend_cpu_graph_plan_compute(ggml_backe
     GGML_UNUSED(backend);
 }
 
-GGML_CALL static enum ggml_status ggml_backend_cpu_graph_compute(ggml_backend_t backend, struct ggml_cgraph * cgraph) {
-    struct ggml_backend_cpu_context * cpu_ctx = (struct ggml_backend_cpu_context *)backend->context;
-
-    struct ggml_cplan cplan = ggml_graph_plan(cgraph, cpu_ctx->n_threads, cpu_ctx->threadpool);
+// computes the graph with the settings of the backend, the work buffer of cpu_ctx grows as needed
+static enum ggml_status ggml_backend_cpu_compute(struct ggml_backend_cpu_context * cpu_ctx, const struct ggml_backend_cpu_context * settings, struct ggml_cgraph * cgraph) {
+    struct ggml_cplan cplan = ggml_graph_plan(cgraph, settings->n_threads, settings->threadpool);
 
     if (cpu_ctx->work_size < cplan.work_size) {
         free(cpu_ctx->work_data);
@@ -835,15 +941,28 @@ GGML_CALL static enum ggml_status ggml_backend_cpu_graph_compute(ggml_backend_t
     }
     cplan.work_data = cpu_ctx->work_data;
 
-    cplan.abort_callback      = cpu_ctx->abort_callback;
-    cplan.abort_callback_data = cpu_ctx->abort_callback_data;
+    cplan.priority            = settings->priority;
+    cplan.fuse_ops            = settings->fuse_ops;
+    cplan.abort_callback      = settings->abort_callback;
+    cplan.abort_callback_data = settings->abort_callback_data;
+    cplan.profiler            = settings->profiler;
 
     return ggml_graph_compute(cgraph, &cplan);
 }
 
+GGML_CALL static enum ggml_status ggml_backend_cpu_graph_compute(ggml_backend_t backend, struct ggml_cgraph * cgraph) {
+    struct ggml_backend_cpu_context * cpu_ctx = (struct ggml_backend_cpu_context *)backend->context;
+
+    return ggml_backend_cpu_compute(cpu_ctx, cpu_ctx, cgraph);
+}
+
 GGML_CALL static bool ggml_backend_cpu_supports_op(ggml_backend_t backend, const struct ggml_tensor * op) {
     switch (op->op) {
         case GGML_OP_CPY:
+            if (ggml_is_quantized(op->src[0]->type) && op->src[0]->type != op->type) {
+                // dequantizing copies
+                return op->type == GGML_TYPE_F32 || op->type == GGML_TYPE_F16;
+            }
             return
                 op->type != GGML_TYPE_IQ2_XXS &&
                 op->type != GGML_TYPE_IQ2_XS  &&
@@ -851,6 +970,12 @@ GGML_CALL static bool ggml_backend_cpu_supports_op(ggml_backend_t backend, const
                 op->type != GGML_TYPE_IQ1_M; // missing type_traits.from_float
         case GGML_OP_MUL_MAT:
             return op->src[1]->type == GGML_TYPE_F32 || op->src[1]->type == ggml_internal_get_type_traits(op->src[0]->type).vec_dot_type;
+        case GGML_OP_SET_ROWS:
+            if (op->nb[0] != ggml_type_size(op->type)) {
+                // strided rows are converted element by element
+                return op->type == GGML_TYPE_F32 || op->type == GGML_TYPE_F16 || op->type == GGML_TYPE_BF16;
+            }
+            return op->type == GGML_TYPE_F32 || ggml_internal_get_type_traits(op->type).from_float != NULL;
         case GGML_OP_ROPE_BACK:
             return op->src[2] == NULL && (op->op_params[2] & 4) == 0;
         case GGML_OP_IM2COL_BACK:
@@ -863,9 +988,12 @@ GGML_CALL static bool ggml_backend_cpu_supports_op(ggml_backend_t backend, const
 }
 
 GGML_CALL static bool ggml_backend_cpu_supports_buft(ggml_backend_t backend, ggml_backend_buffer_type_t buft) {
-    return ggml_backend_buft_is_host(buft);
+    if (buft->iface.get_name == ggml_backend_cpu_stage_buffer_type_get_name) {
+        // the compute buffer of a pipeline stage
+        return buft->context == backend->context;
+    }
 
-    GGML_UNUSED(backend);
+    return ggml_backend_buft_is_host(buft);
 }
 
 static struct ggml_backend_i cpu_backend_i = {
@@ -904,10 +1032,14 @@ ggml_backend_t ggml_backend_cpu_init(void) {
 
     ctx->n_threads           = GGML_DEFAULT_N_THREADS;
     ctx->threadpool          = NULL;
+    ctx->priority            = 0;
+    ctx->fuse_ops            = true;
     ctx->work_data           = NULL;
     ctx->work_size           = 0;
     ctx->abort_callback      = NULL;
     ctx->abort_callback_data = NULL;
+    ctx->profiler            = NULL;
+    ctx->stage               = NULL;
 
     ggml_backend_t cpu_backend = malloc(sizeof(struct ggml_backend));
     if (cpu_backend == NULL) {
@@ -946,6 +1078,20 @@ void ggml_backend_cpu_set_threadpool(ggml_backend_t backend_cpu, ggml_threadpool
     ctx->threadpool = threadpool;
 }
 
+void ggml_backend_cpu_set_priority(ggml_backend_t backend_cpu, int32_t priority) {
+    GGML_ASSERT(ggml_backend_is_cpu(backend_cpu));
+
+    struct ggml_backend_cpu_context * ctx = (struct ggml_backend_cpu_context *)backend_cpu->context;
+    ctx->priority = priority;
+}
+
+void ggml_backend_cpu_set_fuse_ops(ggml_backend_t backend_cpu, bool fuse_ops) {
+    GGML_ASSERT(ggml_backend_is_cpu(backend_cpu));
+
+    struct ggml_backend_cpu_context * ctx = (struct ggml_backend_cpu_context *)backend_cpu->context;
+    ctx->fuse_ops = fuse_ops;
+}
+
 void ggml_backend_cpu_set_abort_callback(ggml_backend_t backend_cpu, ggml_abort_callback abort_callback, void * abort_callback_data) {
     GGML_ASSERT(ggml_backend_is_cpu(backend_cpu));
 
@@ -954,6 +1100,491 @@ void ggml_backend_cpu_set_abort_callback(ggml_backend_t backend_cpu, ggml_abort_
     ctx->abort_callback_data = abort_callback_data;
 }
 
+void ggml_backend_cpu_set_profiler(ggml_backend_t backend_cpu, struct ggml_profiler * profiler) {
+    GGML_ASSERT(ggml_backend_is_cpu(backend_cpu));
+
+    struct ggml_backend_cpu_context * ctx = (struct ggml_backend_cpu_context *)backend_cpu->context;
+    ctx->profiler = profiler;
+}
+
+// CPU pipeline stage
+
+static void ggml_backend_cpu_stage_submit(struct ggml_backend_cpu_stage * stage, struct ggml_backend_cpu_job * job) {
+    job->next = NULL;
+
+    ggml_stage_mutex_lock(&stage->mutex);
+    if (stage->tail) {
+        stage->tail->next = job;
+    } else {
+        stage->head = job;
+    }
+    stage->tail = job;
+    stage->n_submitted++;
+    ggml_stage_cond_broadcast(&stage->cond);
+    ggml_stage_mutex_unlock(&stage->mutex);
+}
+
+// blocks until the first n_jobs jobs submitted to the stage are done, returns the error of the stage that is not reported yet
+static enum ggml_status ggml_backend_cpu_stage_wait(struct ggml_backend_cpu_stage * stage, uint64_t n_jobs) {
+    ggml_stage_mutex_lock(&stage->mutex);
+    while (stage->n_done < n_jobs) {
+        ggml_stage_cond_wait(&stage->cond, &stage->mutex);
+    }
+    const enum ggml_status ec = stage->ec;
+    ggml_stage_mutex_unlock(&stage->mutex);
+
+    return ec;
+}
+
+static uint64_t ggml_backend_cpu_stage_n_submitted(struct ggml_backend_cpu_stage * stage) {
+    ggml_stage_mutex_lock(&stage->mutex);
+    const uint64_t n_submitted = stage->n_submitted;
+    ggml_stage_mutex_unlock(&stage->mutex);
+
+    return n_submitted;
+}
+
+static struct ggml_tensor * ggml_backend_cpu_graph_dup_tensor(struct ggml_hash_set * set, struct ggml_tensor ** dups, struct ggml_tensor * tensors, size_t * n_tensors, struct ggml_tensor * tensor) {
+    if (tensor == NULL) {
+        return NULL;
+    }
+
+    const size_t id = ggml_hash_find_or_insert(set, tensor);
+    if (dups[id] == NULL) {
+        dups[id] = &tensors[(*n_tensors)++];
+        *dups[id] = *tensor;
+    }
+
+    return dups[id];
+}
+
+// the graph of a stage is computed after the caller has returned, and the caller reuses the memory of the tensor meta data for
+// the next graph, so the job computes a copy of the nodes of the graph and of their sources
+static void ggml_backend_cpu_graph_dup(struct ggml_backend_cpu_job * job, struct ggml_cgraph * cgraph) {
+    const int n_nodes = cgraph->n_nodes;
+
+    struct ggml_hash_set set = ggml_hash_set_new(n_nodes*(GGML_MAX_SRC + 1));
+
+    size_t n_tensors = 0;
+    for (int i = 0; i < n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+        n_tensors += ggml_hash_insert(&set, node) != GGML_HASHSET_ALREADY_EXISTS;
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            if (node->src[j]) {
+                n_tensors += ggml_hash_insert(&set, node->src[j]) != GGML_HASHSET_ALREADY_EXISTS;
+            }
+        }
+    }
+    ggml_hash_set_reset(&set);
+
+    struct ggml_tensor ** dups = calloc(set.size, sizeof(struct ggml_tensor *));
+    job->nodes = malloc(n_nodes*sizeof(struct ggml_tensor *) + n_tensors*sizeof(struct ggml_tensor));
+    GGML_ASSERT(dups != NULL && job->nodes != NULL);
+
+    struct ggml_tensor * tensors = (struct ggml_tensor *) (job->nodes + n_nodes);
+    n_tensors = 0;
+
+    for (int i = 0; i < n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+        struct ggml_tensor * dup  = ggml_backend_cpu_graph_dup_tensor(&set, dups, tensors, &n_tensors, node);
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            dup->src[j] = ggml_backend_cpu_graph_dup_tensor(&set, dups, tensors, &n_tensors, node->src[j]);
+        }
+        job->nodes[i] = dup;
+    }
+
+    job->graph = ggml_graph_view(cgraph, 0, n_nodes);
+    job->graph.nodes = job->nodes;
+    job->graph.grads = NULL;
+    job->graph.visited_hash_set = (struct ggml_hash_set) { 0, NULL, NULL };
+    job->graph.use_counts = NULL;
+
+    // the use counts of the nodes in the whole graph, they decide which nodes can be fused
+    if (cgraph->use_counts != NULL && cgraph->visited_hash_set.size > 0) {
+        job->graph.visited_hash_set = ggml_hash_set_new(n_nodes);
+        job->graph.use_counts = malloc(job->graph.visited_hash_set.size*sizeof(int32_t));
+        GGML_ASSERT(job->graph.use_counts != NULL);
+
+        for (int i = 0; i < n_nodes; i++) {
+            struct ggml_tensor * node = cgraph->nodes[i];
+            if (ggml_hash_contains(&cgraph->visited_hash_set, node)) {
+                const size_t id = ggml_hash_insert(&job->graph.visited_hash_set, job->nodes[i]);
+                job->graph.use_counts[id] = cgraph->use_counts[ggml_hash_find(&cgraph->visited_hash_set, node)];
+            }
+        }
+    }
+
+    free(dups);
+    ggml_hash_set_free(&set);
+}
+
+static void ggml_backend_cpu_job_free(struct ggml_backend_cpu_job * job) {
+    if (job->type == GGML_BACKEND_CPU_JOB_COMPUTE) {
+        if (job->graph.use_counts != NULL) {
+            ggml_hash_set_free(&job->graph.visited_hash_set);
+            free(job->graph.use_counts);
+        }
+        free(job->nodes);
+    }
+    free(job);
+}
+
+static void ggml_backend_cpu_stage_main(ggml_backend_t backend) {
+    struct ggml_backend_cpu_context * cpu_ctx = (struct ggml_backend_cpu_context *)backend->context;
+    struct ggml_backend_cpu_stage   * stage   = cpu_ctx->stage;
+
+    while (true) {
+        ggml_stage_mutex_lock(&stage->mutex);
+        while (stage->head == NULL && !stage->stop) {
+            ggml_stage_cond_wait(&stage->cond, &stage->mutex);
+        }
+        struct ggml_backend_cpu_job * job = stage->head;
+        ggml_stage_mutex_unlock(&stage->mutex);
+
+        if (job == NULL) {
+            break;
+        }
+
+        ggml_stage_mutex_lock(&stage->mutex);
+        const bool failed = stage->ec != GGML_STATUS_SUCCESS;
+        ggml_stage_mutex_unlock(&stage->mutex);
+
+        enum ggml_status ec = GGML_STATUS_SUCCESS;
+
+        switch (job->type) {
+            case GGML_BACKEND_CPU_JOB_COMPUTE:
+                // the inputs of the graph come from the failed one
+                if (!failed) {
+                    ec = ggml_backend_cpu_compute(cpu_ctx, &job->settings, &job->graph);
+                }
+                break;
+            case GGML_BACKEND_CPU_JOB_COPY:
+                memcpy(job->dst, job->src, job->size);
+                break;
+            case GGML_BACKEND_CPU_JOB_WAIT:
+                // a failure of the other stage is also one of this stage, its graphs use the results
+                ec = ggml_backend_cpu_stage_wait(job->stage, job->n_jobs);
+                break;
+        }
+
+        ggml_stage_mutex_lock(&stage->mutex);
+        stage->head = job->next;
+        if (stage->head == NULL) {
+            stage->tail = NULL;
+        }
+        if (stage->ec == GGML_STATUS_SUCCESS) {
+            stage->ec = ec;
+        }
+        stage->n_done++;
+        ggml_stage_cond_broadcast(&stage->cond);
+        ggml_stage_mutex_unlock(&stage->mutex);
+
+        ggml_backend_cpu_job_free(job);
+    }
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI ggml_backend_cpu_stage_thread(LPVOID data) {
+    ggml_backend_cpu_stage_main((ggml_backend_t) data);
+    return 0;
+}
+#else
+static void * ggml_backend_cpu_stage_thread(void * data) {
+    ggml_backend_cpu_stage_main((ggml_backend_t) data);
+    return NULL;
+}
+#endif
+
+GGML_CALL static const char * ggml_backend_cpu_stage_name(ggml_backend_t backend) {
+    struct ggml_backend_cpu_context * cpu_ctx = (struct ggml_backend_cpu_context *)backend->context;
+
+    return cpu_ctx->stage->name;
+}
+
+GGML_CALL static void ggml_backend_cpu_stage_free(ggml_backend_t backend) {
+    struct ggml_backend_cpu_context * cpu_ctx = (struct ggml_backend_cpu_context *)backend->context;
+    struct ggml_backend_cpu_stage   * stage   = cpu_ctx->stage;
+
+    // the pending jobs are done before the thread exits
+    ggml_stage_mutex_lock(&stage->mutex);
+    stage->stop = true;
+    ggml_stage_cond_broadcast(&stage->cond);
+    ggml_stage_mutex_unlock(&stage->mutex);
+
+#if defined(_WIN32)
+    WaitForSingleObject(stage->thrd, INFINITE);
+    CloseHandle(stage->thrd);
+#else
+    pthread_join(stage->thrd, NULL);
+#endif
+
+    ggml_stage_mutex_destroy(&stage->mutex);
+    ggml_stage_cond_destroy(&stage->cond);
+    free(stage);
+
+    ggml_backend_cpu_free(backend);
+}
+
+GGML_CALL static ggml_backend_buffer_type_t ggml_backend_cpu_stage_get_default_buffer_type(ggml_backend_t backend) {
+    struct ggml_backend_cpu_context * cpu_ctx = (struct ggml_backend_cpu_context *)backend->context;
+
+    return &cpu_ctx->stage->buft;
+}
+
+static void ggml_backend_cpu_stage_copy(struct ggml_backend_cpu_stage * stage, void * dst, const void * src, size_t size) {
+    struct ggml_backend_cpu_job * job = calloc(1, sizeof(struct ggml_backend_cpu_job));
+    GGML_ASSERT(job != NULL);
+
+    job->type = GGML_BACKEND_CPU_JOB_COPY;
+    job->dst  = dst;
+    job->src  = src;
+    job->size = size;
+
+    ggml_backend_cpu_stage_submit(stage, job);
+}
+
+GGML_CALL static void ggml_backend_cpu_stage_set_tensor_async(ggml_backend_t backend, struct ggml_tensor * tensor, const void * data, size_t offset, size_t size) {
+    struct ggml_backend_cpu_context * cpu_ctx = (struct ggml_backend_cpu_context *)backend->context;
+    GGML_ASSERT(ggml_backend_buffer_is_host(tensor->view_src ? tensor->view_src->buffer : tensor->buffer));
+
+    ggml_backend_cpu_stage_copy(cpu_ctx->stage, (char *)tensor->data + offset, data, size);
+}
+
+GGML_CALL static void ggml_backend_cpu_stage_get_tensor_async(ggml_backend_t backend, const struct ggml_tensor * tensor, void * data, size_t offset, size_t size) {
+    struct ggml_backend_cpu_context * cpu_ctx = (struct ggml_backend_cpu_context *)backend->context;
+    GGML_ASSERT(ggml_backend_buffer_is_host(tensor->view_src ? tensor->view_src->buffer : tensor->buffer));
+
+    ggml_backend_cpu_stage_copy(cpu_ctx->stage, data, (const char *)tensor->data + offset, size);
+}
+
+GGML_CALL static bool ggml_backend_cpu_stage_cpy_tensor_async(ggml_backend_t backend_src, ggml_backend_t backend_dst, const struct ggml_tensor * src, struct ggml_tensor * dst) {
+    if (!ggml_backend_is_cpu(backend_src) ||
+        !ggml_backend_buffer_is_host(src->view_src ? src->view_src->buffer : src->buffer) ||
+        !ggml_backend_buffer_is_host(dst->view_src ? dst->view_src->buffer : dst->buffer)) {
+        return false;
+    }
+
+    struct ggml_backend_cpu_stage * stage_src = ((struct ggml_backend_cpu_context *)backend_src->context)->stage;
+    struct ggml_backend_cpu_stage * stage_dst = ((struct ggml_backend_cpu_context *)backend_dst->context)->stage;
+
+    if (stage_src == NULL || stage_src == stage_dst) {
+        ggml_backend_cpu_stage_copy(stage_dst, dst->data, src->data, ggml_nbytes(src));
+        return true;
+    }
+
+    // the source is computed by the jobs submitted to the other stage until now
+    struct ggml_backend_cpu_job * job = calloc(1, sizeof(struct ggml_backend_cpu_job));
+    GGML_ASSERT(job != NULL);
+
+    job->type   = GGML_BACKEND_CPU_JOB_WAIT;
+    job->stage  = stage_src;
+    job->n_jobs = ggml_backend_cpu_stage_n_submitted(stage_src);
+
+    ggml_backend_cpu_stage_submit(stage_dst, job);
+    ggml_backend_cpu_stage_copy(stage_dst, dst->data, src->data, ggml_nbytes(src));
+
+    // and the next graph of the other stage may overwrite it, so it waits for the copy
+    job = calloc(1, sizeof(struct ggml_backend_cpu_job));
+    GGML_ASSERT(job != NULL);
+
+    job->type   = GGML_BACKEND_CPU_JOB_WAIT;
+    job->stage  = stage_dst;
+    job->n_jobs = ggml_backend_cpu_stage_n_submitted(stage_dst);
+
+    ggml_backend_cpu_stage_submit(stage_src, job);
+
+    return true;
+}
+
+GGML_CALL static void ggml_backend_cpu_stage_synchronize(ggml_backend_t backend) {
+    struct ggml_backend_cpu_context * cpu_ctx = (struct ggml_backend_cpu_context *)backend->context;
+
+    ggml_backend_cpu_stage_wait(cpu_ctx->stage, ggml_backend_cpu_stage_n_submitted(cpu_ctx->stage));
+}
+
+GGML_CALL static enum ggml_status ggml_backend_cpu_stage_graph_compute(ggml_backend_t backend, struct ggml_cgraph * cgraph) {
+    struct ggml_backend_cpu_context * cpu_ctx = (struct ggml_backend_cpu_context *)backend->context;
+    struct ggml_backend_cpu_stage   * stage   = cpu_ctx->stage;
+
+    // report the errors of the graphs computed since the last call
+    ggml_stage_mutex_lock(&stage->mutex);
+    const enum ggml_status ec = stage->ec;
+    stage->ec = GGML_STATUS_SUCCESS;
+    ggml_stage_mutex_unlock(&stage->mutex);
+
+    if (ec != GGML_STATUS_SUCCESS) {
+        return ec;
+    }
+
+    struct ggml_backend_cpu_job * job = calloc(1, sizeof(struct ggml_backend_cpu_job));
+    GGML_ASSERT(job != NULL);
+
+    job->type     = GGML_BACKEND_CPU_JOB_COMPUTE;
+    job->settings = *cpu_ctx;
+    ggml_backend_cpu_graph_dup(job, cgraph);
+
+    ggml_backend_cpu_stage_submit(stage, job);
+
+    return GGML_STATUS_SUCCESS;
+}
+
+// an event is the number of jobs submitted to the stage when it was recorded
+GGML_CALL static ggml_backend_event_t ggml_backend_cpu_stage_event_new(ggml_backend_t backend) {
+    struct ggml_backend_event * event = malloc(sizeof(struct ggml_backend_event));
+    uint64_t * n_jobs = malloc(sizeof(uint64_t));
+    GGML_ASSERT(event != NULL && n_jobs != NULL);
+
+    *n_jobs = 0;
+
+    event->backend = backend;
+    event->context = n_jobs;
+
+    return event;
+}
+
+GGML_CALL static void ggml_backend_cpu_stage_event_free(ggml_backend_event_t event) {
+    free(event->context);
+    free(event);
+}
+
+GGML_CALL static void ggml_backend_cpu_stage_event_record(ggml_backend_event_t event) {
+    struct ggml_backend_cpu_context * cpu_ctx = (struct ggml_backend_cpu_context *)event->backend->context;
+
+    *(uint64_t *) event->context = ggml_backend_cpu_stage_n_submitted(cpu_ctx->stage);
+}
+
+GGML_CALL static void ggml_backend_cpu_stage_event_synchronize(ggml_backend_event_t event) {
+    struct ggml_backend_cpu_context * cpu_ctx = (struct ggml_backend_cpu_context *)event->backend->context;
+
+    ggml_backend_cpu_stage_wait(cpu_ctx->stage, *(uint64_t *) event->context);
+}
+
+GGML_CALL static void ggml_backend_cpu_stage_event_wait(ggml_backend_t backend, ggml_backend_event_t event) {
+    if (event->backend == backend) {
+        // the jobs of a stage are done in order
+        return;
+    }
+
+    if (!ggml_backend_cpu_is_stage(event->backend)) {
+        ggml_backend_event_synchronize(event);
+        return;
+    }
+
+    struct ggml_backend_cpu_job * job = calloc(1, sizeof(struct ggml_backend_cpu_job));
+    GGML_ASSERT(job != NULL);
+
+    job->type   = GGML_BACKEND_CPU_JOB_WAIT;
+    job->stage  = ((struct ggml_backend_cpu_context *)event->backend->context)->stage;
+    job->n_jobs = *(uint64_t *) event->context;
+
+    ggml_backend_cpu_stage_submit(((struct ggml_backend_cpu_context *)backend->context)->stage, job);
+}
+
+static struct ggml_backend_i cpu_stage_backend_i = {
+    /* .get_name                = */ ggml_backend_cpu_stage_name,
+    /* .free                    = */ ggml_backend_cpu_stage_free,
+    /* .get_default_buffer_type = */ ggml_backend_cpu_stage_get_default_buffer_type,
+    /* .set_tensor_async        = */ ggml_backend_cpu_stage_set_tensor_async,
+    /* .get_tensor_async        = */ ggml_backend_cpu_stage_get_tensor_async,
+    /* .cpy_tensor_async        = */ ggml_backend_cpu_stage_cpy_tensor_async,
+    /* .synchronize             = */ ggml_backend_cpu_stage_synchronize,
+    /* .graph_plan_create       = */ NULL,
+    /* .graph_plan_free         = */ NULL,
+    /* .graph_plan_update       = */ NULL,
+    /* .graph_plan_compute      = */ NULL,
+    /* .graph_compute           = */ ggml_backend_cpu_stage_graph_compute,
+    /* .supports_op             = */ ggml_backend_cpu_supports_op,
+    /* .supports_buft           = */ ggml_backend_cpu_supports_buft,
+    /* .offload_op              = */ NULL,
+    /* .event_new               = */ ggml_backend_cpu_stage_event_new,
+    /* .event_free              = */ ggml_backend_cpu_stage_event_free,
+    /* .event_record            = */ ggml_backend_cpu_stage_event_record,
+    /* .event_wait              = */ ggml_backend_cpu_stage_event_wait,
+    /* .event_synchronize       = */ ggml_backend_cpu_stage_event_synchronize,
+};
+
+ggml_backend_t ggml_backend_cpu_stage_init(int i_stage) {
+    ggml_backend_t backend = ggml_backend_cpu_init();
+    if (backend == NULL) {
+        return NULL;
+    }
+
+    struct ggml_backend_cpu_context * cpu_ctx = (struct ggml_backend_cpu_context *)backend->context;
+
+    struct ggml_backend_cpu_stage * stage = calloc(1, sizeof(struct ggml_backend_cpu_stage));
+    if (stage == NULL) {
+        ggml_backend_cpu_free(backend);
+        return NULL;
+    }
+
+    snprintf(stage->name, sizeof(stage->name), "CPU%d", i_stage);
+
+    stage->buft = (struct ggml_backend_buffer_type) {
+        /* .iface = */ {
+            /* .get_name         = */ ggml_backend_cpu_stage_buffer_type_get_name,
+            /* .alloc_buffer     = */ ggml_backend_cpu_buffer_type_alloc_buffer,
+            /* .get_alignment    = */ ggml_backend_cpu_buffer_type_get_alignment,
+            /* .get_max_size     = */ NULL, // defaults to SIZE_MAX
+            /* .get_alloc_size   = */ NULL, // defaults to ggml_nbytes
+            /* .is_host          = */ ggml_backend_cpu_buffer_type_is_host,
+        },
+        /* .context = */ cpu_ctx,
+    };
+
+    ggml_stage_mutex_init(&stage->mutex);
+    ggml_stage_cond_init(&stage->cond);
+    stage->ec = GGML_STATUS_SUCCESS;
+
+    cpu_ctx->stage = stage;
+    backend->iface = cpu_stage_backend_i;
+
+#if defined(_WIN32)
+    stage->thrd = CreateThread(NULL, 0, ggml_backend_cpu_stage_thread, backend, 0, NULL);
+    const bool ok = stage->thrd != NULL;
+#else
+    const bool ok = pthread_create(&stage->thrd, NULL, ggml_backend_cpu_stage_thread, backend) == 0;
+#endif
+    if (!ok) {
+        fprintf(stderr, "%s: failed to create the thread of the stage\n", __func__);
+        ggml_stage_mutex_destroy(&stage->mutex);
+        ggml_stage_cond_destroy(&stage->cond);
+        free(stage);
+        ggml_backend_cpu_free(backend);
+        return NULL;
+    }
+
+    return backend;
+}
+
+GGML_CALL bool ggml_backend_cpu_is_stage(ggml_backend_t backend) {
+    return ggml_backend_is_cpu(backend) && ((struct ggml_backend_cpu_context *)backend->context)->stage != NULL;
+}
+
+bool ggml_backend_cpu_stage_is_idle(ggml_backend_t backend) {
+    GGML_ASSERT(ggml_backend_cpu_is_stage(backend));
+
+    struct ggml_backend_cpu_stage * stage = ((struct ggml_backend_cpu_context *)backend->context)->stage;
+
+    ggml_stage_mutex_lock(&stage->mutex);
+    const bool idle = stage->n_done == stage->n_submitted;
+    ggml_stage_mutex_unlock(&stage->mutex);
+
+    return idle;
+}
+
+enum ggml_status ggml_backend_cpu_stage_get_status(ggml_backend_t backend) {
+    GGML_ASSERT(ggml_backend_cpu_is_stage(backend));
+
+    struct ggml_backend_cpu_stage * stage = ((struct ggml_backend_cpu_context *)backend->context)->stage;
+
+    ggml_stage_mutex_lock(&stage->mutex);
+    const enum ggml_status ec = stage->ec;
+    stage->ec = GGML_STATUS_SUCCESS;
+    ggml_stage_mutex_unlock(&stage->mutex);
+
+    return ec;
+}
+
 GGML_CALL ggml_backend_buffer_t ggml_backend_cpu_buffer_from_ptr(void * ptr, size_t size) {
     GGML_ASSERT((uintptr_t)ptr % TENSOR_ALIGNMENT == 0 && "buffer pointer must be aligned");
     return ggml_backend_buffer_init(ggml_backend_cpu_buffer_type(), cpu_backend_buffer_i_from_ptr, ptr, size);
@@ -1793,6 +2424,16 @@ static bool ggml_backend_sched_alloc_splits(ggml_backend_sched_t sched) {
         }
     }
 
+    // the user sets the inputs of the current copy next: the CPU backends read them in place instead of from a copy,
+    // so they have to be done with the last graph that used this copy
+    if (sched->n_copies > 1) {
+        for (int b = 0; b < sched->n_backends; b++) {
+            if (ggml_backend_is_cpu(sched->backends[b]) && sched->events[b][sched->cur_copy] != NULL) {
+                ggml_backend_event_synchronize(sched->events[b][sched->cur_copy]);
+            }
+        }
+    }
+
     return true;
 }
 
@@ -1879,7 +2520,8 @@ static enum ggml_status ggml_backend_sched_compute_splits(ggml_backend_sched_t s
         }
 
         // record the event of this copy
-        if (split->n_inputs > 0) {
+        // the splits of the CPU backends may also use the graph inputs in place (see ggml_backend_sched_alloc_splits)
+        if (split->n_inputs > 0 || ggml_backend_is_cpu(split_backend)) {
             if (sched->events[split_backend_id][sched->cur_copy] != NULL) {
                 ggml_backend_event_record(sched->events[split_backend_id][sched->cur_copy]);
             }
@@ -1986,12 +2628,14 @@ bool ggml_backend_sched_reserve(ggml_backend_sched_t sched, struct ggml_cgraph *
 
     ggml_backend_sched_split_graph(sched, measure_graph);
 
+    // the buffers may be reallocated while the graphs of the pipeline are computed
+    ggml_backend_sched_synchronize(sched);
+
     if (!ggml_gallocr_reserve_n(sched->galloc, &sched->graph, sched->node_backend_ids, sched->leaf_backend_ids)) {
         return false;
     }
 
     ggml_backend_sched_reset(sched);
-    ggml_backend_sched_synchronize(sched);
 
     return true;
 }
@@ -2066,6 +2710,13 @@ size_t ggml_backend_sched_get_buffer_size(ggml_backend_sched_t sched, ggml_backe
     return ggml_gallocr_get_buffer_size(sched->galloc, backend_index);
 }
 
+size_t ggml_backend_sched_get_peak_size(ggml_backend_sched_t sched, ggml_backend_t backend) {
+    int backend_index = ggml_backend_sched_backend_id(sched, backend);
+    GGML_ASSERT(backend_index >= 0 && backend_index < sched->n_backends);
+
+    return ggml_gallocr_get_peak_size(sched->galloc, backend_index);
+}
+
 void ggml_backend_sched_set_tensor_backend(ggml_backend_sched_t sched, struct ggml_tensor * node, ggml_backend_t backend) {
     int backend_index = ggml_backend_sched_backend_id(sched, backend);
     GGML_ASSERT(backend_index >= 0 && backend_index < sched->n_backends);
@@ -2232,9 +2883,8 @@ struct ggml_backend_graph_copy ggml_backend_graph_copy(ggml_backend_t backend, s
     for (int i = 0; i < graph->n_nodes; i++) {
         struct ggml_tensor * node = graph->nodes[i];
         struct ggml_tensor * node_copy = node_copies[ggml_hash_find(&hash_set, node)];
-        graph_copy->nodes[i] = node_copy;
+        ggml_graph_add_node(graph_copy, node_copy);
     }
-    graph_copy->n_nodes = graph->n_nodes;
 
     ggml_hash_set_free(&hash_set);
     free(node_copies);
@@ -175,6 +175,7 @@ struct ggml_cgraph {
     struct ggml_tensor ** leafs;
 
     struct ggml_hash_set visited_hash_set;
+    int32_t            * use_counts; // number of nodes that use each tensor as a source, indexed by hash table slot
 
     enum ggml_cgraph_eval_order order;
 };
@@ -1983,6 +1983,7 @@ typedef SRWLOCK            ggml_mutex_t;
 #define ggml_cond_init(c)    InitializeConditionVariable(c)
 #define ggml_cond_destroy(c)
 #define ggml_cond_wait(c, m) SleepConditionVariableSRW(c, m, INFINITE, CONDITION_VARIABLE_LOCKMODE_SHARED)
+#define ggml_cond_wait_exclusive(c, m) SleepConditionVariableSRW(c, m, INFINITE, 0)
 #define ggml_cond_broadcast(c) WakeAllConditionVariable(c)
 
 #define ggml_thread_create pthread_create
@@ -2013,6 +2014,7 @@ typedef pthread_mutex_t    ggml_mutex_t;
 #define ggml_cond_init(c)      pthread_cond_init(c, NULL)
 #define ggml_cond_destroy(c)   pthread_cond_destroy(c)
 #define ggml_cond_wait(c, m)   pthread_cond_wait(c, m)
+#define ggml_cond_wait_exclusive(c, m) pthread_cond_wait(c, m)
 #define ggml_cond_broadcast(c) pthread_cond_broadcast(c)
 
 #define ggml_thread_create pthread_create
@@ -2020,11 +2022,44 @@ typedef pthread_mutex_t    ggml_mutex_t;
 
 #endif
 
+// on Linux, the workers that sleep between graphs wait on a futex instead of the condition variable,
+// so the main thread does not have to take the mutex to kick off a graph
+#if defined(__linux__) && !defined(GGML_USE_OPENMP)
+#define GGML_USE_FUTEX
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+static void ggml_futex_wait(atomic_int * addr, int val) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void ggml_futex_wake(atomic_int * addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+#endif
+
+static atomic_int g_threadpool_id = 0;
+
+// caller waiting to compute a graph on a shared threadpool, see ggml_threadpool_acquire
+struct ggml_threadpool_waiter {
+    int32_t priority;
+    int32_t n_passed; // number of graphs that were started while waiting
+    bool    granted;
+
+    struct ggml_threadpool_waiter * next;
+};
+
 // Threadpool def
 struct ggml_threadpool {
     ggml_mutex_t mutex;       // mutex for cond.var
     ggml_cond_t  cond;        // cond.var for waiting for new work
 
+    ggml_mutex_t lease_mutex; // mutex for the fields below
+    ggml_cond_t  lease_cond;  // cond.var for handing the threadpool to a waiting caller
+    bool         busy;        // a caller is computing a graph
+    struct ggml_threadpool_waiter * waiters; // callers waiting for the threadpool, in arrival order
+
     struct ggml_cgraph * cgraph;
     struct ggml_cplan  * cplan;
 
@@ -2034,6 +2069,20 @@ struct ggml_threadpool {
     atomic_int GGML_CACHE_ALIGN n_barrier_passed;
     atomic_int current_chunk; // currently processing chunk during Mat_Mul, shared between all the threads.
 
+    atomic_int GGML_CACHE_ALIGN n_wake; // futex, incremented to wake up the sleeping workers (new graph, pause, stop)
+    atomic_int n_sleeping;    // number of workers sleeping on n_wake
+    atomic_int t_idle_avg_us; // moving average of the idle time between graphs (-1 until measured), drives the wait policy
+    int64_t    t_last_us;     // time at which the last graph was completed
+
+    struct ggml_threadpool_stats stats; // graph counters, the wait counters are kept by each worker
+
+    uint8_t * node_flags;     // enum ggml_node_flag per node of the current graph
+    int       n_node_flags;   // allocated size of node_flags
+
+    int64_t * node_times;     // [n_nodes][n_threads][2] start and end of each node on each thread, when profiling
+    size_t    n_node_times;   // allocated size of node_times
+    int32_t   id;             // identifies the threads of the threadpool in a profile
+
     // these are atomic as an annotation for thread-sanitizer
     atomic_bool stop;         // Used for stopping the threadpool altogether
     atomic_bool pause;        // Used for pausing the threadpool or individual threads
@@ -2045,6 +2094,7 @@ struct ggml_threadpool {
 
     int32_t      prio;        // Scheduling priority
     uint32_t     poll;        // Polling level (0 - no polling)
+    int32_t      numa_node;   // NUMA node of the threads (-1 - follow the NUMA strategy)
 
     enum ggml_status ec;
 };
@@ -2056,11 +2106,28 @@ struct ggml_compute_state {
     bool cpumask[GGML_MAX_N_THREADS];
     int  last_graph;
     bool pending;
+    struct ggml_threadpool_stats stats; // wait counters of this worker
 #endif
     struct ggml_threadpool * threadpool;
     int ith;
+    int numa_node; // NUMA node that the thread runs on, -1 if its CPUs are on several nodes (set with the NUMA split)
 };
 
+#ifndef GGML_USE_OPENMP
+// wake up the workers sleeping in ggml_graph_compute_check_for_work after a new graph, pause or stop
+// without futex they sleep on the condition variable, which the callers broadcast under the mutex
+static void ggml_threadpool_wake_sleeping(struct ggml_threadpool * threadpool) {
+#ifdef GGML_USE_FUTEX
+    atomic_fetch_add_explicit(&threadpool->n_wake, 1, memory_order_seq_cst);
+    if (atomic_load_explicit(&threadpool->n_sleeping, memory_order_seq_cst) > 0) {
+        ggml_futex_wake(&threadpool->n_wake);
+    }
+#else
+    UNUSED(threadpool);
+#endif
+}
+#endif
+
 struct ggml_compute_params {
     // ith = thread index, nth = number of threads
     int ith, nth;
@@ -2974,6 +3041,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "TRANSPOSE",
     "GET_ROWS",
     "GET_ROWS_BACK",
+    "SET_ROWS",
     "DIAG",
     "DIAG_MASK_INF",
     "DIAG_MASK_ZERO",
@@ -3024,7 +3092,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "OPT_STEP_ADAMW",
 };
 
-static_assert(GGML_OP_COUNT == 80, "GGML_OP_COUNT != 80");
+static_assert(GGML_OP_COUNT == 81, "GGML_OP_COUNT != 81");
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "none",
@@ -3068,6 +3136,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "transpose(x)",
     "get_rows(x)",
     "get_rows_back(x)",
+    "set_rows(x)",
     "diag(x)",
     "diag_mask_inf(x)",
     "diag_mask_zero(x)",
@@ -3118,7 +3187,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "adamw(x)",
 };
 
-static_assert(GGML_OP_COUNT == 80, "GGML_OP_COUNT != 80");
+static_assert(GGML_OP_COUNT == 81, "GGML_OP_COUNT != 81");
 
 static_assert(GGML_OP_POOL_COUNT == 2, "GGML_OP_POOL_COUNT != 2");
 
@@ -3356,6 +3425,114 @@ bool ggml_is_numa(void) {
     return g_state.numa.n_nodes > 1;
 }
 
+bool ggml_is_numa_split(void) {
+    return ggml_is_numa() && g_state.numa.numa_strategy == GGML_NUMA_STRATEGY_SPLIT;
+}
+
+// node boundaries of split tensors are rounded to this many rows, so that no block of rows handled by a kernel straddles two nodes
+#define GGML_NUMA_SPLIT_ROW_ALIGN 64
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1 << 1)
+#endif
+
+// first row of a split tensor with nrows rows that is placed on node
+static int64_t ggml_numa_split_row(int64_t nrows, int node) {
+    const int n_nodes = g_state.numa.n_nodes;
+    if (node >= n_nodes) {
+        return nrows;
+    }
+    const int64_t row = nrows*node/n_nodes;
+    return row - row % GGML_NUMA_SPLIT_ROW_ALIGN;
+}
+
+bool ggml_numa_split_tensor(struct ggml_tensor * tensor) {
+    const int n_nodes = g_state.numa.n_nodes;
+
+    if (!ggml_is_numa_split() || tensor->data == NULL || ggml_n_dims(tensor) != 2 || !ggml_is_contiguous(tensor) ||
+        tensor->ne[1] < n_nodes*GGML_NUMA_SPLIT_ROW_ALIGN) {
+        return false;
+    }
+
+#if defined(__gnu_linux__)
+    const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+
+    for (int node = 0; node < n_nodes; ++node) {
+        // pages shared by two nodes go to the first one
+        const uintptr_t start = GGML_PAD((uintptr_t) tensor->data + ggml_numa_split_row(tensor->ne[1], node    )*tensor->nb[1], page_size);
+        const uintptr_t end   = GGML_PAD((uintptr_t) tensor->data + ggml_numa_split_row(tensor->ne[1], node + 1)*tensor->nb[1], page_size);
+        if (start >= end) {
+            continue;
+        }
+
+        // the pages are normally not touched yet and will be allocated on the node, otherwise move them there
+        unsigned long nodemask = 1ul << node;
+        if (syscall(SYS_mbind, (void *) start, end - start, MPOL_PREFERRED, &nodemask, 8*sizeof(nodemask), MPOL_MF_MOVE) != 0) {
+            GGML_PRINT_DEBUG("%s: mbind failed for %s: %s\n", __func__, tensor->name, strerror(errno));
+            return false;
+        }
+    }
+
+    tensor->flags |= GGML_TENSOR_FLAG_NUMA;
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+// range of rows of a tensor split by ggml_numa_split_tensor that thread ith multiplies
+// the rows of each node are divided among the threads that run on it, so that each thread only reads rows from its own node
+// returns false if some node has no thread or some thread is not bound to a single node (e.g. a threadpool pinned to one node)
+static bool ggml_numa_thread_rows(const struct ggml_tensor * tensor, const struct ggml_compute_params * params, int64_t * ir0_start, int64_t * ir0_end) {
+    const int n_nodes = g_state.numa.n_nodes;
+    const int ith     = params->ith;
+    const int nth     = params->nth;
+
+    if (!(tensor->flags & GGML_TENSOR_FLAG_NUMA) || nth < n_nodes) {
+        return false;
+    }
+
+    const struct ggml_compute_state * workers = params->threadpool->workers;
+
+    int n_threads_node[GGML_NUMA_MAX_NODES] = { 0 };
+    int ith_node = 0;
+
+    for (int j = 0; j < nth; ++j) {
+        const int node_j = workers[j].numa_node;
+        if (node_j < 0 || node_j >= n_nodes) {
+            return false;
+        }
+        if (j < ith && node_j == workers[ith].numa_node) {
+            ith_node++;
+        }
+        n_threads_node[node_j]++;
+    }
+
+    for (int node_j = 0; node_j < n_nodes; ++node_j) {
+        if (n_threads_node[node_j] == 0) {
+            return false;
+        }
+    }
+
+    const int node     = workers[ith].numa_node;
+    const int nth_node = n_threads_node[node];
+
+    const int64_t node_start = ggml_numa_split_row(tensor->ne[1], node);
+    const int64_t node_end   = ggml_numa_split_row(tensor->ne[1], node + 1);
+
+    // keep the thread boundaries aligned for the kernels that process several rows at a time
+    const int64_t dr = GGML_PAD((node_end - node_start + nth_node - 1)/nth_node, 16);
+
+    *ir0_start = MIN(node_start + dr*ith_node, node_end);
+    *ir0_end   = MIN(*ir0_start + dr, node_end);
+
+    return true;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void ggml_print_object(const struct ggml_object * obj) {
@@ -6465,6 +6642,32 @@ struct ggml_tensor * ggml_get_rows_back(
     return result;
 }
 
+// ggml_set_rows
+
+struct ggml_tensor * ggml_set_rows(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * c) {
+    GGML_ASSERT(ggml_is_matrix(a) && ggml_is_matrix(b) && ggml_is_vector(c));
+    GGML_ASSERT(a->ne[0] == b->ne[0] && b->ne[1] == c->ne[0]);
+    GGML_ASSERT(b->type == GGML_TYPE_F32 && b->nb[0] == sizeof(float));
+    GGML_ASSERT(c->type == GGML_TYPE_I32);
+
+    if (a->grad || b->grad) {
+        GGML_ABORT("fatal error"); // TODO: implement backward
+    }
+
+    struct ggml_tensor * result = ggml_view_tensor(ctx, a);
+
+    result->op     = GGML_OP_SET_ROWS;
+    result->src[0] = a;
+    result->src[1] = b;
+    result->src[2] = c;
+
+    return result;
+}
+
 // ggml_diag
 
 struct ggml_tensor * ggml_diag(
@@ -9517,6 +9720,69 @@ static void ggml_compute_forward_dup_bytes(
     }
 }
 
+// dequantize src0 into a F32 or F16 dst of the same shape, dst may be transposed or permuted
+static void ggml_compute_forward_dup_q(
+        const struct ggml_compute_params * params,
+        struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+
+    GGML_ASSERT(ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(dst->type == GGML_TYPE_F32 || dst->type == GGML_TYPE_F16);
+
+    GGML_TENSOR_UNARY_OP_LOCALS
+
+    const enum ggml_type type = src0->type;
+    ggml_to_float_t const dequantize_row_q = type_traits[type].to_float;
+
+    // we don't support permuted src0
+    GGML_ASSERT(nb00 == ggml_type_size(type));
+    GGML_ASSERT(ne00 % ggml_blck_size(type) == 0);
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int nr = ggml_nrows(src0);
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    float * wdata = (float *) params->wdata + (ne00 + CACHE_LINE_SIZE_F32) * ith;
+
+    for (int ir = ir0; ir < ir1; ++ir) {
+        const int i03 = ir/(ne02*ne01);
+        const int i02 = (ir - i03*ne02*ne01)/ne01;
+        const int i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+        const void * src0_row = (const void *) ((const char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03));
+              char * dst_row  =                 (char *)        dst->data + (i01*nb1  + i02*nb2  + i03*nb3);
+
+        dequantize_row_q(src0_row, wdata, ne00);
+
+        if (dst->type == GGML_TYPE_F32) {
+            if (nb0 == sizeof(float)) {
+                memcpy(dst_row, wdata, ne00*sizeof(float));
+            } else {
+                for (int64_t i00 = 0; i00 < ne00; i00++) {
+                    *(float *) (dst_row + i00*nb0) = wdata[i00];
+                }
+            }
+        } else {
+            if (nb0 == sizeof(ggml_fp16_t)) {
+                ggml_fp32_to_fp16_row(wdata, (ggml_fp16_t *) dst_row, ne00);
+            } else {
+                for (int64_t i00 = 0; i00 < ne00; i00++) {
+                    *(ggml_fp16_t *) (dst_row + i00*nb0) = GGML_FP32_TO_FP16(wdata[i00]);
+                }
+            }
+        }
+    }
+}
+
 static void ggml_compute_forward_dup(
         const struct ggml_compute_params * params,
         struct ggml_tensor * dst) {
@@ -9528,6 +9794,11 @@ static void ggml_compute_forward_dup(
         return;
     }
 
+    if (ggml_is_quantized(src0->type)) {
+        ggml_compute_forward_dup_q(params, dst);
+        return;
+    }
+
     switch (src0->type) {
         case GGML_TYPE_F16:
             {
@@ -12798,6 +13069,9 @@ static void ggml_compute_forward_mul_mat_one_chunk(
     const void * wdata = (src1->type == vec_dot_type) ? src1->data : params->wdata;
     const size_t row_size = ggml_row_size(vec_dot_type, ne10);
 
+    // optional bias row, see ggml_compute_forward_mul_mat_add
+    const float * bias = dst->src[2] ? (const float *) dst->src[2]->data : NULL;
+
     assert(ne12 % ne02 == 0);
     assert(ne13 % ne03 == 0);
 
@@ -12847,13 +13121,37 @@ static void ggml_compute_forward_mul_mat_one_chunk(
                 }
 
                 for (int cn = 0; cn < num_rows_per_vec_dot; ++cn) {
-                    memcpy(&dst_col[iir0 + cn * nb1 / nb0], tmp + (cn * 16), (MIN(iir0 + blck_0, ir0_end) - iir0) * sizeof(float));
+                    if (bias) {
+                        ggml_vec_add_f32(MIN(iir0 + blck_0, ir0_end) - iir0, &dst_col[iir0 + cn * nb1 / nb0], tmp + (cn * 16), bias + iir0);
+                    } else {
+                        memcpy(&dst_col[iir0 + cn * nb1 / nb0], tmp + (cn * 16), (MIN(iir0 + blck_0, ir0_end) - iir0) * sizeof(float));
+                    }
                 }
             }
         }
     }
 }
 
+// add the bias row in dst->src[2] (if any) to the result of the paths that do not handle it themselves
+static void ggml_compute_forward_mul_mat_bias(
+        const struct ggml_compute_params * params,
+              struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * bias = dst->src[2];
+    if (bias == NULL) {
+        return;
+    }
+
+    ggml_barrier(params->threadpool);
+
+    const int64_t nr = ggml_nrows(dst);
+
+    for (int64_t ir = params->ith; ir < nr; ir += params->nth) {
+        float * row = (float *) ((char *) dst->data + ir*dst->nb[1]);
+        ggml_vec_add_f32(dst->ne[0], row, row, (const float *) bias->data);
+    }
+}
+
 static void ggml_compute_forward_mul_mat(
         const struct ggml_compute_params * params,
               struct ggml_tensor * dst) {
@@ -12895,6 +13193,11 @@ static void ggml_compute_forward_mul_mat(
     // nb01 >= nb00 - src0 is not transposed
     //   compute by src0 rows
 
+    // rows of src0 placed on NUMA nodes are multiplied by the threads pinned to the same node
+    int64_t numa_ir0_start = 0;
+    int64_t numa_ir0_end   = 0;
+    const bool numa_rows = ggml_numa_thread_rows(src0, params, &numa_ir0_start, &numa_ir0_end);
+
 #if GGML_USE_LLAMAFILE
     // broadcast factors
     const int64_t r2 = ne12 / ne02;
@@ -12902,7 +13205,8 @@ static void ggml_compute_forward_mul_mat(
 
     const bool src1_cont = ggml_is_contiguous(src1);
 
-    if (src1_cont) {
+    // llamafile_sgemm splits the work by itself, so it is not used for the NUMA split
+    if (src1_cont && !numa_rows) {
         for (int64_t i13 = 0; i13 < ne13; i13++)
             for (int64_t i12 = 0; i12 < ne12; i12++)
                 if (!llamafile_sgemm(ne01, ne11, ne00/ggml_blck_size(src0->type),
@@ -12917,6 +13221,7 @@ static void ggml_compute_forward_mul_mat(
                                      src1->type,
                                      dst->type))
                     goto UseGgmlGemm1;
+        ggml_compute_forward_mul_mat_bias(params, dst);
         return;
     }
 UseGgmlGemm1:;
@@ -12960,7 +13265,7 @@ UseGgmlGemm1:;
     ggml_barrier(params->threadpool);
 
 #if GGML_USE_LLAMAFILE
-    if (src1->type != vec_dot_type) {
+    if (src1->type != vec_dot_type && !numa_rows) {
         const void* wdata = (src1->type == vec_dot_type) ? src1->data : params->wdata;
         const size_t row_size = ggml_row_size(vec_dot_type, ne10);
 
@@ -12978,6 +13283,7 @@ UseGgmlGemm1:;
                                      vec_dot_type,
                                      dst->type))
                     goto UseGgmlGemm2;
+        ggml_compute_forward_mul_mat_bias(params, dst);
         return;
     }
 UseGgmlGemm2:;
@@ -13027,8 +13333,8 @@ UseGgmlGemm2:;
     if ((ggml_n_dims(src0) == 2) && gemv) {
         const void * src1_wdata      = (src1->type == vec_dot_type) ? src1->data : params->wdata;
         const size_t src1_col_stride = ggml_is_contiguous(src1) || src1->type != vec_dot_type ? ggml_row_size(vec_dot_type, ne10) : nb11;
-        int64_t src0_start = (ith * ne01) / nth;
-        int64_t src0_end   = ((ith + 1) * ne01) / nth;
+        int64_t src0_start = numa_rows ? numa_ir0_start : (ith * ne01) / nth;
+        int64_t src0_end   = numa_rows ? numa_ir0_end   : ((ith + 1) * ne01) / nth;
         src0_start = (src0_start % matmul_num_cols) ? src0_start + matmul_num_cols - (src0_start % matmul_num_cols): src0_start;
         src0_end   = (src0_end   % matmul_num_cols) ? src0_end   + matmul_num_cols - (src0_end   % matmul_num_cols): src0_end;
         if (src0_start >= src0_end) return;
@@ -13043,6 +13349,18 @@ UseGgmlGemm2:;
                  (const char *) src0->data + src0_start * nb01, (const char *) src1_wdata + (src1_col_stride * iter), 1,
                  src0_end - src0_start);
         }
+        if (dst->src[2]) {
+            const float * bias = (const float *) dst->src[2]->data;
+            for (int64_t iter = 0; iter < ne11; iter++) {
+                float * row = (float *)((char *) dst->data + (iter * nb1));
+                ggml_vec_add_f32(MIN(src0_end, ne01) - src0_start, row + src0_start, row + src0_start, bias + src0_start);
+            }
+        }
+        return;
+    }
+
+    if (numa_rows) {
+        ggml_compute_forward_mul_mat_one_chunk(params, dst, num_rows_per_vec_dot, numa_ir0_start, numa_ir0_end, 0, nr1);
         return;
     }
 
@@ -14115,6 +14433,79 @@ static void ggml_compute_forward_get_rows_back(
     //}
 }
 
+// ggml_compute_forward_set_rows
+
+static void ggml_compute_forward_set_rows(
+        const struct ggml_compute_params * params,
+        struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src1 = dst->src[1];
+    const struct ggml_tensor * src2 = dst->src[2];
+
+    const int64_t nc = src1->ne[0];
+    const int64_t nr = src1->ne[1];
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    // rows per thread
+    const int64_t dr = (nr + nth - 1)/nth;
+
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    const enum ggml_type type = dst->type;
+    const size_t         nb0  = dst->nb[0];
+
+    // the rows of a transposed view are converted element by element
+    const bool contiguous_rows = nb0 == ggml_type_size(type);
+
+    ggml_from_float_t const from_float = type_traits[type].from_float;
+
+    for (int64_t i = ir0; i < ir1; ++i) {
+        const int64_t r = *(const int32_t *) ((const char *) src2->data + i*src2->nb[0]);
+
+        GGML_ASSERT(r >= 0 && r < dst->ne[1]);
+
+        const float * x = (const float *) ((const char *) src1->data + i*src1->nb[1]);
+              char  * y = (char *) dst->data + r*dst->nb[1];
+
+        if (contiguous_rows) {
+            if (type == GGML_TYPE_F32) {
+                memcpy(y, x, nc*sizeof(float));
+            } else {
+                from_float(x, y, nc);
+            }
+            continue;
+        }
+
+        switch (type) {
+            case GGML_TYPE_F32:
+                {
+                    for (int64_t j = 0; j < nc; ++j) {
+                        *(float *) (y + j*nb0) = x[j];
+                    }
+                } break;
+            case GGML_TYPE_F16:
+                {
+                    for (int64_t j = 0; j < nc; ++j) {
+                        *(ggml_fp16_t *) (y + j*nb0) = GGML_FP32_TO_FP16(x[j]);
+                    }
+                } break;
+            case GGML_TYPE_BF16:
+                {
+                    for (int64_t j = 0; j < nc; ++j) {
+                        *(ggml_bf16_t *) (y + j*nb0) = GGML_FP32_TO_BF16(x[j]);
+                    }
+                } break;
+            default:
+                {
+                    GGML_ABORT("fatal error");
+                }
+        }
+    }
+}
+
 // ggml_compute_forward_diag
 
 static void ggml_compute_forward_diag_f32(
@@ -17784,6 +18175,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_get_rows_back(params, tensor);
             } break;
+        case GGML_OP_SET_ROWS:
+            {
+                ggml_compute_forward_set_rows(params, tensor);
+            } break;
         case GGML_OP_DIAG:
             {
                 ggml_compute_forward_diag(params, tensor);
@@ -17987,46 +18382,184 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
     }
 }
 
-////////////////////////////////////////////////////////////////////////////////
+// ggml_compute_forward_fused
+//
+// pairs of nodes selected by ggml_graph_can_fuse, the result of the first node is not written
 
-struct ggml_hash_set ggml_hash_set_new(size_t size) {
-    size = ggml_hash_size(size);
-    struct ggml_hash_set result;
-    result.size = size;
-    result.keys = GGML_MALLOC(sizeof(struct ggml_tensor *) * size);
-    result.used = GGML_CALLOC(ggml_bitset_size(size), sizeof(ggml_bitset_t));
-    return result;
-}
+static void ggml_compute_forward_rms_norm_mul_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * norm,
+              struct ggml_tensor * dst) {
 
-void ggml_hash_set_reset(struct ggml_hash_set * hash_set) {
-    memset(hash_set->used, 0, sizeof(ggml_bitset_t) * ggml_bitset_size(hash_set->size));
-}
+    const struct ggml_tensor * src0 = norm->src[0];
+    const struct ggml_tensor * src1 = dst->src[1];
 
-void ggml_hash_set_free(struct ggml_hash_set * hash_set) {
-    GGML_FREE(hash_set->used);
-    GGML_FREE(hash_set->keys);
-}
+    const int ith = params->ith;
+    const int nth = params->nth;
 
-size_t ggml_hash_size(size_t min_sz) {
-    // next primes after powers of two
-    static const size_t primes[] = {
-        2, 3, 5, 11, 17, 37, 67, 131, 257, 521, 1031,
-        2053, 4099, 8209, 16411, 32771, 65537, 131101,
-        262147, 524309, 1048583, 2097169, 4194319, 8388617,
-        16777259, 33554467, 67108879, 134217757, 268435459,
-        536870923, 1073741827, 2147483659
-    };
-    static const size_t n_primes = sizeof(primes)/sizeof(primes[0]);
+    GGML_TENSOR_BINARY_OP_LOCALS
 
-    // find the smallest prime that is larger or equal than min_sz
-    size_t l = 0;
-    size_t r = n_primes;
-    while (l < r) {
-        size_t m = (l + r)/2;
-        if (primes[m] < min_sz) {
-            l = m + 1;
-        } else {
-            r = m;
+    float eps;
+    memcpy(&eps, norm->op_params, sizeof(float));
+
+    GGML_ASSERT(eps > 0.0f);
+
+    for (int64_t i03 = 0; i03 < ne03; i03++) {
+        for (int64_t i02 = 0; i02 < ne02; i02++) {
+            for (int64_t i01 = ith; i01 < ne01; i01 += nth) {
+                const float * x = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+                const float * w = (float *) ((char *) src1->data + (i01%ne11)*nb11 + (i02%ne12)*nb12 + (i03%ne13)*nb13);
+
+                ggml_float sum = 0.0;
+                for (int64_t i00 = 0; i00 < ne00; i00++) {
+                    sum += (ggml_float)(x[i00] * x[i00]);
+                }
+
+                const float mean = sum/ne00;
+
+                float * y = (float *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3);
+
+                // same order of operations as RMS_NORM followed by MUL
+                memcpy(y, x, ne00 * sizeof(float));
+                ggml_vec_scale_f32(ne00, y, 1.0f/sqrtf(mean + eps));
+                ggml_vec_mul_f32(ne00, y, y, w);
+            }
+        }
+    }
+}
+
+static void ggml_compute_forward_silu_mul_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * silu,
+              struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = silu->src[0];
+    const struct ggml_tensor * src1 = dst->src[1];
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int nc = src0->ne[0];
+    const int nr = ggml_nrows(src0);
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    for (int ir = ir0; ir < ir1; ir++) {
+        const int64_t i3 = ir/(src0->ne[2]*src0->ne[1]);
+        const int64_t i2 = (ir - i3*src0->ne[2]*src0->ne[1])/src0->ne[1];
+        const int64_t i1 = (ir - i3*src0->ne[2]*src0->ne[1] - i2*src0->ne[1]);
+
+        float * y = (float *) ((char *) dst->data  + i1*dst->nb[1]  + i2*dst->nb[2]  + i3*dst->nb[3]);
+        float * g = (float *) ((char *) src0->data + i1*src0->nb[1] + i2*src0->nb[2] + i3*src0->nb[3]);
+        float * u = (float *) ((char *) src1->data + i1*src1->nb[1] + i2*src1->nb[2] + i3*src1->nb[3]);
+
+        ggml_vec_silu_f32(nc, y, g);
+        ggml_vec_mul_f32(nc, y, y, u);
+    }
+}
+
+static void ggml_compute_forward_mul_mat_add(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * mul_mat,
+              struct ggml_tensor * dst) {
+
+    // compute the product straight into the destination of the ADD, the bias is added by the mul_mat kernels
+    struct ggml_tensor tmp = *mul_mat;
+    tmp.data   = dst->data;
+    tmp.src[2] = dst->src[1];
+
+    ggml_compute_forward_mul_mat(params, &tmp);
+}
+
+static void ggml_compute_forward_scale_soft_max(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * scale,
+              struct ggml_tensor * dst) {
+
+    float s0;
+    float s1;
+    memcpy(&s0, (const float *) scale->op_params, sizeof(float));
+    memcpy(&s1, (const float *) dst->op_params,   sizeof(float));
+
+    const float s = s0*s1;
+
+    struct ggml_tensor tmp = *dst;
+    tmp.src[0] = scale->src[0];
+    memcpy((float *) tmp.op_params, &s, sizeof(float));
+
+    ggml_compute_forward_soft_max(params, &tmp);
+}
+
+static void ggml_compute_forward_fused(struct ggml_compute_params * params, const struct ggml_tensor * node, struct ggml_tensor * next) {
+    switch (node->op) {
+        case GGML_OP_RMS_NORM:
+            {
+                ggml_compute_forward_rms_norm_mul_f32(params, node, next);
+            } break;
+        case GGML_OP_UNARY:
+            {
+                ggml_compute_forward_silu_mul_f32(params, node, next);
+            } break;
+        case GGML_OP_MUL_MAT:
+            {
+                ggml_compute_forward_mul_mat_add(params, node, next);
+            } break;
+        case GGML_OP_SCALE:
+            {
+                ggml_compute_forward_scale_soft_max(params, node, next);
+            } break;
+        default:
+            {
+                GGML_ABORT("fatal error");
+            }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct ggml_hash_set ggml_hash_set_new(size_t size) {
+    size = ggml_hash_size(size);
+    struct ggml_hash_set result;
+    result.size = size;
+    result.keys = GGML_MALLOC(sizeof(struct ggml_tensor *) * size);
+    result.used = GGML_CALLOC(ggml_bitset_size(size), sizeof(ggml_bitset_t));
+    return result;
+}
+
+void ggml_hash_set_reset(struct ggml_hash_set * hash_set) {
+    memset(hash_set->used, 0, sizeof(ggml_bitset_t) * ggml_bitset_size(hash_set->size));
+}
+
+void ggml_hash_set_free(struct ggml_hash_set * hash_set) {
+    GGML_FREE(hash_set->used);
+    GGML_FREE(hash_set->keys);
+}
+
+size_t ggml_hash_size(size_t min_sz) {
+    // next primes after powers of two
+    static const size_t primes[] = {
+        2, 3, 5, 11, 17, 37, 67, 131, 257, 521, 1031,
+        2053, 4099, 8209, 16411, 32771, 65537, 131101,
+        262147, 524309, 1048583, 2097169, 4194319, 8388617,
+        16777259, 33554467, 67108879, 134217757, 268435459,
+        536870923, 1073741827, 2147483659
+    };
+    static const size_t n_primes = sizeof(primes)/sizeof(primes[0]);
+
+    // find the smallest prime that is larger or equal than min_sz
+    size_t l = 0;
+    size_t r = n_primes;
+    while (l < r) {
+        size_t m = (l + r)/2;
+        if (primes[m] < min_sz) {
+            l = m + 1;
+        } else {
+            r = m;
         }
     }
     size_t sz = l < n_primes ? primes[l] : min_sz | 1;
@@ -18745,6 +19278,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ABORT("fatal error"); // TODO: not implemented
             }
+        case GGML_OP_SET_ROWS:
+            {
+                GGML_ABORT("fatal error"); // TODO: not implemented
+            }
         case GGML_OP_DIAG:
             {
                 GGML_ABORT("fatal error"); // TODO: not implemented
@@ -19154,10 +19691,13 @@ static void ggml_visit_parents(struct ggml_cgraph * cgraph, struct ggml_tensor *
     }
 
     // check if already visited
-    if (ggml_hash_insert(&cgraph->visited_hash_set, node) == GGML_HASHSET_ALREADY_EXISTS) {
+    const size_t node_hash_pos = ggml_hash_insert(&cgraph->visited_hash_set, node);
+    if (node_hash_pos == GGML_HASHSET_ALREADY_EXISTS) {
         return;
     }
 
+    cgraph->use_counts[node_hash_pos] = 0;
+
     for (int i = 0; i < GGML_MAX_SRC; ++i) {
         const int k =
             (cgraph->order == GGML_CGRAPH_EVAL_ORDER_LEFT_TO_RIGHT) ? i :
@@ -19165,6 +19705,8 @@ static void ggml_visit_parents(struct ggml_cgraph * cgraph, struct ggml_tensor *
             /* unknown order, just fall back to using i*/ i;
         if (node->src[k]) {
             ggml_visit_parents(cgraph, node->src[k]);
+
+            cgraph->use_counts[ggml_hash_find(&cgraph->visited_hash_set, node->src[k])] += 1;
         }
     }
 
@@ -19312,6 +19854,7 @@ static size_t ggml_graph_nbytes(size_t size, bool grads) {
     incr_ptr_aligned(&p, size * sizeof(struct ggml_tensor *), sizeof(struct ggml_tensor *)); // nodes
     incr_ptr_aligned(&p, size * sizeof(struct ggml_tensor *), sizeof(struct ggml_tensor *)); // leafs
     incr_ptr_aligned(&p, hash_size * sizeof(struct ggml_tensor *), sizeof(struct ggml_tensor *)); // hash keys
+    incr_ptr_aligned(&p, hash_size * sizeof(int32_t), sizeof(int32_t)); // use counts
     if (grads) {
         incr_ptr_aligned(&p, size * sizeof(struct ggml_tensor *), sizeof(struct ggml_tensor *)); // grads
     }
@@ -19342,6 +19885,7 @@ struct ggml_cgraph * ggml_new_graph_custom(struct ggml_context * ctx, size_t siz
     struct ggml_tensor ** nodes_ptr = incr_ptr_aligned(&p, size * sizeof(struct ggml_tensor *), sizeof(struct ggml_tensor *));
     struct ggml_tensor ** leafs_ptr = incr_ptr_aligned(&p, size * sizeof(struct ggml_tensor *), sizeof(struct ggml_tensor *));
     struct ggml_tensor ** hash_keys_ptr = incr_ptr_aligned(&p, hash_size * sizeof(struct ggml_tensor *), sizeof(struct ggml_tensor *));
+    int32_t             * use_counts_ptr = incr_ptr_aligned(&p, hash_size * sizeof(int32_t), sizeof(int32_t));
     struct ggml_tensor ** grads_ptr = grads ? incr_ptr_aligned(&p, size * sizeof(struct ggml_tensor *), sizeof(struct ggml_tensor *)) : NULL;
     ggml_bitset_t * hash_used = incr_ptr_aligned(&p, ggml_bitset_size(hash_size) * sizeof(ggml_bitset_t), sizeof(ggml_bitset_t));
 
@@ -19356,6 +19900,7 @@ struct ggml_cgraph * ggml_new_graph_custom(struct ggml_context * ctx, size_t siz
         /*.grads        =*/ grads_ptr,
         /*.leafs        =*/ leafs_ptr,
         /*.hash_table   =*/ { hash_size, hash_used, hash_keys_ptr },
+        /*.use_counts   =*/ use_counts_ptr,
         /*.order        =*/ GGML_CGRAPH_EVAL_ORDER_LEFT_TO_RIGHT,
     };
 
@@ -19376,7 +19921,8 @@ struct ggml_cgraph ggml_graph_view(struct ggml_cgraph * cgraph0, int i0, int i1)
         /*.nodes        =*/ cgraph0->nodes + i0,
         /*.grads        =*/ cgraph0->grads ? cgraph0->grads + i0 : NULL,
         /*.leafs        =*/ NULL,
-        /*.hash_table   =*/ { 0, NULL, NULL },
+        /*.hash_table   =*/ cgraph0->visited_hash_set, // shared with the parent so that the use counts stay valid
+        /*.use_counts   =*/ cgraph0->use_counts,
         /*.order        =*/ cgraph0->order,
     };
 
@@ -19410,7 +19956,8 @@ void ggml_graph_cpy(struct ggml_cgraph * src, struct ggml_cgraph * dst) {
     for (size_t i = 0; i < src->visited_hash_set.size; ++i) {
         // copy all hashset keys (tensors) that are in use
         if (ggml_bitset_get(src->visited_hash_set.used, i)) {
-            ggml_hash_insert(&dst->visited_hash_set, src->visited_hash_set.keys[i]);
+            const size_t id = ggml_hash_find_or_insert(&dst->visited_hash_set, src->visited_hash_set.keys[i]);
+            dst->use_counts[id] = src->use_counts[i];
         }
     }
 }
@@ -19483,11 +20030,22 @@ void ggml_graph_add_node(struct ggml_cgraph * cgraph, struct ggml_tensor * tenso
     GGML_ASSERT(cgraph->size > cgraph->n_nodes);
     cgraph->nodes[cgraph->n_nodes] = tensor;
     cgraph->n_nodes++;
+
+    // keep the use counts up to date
+    const size_t id = ggml_hash_insert(&cgraph->visited_hash_set, tensor);
+    if (id != GGML_HASHSET_ALREADY_EXISTS) {
+        cgraph->use_counts[id] = 0;
+    }
+    for (int i = 0; i < GGML_MAX_SRC; i++) {
+        if (tensor->src[i] && ggml_hash_contains(&cgraph->visited_hash_set, tensor->src[i])) {
+            cgraph->use_counts[ggml_hash_find(&cgraph->visited_hash_set, tensor->src[i])] += 1;
+        }
+    }
 }
 
 // Android's libc implementation "bionic" does not support setting affinity
 #if defined(__gnu_linux__)
-static void set_numa_thread_affinity(int thread_n) {
+static void set_numa_thread_affinity(int thread_n, int numa_node) {
     if (!ggml_is_numa()) {
         return;
     }
@@ -19496,24 +20054,30 @@ static void set_numa_thread_affinity(int thread_n) {
     int rv;
     size_t setsize = CPU_ALLOC_SIZE(g_state.numa.total_cpus);
 
-    switch(g_state.numa.numa_strategy) {
-        case GGML_NUMA_STRATEGY_DISTRIBUTE:
-            // run thread on node_num thread_n / (threads per node)
-            node_num = thread_n % g_state.numa.n_nodes;
-            break;
-        case GGML_NUMA_STRATEGY_ISOLATE:
-            // run thread on current_node
-            node_num = g_state.numa.current_node;
-            break;
-        case GGML_NUMA_STRATEGY_NUMACTL:
-            // use the cpuset that numactl gave us
-            rv = pthread_setaffinity_np(pthread_self(), setsize, &g_state.numa.cpuset);
-            if (rv) {
-                fprintf(stderr, "warning: pthread_setaffinity_np() failed: %s\n",strerror(rv));
-            }
-            return;
-        default:
-            return;
+    if (numa_node >= 0) {
+        // the threadpool is pinned to a node of its own, e.g. a pipeline stage
+        node_num = numa_node % g_state.numa.n_nodes;
+    } else {
+        switch(g_state.numa.numa_strategy) {
+            case GGML_NUMA_STRATEGY_DISTRIBUTE:
+            case GGML_NUMA_STRATEGY_SPLIT:
+                // run thread on node_num thread_n / (threads per node)
+                node_num = thread_n % g_state.numa.n_nodes;
+                break;
+            case GGML_NUMA_STRATEGY_ISOLATE:
+                // run thread on current_node
+                node_num = g_state.numa.current_node;
+                break;
+            case GGML_NUMA_STRATEGY_NUMACTL:
+                // use the cpuset that numactl gave us
+                rv = pthread_setaffinity_np(pthread_self(), setsize, &g_state.numa.cpuset);
+                if (rv) {
+                    fprintf(stderr, "warning: pthread_setaffinity_np() failed: %s\n",strerror(rv));
+                }
+                return;
+            default:
+                return;
+        }
     }
 
     struct ggml_numa_node * node = &g_state.numa.nodes[node_num];
@@ -19532,6 +20096,37 @@ static void set_numa_thread_affinity(int thread_n) {
     CPU_FREE(cpus);
 }
 
+// the NUMA node of the CPUs that the calling thread may run on, -1 if they are on several nodes
+static int get_numa_thread_node(void) {
+    size_t setsize = CPU_ALLOC_SIZE(g_state.numa.total_cpus);
+
+    cpu_set_t * cpus = CPU_ALLOC(g_state.numa.total_cpus);
+    CPU_ZERO_S(setsize, cpus);
+
+    int node_num = -1;
+
+    if (sched_getaffinity(0, setsize, cpus) == 0) {
+        const int n_cpus = CPU_COUNT_S(setsize, cpus);
+
+        for (uint32_t n = 0; n < g_state.numa.n_nodes && node_num < 0; ++n) {
+            const struct ggml_numa_node * node = &g_state.numa.nodes[n];
+
+            int n_cpus_node = 0;
+            for (uint32_t i = 0; i < node->n_cpus; ++i) {
+                n_cpus_node += CPU_ISSET_S(node->cpus[i], setsize, cpus) ? 1 : 0;
+            }
+
+            if (n_cpus_node > 0 && n_cpus_node == n_cpus) {
+                node_num = n;
+            }
+        }
+    }
+
+    CPU_FREE(cpus);
+
+    return node_num;
+}
+
 static void clear_numa_thread_affinity(void) {
     if (!ggml_is_numa()) {
         return;
@@ -19555,7 +20150,8 @@ static void clear_numa_thread_affinity(void) {
 #else
 // TODO: Windows etc.
 // (the linux implementation may also work on BSD, someone should test)
-static void set_numa_thread_affinity(int thread_n) { UNUSED(thread_n);  }
+static void set_numa_thread_affinity(int thread_n, int numa_node) { UNUSED(thread_n); UNUSED(numa_node); }
+static int get_numa_thread_node(void) { return -1; }
 static void clear_numa_thread_affinity(void) {}
 #endif
 
@@ -19575,6 +20171,7 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
         case GGML_OP_ADD:
         case GGML_OP_ADD1:
         case GGML_OP_ACC:
+        case GGML_OP_SET_ROWS:
             {
                 n_tasks = n_threads;
             } break;
@@ -19965,6 +20562,71 @@ static void ggml_thread_cpumask_next(const bool * global_mask, bool * local_mask
     }
 }
 
+// A threadpool can be shared by several callers, e.g. llama_context instances used from different threads.
+// Their graphs are computed one at a time: while the threadpool is busy, callers queue up, and the
+// threadpool is handed to the waiter with the highest priority, in arrival order for equal priorities.
+// Waiters that are passed over slowly gain priority, so low priority work is delayed but not starved.
+#define GGML_THREADPOOL_AGING 32 // a waiter gains one priority level every this many graphs started before it
+
+static int64_t ggml_threadpool_waiter_priority(const struct ggml_threadpool_waiter * waiter) {
+    return (int64_t) waiter->priority + waiter->n_passed / GGML_THREADPOOL_AGING;
+}
+
+static void ggml_threadpool_acquire(struct ggml_threadpool * threadpool, int32_t priority) {
+    ggml_mutex_lock(&threadpool->lease_mutex);
+
+    if (!threadpool->busy) {
+        threadpool->busy = true;
+        ggml_mutex_unlock(&threadpool->lease_mutex);
+        return;
+    }
+
+    struct ggml_threadpool_waiter self = {
+        /*.priority =*/ priority,
+        /*.n_passed =*/ 0,
+        /*.granted  =*/ false,
+        /*.next     =*/ NULL,
+    };
+
+    struct ggml_threadpool_waiter ** tail = &threadpool->waiters;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = &self;
+
+    while (!self.granted) {
+        ggml_cond_wait_exclusive(&threadpool->lease_cond, &threadpool->lease_mutex);
+    }
+
+    ggml_mutex_unlock(&threadpool->lease_mutex);
+}
+
+static void ggml_threadpool_release(struct ggml_threadpool * threadpool) {
+    ggml_mutex_lock(&threadpool->lease_mutex);
+
+    struct ggml_threadpool_waiter ** best = NULL;
+    for (struct ggml_threadpool_waiter ** w = &threadpool->waiters; *w; w = &(*w)->next) {
+        if (best == NULL || ggml_threadpool_waiter_priority(*w) > ggml_threadpool_waiter_priority(*best)) {
+            best = w;
+        }
+    }
+
+    if (best) {
+        // hand the threadpool over directly, it stays busy
+        struct ggml_threadpool_waiter * next = *best;
+        *best = next->next;
+        for (struct ggml_threadpool_waiter * w = threadpool->waiters; w; w = w->next) {
+            w->n_passed++;
+        }
+        next->granted = true;
+        ggml_cond_broadcast(&threadpool->lease_cond);
+    } else {
+        threadpool->busy = false;
+    }
+
+    ggml_mutex_unlock(&threadpool->lease_mutex);
+}
+
 void ggml_threadpool_free(struct ggml_threadpool* threadpool) {
     if (!threadpool) return;
 
@@ -19978,6 +20640,7 @@ void ggml_threadpool_free(struct ggml_threadpool* threadpool) {
     threadpool->pause = false;
 
     ggml_cond_broadcast(&threadpool->cond);
+    ggml_threadpool_wake_sleeping(threadpool);
     ggml_mutex_unlock(&threadpool->mutex);
 
     for (int j = 1; j < n_threads; j++) {
@@ -19990,6 +20653,11 @@ void ggml_threadpool_free(struct ggml_threadpool* threadpool) {
     ggml_cond_destroy(&threadpool->cond);
 #endif // GGML_USE_OPENMP
 
+    ggml_mutex_destroy(&threadpool->lease_mutex);
+    ggml_cond_destroy(&threadpool->lease_cond);
+
+    free(threadpool->node_flags);
+    free(threadpool->node_times);
     GGML_ALIGNED_FREE(threadpool->workers);
     GGML_ALIGNED_FREE(threadpool);
 }
@@ -20000,22 +20668,27 @@ static void ggml_threadpool_pause_locked(struct ggml_threadpool * threadpool) {
     GGML_PRINT_DEBUG("Pausing threadpool\n");
     threadpool->pause = true;
     ggml_cond_broadcast(&threadpool->cond);
+    ggml_threadpool_wake_sleeping(threadpool);
 }
 
 static void ggml_threadpool_resume_locked(struct ggml_threadpool * threadpool) {
     GGML_PRINT_DEBUG("Resuming threadpool\n");
     threadpool->pause = false;
     ggml_cond_broadcast(&threadpool->cond);
+    ggml_threadpool_wake_sleeping(threadpool);
 }
 #endif
 
 void ggml_threadpool_pause(struct ggml_threadpool * threadpool) {
 #ifndef GGML_USE_OPENMP
+    // a shared threadpool may be computing a graph of another caller, only pause it in between graphs
+    ggml_threadpool_acquire(threadpool, INT32_MAX);
     ggml_mutex_lock(&threadpool->mutex);
     if (!threadpool->pause) {
        ggml_threadpool_pause_locked(threadpool);
     }
     ggml_mutex_unlock(&threadpool->mutex);
+    ggml_threadpool_release(threadpool);
 #else
     UNUSED(threadpool);
 #endif
@@ -20033,166 +20706,200 @@ void ggml_threadpool_resume(struct ggml_threadpool * threadpool) {
 #endif
 }
 
-struct ggml_cplan ggml_graph_plan(
-          const struct ggml_cgraph * cgraph,
-                               int   n_threads,
-            struct ggml_threadpool * threadpool) {
-
-    if (threadpool == NULL) {
-        GGML_PRINT_DEBUG("Threadpool is not specified. Will create a disposable threadpool : n_threads %d\n", n_threads);
+void ggml_threadpool_get_stats(struct ggml_threadpool * threadpool, struct ggml_threadpool_stats * stats) {
+    *stats = threadpool->stats;
+#ifndef GGML_USE_OPENMP
+    for (int j = 1; j < threadpool->n_threads_max; j++) {
+        const struct ggml_threadpool_stats * ws = &threadpool->workers[j].stats;
+        stats->t_spin_us       += ws->t_spin_us;
+        stats->t_yield_us      += ws->t_yield_us;
+        stats->t_sleep_us      += ws->t_sleep_us;
+        stats->n_spin_wakeups  += ws->n_spin_wakeups;
+        stats->n_yield_wakeups += ws->n_yield_wakeups;
+        stats->n_sleep_wakeups += ws->n_sleep_wakeups;
     }
-    if (n_threads <= 0) {
-        n_threads = threadpool ? threadpool->n_threads_max : GGML_DEFAULT_N_THREADS;
+#endif
+}
+
+void ggml_threadpool_reset_stats(struct ggml_threadpool * threadpool) {
+    memset(&threadpool->stats, 0, sizeof(threadpool->stats));
+#ifndef GGML_USE_OPENMP
+    for (int j = 0; j < threadpool->n_threads_max; j++) {
+        memset(&threadpool->workers[j].stats, 0, sizeof(threadpool->workers[j].stats));
     }
+#endif
+}
 
-    size_t work_size = 0;
+// size of the work buffer needed by a node computed with n_tasks threads
+static size_t ggml_graph_node_work_size(const struct ggml_tensor * node, int n_tasks) {
+    size_t cur = 0;
 
-    struct ggml_cplan cplan;
-    memset(&cplan, 0, sizeof(struct ggml_cplan));
+    switch (node->op) {
+        case GGML_OP_CPY:
+        case GGML_OP_DUP:
+            {
+                if (ggml_is_quantized(node->src[0]->type) && node->src[0]->type != node->type) {
+                    // quantized -> F32/F16 copies dequantize a row of src0 at a time
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                } else if (ggml_is_quantized(node->type) ||
+                    // F16 -> BF16 and BF16 -> F16 copies go through intermediate F32
+                    (node->src[0]->type == GGML_TYPE_F16  && node->src[1] && node->src[1]->type == GGML_TYPE_BF16) ||
+                    (node->src[0]->type == GGML_TYPE_BF16 && node->src[1] && node->src[1]->type == GGML_TYPE_F16)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_ADD:
+        case GGML_OP_ADD1:
+            {
+                if (ggml_is_quantized(node->src[0]->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_ACC:
+            {
+                if (ggml_is_quantized(node->src[0]->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[1]->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_MUL_MAT:
+            {
+                const enum ggml_type vec_dot_type = type_traits[node->src[0]->type].vec_dot_type;
 
-    int max_tasks = 1;
+                if (node->src[1]->type != vec_dot_type) {
+                    cur = ggml_row_size(vec_dot_type, ggml_nelements(node->src[1]));
+                }
+            } break;
+        case GGML_OP_MUL_MAT_ID:
+            {
+                cur = 0;
+                const struct ggml_tensor * src0 = node->src[0];
+                const struct ggml_tensor * src1 = node->src[1];
+                const enum ggml_type vec_dot_type = type_traits[src0->type].vec_dot_type;
+                if (src1->type != vec_dot_type) {
+                    cur += ggml_row_size(vec_dot_type, ggml_nelements(src1));
+                }
+                const int n_as = src0->ne[2];
+                cur += GGML_PAD(cur, sizeof(int64_t));       // align
+                cur += n_as * sizeof(int64_t);               // matrix_row_counts
+                cur += n_as * src1->ne[2] * sizeof(int64_t); // matrix_rows
+            } break;
+        case GGML_OP_OUT_PROD:
+            {
+                if (ggml_is_quantized(node->src[0]->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                }
+            } break;
+        case GGML_OP_SOFT_MAX:
+        case GGML_OP_ROPE:
+            {
+                cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
+            } break;
+        case GGML_OP_CONV_TRANSPOSE_1D:
+            {
+                GGML_ASSERT(node->src[0]->ne[3] == 1);
+                GGML_ASSERT(node->src[1]->ne[2] == 1);
+                GGML_ASSERT(node->src[1]->ne[3] == 1);
+
+                const int64_t ne00 = node->src[0]->ne[0];  // K
+                const int64_t ne01 = node->src[0]->ne[1];  // Cout
+                const int64_t ne02 = node->src[0]->ne[2];  // Cin
+
+                const int64_t ne10 = node->src[1]->ne[0];  // L
+                const int64_t ne11 = node->src[1]->ne[1];  // Cin
+
+                if ((node->src[0]->type == GGML_TYPE_F16 ||
+                     node->src[0]->type == GGML_TYPE_BF16) &&
+                    node->src[1]->type == GGML_TYPE_F32) {
+                    cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02;
+                    cur += sizeof(ggml_fp16_t)*ne10*ne11;
+                } else if (node->src[0]->type == GGML_TYPE_F32 &&
+                           node->src[1]->type == GGML_TYPE_F32) {
+                    cur += sizeof(float)*ne00*ne01*ne02;
+                    cur += sizeof(float)*ne10*ne11;
+                } else {
+                    GGML_ABORT("fatal error");
+                }
+            } break;
+        case GGML_OP_CONV_TRANSPOSE_2D:
+            {
+                const int64_t ne00 = node->src[0]->ne[0]; // W
+                const int64_t ne01 = node->src[0]->ne[1]; // H
+                const int64_t ne02 = node->src[0]->ne[2]; // Channels Out
+                const int64_t ne03 = node->src[0]->ne[3]; // Channels In
 
-    // thread scheduling for the different operations + work buffer size estimation
-    for (int i = 0; i < cgraph->n_nodes; i++) {
-        struct ggml_tensor * node = cgraph->nodes[i];
+                const int64_t ne10 = node->src[1]->ne[0]; // W
+                const int64_t ne11 = node->src[1]->ne[1]; // H
+                const int64_t ne12 = node->src[1]->ne[2]; // Channels In
 
-        const int n_tasks = ggml_get_n_tasks(node, n_threads);
+                cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02*ne03;
+                cur += sizeof(ggml_fp16_t)*ne10*ne11*ne12;
+            } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                const int64_t ne00 = node->src[0]->ne[0]; // D
 
-        max_tasks = MAX(max_tasks, n_tasks);
+                cur = 3*sizeof(float)*ne00*n_tasks; // 3x head size/thread
+            } break;
+        case GGML_OP_FLASH_ATTN_BACK:
+            {
+                const int64_t    D = node->src[0]->ne[0];
+                const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
+                const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
+                if (node->src[1]->type == GGML_TYPE_F32) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                } else if (node->src[1]->type == GGML_TYPE_F16) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                } else if (node->src[1]->type == GGML_TYPE_BF16) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                }
+            } break;
 
-        size_t cur = 0;
+        case GGML_OP_CROSS_ENTROPY_LOSS:
+            {
+                cur = ggml_type_size(node->type)*(n_tasks + node->src[0]->ne[0]*n_tasks);
+            } break;
+        case GGML_OP_COUNT:
+            {
+                GGML_ABORT("fatal error");
+            }
+        default:
+            break;
+    }
 
-        switch (node->op) {
-            case GGML_OP_CPY:
-            case GGML_OP_DUP:
-                {
-                    if (ggml_is_quantized(node->type) ||
-                        // F16 -> BF16 and BF16 -> F16 copies go through intermediate F32
-                        (node->src[0]->type == GGML_TYPE_F16  && node->src[1] && node->src[1]->type == GGML_TYPE_BF16) ||
-                        (node->src[0]->type == GGML_TYPE_BF16 && node->src[1] && node->src[1]->type == GGML_TYPE_F16)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_ADD:
-            case GGML_OP_ADD1:
-                {
-                    if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_ACC:
-                {
-                    if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[1]->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_MUL_MAT:
-                {
-                    const enum ggml_type vec_dot_type = type_traits[node->src[0]->type].vec_dot_type;
+    return cur;
+}
 
-                    if (node->src[1]->type != vec_dot_type) {
-                        cur = ggml_row_size(vec_dot_type, ggml_nelements(node->src[1]));
-                    }
-                } break;
-            case GGML_OP_MUL_MAT_ID:
-                {
-                    cur = 0;
-                    const struct ggml_tensor * src0 = node->src[0];
-                    const struct ggml_tensor * src1 = node->src[1];
-                    const enum ggml_type vec_dot_type = type_traits[src0->type].vec_dot_type;
-                    if (src1->type != vec_dot_type) {
-                        cur += ggml_row_size(vec_dot_type, ggml_nelements(src1));
-                    }
-                    const int n_as = src0->ne[2];
-                    cur += GGML_PAD(cur, sizeof(int64_t));       // align
-                    cur += n_as * sizeof(int64_t);               // matrix_row_counts
-                    cur += n_as * src1->ne[2] * sizeof(int64_t); // matrix_rows
-                } break;
-            case GGML_OP_OUT_PROD:
-                {
-                    if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
-                    }
-                } break;
-            case GGML_OP_SOFT_MAX:
-            case GGML_OP_ROPE:
-                {
-                    cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
-                } break;
-            case GGML_OP_CONV_TRANSPOSE_1D:
-                {
-                    GGML_ASSERT(node->src[0]->ne[3] == 1);
-                    GGML_ASSERT(node->src[1]->ne[2] == 1);
-                    GGML_ASSERT(node->src[1]->ne[3] == 1);
-
-                    const int64_t ne00 = node->src[0]->ne[0];  // K
-                    const int64_t ne01 = node->src[0]->ne[1];  // Cout
-                    const int64_t ne02 = node->src[0]->ne[2];  // Cin
-
-                    const int64_t ne10 = node->src[1]->ne[0];  // L
-                    const int64_t ne11 = node->src[1]->ne[1];  // Cin
-
-                    if ((node->src[0]->type == GGML_TYPE_F16 ||
-                         node->src[0]->type == GGML_TYPE_BF16) &&
-                        node->src[1]->type == GGML_TYPE_F32) {
-                        cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02;
-                        cur += sizeof(ggml_fp16_t)*ne10*ne11;
-                    } else if (node->src[0]->type == GGML_TYPE_F32 &&
-                               node->src[1]->type == GGML_TYPE_F32) {
-                        cur += sizeof(float)*ne00*ne01*ne02;
-                        cur += sizeof(float)*ne10*ne11;
-                    } else {
-                        GGML_ABORT("fatal error");
-                    }
-                } break;
-            case GGML_OP_CONV_TRANSPOSE_2D:
-                {
-                    const int64_t ne00 = node->src[0]->ne[0]; // W
-                    const int64_t ne01 = node->src[0]->ne[1]; // H
-                    const int64_t ne02 = node->src[0]->ne[2]; // Channels Out
-                    const int64_t ne03 = node->src[0]->ne[3]; // Channels In
+struct ggml_cplan ggml_graph_plan(
+          const struct ggml_cgraph * cgraph,
+                               int   n_threads,
+            struct ggml_threadpool * threadpool) {
+
+    if (threadpool == NULL) {
+        GGML_PRINT_DEBUG("Threadpool is not specified. Will create a disposable threadpool : n_threads %d\n", n_threads);
+    }
+    if (n_threads <= 0) {
+        n_threads = threadpool ? threadpool->n_threads_max : GGML_DEFAULT_N_THREADS;
+    }
 
-                    const int64_t ne10 = node->src[1]->ne[0]; // W
-                    const int64_t ne11 = node->src[1]->ne[1]; // H
-                    const int64_t ne12 = node->src[1]->ne[2]; // Channels In
+    size_t work_size = 0;
 
-                    cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02*ne03;
-                    cur += sizeof(ggml_fp16_t)*ne10*ne11*ne12;
-                } break;
-            case GGML_OP_FLASH_ATTN_EXT:
-                {
-                    const int64_t ne00 = node->src[0]->ne[0]; // D
+    struct ggml_cplan cplan;
+    memset(&cplan, 0, sizeof(struct ggml_cplan));
 
-                    cur = 3*sizeof(float)*ne00*n_tasks; // 3x head size/thread
-                } break;
-            case GGML_OP_FLASH_ATTN_BACK:
-                {
-                    const int64_t    D = node->src[0]->ne[0];
-                    const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
-                    const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
-                    if (node->src[1]->type == GGML_TYPE_F32) {
-                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                    } else if (node->src[1]->type == GGML_TYPE_F16) {
-                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                    } else if (node->src[1]->type == GGML_TYPE_BF16) {
-                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                    }
-                } break;
+    int max_tasks = 1;
 
-            case GGML_OP_CROSS_ENTROPY_LOSS:
-                {
-                    cur = ggml_type_size(node->type)*(n_tasks + node->src[0]->ne[0]*n_tasks);
-                } break;
-            case GGML_OP_COUNT:
-                {
-                    GGML_ABORT("fatal error");
-                }
-            default:
-                break;
-        }
+    // thread scheduling for the different operations + work buffer size estimation
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+
+        const int n_tasks = ggml_get_n_tasks(node, n_threads);
+
+        max_tasks = MAX(max_tasks, n_tasks);
+
+        const size_t cur = ggml_graph_node_work_size(node, n_tasks);
 
         work_size = MAX(work_size, cur);
     }
@@ -20209,6 +20916,631 @@ struct ggml_cplan ggml_graph_plan(
     return cplan;
 }
 
+// max number of nodes that are computed between two barriers
+#define GGML_GRAPH_SYNC_WINDOW 8
+
+static bool ggml_graph_node_is_noop(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_VIEW:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+            return true;
+        default:
+            return ggml_is_empty(node);
+    }
+}
+
+// ops that use state shared between the threads besides their src and dst tensors:
+// the work buffer, the mat mul chunk counter or user data of custom ops
+static bool ggml_graph_node_uses_shared_state(const struct ggml_tensor * node, int n_threads) {
+    switch (node->op) {
+        case GGML_OP_MUL_MAT:
+        case GGML_OP_MUL_MAT_ID:
+        case GGML_OP_MAP_UNARY:
+        case GGML_OP_MAP_BINARY:
+        case GGML_OP_MAP_CUSTOM1_F32:
+        case GGML_OP_MAP_CUSTOM2_F32:
+        case GGML_OP_MAP_CUSTOM3_F32:
+        case GGML_OP_MAP_CUSTOM1:
+        case GGML_OP_MAP_CUSTOM2:
+        case GGML_OP_MAP_CUSTOM3:
+        case GGML_OP_CROSS_ENTROPY_LOSS:
+        case GGML_OP_CROSS_ENTROPY_LOSS_BACK:
+        case GGML_OP_OPT_STEP_ADAMW:
+            return true;
+        default:
+            return ggml_graph_node_work_size(node, n_threads) > 0;
+    }
+}
+
+static bool ggml_graph_tensors_overlap(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    if (a->data == NULL || b->data == NULL) {
+        return false;
+    }
+
+    const char * a0 = (const char *) a->data;
+    const char * b0 = (const char *) b->data;
+
+    return a0 < b0 + ggml_nbytes(b) && b0 < a0 + ggml_nbytes(a);
+}
+
+// true if b is stored in the same memory as a, with the same layout
+static bool ggml_graph_tensors_in_place(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    return a->data == b->data && a->type == b->type && ggml_are_same_shape(a, b) && ggml_are_same_stride(a, b);
+}
+
+// true if node reads or writes memory that is written by prev, or writes memory that prev reads
+static bool ggml_graph_nodes_depend(const struct ggml_tensor * node, const struct ggml_tensor * prev) {
+    if (ggml_graph_tensors_overlap(node, prev)) {
+        return true;
+    }
+
+    for (int i = 0; i < GGML_MAX_SRC; i++) {
+        if (node->src[i] && ggml_graph_tensors_overlap(node->src[i], prev)) {
+            return true;
+        }
+        if (prev->src[i] && ggml_graph_tensors_overlap(prev->src[i], node)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// max distance in the graph between two nodes that are fused
+#define GGML_GRAPH_FUSE_MAX_DIST 4
+
+enum ggml_node_flag {
+    GGML_NODE_FLAG_SYNC  = 1, // the threads have to synchronize after computing the node
+    GGML_NODE_FLAG_FUSED = 2, // the node is computed together with the node that uses it by a fused kernel
+    // the upper bits of the node that uses a fused node hold the distance to it
+};
+
+#define GGML_NODE_FUSED_DIST_SHIFT 2
+
+// number of nodes in the graph that use the tensor as a source, -1 if unknown
+static int ggml_graph_get_use_count(const struct ggml_cgraph * cgraph, struct ggml_tensor * t) {
+    if (cgraph->use_counts == NULL || cgraph->visited_hash_set.size == 0 ||
+        !ggml_hash_contains(&cgraph->visited_hash_set, t)) {
+        return -1;
+    }
+
+    return cgraph->use_counts[ggml_hash_find(&cgraph->visited_hash_set, t)];
+}
+
+// check if node and its only user next can be computed with a fused kernel without storing the result of node
+static bool ggml_graph_can_fuse(const struct ggml_cgraph * cgraph, struct ggml_tensor * node, const struct ggml_tensor * next) {
+    if (next->src[0] != node || node->view_src != NULL || (node->flags & GGML_TENSOR_FLAG_OUTPUT) ||
+        ggml_is_empty(node) || ggml_is_empty(next) || ggml_graph_get_use_count(cgraph, node) != 1) {
+        return false;
+    }
+
+    // the fused kernel writes the result of next while it still reads the sources of both nodes, which the allocator
+    // may have placed in the same memory when they are no longer used after next - the row-wise kernels read each row
+    // before they write it, so only a source computed in place is allowed, the matrix multiplication allows none
+    const bool row_wise = node->op != GGML_OP_MUL_MAT;
+
+    for (int j = 0; j < GGML_MAX_SRC; j++) {
+        // the first source of next is node, its result is not stored
+        const struct ggml_tensor * srcs[2] = { node->src[j], j > 0 ? next->src[j] : NULL };
+
+        for (int k = 0; k < 2; k++) {
+            if (srcs[k] && ggml_graph_tensors_overlap(next, srcs[k]) && !(row_wise && ggml_graph_tensors_in_place(next, srcs[k]))) {
+                return false;
+            }
+        }
+    }
+
+    const struct ggml_tensor * src0 = node->src[0];
+    const struct ggml_tensor * src1 = next->src[1];
+
+    switch (node->op) {
+        case GGML_OP_RMS_NORM:
+            {
+                // RMS_NORM -> MUL by a weight row
+                return next->op == GGML_OP_MUL &&
+                    src0->type == GGML_TYPE_F32 && src0->nb[0] == sizeof(float) &&
+                    src1->type == GGML_TYPE_F32 && src1->nb[0] == sizeof(float) &&
+                    next->type == GGML_TYPE_F32 && next->nb[0] == sizeof(float) &&
+                    src1->ne[0] == node->ne[0] && ggml_can_repeat(src1, node);
+            }
+        case GGML_OP_UNARY:
+            {
+                // SILU(gate) -> MUL by up
+                return ggml_get_unary_op(node) == GGML_UNARY_OP_SILU && next->op == GGML_OP_MUL &&
+                    src0->type == GGML_TYPE_F32 && ggml_is_contiguous_1(src0) &&
+                    src1->type == GGML_TYPE_F32 && src1->nb[0] == sizeof(float) &&
+                    next->type == GGML_TYPE_F32 && next->nb[0] == sizeof(float) &&
+                    ggml_are_same_shape(src1, node);
+            }
+        case GGML_OP_MUL_MAT:
+            {
+                // MUL_MAT -> ADD of a bias row
+                return next->op == GGML_OP_ADD &&
+                    next->type == GGML_TYPE_F32 && ggml_is_contiguous(next) && ggml_are_same_shape(next, node) &&
+                    src1->type == GGML_TYPE_F32 && ggml_is_contiguous(src1) &&
+                    ggml_nrows(src1) == 1 && src1->ne[0] == node->ne[0];
+            }
+        case GGML_OP_SCALE:
+            {
+                // SCALE -> SOFT_MAX, the scale is folded into the soft max scale
+                return next->op == GGML_OP_SOFT_MAX &&
+                    src0->type == GGML_TYPE_F32 && ggml_is_contiguous(src0);
+            }
+        default:
+            return false;
+    }
+}
+
+// plan the computation of the graph:
+// - pairs of nodes that can be fused are computed by a single kernel, without writing the intermediate result
+// - consecutive nodes without data dependencies between them are computed without synchronization,
+//   so a thread that is done with its part of a node can start on the next one while the others finish
+static void ggml_graph_compute_plan_nodes(
+        struct ggml_threadpool   * tp,
+        const struct ggml_cgraph * cgraph,
+        const struct ggml_cplan  * cplan,
+        int                        n_threads) {
+    const int n_nodes = cgraph->n_nodes;
+
+    if (tp->n_node_flags < n_nodes) {
+        free(tp->node_flags);
+        tp->node_flags   = malloc(n_nodes*sizeof(uint8_t));
+        tp->n_node_flags = n_nodes;
+        GGML_ASSERT(tp->node_flags);
+    }
+
+    memset(tp->node_flags, 0, n_nodes*sizeof(uint8_t));
+
+    for (int i = 0; cplan->fuse_ops && i < n_nodes - 1; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+
+        // the user of node is not necessarily next to it, e.g. the up projection is computed between SILU(gate) and MUL
+        for (int k = i + 1; k < n_nodes && k <= i + GGML_GRAPH_FUSE_MAX_DIST; k++) {
+            const struct ggml_tensor * next = cgraph->nodes[k];
+
+            if (!ggml_graph_can_fuse(cgraph, node, next)) {
+                // the nodes in between must not overwrite the sources of node
+                bool ok = true;
+                for (int j = 0; j < GGML_MAX_SRC && ok; j++) {
+                    ok = node->src[j] == NULL || !ggml_graph_tensors_overlap(next, node->src[j]);
+                }
+                if (!ok) {
+                    break;
+                }
+                continue;
+            }
+
+            tp->node_flags[i] |= GGML_NODE_FLAG_FUSED;
+            tp->node_flags[k] |= (k - i) << GGML_NODE_FUSED_DIST_SHIFT;
+            break;
+        }
+    }
+
+    const struct ggml_tensor * window[GGML_GRAPH_SYNC_WINDOW];
+    int  n_window      = 0;
+    bool window_shared = false; // a node in the window uses shared state
+    int  prev          = -1;    // last node that is not a no-op
+
+    for (int i = 0; i < n_nodes; i++) {
+        const struct ggml_tensor * node = cgraph->nodes[i];
+
+        if (n_threads == 1) {
+            // the barrier is a no-op anyway
+            tp->node_flags[i] |= GGML_NODE_FLAG_SYNC;
+            continue;
+        }
+
+        if (ggml_graph_node_is_noop(node) || (tp->node_flags[i] & GGML_NODE_FLAG_FUSED)) {
+            continue;
+        }
+
+        // a fused node also reads the sources of the node fused into it
+        const int dist = tp->node_flags[i] >> GGML_NODE_FUSED_DIST_SHIFT;
+        const struct ggml_tensor * fused = dist > 0 ? cgraph->nodes[i - dist] : NULL;
+
+        bool shared = ggml_graph_node_uses_shared_state(node, n_threads);
+        if (fused) {
+            shared = shared || ggml_graph_node_uses_shared_state(fused, n_threads);
+        }
+
+        bool sync = n_window >= GGML_GRAPH_SYNC_WINDOW - 1 || (shared && window_shared);
+        for (int j = 0; j < n_window && !sync; j++) {
+            sync = ggml_graph_nodes_depend(node, window[j]) || (fused && ggml_graph_nodes_depend(fused, window[j]));
+        }
+
+        if (sync && prev >= 0) {
+            tp->node_flags[prev] |= GGML_NODE_FLAG_SYNC;
+            n_window      = 0;
+            window_shared = false;
+        }
+
+        if (fused) {
+            window[n_window++] = fused;
+        }
+        window[n_window++] = node;
+        window_shared = window_shared || shared;
+        prev = i;
+    }
+
+    if (n_nodes > 0) {
+        tp->node_flags[n_nodes - 1] |= GGML_NODE_FLAG_SYNC;
+    }
+}
+
+bool ggml_threadpool_node_synced(struct ggml_threadpool * threadpool, int i) {
+    GGML_ASSERT(i >= 0 && i < threadpool->n_node_flags);
+
+    return threadpool->node_flags[i] & GGML_NODE_FLAG_SYNC;
+}
+
+//
+// profiler
+//
+
+#define GGML_PROFILE_N_OPS (GGML_OP_COUNT + GGML_UNARY_OP_COUNT)
+
+struct ggml_profile_op {
+    int64_t n_nodes;
+    int64_t t_ns;          // wall time from the first thread starting a node to the last one finishing it
+    int64_t t_busy_ns;     // summed over the threads
+    int64_t t_busy_max_ns; // summed over the nodes, time of the busiest thread
+    int64_t t_wait_ns;     // summed over the threads
+    double  bytes;
+    double  flops;
+};
+
+struct ggml_profile_event {
+    int64_t t_start_ns;
+    int64_t t_end_ns;
+    int32_t tid;
+    int32_t pid;
+    int16_t op;
+    int16_t op_fused; // -1 if the node was not fused
+    char    name[GGML_MAX_NAME];
+};
+
+struct ggml_profiler {
+    ggml_mutex_t mutex;
+
+    int64_t n_graphs;
+    int64_t t_graphs_ns;
+    int64_t t_origin_ns; // start of the first graph, the origin of the trace
+
+    struct ggml_profile_op ops[GGML_PROFILE_N_OPS];
+
+    int     n_threads; // largest number of threads seen
+    int64_t t_busy_ns[GGML_MAX_N_THREADS];
+    int64_t t_wait_ns[GGML_MAX_N_THREADS];
+
+    struct ggml_profile_event * events;
+    int64_t n_events;
+    int64_t n_events_max;
+    int64_t n_events_dropped;
+};
+
+static int64_t ggml_profile_time_ns(void) {
+#if defined(_MSC_VER) || defined(__MINGW32__)
+    LARGE_INTEGER t;
+    QueryPerformanceCounter(&t);
+    return (int64_t) ((double) (t.QuadPart - timer_start) * 1e9 / timer_freq);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000000000 + (int64_t)ts.tv_nsec;
+#endif
+}
+
+struct ggml_profiler * ggml_profiler_new(int64_t n_trace_events) {
+    struct ggml_profiler * profiler = calloc(1, sizeof(struct ggml_profiler));
+    GGML_ASSERT(profiler != NULL);
+
+    ggml_mutex_init(&profiler->mutex);
+
+    if (n_trace_events > 0) {
+        profiler->events = malloc(n_trace_events*sizeof(struct ggml_profile_event));
+        GGML_ASSERT(profiler->events != NULL);
+        profiler->n_events_max = n_trace_events;
+    }
+
+    return profiler;
+}
+
+void ggml_profiler_free(struct ggml_profiler * profiler) {
+    if (profiler == NULL) {
+        return;
+    }
+
+    ggml_mutex_destroy(&profiler->mutex);
+    free(profiler->events);
+    free(profiler);
+}
+
+void ggml_profiler_reset(struct ggml_profiler * profiler) {
+    ggml_mutex_lock(&profiler->mutex);
+
+    profiler->n_graphs         = 0;
+    profiler->t_graphs_ns      = 0;
+    profiler->t_origin_ns      = 0;
+    profiler->n_threads        = 0;
+    profiler->n_events         = 0;
+    profiler->n_events_dropped = 0;
+    memset(profiler->ops,       0, sizeof(profiler->ops));
+    memset(profiler->t_busy_ns, 0, sizeof(profiler->t_busy_ns));
+    memset(profiler->t_wait_ns, 0, sizeof(profiler->t_wait_ns));
+
+    ggml_mutex_unlock(&profiler->mutex);
+}
+
+static int ggml_profile_op_id(const struct ggml_tensor * node) {
+    if (node->op == GGML_OP_UNARY) {
+        return GGML_OP_COUNT + ggml_get_unary_op(node);
+    }
+    return node->op;
+}
+
+static const char * ggml_profile_op_name(int op) {
+    if (op >= GGML_OP_COUNT) {
+        return ggml_unary_op_name((enum ggml_unary_op) (op - GGML_OP_COUNT));
+    }
+    return ggml_op_name((enum ggml_op) op);
+}
+
+// estimated bytes read and written and floating point operations of a node
+static void ggml_profile_node_cost(const struct ggml_tensor * node, double * bytes, double * flops) {
+    *bytes += ggml_nbytes(node);
+
+    switch (node->op) {
+        case GGML_OP_GET_ROWS:
+            {
+                // only the selected rows are read
+                *bytes += ggml_nbytes(node) + ggml_nbytes(node->src[1]);
+            } break;
+        default:
+            {
+                for (int i = 0; i < GGML_MAX_SRC; i++) {
+                    if (node->src[i]) {
+                        *bytes += ggml_nbytes(node->src[i]);
+                    }
+                }
+            } break;
+    }
+
+    switch (node->op) {
+        case GGML_OP_MUL_MAT:
+        case GGML_OP_MUL_MAT_ID:
+            {
+                *flops += 2.0*node->src[0]->ne[0]*ggml_nelements(node);
+            } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                const struct ggml_tensor * q = node->src[0];
+                const struct ggml_tensor * k = node->src[1];
+                const struct ggml_tensor * v = node->src[2];
+                *flops += 2.0*q->ne[1]*q->ne[2]*q->ne[3]*k->ne[1]*(q->ne[0] + v->ne[0]);
+            } break;
+        default:
+            {
+                *flops += ggml_nelements(node);
+            } break;
+    }
+}
+
+static bool ggml_profile_skip_node(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_VIEW:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+            return true;
+        default:
+            return ggml_is_empty(node);
+    }
+}
+
+// adds the node times recorded by the threads of tp while computing cgraph
+static void ggml_profiler_add_graph(
+        struct ggml_profiler         * profiler,
+        const struct ggml_threadpool * tp,
+        const struct ggml_cgraph     * cgraph,
+        int                            n_threads) {
+    const int stride = tp->cplan->n_threads;
+    const int64_t * times = tp->node_times;
+
+    ggml_mutex_lock(&profiler->mutex);
+
+    profiler->n_graphs++;
+    profiler->n_threads = MAX(profiler->n_threads, n_threads);
+
+    int64_t t_graph_start = INT64_MAX;
+    int64_t t_graph_end   = 0;
+
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        const struct ggml_tensor * node = cgraph->nodes[i];
+        const int64_t * t = times + (size_t) i*stride*2;
+
+        if (tp->node_flags[i] & GGML_NODE_FLAG_FUSED) {
+            continue;
+        }
+
+        int64_t t_start = INT64_MAX;
+        int64_t t_end   = 0;
+        int64_t t_busy  = 0;
+        int64_t t_busy_max = 0;
+        for (int j = 0; j < n_threads; j++) {
+            t_start = MIN(t_start, t[2*j + 0]);
+            t_end   = MAX(t_end,   t[2*j + 1]);
+            t_busy += t[2*j + 1] - t[2*j + 0];
+            t_busy_max = MAX(t_busy_max, t[2*j + 1] - t[2*j + 0]);
+        }
+        if (t_end == 0) {
+            // not computed, the graph was aborted
+            break;
+        }
+        t_graph_start = MIN(t_graph_start, t_start);
+        t_graph_end   = MAX(t_graph_end,   t_end);
+
+        // the threads wait for the slowest one at the barriers
+        int64_t t_wait = 0;
+        if (tp->node_flags[i] & GGML_NODE_FLAG_SYNC) {
+            for (int j = 0; j < n_threads; j++) {
+                profiler->t_wait_ns[j] += t_end - t[2*j + 1];
+                t_wait += t_end - t[2*j + 1];
+            }
+        }
+        for (int j = 0; j < n_threads; j++) {
+            profiler->t_busy_ns[j] += t[2*j + 1] - t[2*j + 0];
+        }
+
+        if (ggml_profile_skip_node(node)) {
+            continue;
+        }
+
+        const int fused_dist = tp->node_flags[i] >> GGML_NODE_FUSED_DIST_SHIFT;
+        const struct ggml_tensor * fused = fused_dist > 0 ? cgraph->nodes[i - fused_dist] : NULL;
+
+        struct ggml_profile_op * op = &profiler->ops[ggml_profile_op_id(node)];
+        op->n_nodes       += 1;
+        op->t_ns          += t_end - t_start;
+        op->t_busy_ns     += t_busy;
+        op->t_busy_max_ns += t_busy_max;
+        op->t_wait_ns     += t_wait;
+        ggml_profile_node_cost(node, &op->bytes, &op->flops);
+        if (fused) {
+            ggml_profile_node_cost(fused, &op->bytes, &op->flops);
+        }
+
+        if (profiler->n_events_max == 0) {
+            continue;
+        }
+        if (profiler->n_graphs == 1 && profiler->t_origin_ns == 0) {
+            profiler->t_origin_ns = t_start;
+        }
+        for (int j = 0; j < n_threads; j++) {
+            if (profiler->n_events == profiler->n_events_max) {
+                profiler->n_events_dropped++;
+                continue;
+            }
+            struct ggml_profile_event * ev = &profiler->events[profiler->n_events++];
+            ev->t_start_ns = t[2*j + 0];
+            ev->t_end_ns   = t[2*j + 1];
+            ev->tid        = j;
+            ev->pid        = tp->id;
+            ev->op         = (int16_t) ggml_profile_op_id(node);
+            ev->op_fused   = (int16_t) (fused ? ggml_profile_op_id(fused) : -1);
+            memcpy(ev->name, node->name, sizeof(ev->name));
+        }
+    }
+
+    if (t_graph_end > 0) {
+        profiler->t_graphs_ns += t_graph_end - t_graph_start;
+    }
+
+    ggml_mutex_unlock(&profiler->mutex);
+}
+
+void ggml_profiler_print(struct ggml_profiler * profiler, FILE * stream) {
+    ggml_mutex_lock(&profiler->mutex);
+
+    int order[GGML_PROFILE_N_OPS];
+    int n_ops = 0;
+    int64_t t_total_ns = 0;
+    for (int i = 0; i < GGML_PROFILE_N_OPS; i++) {
+        if (profiler->ops[i].n_nodes > 0) {
+            order[n_ops++] = i;
+            t_total_ns += profiler->ops[i].t_ns;
+        }
+    }
+    // insertion sort by time, the number of ops is small
+    for (int i = 1; i < n_ops; i++) {
+        for (int j = i; j > 0 && profiler->ops[order[j - 1]].t_ns < profiler->ops[order[j]].t_ns; j--) {
+            const int tmp = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = tmp;
+        }
+    }
+
+    fprintf(stream, "ggml_profiler: %" PRId64 " graphs, %.2f ms\n", profiler->n_graphs, profiler->t_graphs_ns/1e6);
+    fprintf(stream, "%-16s %8s %10s %6s %9s %6s %6s %6s %9s %9s\n",
+            "op", "nodes", "time ms", "%", "avg us", "busy %", "wait %", "imbal", "GB/s", "GFLOP/s");
+    for (int k = 0; k < n_ops; k++) {
+        const struct ggml_profile_op * op = &profiler->ops[order[k]];
+        const int64_t t_busy_wait = op->t_busy_ns + op->t_wait_ns;
+        fprintf(stream, "%-16s %8" PRId64 " %10.3f %6.2f %9.2f %6.1f %6.1f %6.2f %9.2f %9.2f\n",
+                ggml_profile_op_name(order[k]),
+                op->n_nodes,
+                op->t_ns/1e6,
+                t_total_ns > 0 ? 100.0*op->t_ns/t_total_ns : 0.0,
+                op->t_ns/1e3/op->n_nodes,
+                t_busy_wait > 0 ? 100.0*op->t_busy_ns/t_busy_wait : 0.0,
+                t_busy_wait > 0 ? 100.0*op->t_wait_ns/t_busy_wait : 0.0,
+                // time of the busiest thread over the average time of the threads, 1.00 = balanced
+                op->t_busy_ns > 0 ? (double) op->t_busy_max_ns*profiler->n_threads/op->t_busy_ns : 0.0,
+                op->t_ns > 0 ? op->bytes/op->t_ns : 0.0,
+                op->t_ns > 0 ? op->flops/op->t_ns : 0.0);
+    }
+
+    fprintf(stream, "%-16s %10s %10s\n", "thread", "busy ms", "wait ms");
+    for (int j = 0; j < profiler->n_threads; j++) {
+        fprintf(stream, "%-16d %10.3f %10.3f\n", j, profiler->t_busy_ns[j]/1e6, profiler->t_wait_ns[j]/1e6);
+    }
+
+    if (profiler->n_events_dropped > 0) {
+        fprintf(stream, "ggml_profiler: the trace is missing %" PRId64 " events, increase n_trace_events\n", profiler->n_events_dropped);
+    }
+
+    ggml_mutex_unlock(&profiler->mutex);
+}
+
+static void ggml_profile_write_string(FILE * f, const char * str) {
+    fputc('"', f);
+    for (const char * c = str; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', f);
+        }
+        if ((unsigned char) *c >= 0x20) {
+            fputc(*c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+bool ggml_profiler_write_trace(struct ggml_profiler * profiler, const char * fname) {
+    FILE * f = ggml_fopen(fname, "w");
+    if (f == NULL) {
+        return false;
+    }
+
+    ggml_mutex_lock(&profiler->mutex);
+
+    fprintf(f, "{\"traceEvents\":[\n");
+    for (int64_t i = 0; i < profiler->n_events; i++) {
+        const struct ggml_profile_event * ev = &profiler->events[i];
+        char op[64];
+        if (ev->op_fused >= 0) {
+            snprintf(op, sizeof(op), "%s+%s", ggml_profile_op_name(ev->op_fused), ggml_profile_op_name(ev->op));
+        } else {
+            snprintf(op, sizeof(op), "%s", ggml_profile_op_name(ev->op));
+        }
+        fprintf(f, "{\"name\":");
+        ggml_profile_write_string(f, ev->name[0] ? ev->name : op);
+        fprintf(f, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}%s\n",
+                op, (ev->t_start_ns - profiler->t_origin_ns)/1e3, (ev->t_end_ns - ev->t_start_ns)/1e3,
+                ev->pid, ev->tid, i + 1 < profiler->n_events ? "," : "");
+    }
+    fprintf(f, "],\"displayTimeUnit\":\"ns\"}\n");
+
+    ggml_mutex_unlock(&profiler->mutex);
+
+    const bool ok = ferror(f) == 0;
+    fclose(f);
+
+    return ok;
+}
+
 static thread_ret_t ggml_graph_compute_thread(void * data) {
     struct ggml_compute_state * state = (struct ggml_compute_state *) data;
     struct ggml_threadpool    * tp    = state->threadpool;
@@ -20216,7 +21548,14 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
     const struct ggml_cgraph * cgraph = tp->cgraph;
     const struct ggml_cplan  * cplan  = tp->cplan;
 
-    set_numa_thread_affinity(state->ith);
+    set_numa_thread_affinity(state->ith, tp->numa_node);
+
+    // the rows of the NUMA split tensors are divided by the nodes that the threads actually run on, which can differ
+    // from the NUMA strategy (e.g. CPU masks or threadpools pinned to one node) - all threads need to see them
+    if (ggml_is_numa_split()) {
+        state->numa_node = get_numa_thread_node();
+        ggml_barrier(tp);
+    }
 
     struct ggml_compute_params params = {
         /*.ith       =*/ state->ith,
@@ -20226,11 +21565,43 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
         /*.threadpool=*/ tp,
     };
 
-    for (int node_n = 0; node_n < cgraph->n_nodes && !tp->abort; node_n++) {
+    // the caller may free the graph or compute the next one as soon as the last barrier is passed,
+    // so the graph must not be read after it
+    const int n_nodes = cgraph->n_nodes;
+
+    int64_t * node_times   = cplan->profiler ? tp->node_times : NULL;
+    const int times_stride = cplan->n_threads;
+
+    for (int node_n = 0; node_n < n_nodes; node_n++) {
         struct ggml_tensor * node = cgraph->nodes[node_n];
 
-        ggml_compute_forward(&params, node);
+        if (tp->node_flags[node_n] & GGML_NODE_FLAG_FUSED) {
+            // computed with the node that uses it
+            continue;
+        }
+
+        int64_t * times = node_times ? node_times + ((size_t) node_n*times_stride + state->ith)*2 : NULL;
+        if (times) {
+            times[0] = ggml_profile_time_ns();
+        }
+
+        const int fused_dist = tp->node_flags[node_n] >> GGML_NODE_FUSED_DIST_SHIFT;
+        if (fused_dist > 0) {
+            ggml_compute_forward_fused(&params, cgraph->nodes[node_n - fused_dist], node);
+        } else {
+            ggml_compute_forward(&params, node);
+        }
 
+        if (times) {
+            times[1] = ggml_profile_time_ns();
+        }
+
+        if (!(tp->node_flags[node_n] & GGML_NODE_FLAG_SYNC)) {
+            // the next node does not depend on this one
+            continue;
+        }
+
+        // the abort flag is only set and checked at the barriers so that all threads stop at the same node
         if (state->ith == 0 && cplan->abort_callback &&
                 cplan->abort_callback(cplan->abort_callback_data)) {
             tp->abort = true;
@@ -20238,6 +21609,10 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
         }
 
         ggml_barrier(state->threadpool);
+
+        if (tp->abort) {
+            break;
+        }
     }
 
     return 0;
@@ -20279,34 +21654,101 @@ static inline void ggml_graph_compute_thread_sync(struct ggml_compute_state * st
     UNUSED(state);
 }
 
-static inline bool ggml_graph_compute_poll_for_work(struct ggml_compute_state * state) {
+// Idle workers wait for the next graph in three phases:
+//  - spin:  lowest wakeup latency, but keeps the core busy
+//  - yield: lets other threads (e.g. of other contexts) use the core, and still wakes up quickly
+//  - sleep: frees the core until the next graph is kicked off
+// The spin and yield phases last up to twice the average idle time between graphs, and are skipped
+// when that is longer than the poll level allows, so that the workers sleep right away when graphs are far apart.
+#define GGML_THREADPOOL_SPIN_US_PER_POLL   2 // poll = 50: spin through idle times up to 100 us
+#define GGML_THREADPOOL_YIELD_US_PER_POLL 40 // poll = 50: yield through idle times up to 2 ms
+
+static void ggml_graph_compute_wait_budget(struct ggml_compute_state * state, int64_t * t_spin_us, int64_t * t_yield_us) {
     struct ggml_threadpool * threadpool = state->threadpool;
 
-    // Skip polling for unused threads
+    *t_spin_us  = 0;
+    *t_yield_us = 0;
+
+    // unused threads go to sleep right away
     if (!ggml_graph_compute_thread_active(state)) {
-        return state->pending;
+        return;
     }
 
-    // This seems to make 0 ... 100 a decent range for polling level across modern processors.
-    // Perhaps, we can adjust it dynamically based on load and things.
-    const uint64_t n_rounds = 1024UL * 128 * threadpool->poll;
+    const int64_t t_idle_avg  = atomic_load_explicit(&threadpool->t_idle_avg_us, memory_order_relaxed);
+    const int64_t t_spin_max  = (int64_t) threadpool->poll * GGML_THREADPOOL_SPIN_US_PER_POLL;
+    const int64_t t_yield_max = (int64_t) threadpool->poll * GGML_THREADPOOL_YIELD_US_PER_POLL;
 
-    for (uint64_t i=0; !ggml_graph_compute_thread_ready(state) && i < n_rounds; i++) {
-        // No new work. Keep polling.
-        ggml_thread_cpu_relax();
+    const int64_t t_budget = t_idle_avg < 0 ? t_spin_max : 2*t_idle_avg;
+    if (t_budget > t_yield_max) {
+        return;
+    }
+
+    *t_spin_us  = MIN(t_budget, t_spin_max);
+    *t_yield_us = t_budget;
+}
+
+static inline bool ggml_graph_compute_poll_for_work(struct ggml_compute_state * state, int64_t t_end_us, bool yield) {
+    for (uint64_t i = 0; !ggml_graph_compute_thread_ready(state); i++) {
+        // reading the clock is slower than checking for work, so only do it every few rounds when spinning
+        if ((yield || i % 64 == 0) && ggml_time_us() >= t_end_us) {
+            break;
+        }
+        if (yield) {
+            sched_yield();
+        } else {
+            ggml_thread_cpu_relax();
+        }
     }
 
     return state->pending;
 }
 
 static inline bool ggml_graph_compute_check_for_work(struct ggml_compute_state * state) {
-    struct ggml_threadpool * threadpool = state->threadpool;
+    struct ggml_threadpool     * threadpool = state->threadpool;
+    struct ggml_threadpool_stats * stats    = &state->stats;
+
+    int64_t t_spin_us;
+    int64_t t_yield_us;
+    ggml_graph_compute_wait_budget(state, &t_spin_us, &t_yield_us);
 
-    if (ggml_graph_compute_poll_for_work(state)) {
+    // the counters are only updated when there is work: the main thread waits for this thread to finish it
+    // before returning from ggml_graph_compute, so they can be read between graphs without races
+
+    const int64_t t_start = ggml_time_us();
+
+    if (ggml_graph_compute_poll_for_work(state, t_start + t_spin_us, false)) {
         ggml_graph_compute_thread_sync(state);
-        return state->pending;
+        stats->t_spin_us += ggml_time_us() - t_start;
+        stats->n_spin_wakeups++;
+        return true;
     }
 
+    const int64_t t_spin_end = ggml_time_us();
+
+    if (ggml_graph_compute_poll_for_work(state, t_start + t_yield_us, true)) {
+        ggml_graph_compute_thread_sync(state);
+        stats->t_spin_us  += t_spin_end - t_start;
+        stats->t_yield_us += ggml_time_us() - t_spin_end;
+        stats->n_yield_wakeups++;
+        return true;
+    }
+
+    const int64_t t_yield_end = ggml_time_us();
+
+#ifdef GGML_USE_FUTEX
+    atomic_fetch_add_explicit(&threadpool->n_sleeping, 1, memory_order_seq_cst);
+    while (true) {
+        // read n_wake before checking, so a wakeup between the check and the wait is not lost
+        const int n_wake = atomic_load_explicit(&threadpool->n_wake, memory_order_seq_cst);
+        if (ggml_graph_compute_thread_ready(state)) {
+            break;
+        }
+        GGML_PRINT_DEBUG("thread #%d waiting for work (sleeping)\n", state->ith);
+        ggml_futex_wait(&threadpool->n_wake, n_wake);
+    }
+    atomic_fetch_sub_explicit(&threadpool->n_sleeping, 1, memory_order_seq_cst);
+    ggml_graph_compute_thread_sync(state);
+#else
     ggml_mutex_lock_shared(&threadpool->mutex);
     while (!ggml_graph_compute_thread_ready(state)) {
         // No new work. Wait for the signal.
@@ -20314,6 +21756,14 @@ static inline bool ggml_graph_compute_check_for_work(struct ggml_compute_state *
         ggml_cond_wait(&threadpool->cond, &threadpool->mutex);
     }
     ggml_mutex_unlock_shared(&threadpool->mutex);
+#endif
+
+    if (state->pending) {
+        stats->t_spin_us  += t_spin_end  - t_start;
+        stats->t_yield_us += t_yield_end - t_spin_end;
+        stats->t_sleep_us += ggml_time_us() - t_yield_end;
+        stats->n_sleep_wakeups++;
+    }
 
     return state->pending;
 }
@@ -20359,7 +21809,17 @@ static thread_ret_t ggml_graph_compute_secondary_thread(void* data) {
 // Start processing new graph
 static void ggml_graph_compute_kickoff(struct ggml_threadpool * threadpool, int n_threads)
 {
-    // Always take the mutex here because the worker threads are doing hybrid poll/wait
+#ifdef GGML_USE_FUTEX
+    if (!threadpool->pause) {
+        // the sleeping workers wait on the futex, the mutex is only needed to resume the threadpool
+        atomic_store_explicit(&threadpool->n_threads_cur, n_threads, memory_order_relaxed);
+        atomic_fetch_add_explicit(&threadpool->n_graph, 1, memory_order_seq_cst);
+        ggml_threadpool_wake_sleeping(threadpool);
+        return;
+    }
+#endif
+
+    // Take the mutex here because the worker threads are doing hybrid poll/wait
 
     ggml_mutex_lock(&threadpool->mutex);
 
@@ -20396,6 +21856,7 @@ void ggml_threadpool_params_init(struct ggml_threadpool_params * p, int n_thread
     p->poll       = 50;    // hybrid-polling enabled
     p->strict_cpu = false; // no strict placement (all threads share same cpumask)
     p->paused     = false; // threads are ready to go
+    p->numa_node  = -1;    // the threads are placed by the NUMA strategy
     memset(p->cpumask, 0, GGML_MAX_N_THREADS); // all-zero means use the default affinity (usually inherited)
 }
 
@@ -20410,6 +21871,7 @@ bool ggml_threadpool_params_match(const struct ggml_threadpool_params * p0, cons
     if (p0->prio           != p1->prio       )    return false;
     if (p0->poll           != p1->poll       )    return false;
     if (p0->strict_cpu     != p1->strict_cpu )    return false;
+    if (p0->numa_node      != p1->numa_node  )    return false;
     return memcmp(p0->cpumask, p1->cpumask, GGML_MAX_N_THREADS) == 0;
 }
 
@@ -20427,6 +21889,15 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
         threadpool->n_barrier        = 0;
         threadpool->n_barrier_passed = 0;
         threadpool->current_chunk    = 0;
+        threadpool->n_wake           = 0;
+        threadpool->n_sleeping       = 0;
+        threadpool->t_idle_avg_us    = -1;
+        threadpool->t_last_us        = 0;
+        threadpool->node_flags       = NULL;
+        threadpool->n_node_flags     = 0;
+        threadpool->node_times       = NULL;
+        threadpool->n_node_times     = 0;
+        threadpool->id               = atomic_fetch_add(&g_threadpool_id, 1);
         threadpool->stop             = false;
         threadpool->pause            = tpp->paused;
         threadpool->abort            = false;
@@ -20435,9 +21906,16 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
         threadpool->n_threads_cur    = tpp->n_threads;
         threadpool->poll             = tpp->poll;
         threadpool->prio             = tpp->prio;
+        threadpool->numa_node        = tpp->numa_node;
         threadpool->ec               = GGML_STATUS_SUCCESS;
+        threadpool->busy             = false;
+        threadpool->waiters          = NULL;
+        memset(&threadpool->stats, 0, sizeof(threadpool->stats));
     }
 
+    ggml_mutex_init(&threadpool->lease_mutex);
+    ggml_cond_init(&threadpool->lease_cond);
+
     // Allocate and init workers state
     const size_t workers_size = sizeof(struct ggml_compute_state) * tpp->n_threads;
     struct ggml_compute_state * workers = GGML_ALIGNED_MALLOC(workers_size);
@@ -20446,6 +21924,7 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
     for (int j = 0; j < tpp->n_threads; j++) {
         workers[j].threadpool = threadpool;
         workers[j].ith        = j;
+        workers[j].numa_node  = -1;
     }
 
     threadpool->workers = workers;
@@ -20501,6 +21980,9 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         struct ggml_threadpool_params ttp = ggml_threadpool_params_default(n_threads);
         threadpool = ggml_threadpool_new_impl(&ttp, cgraph, cplan);
     } else {
+        // wait for the graphs of other callers sharing the threadpool
+        ggml_threadpool_acquire(threadpool, cplan->priority);
+
         // Reset some of the parameters that need resetting
         // No worker threads should be accessing the parameters below at this stage
         threadpool->cgraph           = cgraph;
@@ -20510,6 +21992,29 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         threadpool->ec               = GGML_STATUS_SUCCESS;
     }
 
+    ggml_graph_compute_plan_nodes(threadpool, cgraph, cplan, n_threads);
+
+    if (cplan->profiler) {
+        const size_t n_times = (size_t) cgraph->n_nodes*n_threads*2;
+        if (threadpool->n_node_times < n_times) {
+            free(threadpool->node_times);
+            threadpool->node_times   = malloc(n_times*sizeof(int64_t));
+            threadpool->n_node_times = n_times;
+            GGML_ASSERT(threadpool->node_times);
+        }
+        memset(threadpool->node_times, 0, n_times*sizeof(int64_t));
+    }
+
+    // the wait policy of the workers follows the average idle time between graphs
+    const int64_t t_start_us = ggml_time_us();
+    if (threadpool->t_last_us > 0) {
+        const int64_t t_idle_us  = t_start_us - threadpool->t_last_us;
+        const int64_t t_idle_avg = atomic_load_explicit(&threadpool->t_idle_avg_us, memory_order_relaxed);
+        const int64_t t_idle_new = t_idle_avg < 0 ? t_idle_us : (7*t_idle_avg + t_idle_us)/8;
+        atomic_store_explicit(&threadpool->t_idle_avg_us, (int) MIN(t_idle_new, INT_MAX/8), memory_order_relaxed);
+        threadpool->stats.t_idle_us += t_idle_us;
+    }
+
 #ifdef GGML_USE_OPENMP
     if (n_threads > 1) {
         #pragma omp parallel num_threads(n_threads)
@@ -20543,10 +22048,20 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
     // don't leave affinity set on the main thread
     clear_numa_thread_affinity();
 
+    if (cplan->profiler) {
+        ggml_profiler_add_graph(cplan->profiler, threadpool, cgraph, atomic_load_explicit(&threadpool->n_threads_cur, memory_order_relaxed));
+    }
+
+    threadpool->t_last_us = ggml_time_us();
+    threadpool->stats.n_graphs++;
+    threadpool->stats.t_compute_us += threadpool->t_last_us - t_start_us;
+
     enum ggml_status ret = threadpool->ec;
 
     if (disposable_threadpool) {
         ggml_threadpool_free(threadpool);
+    } else {
+        ggml_threadpool_release(threadpool);
     }
 
     return ret;
@@ -41,10 +41,10 @@
 #define LLAMA_FILE_MAGIC_GGSQ 0x67677371u // 'ggsq'
 
 #define LLAMA_SESSION_MAGIC   LLAMA_FILE_MAGIC_GGSN
-#define LLAMA_SESSION_VERSION 9
+#define LLAMA_SESSION_VERSION 10
 
 #define LLAMA_STATE_SEQ_MAGIC   LLAMA_FILE_MAGIC_GGSQ
-#define LLAMA_STATE_SEQ_VERSION 2
+#define LLAMA_STATE_SEQ_VERSION 3
 
 #ifdef __cplusplus
 extern "C" {
@@ -330,6 +330,9 @@ extern "C" {
         float    yarn_beta_slow;   // YaRN high correction dim
         uint32_t yarn_orig_ctx;    // YaRN original context size
         float    defrag_thold;     // defragment the KV cache if holes/size > thold, < 0 disabled (default)
+        uint32_t kv_block_size;    // KV cache block size in cells for the paged cache, 0 = contiguous slots (default) [EXPERIMENTAL]
+        uint32_t n_pipeline_stages; // number of CPU stages the layers are split across, the ubatches of a batch are streamed through them (0/1 = disabled) [EXPERIMENTAL]
+        uint32_t n_swa_keep;        // number of cells at the start of each sequence that the sliding-window KV cache keeps out of the window (the n_keep tokens of a context shift)
 
         ggml_backend_sched_eval_callback cb_eval;
         void * cb_eval_user_data;
@@ -344,6 +347,10 @@ extern "C" {
         bool offload_kqv; // whether to offload the KQV ops (including the KV cache) to GPU
         bool flash_attn;  // whether to use flash attention [EXPERIMENTAL]
         bool no_perf;     // whether to measure performance timings
+        bool swa_full;    // keep the full history in the KV cache of the sliding-window attention layers
+        bool lazy_rope;   // cache K before RoPE and rotate it when attending, position shifts do not touch the cache (llama-like models only)
+                          // a state saved with the other lazy_rope setting fails to load
+        bool async_decode; // compute the graphs on a CPU thread of their own, so that llama_decode_async() returns before they are done
 
         // Abort callback
         // if it returns true, execution of llama_decode() will be aborted
@@ -401,12 +408,24 @@ extern "C" {
     LLAMA_API void llama_numa_init(enum ggml_numa_strategy numa);
 
     // Optional: an auto threadpool gets created in ggml if not passed explicitly
+    // The same threadpool can be attached to several contexts, also when they are used from different threads:
+    // their graphs are then computed one at a time, so a single pool sized to the cores serves all of them
+    // With n_pipeline_stages, the stages also compute on the attached threadpool instead of their own ones
     LLAMA_API void llama_attach_threadpool(
                struct   llama_context * ctx,
             ggml_threadpool_t   threadpool,
             ggml_threadpool_t   threadpool_batch);
     LLAMA_API void llama_detach_threadpool(struct llama_context * ctx);
 
+    // Priority of the graphs of this context on a shared threadpool (default: 0)
+    // When several contexts are waiting for the threadpool, the one with the highest priority goes first,
+    // e.g. interactive generation above batch embedding. Contexts that keep waiting slowly gain priority.
+    LLAMA_API void llama_set_compute_priority(struct llama_context * ctx, int32_t priority);
+
+    // Record the time of each graph node computed on the CPU, NULL to stop (see ggml_profiler_new)
+    // The profiler is owned by the caller and can be shared with other contexts
+    LLAMA_API void llama_attach_profiler(struct llama_context * ctx, struct ggml_profiler * profiler);
+
     // Call once at the end of the program - currently only used for MPI
     LLAMA_API void llama_backend_free(void);
 
@@ -632,6 +651,8 @@ extern "C" {
                     llama_seq_id   seq_id);
 
     // Adds relative position "delta" to all tokens that belong to the specified sequence and have positions in [p0, p1)
+    // Tokens shared with other sequences (see llama_kv_cache_seq_cp) get their own cells, the other sequences keep their
+    // positions - the data of these cells is copied together with the RoPE update below
     // If the KV cache is RoPEd, the KV data is updated accordingly:
     //   - lazily on next llama_decode()
     //   - explicitly with llama_kv_cache_update()
@@ -809,11 +830,29 @@ extern "C" {
     // Positive return values does not mean a fatal error, but rather a warning.
     //   0 - success
     //   1 - could not find a KV slot for the batch (try reducing the size of the batch or increase the context)
+    //   2 - the computation was aborted (see llama_set_abort_callback)
     // < 0 - error
     LLAMA_API int32_t llama_decode(
             struct llama_context * ctx,
               struct llama_batch   batch);
 
+    // Submits a batch like llama_decode(), without waiting for its outputs
+    // The outputs of the previous decode stay readable until llama_decode_wait(), e.g. to sample other sequences meanwhile
+    // A decode that is still in flight is waited for first
+    // The graphs are computed in the background with async_decode or n_pipeline_stages, or by the asynchronous backends (e.g. GPU)
+    // Returns the same values as llama_decode()
+    LLAMA_API int32_t llama_decode_async(
+            struct llama_context * ctx,
+              struct llama_batch   batch);
+
+    // Returns true when the outputs of the last llama_decode_async() are ready
+    // Always true when the graphs are not computed by a CPU thread of their own
+    LLAMA_API bool llama_decode_ready(struct llama_context * ctx);
+
+    // Waits for the last llama_decode_async(), its outputs replace those of the previous decode
+    // Returns the status of the graphs computed in the background since the last call, with the values of llama_decode()
+    LLAMA_API int32_t llama_decode_wait(struct llama_context * ctx);
+
     // Set the number of threads used for decoding
     // n_threads is the number of threads used for generation (single token)
     // n_threads_batch is the number of threads used for prompt and batch processing (multiple tokens)
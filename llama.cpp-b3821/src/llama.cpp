@@ -92,6 +92,7 @@
 #include <set>
 #include <sstream>
 #include <thread>
+#include <tuple>
 #include <type_traits>
 #include <unordered_map>
 
@@ -2359,6 +2360,8 @@ struct llama_hparams {
     std::array<uint32_t, LLAMA_MAX_LAYERS> n_head_kv_arr;
     std::array<uint32_t, LLAMA_MAX_LAYERS> n_ff_arr;
 
+    std::array<bool, LLAMA_MAX_LAYERS> swa_layers; // layers that attend only to the last n_swa positions
+
     uint32_t n_layer_dense_lead = 0;
     uint32_t n_lora_q = 0;
     uint32_t n_lora_kv = 0;
@@ -2429,6 +2432,7 @@ struct llama_hparams {
         if (this->n_head_arr    != other.n_head_arr)    return true;
         if (this->n_head_kv_arr != other.n_head_kv_arr) return true;
         if (this->n_ff_arr      != other.n_ff_arr)      return true;
+        if (this->swa_layers    != other.swa_layers)    return true;
 
         if (this->n_rel_attn_bkts    != other.n_rel_attn_bkts)    return true;
         if (this->n_layer_dense_lead != other.n_layer_dense_lead) return true;
@@ -2494,6 +2498,14 @@ struct llama_hparams {
         GGML_ABORT("fatal error");
     }
 
+    bool is_swa(uint32_t il) const {
+        if (il < n_layer) {
+            return swa_layers[il];
+        }
+
+        GGML_ABORT("fatal error");
+    }
+
     uint32_t n_gqa(uint32_t il = 0) const {
         const uint32_t n_head    = this->n_head(il);
         const uint32_t n_head_kv = this->n_head_kv(il);
@@ -2562,11 +2574,16 @@ struct llama_cparams {
     float yarn_beta_slow;
     float defrag_thold;
 
+    uint32_t kv_block_size;
+    uint32_t n_pipeline_stages; // 0 = none, 1 = the graphs are computed asynchronously by a single stage
+    uint32_t n_swa_keep;
+
     bool embeddings;
     bool causal_attn;
     bool offload_kqv;
     bool flash_attn;
     bool no_perf;
+    bool lazy_rope;
 
     enum llama_pooling_type pooling_type;
 
@@ -2739,27 +2756,177 @@ struct llama_ubatch {
     int8_t       *  output;   // [n_tokens]
 };
 
-struct llama_kv_cell {
-    llama_pos pos   = -1;
-    llama_pos delta = 0;
-    int32_t   src   = -1; // used by recurrent state models to copy states
-    int32_t   tail  = -1;
+static inline int llama_popcount64(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(x);
+#else
+    int n = 0;
+    for (; x; x &= x - 1) {
+        n++;
+    }
+    return n;
+#endif
+}
+
+static inline int llama_ctz64(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(x);
+#else
+    int n = 0;
+    for (; !(x & 1); x >>= 1) {
+        n++;
+    }
+    return n;
+#endif
+}
+
+// struct-of-arrays store of the KV cells metadata
+// the loops over the cells (slot search, seq_* operations, KQ mask) touch only the arrays they need
+struct llama_kv_cells {
+    std::vector<llama_pos> pos;   // -1 if the cell is empty
+    std::vector<llama_pos> delta; // pending position shift of the cell
+    std::vector<int32_t>   src;   // used by recurrent state models to copy states
+    std::vector<int32_t>   tail;  // used by recurrent state models: cell holding the state of the seq with the same index
+
+    // the sequences of each cell, a bitset of n_seq_words 64-bit words per cell
+    // sized for n_seq_max sequences, it grows when a cell is given a higher seq_id (e.g. one per prompt in llama-embedding)
+    uint32_t              n_seq_words = 1;
+    std::vector<uint64_t> seq;
+
+    void resize(uint32_t n) {
+        pos  .assign(n, -1);
+        delta.assign(n,  0);
+        src  .assign(n, -1);
+        tail .assign(n, -1);
+        seq  .assign((size_t) n*n_seq_words, 0);
+    }
+
+    uint32_t size() const {
+        return pos.size();
+    }
+
+    bool has_seq_id(uint32_t i, llama_seq_id seq_id) const {
+        return seq_id >= 0 && (uint32_t) seq_id < 64*n_seq_words && (seq[(size_t) i*n_seq_words + seq_id/64] >> (seq_id % 64)) & 1;
+    }
+
+    bool is_empty(uint32_t i) const {
+        for (uint32_t w = 0; w < n_seq_words; ++w) {
+            if (seq[(size_t) i*n_seq_words + w]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    uint32_t seq_count(uint32_t i) const {
+        uint32_t n = 0;
+        for (uint32_t w = 0; w < n_seq_words; ++w) {
+            n += llama_popcount64(seq[(size_t) i*n_seq_words + w]);
+        }
+        return n;
+    }
+
+    // the lowest seq_id >= seq_id_min of cell i, -1 if there is none
+    llama_seq_id seq_next(uint32_t i, llama_seq_id seq_id_min) const {
+        for (uint32_t w = seq_id_min/64; w < n_seq_words; ++w) {
+            uint64_t bits = seq[(size_t) i*n_seq_words + w];
+            if (w == (uint32_t) seq_id_min/64) {
+                bits &= ~0ull << (seq_id_min % 64);
+            }
+            if (bits) {
+                return 64*w + llama_ctz64(bits);
+            }
+        }
+        return -1;
+    }
+
+    void seq_set(uint32_t i, llama_seq_id seq_id) {
+        GGML_ASSERT(seq_id >= 0);
+        if ((uint32_t) seq_id >= 64*n_seq_words) {
+            reserve_seq(seq_id + 1);
+        }
+        seq[(size_t) i*n_seq_words + seq_id/64] |= 1ull << (seq_id % 64);
+    }
+
+    void seq_unset(uint32_t i, llama_seq_id seq_id) {
+        if (seq_id >= 0 && (uint32_t) seq_id < 64*n_seq_words) {
+            seq[(size_t) i*n_seq_words + seq_id/64] &= ~(1ull << (seq_id % 64));
+        }
+    }
+
+    void seq_clear(uint32_t i) {
+        std::fill_n(seq.begin() + (size_t) i*n_seq_words, n_seq_words, 0);
+    }
 
-    std::set<llama_seq_id> seq_id;
+    void seq_swap(uint32_t i, uint32_t j) {
+        std::swap_ranges(seq.begin() + (size_t) i*n_seq_words, seq.begin() + (size_t) (i + 1)*n_seq_words, seq.begin() + (size_t) j*n_seq_words);
+    }
+
+    // copy the sequences of cell i to cell j
+    void seq_copy(uint32_t i, uint32_t j) {
+        std::copy_n(seq.begin() + (size_t) i*n_seq_words, n_seq_words, seq.begin() + (size_t) j*n_seq_words);
+    }
+
+    // make room for n_seq sequences in every cell
+    void reserve_seq(uint32_t n_seq) {
+        const uint32_t n_words = (n_seq + 63)/64;
+        if (n_words <= n_seq_words) {
+            return;
+        }
+
+        std::vector<uint64_t> seq_new((size_t) size()*n_words, 0);
+        for (uint32_t i = 0; i < size(); ++i) {
+            std::copy_n(seq.begin() + (size_t) i*n_seq_words, n_seq_words, seq_new.begin() + (size_t) i*n_words);
+        }
 
-    bool has_seq_id(const llama_seq_id & id) const {
-        return seq_id.find(id) != seq_id.end();
+        seq.swap(seq_new);
+        n_seq_words = n_words;
     }
 
-    bool is_empty() const {
-        return seq_id.empty();
+    // mark cell i as empty, the recurrent tail is kept since it is indexed by seq_id
+    void rm(uint32_t i) {
+        pos[i] = -1;
+        src[i] = -1;
+        seq_clear(i);
     }
 
-    bool is_same_seq(const llama_kv_cell & other) const {
-        return seq_id == other.seq_id;
+    // move the metadata of cell i to the empty cell j
+    void mv(uint32_t i, uint32_t j) {
+        pos  [j] = pos  [i];
+        delta[j] = delta[i];
+        src  [j] = src  [i];
+        tail [j] = tail [i];
+        seq_copy(i, j);
+
+        pos  [i] = -1;
+        delta[i] =  0;
+        src  [i] = -1;
+        tail [i] = -1;
+        seq_clear(i);
     }
 };
 
+// a run of consecutive ubatch tokens that is stored in consecutive KV cells
+struct llama_kv_seg {
+    uint32_t i_token; // index of the first token in the ubatch
+    uint32_t i_cell;  // index of the first cell in the cache
+    uint32_t n;       // number of tokens
+};
+
+// a run of cells to copy within the cache
+struct llama_kv_copy {
+    uint32_t i_src;
+    uint32_t i_dst;
+    uint32_t n;
+};
+
+// the layers whose KV data is stored in a cache
+enum llama_kv_layers {
+    LLAMA_KV_LAYERS_ALL,
+    LLAMA_KV_LAYERS_FULL, // the layers attending to the full context, the sliding-window layers have their own cache
+    LLAMA_KV_LAYERS_SWA,  // the sliding-window layers
+};
+
 // ring-buffer of cached KV data
 struct llama_kv_cache {
     bool has_shift = false;
@@ -2780,9 +2947,34 @@ struct llama_kv_cache {
     ggml_type type_k = GGML_TYPE_F16;
     ggml_type type_v = GGML_TYPE_F16;
 
-    std::vector<llama_kv_cell> cells;
+    llama_kv_cells cells;
+
+    // paged mode (block_size > 0): the cells are handed out in fixed-size blocks and each sequence
+    // appends to the last block of its block table, so a ubatch never needs a contiguous slot
+    // the graph stores the tokens with ggml_set_rows at the cells listed in an input, however scattered they are
+    uint32_t block_size = 0;
 
-    std::vector<struct ggml_tensor *> k_l; // per layer
+    std::vector<uint32_t> block_used; // number of used cells in each block
+    std::vector<uint32_t> block_ref;  // number of sequences referencing each block
+
+    // copy-on-write of shared blocks, applied before the next graph is computed
+    std::vector<llama_kv_copy> copies;
+
+    // per-sequence block tables, ordered by position (the last block is the one being filled)
+    std::unordered_map<llama_seq_id, std::vector<uint32_t>> seq_blocks;
+
+    // where the tokens of the current ubatch are stored (set by llama_kv_cache_find_slot in paged mode)
+    std::vector<llama_kv_seg> segs;
+
+    // sliding-window cache: number of positions kept behind the last position of each sequence, the older cells
+    // are released before a ubatch is stored (see llama_kv_cache_swa_prune) - 0 for a cache keeping the full history
+    uint32_t n_window = 0;
+
+    // sliding-window cache: number of cells at the start of each sequence that are not released with the window, so
+    // that a context shift that keeps them can bring them back into the window
+    uint32_t n_keep = 0;
+
+    std::vector<struct ggml_tensor *> k_l; // per layer, nullptr for the layers stored in another cache
     std::vector<struct ggml_tensor *> v_l;
 
     std::vector<struct ggml_context *> ctxs;
@@ -3256,6 +3448,58 @@ struct llama_sbatch {
     }
 };
 
+// a view of the KV cache cells that a run of tokens of the ubatch is stored in
+struct llama_graph_kv_view {
+    struct ggml_tensor * t;
+
+    const struct llama_kv_cache * kv;
+
+    uint32_t i_seg;   // index of the run of cells in the segments of the ubatch
+    size_t   nb_cell; // bytes per cell in the offset of the view
+};
+
+// the graph of the last ubatch, the next ubatch of the same shape reuses it (see llama_graph_reuse)
+struct llama_graph_cache {
+    struct ggml_cgraph * gf = nullptr;
+
+    // shape of the ubatch
+    uint32_t n_tokens  = 0;
+    uint32_t n_seqs    = 0;
+    int32_t  n_outputs = 0;
+    bool     embd      = false;
+    uint32_t n_kv      = 0;
+    uint32_t n_kv_swa  = 0;
+
+    // runs of cells of the ubatch in kv_self and kv_swa, only their cell indices may change on reuse
+    std::vector<llama_kv_seg> segs;
+    std::vector<llama_kv_seg> segs_swa;
+
+    // the KV store views, recorded while building the graph
+    std::vector<llama_graph_kv_view> views;
+
+    void clear() {
+        gf = nullptr;
+        views.clear();
+    }
+};
+
+// the outputs of a decode, set aside while the next one is computed by llama_decode_async (see llama_output_swap)
+struct llama_outputs {
+    ggml_backend_buffer_t buf_output = nullptr;
+
+    float * logits      = nullptr;
+    size_t  logits_size = 0;
+    float * embd        = nullptr;
+    size_t  embd_size   = 0;
+
+    std::vector<int32_t> output_ids;
+    std::vector<size_t>  out_ids; // outputs to reorder, see llama_sbatch::out_ids
+    size_t               output_size = 0;
+    int32_t              n_outputs   = 0;
+
+    std::map<llama_seq_id, std::vector<float>> embd_seq;
+};
+
 struct llama_context {
     llama_context(const llama_model & model)
         : model(model)
@@ -3263,13 +3507,23 @@ struct llama_context {
         , t_load_us(model.t_load_us) {}
 
     ~llama_context() {
+        // a graph of llama_decode_async() may still be computed in the compute buffers of the scheduler
+        if (sched) {
+            llama_synchronize(this);
+        }
+
         ggml_backend_sched_free(sched);
 
         for (ggml_backend_t backend : backends) {
             ggml_backend_free(backend);
         }
 
+        for (ggml_threadpool_t tp : threadpool_stages) {
+            ggml_threadpool_free(tp);
+        }
+
         ggml_backend_buffer_free(buf_output);
+        ggml_backend_buffer_free(outputs_prev.buf_output);
     }
 
     const struct llama_model & model;
@@ -3277,6 +3531,7 @@ struct llama_context {
     struct llama_cparams        cparams;
     struct llama_sbatch         sbatch;
     struct llama_kv_cache       kv_self;
+    struct llama_kv_cache       kv_swa; // the sliding-window layers, when they are not stored in kv_self (size 0)
     struct llama_control_vector cvec;
 
     std::unordered_map<struct llama_lora_adapter *, float> lora_adapters;
@@ -3290,9 +3545,18 @@ struct llama_context {
 #endif
     ggml_backend_t backend_cpu = nullptr;
 
+    // CPU pipeline stages, each one computes a contiguous range of layers on threads of its own
+    std::vector<ggml_backend_t>    backend_stages;
+    std::vector<ggml_threadpool_t> threadpool_stages;
+    bool                           stages_pipelined = false; // the current batch has several ubatches in flight
+
     ggml_threadpool_t threadpool       = nullptr;
     ggml_threadpool_t threadpool_batch = nullptr;
 
+    int32_t compute_priority = 0; // priority of the graphs on a threadpool shared with other contexts
+
+    struct ggml_profiler * profiler = nullptr;
+
     bool has_evaluated_once = false;
 
     mutable int64_t t_start_us;
@@ -3328,6 +3592,19 @@ struct llama_context {
     // populated only when pooling_type != LLAMA_POOLING_TYPE_NONE
     std::map<llama_seq_id, std::vector<float>> embd_seq;
 
+    // the outputs that the getters return while an async decode is in flight
+    llama_outputs outputs_prev;
+    bool          decode_pending = false;
+
+    // first error of the graphs that the pipeline stages computed in the background, reported by llama_decode_wait()
+    enum ggml_status compute_status = GGML_STATUS_SUCCESS;
+
+    // scratch buffers for the KQ mask: positions of the KV cells as seen by each sequence of the ubatch,
+    // the row of each seq_id in kq_mask_seq_pos (-1 if the seq_id is not in the ubatch) and the bitset of these seq_ids
+    std::vector<llama_pos> kq_mask_seq_pos;
+    std::vector<int32_t>   kq_mask_seq_row;
+    std::vector<uint64_t>  kq_mask_seq_bits;
+
     // whether we are computing encoder output or decoder output
     bool is_encoding = false;
 
@@ -3339,6 +3616,9 @@ struct llama_context {
     std::vector<uint8_t> buf_compute_meta;
     ggml_backend_sched_t sched = nullptr;
 
+    // the last decode graph, still allocated in sched when it can be reused
+    llama_graph_cache graph_cache;
+
     ggml_abort_callback abort_callback      = nullptr;
     void *              abort_callback_data = nullptr;
 
@@ -3349,7 +3629,11 @@ struct llama_context {
     struct ggml_tensor * inp_out_ids;     // I32 [n_outputs]
     struct ggml_tensor * inp_KQ_mask;     // F32 [kv_size, n_batch]
     struct ggml_tensor * inp_KQ_mask_swa; // F32 [kv_size, n_batch]
-    struct ggml_tensor * inp_K_shift;     // I32 [kv_size]
+    struct ggml_tensor * inp_K_shift;     // I32 [n_shift]
+    struct ggml_tensor * inp_K_shift_swa; // I32 [n_shift_swa]
+    struct ggml_tensor * inp_K_pos;       // I32 [n_kv]
+    struct ggml_tensor * inp_kv_idxs;     // I32 [n_batch]
+    struct ggml_tensor * inp_kv_idxs_swa; // I32 [n_batch]
     struct ggml_tensor * inp_mean;        // F32 [n_batch, n_batch]
     struct ggml_tensor * inp_cls;         // I32 [n_batch]
     struct ggml_tensor * inp_s_copy;      // I32 [kv_size]
@@ -3531,13 +3815,19 @@ static size_t llama_get_device_memory(const llama_model & model, int device) {
 // kv cache helpers
 //
 
+// block size of the paged cache of the sliding-window layers
+static uint32_t llama_kv_cache_swa_block_size(const struct llama_cparams & cparams) {
+    return cparams.kv_block_size > 0 ? cparams.kv_block_size : 32u;
+}
+
 static bool llama_kv_cache_init(
              struct llama_kv_cache & cache,
                const llama_context * ctx,
                          ggml_type   type_k,
                          ggml_type   type_v,
                           uint32_t   kv_size,
-                              bool   offload) {
+                              bool   offload,
+                   llama_kv_layers   layers = LLAMA_KV_LAYERS_ALL) {
     const llama_model & model = ctx->model;
     const llama_cparams & cparams = ctx->cparams;
 
@@ -3545,10 +3835,19 @@ static bool llama_kv_cache_init(
 
     const int64_t  n_layer = hparams.n_layer;
 
+    auto has_layer = [&](int64_t il) {
+        switch (layers) {
+            case LLAMA_KV_LAYERS_FULL: return !hparams.is_swa(il);
+            case LLAMA_KV_LAYERS_SWA:  return  hparams.is_swa(il);
+            default:                   return true;
+        }
+    };
+
     cache.has_shift = false;
 
     cache.recurrent = llama_model_is_recurrent(&model);
-    cache.v_trans   = !cache.recurrent && !cparams.flash_attn;
+    // the quantized V cache is never transposed, its blocks run along the embedding dimension
+    cache.v_trans   = !cache.recurrent && !cparams.flash_attn && !ggml_is_quantized(type_v);
 
     cache.head = 0;
     cache.size = kv_size;
@@ -3557,17 +3856,39 @@ static bool llama_kv_cache_init(
     cache.type_k = type_k;
     cache.type_v = type_v;
 
-    cache.cells.clear();
+    cache.cells.n_seq_words = std::max(1u, (cparams.n_seq_max + 63)/64);
     cache.cells.resize(kv_size);
 
+    cache.block_size = cache.recurrent ? 0 : cparams.kv_block_size;
+    cache.block_used.clear();
+    cache.block_ref.clear();
+    cache.copies.clear();
+    cache.seq_blocks.clear();
+    cache.segs.clear();
+
+    cache.n_window = 0;
+    cache.n_keep   = 0;
+
+    if (layers == LLAMA_KV_LAYERS_SWA) {
+        // the window cells of the sequences are released out of order, the paged cache reuses them without defragmentation
+        cache.block_size = llama_kv_cache_swa_block_size(cparams);
+        cache.n_window   = hparams.n_swa + cparams.n_ubatch;
+        cache.n_keep     = cparams.n_swa_keep;
+    }
+
+    if (cache.block_size > 0) {
+        GGML_ASSERT(kv_size % cache.block_size == 0);
+
+        cache.block_used.resize(kv_size/cache.block_size, 0);
+        cache.block_ref.resize(kv_size/cache.block_size, 0);
+    }
+
     // count used buffer types
     std::map<ggml_backend_buffer_type_t, int> buft_layer_count;
-    if (offload) {
-        for (int64_t i = 0; i < n_layer; ++i) {
-            buft_layer_count[model.buft_layer[i].buft]++;
+    for (int64_t i = 0; i < n_layer; ++i) {
+        if (has_layer(i)) {
+            buft_layer_count[offload ? model.buft_layer[i].buft : llama_default_buffer_type_cpu(true)]++;
         }
-    } else {
-        buft_layer_count[llama_default_buffer_type_cpu(true)] = n_layer;
     }
 
     // create a context for each buffer type
@@ -3592,6 +3913,12 @@ static bool llama_kv_cache_init(
     cache.v_l.reserve(n_layer);
 
     for (int i = 0; i < (int) n_layer; i++) {
+        if (!has_layer(i)) {
+            cache.k_l.push_back(nullptr);
+            cache.v_l.push_back(nullptr);
+            continue;
+        }
+
         const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa(i) + hparams.n_embd_k_s();
         const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(i) + hparams.n_embd_v_s();
 
@@ -3621,6 +3948,341 @@ static bool llama_kv_cache_init(
     return true;
 }
 
+// rebuild the block usage counts and the block tables of a paged cache from all the cells
+// only for the operations that move cells between blocks (defrag, state read) - the others use llama_kv_cache_update_blocks
+static void llama_kv_cache_rebuild_blocks(struct llama_kv_cache & cache) {
+    if (cache.block_size == 0) {
+        return;
+    }
+
+    const uint32_t n_blocks = cache.size/cache.block_size;
+
+    std::fill(cache.block_used.begin(), cache.block_used.end(), 0);
+    std::fill(cache.block_ref.begin(),  cache.block_ref.end(),  0);
+
+    // (highest position of the sequence in the block, block) - used to order the tables
+    std::unordered_map<llama_seq_id, std::vector<std::pair<llama_pos, uint32_t>>> tables;
+
+    for (uint32_t ib = 0; ib < n_blocks; ++ib) {
+        for (uint32_t i = ib*cache.block_size; i < (ib + 1)*cache.block_size; ++i) {
+            const llama_pos pos = cache.cells.pos[i];
+
+            if (pos < 0) {
+                continue;
+            }
+
+            cache.block_used[ib]++;
+
+            for (llama_seq_id seq_id = cache.cells.seq_next(i, 0); seq_id >= 0; seq_id = cache.cells.seq_next(i, seq_id + 1)) {
+                auto & table = tables[seq_id];
+                if (table.empty() || table.back().second != ib) {
+                    table.emplace_back(pos, ib);
+                } else {
+                    table.back().first = std::max(table.back().first, pos);
+                }
+            }
+        }
+    }
+
+    cache.seq_blocks.clear();
+
+    for (auto & it : tables) {
+        auto & table = it.second;
+        std::sort(table.begin(), table.end());
+
+        auto & blocks = cache.seq_blocks[it.first];
+        blocks.reserve(table.size());
+        for (const auto & entry : table) {
+            blocks.push_back(entry.second);
+            cache.block_ref[entry.second]++;
+        }
+    }
+}
+
+// update the block tables of seq_ids and the usage counts of the blocks in ib_touched, after an operation that changed only
+// the cells of seq_ids and only in these blocks or in the blocks of their tables - scans these blocks instead of the whole cache
+static void llama_kv_cache_update_blocks(struct llama_kv_cache & cache, const std::vector<llama_seq_id> & seq_ids, std::vector<uint32_t> ib_touched) {
+    if (cache.block_size == 0) {
+        return;
+    }
+
+    const uint32_t block_size = cache.block_size;
+
+    std::sort(ib_touched.begin(), ib_touched.end());
+    ib_touched.erase(std::unique(ib_touched.begin(), ib_touched.end()), ib_touched.end());
+
+    for (uint32_t ib : ib_touched) {
+        uint32_t n_used = 0;
+        for (uint32_t i = ib*block_size; i < (ib + 1)*block_size; ++i) {
+            n_used += cache.cells.pos[i] >= 0;
+        }
+        cache.block_used[ib] = n_used;
+    }
+
+    for (const llama_seq_id seq_id : seq_ids) {
+        std::vector<uint32_t> blocks = ib_touched;
+
+        auto it = cache.seq_blocks.find(seq_id);
+        if (it != cache.seq_blocks.end()) {
+            for (uint32_t ib : it->second) {
+                cache.block_ref[ib]--;
+            }
+            blocks.insert(blocks.end(), it->second.begin(), it->second.end());
+            std::sort(blocks.begin(), blocks.end());
+            blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+        }
+
+        // (highest position of the sequence in the block, block) - used to order the table
+        std::vector<std::pair<llama_pos, uint32_t>> table;
+
+        for (uint32_t ib : blocks) {
+            llama_pos pos_max = -1;
+            for (uint32_t i = ib*block_size; i < (ib + 1)*block_size; ++i) {
+                if (cache.cells.has_seq_id(i, seq_id)) {
+                    pos_max = std::max(pos_max, cache.cells.pos[i]);
+                }
+            }
+            if (pos_max >= 0) {
+                table.emplace_back(pos_max, ib);
+            }
+        }
+
+        if (table.empty()) {
+            if (it != cache.seq_blocks.end()) {
+                cache.seq_blocks.erase(it);
+            }
+            continue;
+        }
+
+        std::sort(table.begin(), table.end());
+
+        auto & table_seq = cache.seq_blocks[seq_id];
+        table_seq.clear();
+        for (const auto & entry : table) {
+            table_seq.push_back(entry.second);
+            cache.block_ref[entry.second]++;
+        }
+    }
+}
+
+static void llama_kv_cache_update_blocks(struct llama_kv_cache & cache, llama_seq_id seq_id, std::vector<uint32_t> ib_touched) {
+    llama_kv_cache_update_blocks(cache, std::vector<llama_seq_id>{ seq_id }, std::move(ib_touched));
+}
+
+// the distinct sequences of the cells in [i0, i1), added to seq_ids
+static void llama_kv_cache_collect_seqs(const struct llama_kv_cache & cache, uint32_t i0, uint32_t i1, std::vector<llama_seq_id> & seq_ids) {
+    for (uint32_t i = i0; i < i1; ++i) {
+        for (llama_seq_id seq_id = cache.cells.seq_next(i, 0); seq_id >= 0; seq_id = cache.cells.seq_next(i, seq_id + 1)) {
+            if (std::find(seq_ids.begin(), seq_ids.end(), seq_id) == seq_ids.end()) {
+                seq_ids.push_back(seq_id);
+            }
+        }
+    }
+}
+
+// make block ib the last entry of the block table of seq_id
+static void llama_kv_cache_block_append(struct llama_kv_cache & cache, llama_seq_id seq_id, uint32_t ib) {
+    auto & blocks = cache.seq_blocks[seq_id];
+
+    if (!blocks.empty() && blocks.back() == ib) {
+        return;
+    }
+
+    auto it = std::find(blocks.begin(), blocks.end(), ib);
+    if (it != blocks.end()) {
+        blocks.erase(it);
+    } else {
+        cache.block_ref[ib]++;
+    }
+
+    blocks.push_back(ib);
+}
+
+// copy-on-write: give seq_id a private copy of its cells in the shared block it is filling
+// the cells are moved to an empty block right away, the data is copied before the next graph compute (see cache.copies)
+// n_reserve cells are kept free for the rest of the ubatch, returns false if there is no room for the copy
+static bool llama_kv_cache_block_cow(struct llama_kv_cache & cache, llama_seq_id seq_id, uint32_t n_reserve) {
+    const uint32_t block_size = cache.block_size;
+    const uint32_t n_blocks   = cache.size/block_size;
+
+    auto & blocks = cache.seq_blocks[seq_id];
+
+    const uint32_t ib_src = blocks.back();
+
+    uint32_t n_copy = 0;
+    for (uint32_t i = ib_src*block_size; i < (ib_src + 1)*block_size; ++i) {
+        if (cache.cells.has_seq_id(i, seq_id)) {
+            n_copy++;
+        }
+    }
+
+    if (cache.used + n_copy + n_reserve > cache.size) {
+        return false;
+    }
+
+    uint32_t ib_dst = n_blocks;
+    for (uint32_t ib = 0; ib < n_blocks; ++ib) {
+        if (cache.block_used[ib] == 0) {
+            ib_dst = ib;
+            break;
+        }
+    }
+
+    if (ib_dst == n_blocks) {
+        return false;
+    }
+
+    uint32_t i_dst = ib_dst*block_size;
+
+    for (uint32_t i = ib_src*block_size; i < (ib_src + 1)*block_size; ++i) {
+        if (!cache.cells.has_seq_id(i, seq_id)) {
+            continue;
+        }
+
+        cache.cells.pos  [i_dst] = cache.cells.pos  [i];
+        cache.cells.delta[i_dst] = cache.cells.delta[i];
+        cache.cells.seq_set(i_dst, seq_id);
+
+        cache.block_used[ib_dst]++;
+        cache.used++;
+
+        cache.cells.seq_unset(i, seq_id);
+        if (cache.cells.is_empty(i)) {
+            cache.cells.rm(i);
+            cache.block_used[ib_src]--;
+            cache.used--;
+        }
+
+        if (!cache.copies.empty() && cache.copies.back().i_src + cache.copies.back().n == i && cache.copies.back().i_dst + cache.copies.back().n == i_dst) {
+            cache.copies.back().n++;
+        } else {
+            cache.copies.push_back({ i, i_dst, 1 });
+        }
+
+        i_dst++;
+    }
+
+    cache.block_ref[ib_src]--;
+    cache.block_ref[ib_dst]++;
+
+    blocks.back() = ib_dst;
+
+    return true;
+}
+
+// paged mode: each token goes to the block its sequence is filling, and a new block is started when
+// that one is full - the cells of a ubatch can be scattered over the cache, see cache.segs
+static bool llama_kv_cache_find_slot_paged(
+           struct llama_kv_cache & cache,
+       const struct llama_ubatch & batch) {
+    const uint32_t n_tokens     = batch.n_tokens;
+    const uint32_t n_seqs       = batch.n_seqs;
+    const uint32_t n_seq_tokens = batch.n_seq_tokens;
+
+    const uint32_t block_size = cache.block_size;
+    const uint32_t n_blocks   = cache.size/block_size;
+
+    if (cache.used + n_tokens > cache.size) {
+        return false;
+    }
+
+    // first free cell of block ib, or -1 if the block is full
+    auto block_find_free = [&](uint32_t ib) -> int32_t {
+        if (cache.block_used[ib] < block_size) {
+            for (uint32_t i = ib*block_size; i < (ib + 1)*block_size; ++i) {
+                if (cache.cells.pos[i] < 0) {
+                    return i;
+                }
+            }
+        }
+        return -1;
+    };
+
+    cache.segs.clear();
+
+    for (uint32_t s = 0; s < n_seqs; ++s) {
+        const llama_seq_id seq_id = batch.seq_id[s][0];
+
+        for (uint32_t j = 0; j < n_seq_tokens; ++j) {
+            const uint32_t k = s*n_seq_tokens + j;
+
+            const auto & blocks = cache.seq_blocks[seq_id];
+
+            int32_t i_cell = -1;
+
+            // the block being filled is shared with other sequences, e.g. the tail of a prompt copied with
+            // llama_kv_cache_seq_cp - copy it before diverging, so that the sequences stop interleaving their cells
+            // note: the full blocks of the shared prefix are never copied
+            if (!blocks.empty() && batch.n_seq_id[s] == 1 && cache.block_ref[blocks.back()] > 1 && cache.block_used[blocks.back()] < block_size) {
+                llama_kv_cache_block_cow(cache, seq_id, n_tokens - k);
+            }
+
+            // continue the block that the sequence is filling
+            if (!blocks.empty()) {
+                i_cell = block_find_free(blocks.back());
+            }
+
+            // start a new block, lowest free one first to keep the used part of the cache compact
+            for (uint32_t ib = 0; i_cell < 0 && ib < n_blocks; ++ib) {
+                if (cache.block_used[ib] == 0) {
+                    i_cell = ib*block_size;
+                }
+            }
+
+            // no empty block left - use any free cell
+            for (uint32_t ib = 0; i_cell < 0 && ib < n_blocks; ++ib) {
+                i_cell = block_find_free(ib);
+            }
+
+            // there are at least n_tokens free cells
+            GGML_ASSERT(i_cell >= 0);
+
+            const uint32_t ib = i_cell/block_size;
+
+            cache.cells.pos[i_cell] = batch.pos[k];
+
+            for (int32_t i = 0; i < batch.n_seq_id[s]; ++i) {
+                cache.cells.seq_set(i_cell, batch.seq_id[s][i]);
+                llama_kv_cache_block_append(cache, batch.seq_id[s][i], ib);
+            }
+
+            cache.block_used[ib]++;
+            cache.used++;
+
+            if (!cache.segs.empty() && cache.segs.back().i_token + cache.segs.back().n == k && cache.segs.back().i_cell + cache.segs.back().n == (uint32_t) i_cell) {
+                cache.segs.back().n++;
+            } else {
+                cache.segs.push_back({ k, (uint32_t) i_cell, 1 });
+            }
+        }
+    }
+
+    return true;
+}
+
+// release the cells of the last slot found by llama_kv_cache_find_slot_paged
+static void llama_kv_cache_free_segs(struct llama_kv_cache & cache) {
+    std::vector<llama_seq_id> seq_ids;
+    std::vector<uint32_t>     ib_touched;
+
+    for (const auto & seg : cache.segs) {
+        llama_kv_cache_collect_seqs(cache, seg.i_cell, seg.i_cell + seg.n, seq_ids);
+
+        for (uint32_t i = seg.i_cell; i < seg.i_cell + seg.n; ++i) {
+            cache.cells.rm(i);
+            cache.used--;
+
+            if (cache.block_size > 0) {
+                ib_touched.push_back(i/cache.block_size);
+            }
+        }
+    }
+
+    cache.segs.clear();
+
+    llama_kv_cache_update_blocks(cache, seq_ids, std::move(ib_touched));
+}
+
 // find an empty slot of size "n_tokens" in the cache
 // updates the cache head
 // Note: On success, it's important that cache.head points
@@ -3656,16 +4318,15 @@ static bool llama_kv_cache_find_slot(
                     return false;
                 }
                 if (j > 0) {
-                    llama_kv_cell & seq = cache.cells[seq_id];
-                    if (seq.tail >= 0) {
-                        llama_kv_cell & cell = cache.cells[seq.tail];
+                    int32_t & tail = cache.cells.tail[seq_id];
+                    if (tail >= 0) {
+                        const int32_t cell_id = tail;
                         // clear cells from seq_ids that become shared
                         // (should not normally happen, but let's handle it anyway)
-                        cell.seq_id.erase(seq_id);
-                        seq.tail = -1;
-                        if (cell.seq_id.empty()) {
-                            cell.pos = -1;
-                            cell.src = -1;
+                        cache.cells.seq_unset(cell_id, seq_id);
+                        tail = -1;
+                        if (cache.cells.is_empty(cell_id)) {
+                            cache.cells.rm(cell_id);
                             cache.used -= 1;
                         }
                     }
@@ -3678,8 +4339,10 @@ static bool llama_kv_cache_find_slot(
             std::vector<int32_t> tails_verif;
             tails_verif.assign(cache.size, -1);
             for (uint32_t i = 0; i < cache.size; ++i) {
-                llama_kv_cell & cell = cache.cells[i];
-                for (llama_seq_id seq_id : cell.seq_id) {
+                for (llama_seq_id seq_id = 0; seq_id < (llama_seq_id) cache.size; ++seq_id) {
+                    if (!cache.cells.has_seq_id(i, seq_id)) {
+                        continue;
+                    }
                     if (tails_verif[seq_id] != -1) {
                         LLAMA_LOG_ERROR("%s: duplicate tail for seq_id %d in cell %d and %d\n", __func__, seq_id, i, tails_verif[seq_id]);
                     }
@@ -3687,8 +4350,8 @@ static bool llama_kv_cache_find_slot(
                 }
             }
             for (uint32_t i = 0; i < cache.size; ++i) {
-                if (tails_verif[i] != cache.cells[i].tail) {
-                    LLAMA_LOG_ERROR("%s: wrong tail for seq_id %d, (%d instead of %d)\n", __func__, i, cache.cells[i].tail, tails_verif[i]);
+                if (tails_verif[i] != cache.cells.tail[i]) {
+                    LLAMA_LOG_ERROR("%s: wrong tail for seq_id %d, (%d instead of %d)\n", __func__, i, cache.cells.tail[i], tails_verif[i]);
                 }
             }
         }
@@ -3699,67 +4362,61 @@ static bool llama_kv_cache_find_slot(
 
         for (uint32_t i = 0; i < cache.size; ++i) {
             if (next_empty_cell >= cache.size) { next_empty_cell -= cache.size; }
-            llama_kv_cell & cell = cache.cells[next_empty_cell];
-            if (cell.is_empty()) { break; }
+            if (cache.cells.is_empty(next_empty_cell)) { break; }
             next_empty_cell += 1;
         }
 
         // find usable cell range
         for (uint32_t s = 0; s < n_seqs; ++s) {
             const llama_seq_id seq_id = batch.seq_id[s][0];
-            llama_kv_cell & seq_meta = cache.cells[seq_id];
+            int32_t & tail = cache.cells.tail[seq_id];
             bool has_cell = false;
-            if (seq_meta.tail >= 0) {
-                llama_kv_cell & cell = cache.cells[seq_meta.tail];
-                GGML_ASSERT(cell.has_seq_id(seq_id));
+            if (tail >= 0) {
+                GGML_ASSERT(cache.cells.has_seq_id(tail, seq_id));
                 // does this seq_id "own" the cell?
-                if (cell.seq_id.size() == 1) { has_cell = true; }
+                if (cache.cells.seq_count(tail) == 1) { has_cell = true; }
             }
             if (!has_cell) {
-                llama_kv_cell & empty_cell = cache.cells[next_empty_cell];
-                GGML_ASSERT(empty_cell.is_empty());
+                GGML_ASSERT(cache.cells.is_empty(next_empty_cell));
                 // copy old tail into the empty cell
-                if (seq_meta.tail >= 0) {
-                    llama_kv_cell & orig_cell = cache.cells[seq_meta.tail];
-                    empty_cell.pos = orig_cell.pos;
-                    empty_cell.src = orig_cell.src;
-                    orig_cell.seq_id.erase(seq_id);
-                    empty_cell.seq_id.insert(seq_id); // will be overwritten
+                if (tail >= 0) {
+                    cache.cells.pos[next_empty_cell] = cache.cells.pos[tail];
+                    cache.cells.src[next_empty_cell] = cache.cells.src[tail];
+                    cache.cells.seq_unset(tail, seq_id);
+                    cache.cells.seq_set(next_empty_cell, seq_id); // will be overwritten
                 }
-                seq_meta.tail = next_empty_cell;
+                tail = next_empty_cell;
                 // find next empty cell
                 if (s + 1 < n_seqs) {
                     next_empty_cell += 1;
                     for (uint32_t i = 0; i < cache.size; ++i) {
                         if (next_empty_cell >= cache.size) { next_empty_cell -= cache.size; }
-                        llama_kv_cell & cell = cache.cells[next_empty_cell];
-                        if (cell.is_empty()) { break; }
+                        if (cache.cells.is_empty(next_empty_cell)) { break; }
                         next_empty_cell += 1;
                     }
                 }
             }
-            if (min > seq_meta.tail) { min = seq_meta.tail; }
-            if (max < seq_meta.tail) { max = seq_meta.tail; }
+            if (min > tail) { min = tail; }
+            if (max < tail) { max = tail; }
         }
 
         // gather and re-order
         for (uint32_t s = 0; s < n_seqs; ++s) {
             int32_t dst_id = s + min;
-            int32_t src_id = cache.cells[batch.seq_id[s][0]].tail;
+            int32_t src_id = cache.cells.tail[batch.seq_id[s][0]];
             if (dst_id != src_id) {
-                llama_kv_cell & dst_cell = cache.cells[dst_id];
-                llama_kv_cell & src_cell = cache.cells[src_id];
-
-                std::swap(dst_cell.pos, src_cell.pos);
-                std::swap(dst_cell.src, src_cell.src);
-                std::swap(dst_cell.seq_id, src_cell.seq_id);
+                std::swap(cache.cells.pos[dst_id], cache.cells.pos[src_id]);
+                std::swap(cache.cells.src[dst_id], cache.cells.src[src_id]);
+                cache.cells.seq_swap(dst_id, src_id);
 
                 // swap tails (assuming they NEVER overlap)
-                for (const llama_seq_id seq_id : src_cell.seq_id) {
-                    cache.cells[seq_id].tail = src_id;
-                }
-                for (const llama_seq_id seq_id : dst_cell.seq_id) {
-                    cache.cells[seq_id].tail = dst_id;
+                for (llama_seq_id seq_id = 0; seq_id < (llama_seq_id) cache.size; ++seq_id) {
+                    if (cache.cells.has_seq_id(src_id, seq_id)) {
+                        cache.cells.tail[seq_id] = src_id;
+                    }
+                    if (cache.cells.has_seq_id(dst_id, seq_id)) {
+                        cache.cells.tail[seq_id] = dst_id;
+                    }
                 }
             }
         }
@@ -3768,20 +4425,20 @@ static bool llama_kv_cache_find_slot(
         for (uint32_t s = 0; s < n_seqs; ++s) {
             const llama_pos last_pos = batch.pos[n_seq_tokens * s + n_seq_tokens - 1];
             int32_t cell_id = s + min;
-            llama_kv_cell & cell = cache.cells[cell_id];
+            llama_pos & pos = cache.cells.pos[cell_id];
 
-            if (cell.pos >= 0 && last_pos != cell.pos + (llama_pos) n_seq_tokens) {
+            if (pos >= 0 && last_pos != pos + (llama_pos) n_seq_tokens) {
                 // What should happen when the pos backtracks or skips a value?
                 // Clearing the state mid-batch would require special-casing which isn't done.
                 LLAMA_LOG_WARN("%s: non-consecutive token position %d after %d for sequence %d with %u new tokens\n",
-                    __func__, last_pos, cell.pos, batch.seq_id[s][0], n_seq_tokens);
+                    __func__, last_pos, pos, batch.seq_id[s][0], n_seq_tokens);
             }
-            cell.pos = last_pos;
-            cell.seq_id.clear();
+            pos = last_pos;
+            cache.cells.seq_clear(cell_id);
             for (int32_t j = 0; j < batch.n_seq_id[s]; ++j) {
                 const llama_seq_id seq_id = batch.seq_id[s][j];
-                cell.seq_id.insert(seq_id);
-                cache.cells[seq_id].tail = cell_id;
+                cache.cells.seq_set(cell_id, seq_id);
+                cache.cells.tail[seq_id] = cell_id;
             }
         }
 
@@ -3799,6 +4456,10 @@ static bool llama_kv_cache_find_slot(
         return false;
     }
 
+    if (cache.block_size > 0) {
+        return llama_kv_cache_find_slot_paged(cache, batch);
+    }
+
     uint32_t n_tested = 0;
 
     while (true) {
@@ -3810,7 +4471,7 @@ static bool llama_kv_cache_find_slot(
 
         bool found = true;
         for (uint32_t i = 0; i < n_tokens; i++) {
-            if (cache.cells[cache.head + i].pos >= 0) {
+            if (cache.cells.pos[cache.head + i] >= 0) {
                 found = false;
                 cache.head += i + 1;
                 n_tested   += i + 1;
@@ -3831,10 +4492,10 @@ static bool llama_kv_cache_find_slot(
     for (uint32_t s = 0; s < n_seqs; s++) {
         for (uint32_t i = 0; i < n_seq_tokens; ++i) {
             uint32_t k = s*n_seq_tokens + i;
-            cache.cells[cache.head + k].pos = batch.pos[k];
+            cache.cells.pos[cache.head + k] = batch.pos[k];
 
             for (int32_t j = 0; j < batch.n_seq_id[s]; j++) {
-                cache.cells[cache.head + k].seq_id.insert(batch.seq_id[s][j]);
+                cache.cells.seq_set(cache.head + k, batch.seq_id[s][j]);
             }
         }
     }
@@ -3847,9 +4508,7 @@ static bool llama_kv_cache_find_slot(
 // find how many cells are currently in use
 static uint32_t llama_kv_cache_cell_max(const struct llama_kv_cache & cache) {
     for (uint32_t i = cache.size; i > 0; --i) {
-        const llama_kv_cell & cell = cache.cells[i - 1];
-
-        if (cell.pos >= 0 && !cell.is_empty()) {
+        if (cache.cells.pos[i - 1] >= 0 && !cache.cells.is_empty(i - 1)) {
             return i;
         }
     }
@@ -3858,15 +4517,14 @@ static uint32_t llama_kv_cache_cell_max(const struct llama_kv_cache & cache) {
 }
 
 static void llama_kv_cache_clear(struct llama_kv_cache & cache) {
-    for (int32_t i = 0; i < (int32_t) cache.size; ++i) {
-        cache.cells[i].pos = -1;
-        cache.cells[i].seq_id.clear();
-        cache.cells[i].src = -1;
-        cache.cells[i].tail = -1;
-    }
+    cache.cells.resize(cache.size);
     cache.head = 0;
     cache.used = 0;
 
+    std::fill(cache.block_used.begin(), cache.block_used.end(), 0);
+    std::fill(cache.block_ref.begin(),  cache.block_ref.end(),  0);
+    cache.seq_blocks.clear();
+
     for (auto & buf : cache.bufs) {
         ggml_backend_buffer_clear(buf, 0);
     }
@@ -3889,15 +4547,15 @@ static bool llama_kv_cache_seq_rm(
             return false;
         }
         if (0 <= seq_id) {
-            int32_t & tail_id = cache.cells[seq_id].tail;
+            int32_t & tail_id = cache.cells.tail[seq_id];
             if (tail_id >= 0) {
-                const llama_kv_cell & cell = cache.cells[tail_id];
+                const llama_pos pos = cache.cells.pos[tail_id];
                 // partial intersection is invalid
-                if ((0 < p0 && p0 <= cell.pos) || (0 < p1 && p1 <= cell.pos)) {
+                if ((0 < p0 && p0 <= pos) || (0 < p1 && p1 <= pos)) {
                     return false;
                 }
                 // invalidate tails which will be cleared
-                if (p0 <= cell.pos && cell.pos < p1) {
+                if (p0 <= pos && pos < p1) {
                     tail_id = -1;
                 }
             }
@@ -3909,21 +4567,30 @@ static bool llama_kv_cache_seq_rm(
         }
     }
 
+    // the blocks of the removed cells and, for seq_id < 0, their sequences
+    std::vector<uint32_t>     ib_touched;
+    std::vector<llama_seq_id> seq_ids;
+
     for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
+        if (cache.cells.pos[i] >= p0 && cache.cells.pos[i] < p1) {
             if (seq_id < 0) {
-                cache.cells[i].seq_id.clear();
-            } else if (cache.cells[i].has_seq_id(seq_id)) {
-                cache.cells[i].seq_id.erase(seq_id);
+                if (cache.block_size > 0) {
+                    llama_kv_cache_collect_seqs(cache, i, i + 1, seq_ids);
+                }
+                cache.cells.seq_clear(i);
+            } else if (cache.cells.has_seq_id(i, seq_id)) {
+                cache.cells.seq_unset(i, seq_id);
             } else {
                 continue;
             }
-            if (cache.cells[i].is_empty()) {
+            if (cache.block_size > 0 && (ib_touched.empty() || ib_touched.back() != i/cache.block_size)) {
+                ib_touched.push_back(i/cache.block_size);
+            }
+            if (cache.cells.is_empty(i)) {
                 // keep count of the number of used cells
-                if (cache.cells[i].pos >= 0) cache.used--;
+                if (cache.cells.pos[i] >= 0) cache.used--;
 
-                cache.cells[i].pos = -1;
-                cache.cells[i].src = -1;
+                cache.cells.rm(i);
                 if (new_head == cache.size) new_head = i;
             }
         }
@@ -3932,6 +4599,12 @@ static bool llama_kv_cache_seq_rm(
     // If we freed up a slot, set head to it so searching can start there.
     if (new_head != cache.size && new_head < cache.head) cache.head = new_head;
 
+    if (seq_id < 0) {
+        llama_kv_cache_update_blocks(cache, seq_ids, std::move(ib_touched));
+    } else {
+        llama_kv_cache_update_blocks(cache, seq_id, std::move(ib_touched));
+    }
+
     return true;
 }
 
@@ -3946,26 +4619,23 @@ static void llama_kv_cache_seq_cp(
 
     if (cache.recurrent) {
         if ((uint32_t) seq_id_dst < cache.size && (uint32_t) seq_id_src < cache.size) {
-            llama_kv_cell & tail_src = cache.cells[seq_id_src];
-            llama_kv_cell & tail_dst = cache.cells[seq_id_dst];
-            if (tail_dst.tail >= 0) {
+            const int32_t tail_src = cache.cells.tail[seq_id_src];
+                  int32_t & tail_dst = cache.cells.tail[seq_id_dst];
+            if (tail_dst >= 0) {
                 // clear destination seq_id if it wasn't empty
-                llama_kv_cell & cell_dst = cache.cells[tail_dst.tail];
-
-                cell_dst.seq_id.erase(seq_id_dst);
-                tail_dst.tail = -1;
-                if (cell_dst.seq_id.empty()) {
-                    cell_dst.pos = -1;
-                    cell_dst.delta = -1;
-                    cell_dst.src = -1;
+                const int32_t cell_dst = tail_dst;
+
+                cache.cells.seq_unset(cell_dst, seq_id_dst);
+                tail_dst = -1;
+                if (cache.cells.is_empty(cell_dst)) {
+                    cache.cells.rm(cell_dst);
+                    cache.cells.delta[cell_dst] = -1;
                     cache.used -= 1;
                 }
             }
-            if (tail_src.tail >= 0) {
-                llama_kv_cell & cell_src = cache.cells[tail_src.tail];
-
-                cell_src.seq_id.insert(seq_id_dst);
-                tail_dst.tail = tail_src.tail;
+            if (tail_src >= 0) {
+                cache.cells.seq_set(tail_src, seq_id_dst);
+                tail_dst = tail_src;
             }
         }
 
@@ -3975,34 +4645,141 @@ static void llama_kv_cache_seq_cp(
 
     cache.head = 0;
 
+    std::vector<uint32_t> ib_touched;
+
     for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id_src) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            cache.cells[i].seq_id.insert(seq_id_dst);
+        if (cache.cells.has_seq_id(i, seq_id_src) && cache.cells.pos[i] >= p0 && cache.cells.pos[i] < p1) {
+            cache.cells.seq_set(i, seq_id_dst);
+
+            if (cache.block_size > 0 && (ib_touched.empty() || ib_touched.back() != i/cache.block_size)) {
+                ib_touched.push_back(i/cache.block_size);
+            }
         }
     }
+
+    llama_kv_cache_update_blocks(cache, seq_id_dst, std::move(ib_touched));
 }
 
 static void llama_kv_cache_seq_keep(struct llama_kv_cache & cache, llama_seq_id seq_id) {
     uint32_t new_head = cache.size;
 
+    // the blocks of the removed cells
+    std::vector<uint32_t> ib_touched;
+
     for (uint32_t i = 0; i < cache.size; ++i) {
         if (cache.recurrent && (llama_seq_id) i != seq_id) {
-            cache.cells[i].tail = -1;
+            cache.cells.tail[i] = -1;
         }
-        if (!cache.cells[i].has_seq_id(seq_id)) {
-            if (cache.cells[i].pos >= 0) cache.used--;
-            cache.cells[i].pos = -1;
-            cache.cells[i].src = -1;
-            cache.cells[i].seq_id.clear();
+        if (!cache.cells.has_seq_id(i, seq_id)) {
+            if (cache.cells.pos[i] >= 0) {
+                cache.used--;
+                if (cache.block_size > 0 && (ib_touched.empty() || ib_touched.back() != i/cache.block_size)) {
+                    ib_touched.push_back(i/cache.block_size);
+                }
+            }
+            cache.cells.rm(i);
             if (new_head == cache.size) new_head = i;
         } else {
-            cache.cells[i].seq_id.clear();
-            cache.cells[i].seq_id.insert(seq_id);
+            cache.cells.seq_clear(i);
+            cache.cells.seq_set(i, seq_id);
         }
     }
 
     // If we freed up a slot, set head to it so searching can start there.
     if (new_head != cache.size && new_head < cache.head) cache.head = new_head;
+
+    if (cache.block_size > 0) {
+        // the cells of seq_id stay where they were, so only its table is left and its blocks are no longer shared
+        for (uint32_t ib : ib_touched) {
+            uint32_t n_used = 0;
+            for (uint32_t i = ib*cache.block_size; i < (ib + 1)*cache.block_size; ++i) {
+                n_used += cache.cells.pos[i] >= 0;
+            }
+            cache.block_used[ib] = n_used;
+        }
+
+        for (auto it = cache.seq_blocks.begin(); it != cache.seq_blocks.end(); ) {
+            it = it->first == seq_id ? std::next(it) : cache.seq_blocks.erase(it);
+        }
+
+        std::fill(cache.block_ref.begin(), cache.block_ref.end(), 0);
+
+        auto it = cache.seq_blocks.find(seq_id);
+        if (it != cache.seq_blocks.end()) {
+            for (uint32_t ib : it->second) {
+                cache.block_ref[ib] = 1;
+            }
+        }
+    }
+}
+
+// copy-on-shift: give seq_id private copies of the cells in [p0, p1) that it shares with other sequences (e.g. a
+// prompt prefix copied with llama_kv_cache_seq_cp), so that moving its cells leaves the positions of the others intact
+// the cells that the shift by delta drops are not copied, the data is copied before the next graph compute (see cache.copies)
+// the blocks of the copies are added to ib_touched
+static void llama_kv_cache_seq_unshare(
+        struct llama_kv_cache & cache,
+                 llama_seq_id   seq_id,
+                    llama_pos   p0,
+                    llama_pos   p1,
+                    llama_pos   delta,
+        std::vector<uint32_t> & ib_touched) {
+    const uint32_t block_size = cache.block_size;
+
+    int32_t i_dst = -1;
+
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        if (!cache.cells.has_seq_id(i, seq_id) || cache.cells.seq_count(i) < 2) {
+            continue;
+        }
+        if (cache.cells.pos[i] < p0 || cache.cells.pos[i] >= p1 || cache.cells.pos[i] + delta < 0) {
+            continue;
+        }
+
+        // keep the copies of a run of shared cells together, in paged mode a run continues into the next block only
+        // if that block is empty
+        if (i_dst >= 0 && ((uint32_t) i_dst + 1 >= cache.size || cache.cells.pos[i_dst + 1] >= 0 ||
+                           (block_size > 0 && (i_dst + 1) % block_size == 0 && cache.block_used[(i_dst + 1)/block_size] > 0))) {
+            i_dst = -1;
+        } else if (i_dst >= 0) {
+            i_dst++;
+        }
+
+        // paged mode: start an empty block, so that the copies do not end up in the blocks of other sequences
+        for (uint32_t ib = 0; i_dst < 0 && block_size > 0 && ib < cache.size/block_size; ++ib) {
+            if (cache.block_used[ib] == 0) {
+                i_dst = ib*block_size;
+            }
+        }
+
+        for (uint32_t j = 0; i_dst < 0 && j < cache.size; ++j) {
+            if (cache.cells.pos[j] < 0) {
+                i_dst = j;
+            }
+        }
+
+        if (i_dst < 0) {
+            LLAMA_LOG_WARN("%s: no free cell to copy the shared cells of seq %d, their other sequences are shifted too\n", __func__, seq_id);
+            return;
+        }
+
+        cache.cells.pos  [i_dst] = cache.cells.pos  [i];
+        cache.cells.delta[i_dst] = cache.cells.delta[i];
+        cache.cells.seq_set(i_dst, seq_id);
+        cache.cells.seq_unset(i, seq_id);
+
+        cache.used++;
+        if (block_size > 0) {
+            cache.block_used[i_dst/block_size]++;
+            ib_touched.push_back(i_dst/block_size);
+        }
+
+        if (!cache.copies.empty() && cache.copies.back().i_src + cache.copies.back().n == i && cache.copies.back().i_dst + cache.copies.back().n == (uint32_t) i_dst) {
+            cache.copies.back().n++;
+        } else {
+            cache.copies.push_back({ i, (uint32_t) i_dst, 1 });
+        }
+    }
 }
 
 static void llama_kv_cache_seq_add(
@@ -4021,32 +4798,46 @@ static void llama_kv_cache_seq_add(
     if (cache.recurrent) {
         // for Mamba-like or RWKV models, only the pos needs to be shifted
         if (0 <= seq_id && seq_id < (int64_t) cache.size) {
-            const int32_t tail_id = cache.cells[seq_id].tail;
+            const int32_t tail_id = cache.cells.tail[seq_id];
             if (tail_id >= 0) {
-                llama_kv_cell & cell = cache.cells[tail_id];
-                if (cell.has_seq_id(seq_id) && p0 <= cell.pos && cell.pos < p1) {
-                    cell.pos += delta;
+                llama_pos & pos = cache.cells.pos[tail_id];
+                if (cache.cells.has_seq_id(tail_id, seq_id) && p0 <= pos && pos < p1) {
+                    pos += delta;
                 }
             }
         }
         return;
     }
 
+    // the blocks of the copies and of the dropped cells
+    std::vector<uint32_t> ib_touched;
+
+    llama_kv_cache_seq_unshare(cache, seq_id, p0, p1, delta, ib_touched);
+
     for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
+        if (cache.cells.has_seq_id(i, seq_id) && cache.cells.pos[i] >= p0 && cache.cells.pos[i] < p1) {
+            if (cache.cells.pos[i] + delta < 0 && cache.cells.seq_count(i) > 1) {
+                // dropped by this sequence only
+                cache.cells.seq_unset(i, seq_id);
+                continue;
+            }
+
             cache.has_shift = true;
-            cache.cells[i].pos   += delta;
-            cache.cells[i].delta += delta;
+            cache.cells.pos  [i] += delta;
+            cache.cells.delta[i] += delta;
 
-            if (cache.cells[i].pos < 0) {
-                if (!cache.cells[i].is_empty()) {
+            if (cache.cells.pos[i] < 0) {
+                if (!cache.cells.is_empty(i)) {
                     cache.used--;
                 }
-                cache.cells[i].pos = -1;
-                cache.cells[i].seq_id.clear();
+                cache.cells.pos[i] = -1;
+                cache.cells.seq_clear(i);
                 if (new_head == cache.size) {
                     new_head = i;
                 }
+                if (cache.block_size > 0) {
+                    ib_touched.push_back(i/cache.block_size);
+                }
             }
         }
     }
@@ -4054,6 +4845,8 @@ static void llama_kv_cache_seq_add(
     // If we freed up a slot, set head to it so searching can start there.
     // Otherwise we just start the next search from the beginning.
     cache.head = new_head != cache.size ? new_head : 0;
+
+    llama_kv_cache_update_blocks(cache, seq_id, std::move(ib_touched));
 }
 
 static void llama_kv_cache_seq_div(
@@ -4070,42 +4863,225 @@ static void llama_kv_cache_seq_div(
     if (cache.recurrent) {
         // for Mamba-like or RWKV models, only the pos needs to be changed
         if (0 <= seq_id && seq_id < (int64_t) cache.size) {
-            const int32_t tail_id = cache.cells[seq_id].tail;
+            const int32_t tail_id = cache.cells.tail[seq_id];
             if (tail_id >= 0) {
-                llama_kv_cell & cell = cache.cells[tail_id];
-                if (cell.has_seq_id(seq_id) && p0 <= cell.pos && cell.pos < p1) {
-                    cell.pos /= d;
+                llama_pos & pos = cache.cells.pos[tail_id];
+                if (cache.cells.has_seq_id(tail_id, seq_id) && p0 <= pos && pos < p1) {
+                    pos /= d;
                 }
             }
         }
         return;
     }
 
+    std::vector<uint32_t> ib_touched;
+
+    llama_kv_cache_seq_unshare(cache, seq_id, p0, p1, 0, ib_touched);
+
     for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
+        if (cache.cells.has_seq_id(i, seq_id) && cache.cells.pos[i] >= p0 && cache.cells.pos[i] < p1) {
             cache.has_shift = true;
 
             {
-                llama_pos p_old = cache.cells[i].pos;
-                cache.cells[i].pos   /= d;
-                cache.cells[i].delta += cache.cells[i].pos - p_old;
+                llama_pos p_old = cache.cells.pos[i];
+                cache.cells.pos  [i] /= d;
+                cache.cells.delta[i] += cache.cells.pos[i] - p_old;
             }
         }
     }
+
+    llama_kv_cache_update_blocks(cache, seq_id, std::move(ib_touched));
 }
 
 static llama_pos llama_kv_cache_seq_pos_max(struct llama_kv_cache & cache, llama_seq_id seq_id) {
     llama_pos result = 0;
 
     for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id)) {
-            result = std::max(result, cache.cells[i].pos);
+        if (cache.cells.has_seq_id(i, seq_id)) {
+            result = std::max(result, cache.cells.pos[i]);
         }
     }
 
     return result;
 }
 
+// range of cells [first, second) with a pending K-shift, empty if no cell has moved
+// the K-shift graph only rotates this range, so moving a few cells (e.g. the attention sinks) stays cheap
+static std::pair<uint32_t, uint32_t> llama_kv_cache_shift_range(const struct llama_kv_cache & cache) {
+    uint32_t c0 = cache.size;
+    uint32_t c1 = 0;
+
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        if (cache.cells.delta[i] != 0) {
+            c0 = std::min(c0, i);
+            c1 = i + 1;
+        }
+    }
+
+    return { std::min(c0, c1), c1 };
+}
+
+// sliding-window cache: release the cells that the tokens of the ubatch and the tokens after them can no longer see
+// a sequence keeps cache.n_window positions behind its last one, so that it can be rewound by up to n_ubatch tokens
+static void llama_kv_cache_swa_prune(
+           struct llama_kv_cache & cache,
+       const struct llama_ubatch & batch,
+                        uint32_t   n_swa) {
+    // (seq_id, first position, last position) of the sequences of the ubatch
+    std::vector<std::tuple<llama_seq_id, llama_pos, llama_pos>> seq_range;
+
+    for (uint32_t s = 0; s < batch.n_seqs; ++s) {
+        for (uint32_t j = 0; j < batch.n_seq_tokens; ++j) {
+            const llama_pos pos = batch.pos[s*batch.n_seq_tokens + j];
+
+            for (int32_t i = 0; i < batch.n_seq_id[s]; ++i) {
+                const llama_seq_id seq_id = batch.seq_id[s][i];
+
+                auto it = std::find_if(seq_range.begin(), seq_range.end(), [&](const auto & r) { return std::get<0>(r) == seq_id; });
+                if (it == seq_range.end()) {
+                    seq_range.emplace_back(seq_id, pos, pos);
+                } else {
+                    std::get<1>(*it) = std::min(std::get<1>(*it), pos);
+                    std::get<2>(*it) = std::max(std::get<2>(*it), pos);
+                }
+            }
+        }
+    }
+
+    // the cells of each sequence up to this position are released
+    std::vector<std::pair<llama_seq_id, llama_pos>> seq_pos_rm;
+
+    for (const auto & r : seq_range) {
+        seq_pos_rm.emplace_back(std::get<0>(r), std::min(std::get<1>(r) - (llama_pos) n_swa, std::get<2>(r) - (llama_pos) cache.n_window));
+    }
+
+    // the first cache.n_keep cells of each sequence, up to this position, are kept
+    std::vector<llama_pos> seq_pos_keep(seq_pos_rm.size(), -1);
+
+    if (cache.n_keep > 0) {
+        std::vector<llama_pos> seq_pos;
+
+        for (size_t k = 0; k < seq_pos_rm.size(); ++k) {
+            seq_pos.clear();
+            for (uint32_t i = 0; i < cache.size; ++i) {
+                if (cache.cells.pos[i] >= 0 && cache.cells.has_seq_id(i, seq_pos_rm[k].first)) {
+                    seq_pos.push_back(cache.cells.pos[i]);
+                }
+            }
+
+            if (seq_pos.size() <= cache.n_keep) {
+                seq_pos_keep[k] = std::numeric_limits<llama_pos>::max();
+            } else {
+                std::nth_element(seq_pos.begin(), seq_pos.begin() + cache.n_keep - 1, seq_pos.end());
+                seq_pos_keep[k] = seq_pos[cache.n_keep - 1];
+            }
+        }
+    }
+
+    // the blocks of the released cells
+    std::vector<uint32_t> ib_touched;
+
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        if (cache.cells.pos[i] < 0) {
+            continue;
+        }
+
+        for (size_t k = 0; k < seq_pos_rm.size(); ++k) {
+            const auto & it = seq_pos_rm[k];
+
+            if (cache.cells.pos[i] <= it.second && cache.cells.pos[i] > seq_pos_keep[k] && cache.cells.has_seq_id(i, it.first)) {
+                cache.cells.seq_unset(i, it.first);
+
+                if (ib_touched.empty() || ib_touched.back() != i/cache.block_size) {
+                    ib_touched.push_back(i/cache.block_size);
+                }
+            }
+        }
+
+        if (cache.cells.is_empty(i)) {
+            cache.cells.rm(i);
+            cache.used--;
+        }
+    }
+
+    if (!ib_touched.empty()) {
+        std::vector<llama_seq_id> seq_ids;
+        for (const auto & it : seq_pos_rm) {
+            seq_ids.push_back(it.first);
+        }
+        llama_kv_cache_update_blocks(cache, seq_ids, std::move(ib_touched));
+    }
+}
+
+// sliding-window cache: check that after removing [p0, p1) from the sequence, the cells that the next token of the
+// sequence attends to are still in the cache - the positions older than the window of the sequence are not kept
+// a removal is often followed by shifting the cells after p1 down by p1 - p0 (context shift), which can bring older
+// cells (e.g. the n_keep cells at the start) back into the window, so the check is done with both positions
+static bool llama_kv_cache_swa_can_rm(
+     const struct llama_kv_cache & cache,
+     const struct llama_kv_cache & cache_swa,
+                    llama_seq_id   seq_id,
+                       llama_pos   p0,
+                       llama_pos   p1,
+                        uint32_t   n_swa) {
+    if (p0 < 0) p0 = 0;
+    if (p1 < 0) p1 = std::numeric_limits<llama_pos>::max();
+
+    auto is_kept = [&](const llama_kv_cache & kv, uint32_t i, llama_seq_id s) {
+        return kv.cells.has_seq_id(i, s) && (kv.cells.pos[i] < p0 || kv.cells.pos[i] >= p1);
+    };
+
+    auto check = [&](llama_seq_id s, llama_pos shift) {
+        auto pos_of = [&](const llama_kv_cache & kv, uint32_t i) {
+            return kv.cells.pos[i] >= p1 ? kv.cells.pos[i] - shift : kv.cells.pos[i];
+        };
+
+        llama_pos pos_max = -1;
+        for (uint32_t i = 0; i < cache.size; ++i) {
+            if (is_kept(cache, i, s)) {
+                pos_max = std::max(pos_max, pos_of(cache, i));
+            }
+        }
+
+        // the window of the token at pos_max + 1
+        const llama_pos pos_min = pos_max + 2 - (llama_pos) n_swa;
+
+        uint32_t n_cells     = 0;
+        uint32_t n_cells_swa = 0;
+        for (uint32_t i = 0; i < cache.size; ++i) {
+            n_cells += is_kept(cache, i, s) && pos_of(cache, i) >= pos_min;
+        }
+        for (uint32_t i = 0; i < cache_swa.size; ++i) {
+            n_cells_swa += is_kept(cache_swa, i, s) && pos_of(cache_swa, i) >= pos_min;
+        }
+
+        return n_cells == n_cells_swa;
+    };
+
+    auto check_seq = [&](llama_seq_id s) {
+        return check(s, 0) && check(s, p1 - p0);
+    };
+
+    if (seq_id >= 0) {
+        return check_seq(seq_id);
+    }
+
+    std::set<llama_seq_id> seqs;
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        for (llama_seq_id s = cache.cells.seq_next(i, 0); s >= 0; s = cache.cells.seq_next(i, s + 1)) {
+            seqs.insert(s);
+        }
+    }
+
+    for (llama_seq_id s : seqs) {
+        if (!check_seq(s)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 static void llama_kv_cache_defrag(struct llama_kv_cache & cache) {
     if (!cache.recurrent) {
         cache.do_defrag = true;
@@ -4117,6 +5093,27 @@ static uint32_t llama_kv_cache_get_padding(const struct llama_cparams & cparams)
     return cparams.flash_attn ? 256u : 32u;
 }
 
+// number of cells of the cache of the sliding-window layers, 0 if they are stored in the main cache
+// each sequence keeps at most n_window cells and its n_swa_keep first cells, which can straddle one more block than they
+// fill, plus a free block for copy-on-write
+static uint32_t llama_kv_cache_swa_size(const struct llama_hparams & hparams, const struct llama_cparams & cparams) {
+    if (hparams.n_swa == 0 || !std::any_of(hparams.swa_layers.begin(), hparams.swa_layers.begin() + hparams.n_layer, [](bool swa) { return swa; })) {
+        return 0;
+    }
+
+    const uint32_t block_size = llama_kv_cache_swa_block_size(cparams);
+    const uint32_t n_window   = hparams.n_swa + cparams.n_ubatch + cparams.n_swa_keep;
+
+    const uint32_t size = GGML_PAD(cparams.n_seq_max*(GGML_PAD(n_window, block_size) + 2*block_size), std::max(llama_kv_cache_get_padding(cparams), block_size));
+
+    // no memory to save
+    if (size >= cparams.n_ctx) {
+        return 0;
+    }
+
+    return size;
+}
+
 //
 // model loading and saving
 //
@@ -4588,6 +5585,12 @@ struct llama_model_loader {
             use_mmap = false;
         }
 
+        if (use_mmap && ggml_is_numa_split()) {
+            // the page cache of a mapped file cannot be placed per node, the weights are loaded into node-local buffers instead
+            LLAMA_LOG_INFO("%s: NUMA split mode, disabling mmap\n", __func__);
+            use_mmap = false;
+        }
+
         this->use_mmap = use_mmap;
         this->check_tensors = check_tensors;
     }
@@ -5369,6 +6372,7 @@ static void llm_load_hparams(
     std::fill(hparams.n_head_arr.begin(),    hparams.n_head_arr.end(),    0);
     std::fill(hparams.n_head_kv_arr.begin(), hparams.n_head_kv_arr.end(), 0);
     std::fill(hparams.n_ff_arr.begin(),      hparams.n_ff_arr.end(),      0);
+    std::fill(hparams.swa_layers.begin(),    hparams.swa_layers.end(),    false);
 
     ml.get_key_or_arr(LLM_KV_FEED_FORWARD_LENGTH,  hparams.n_ff_arr,   hparams.n_layer);
     ml.get_key_or_arr(LLM_KV_ATTENTION_HEAD_COUNT, hparams.n_head_arr, hparams.n_layer);
@@ -5686,6 +6690,9 @@ static void llm_load_hparams(
                 if (!found_swa && hparams.n_swa == 0) {
                     throw std::runtime_error("invalid value for sliding_window");
                 }
+
+                // all layers use the sliding window
+                std::fill(hparams.swa_layers.begin(), hparams.swa_layers.begin() + hparams.n_layer, true);
             } break;
         case LLM_ARCH_PLAMO:
             {
@@ -5747,6 +6754,11 @@ static void llm_load_hparams(
             {
                 hparams.n_swa = 4096; // default value of gemma 2
                 ml.get_key(LLM_KV_ATTENTION_SLIDING_WINDOW, hparams.n_swa, false);
+
+                // the even layers use the sliding window, the odd layers attend to the full context
+                for (uint32_t il = 0; il < hparams.n_layer; il += 2) {
+                    hparams.swa_layers[il] = true;
+                }
                 ml.get_key(LLM_KV_ATTENTION_LAYERNORM_RMS_EPS, hparams.f_norm_rms_eps);
                 ml.get_key(LLM_KV_ATTN_LOGIT_SOFTCAPPING, hparams.f_attn_logit_softcapping, false);
                 ml.get_key(LLM_KV_FINAL_LOGIT_SOFTCAPPING, hparams.f_final_logit_softcapping, false);
@@ -8780,6 +9792,14 @@ static bool llm_load_tensors(
                 throw std::runtime_error("unable to allocate backend buffer");
             }
             model.bufs.push_back(buf);
+            if (ggml_is_numa_split() && ggml_backend_buffer_is_host(buf)) {
+                // place the rows of the weights on the nodes that will multiply them before the data is loaded
+                int n_split = 0;
+                for (ggml_tensor * t = ggml_get_first_tensor(ctx); t != nullptr; t = ggml_get_next_tensor(ctx, t)) {
+                    n_split += ggml_numa_split_tensor(t);
+                }
+                LLAMA_LOG_INFO("%s: split %d tensors across NUMA nodes\n", __func__, n_split);
+            }
             if (use_mlock && ggml_backend_buffer_is_host(buf)) {
                 model.mlock_bufs.emplace_back(new llama_mlock);
                 auto & mlock_buf = model.mlock_bufs.back();
@@ -8977,10 +9997,19 @@ static struct ggml_tensor * llm_build_inp_embd(
     return inpL;
 }
 
+// runs of cells the graph stores the ubatch in through views of the cache: the ring buffer stores it at kv_head, the paged
+// cache stores it with ggml_set_rows at the cells of an input, so its graph does not depend on the cells
+static std::vector<llama_kv_seg> llama_kv_cache_ubatch_segs(const llama_kv_cache & kv, int32_t kv_head, int32_t n_tokens) {
+    if (kv.block_size > 0) {
+        return {};
+    }
+
+    return { { 0, (uint32_t) kv_head, (uint32_t) n_tokens } };
+}
+
 static void llm_build_kv_store(
         struct ggml_context * ctx,
-        const llama_hparams & hparams,
-        const llama_cparams & cparams,
+       struct llama_context & lctx,
        const llama_kv_cache & kv,
          struct ggml_cgraph * graph,
          struct ggml_tensor * k_cur,
@@ -8989,36 +10018,106 @@ static void llm_build_kv_store(
                     int32_t   kv_head,
          const llm_build_cb & cb,
                     int64_t   il) {
-    const int64_t n_ctx = cparams.n_ctx;
+    const llama_hparams & hparams = lctx.model.hparams;
 
     const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
     const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
 
-    GGML_ASSERT(kv.size == n_ctx);
+    assert(v_cur->ne[0] == n_embd_v_gqa && v_cur->ne[1] == n_tokens);
 
-    struct ggml_tensor * k_cache_view = ggml_view_1d(ctx, kv.k_l[il], n_tokens*n_embd_k_gqa, ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa)*kv_head);
-    cb(k_cache_view, "k_cache_view", il);
+    if (kv.block_size > 0) {
+        // the cells of the tokens, set from kv.segs - the ubatch can be scattered over any number of blocks
+        struct ggml_tensor *& inp_kv_idxs = &kv == &lctx.kv_swa ? lctx.inp_kv_idxs_swa : lctx.inp_kv_idxs;
+        if (inp_kv_idxs == nullptr) {
+            inp_kv_idxs = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, n_tokens);
+            cb(inp_kv_idxs, &kv == &lctx.kv_swa ? "inp_kv_idxs_swa" : "inp_kv_idxs", -1);
+            ggml_set_input(inp_kv_idxs);
+        }
 
-    // note: storing RoPE-ed version of K in the KV cache
-    ggml_build_forward_expand(graph, ggml_cpy(ctx, k_cur, k_cache_view));
+        struct ggml_tensor * k_rows = ggml_is_contiguous(k_cur)
+            ? ggml_reshape_2d(ctx, k_cur, n_embd_k_gqa, n_tokens)
+            : ggml_cont_2d   (ctx, k_cur, n_embd_k_gqa, n_tokens);
 
-    assert(v_cur->ne[0] == n_embd_v_gqa && v_cur->ne[1] == n_tokens);
+        struct ggml_tensor * k_cache = ggml_view_2d(ctx, kv.k_l[il], n_embd_k_gqa, kv.size,
+                ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa), 0);
+        cb(k_cache, "k_cache_view", il);
 
-    struct ggml_tensor * v_cache_view = nullptr;
+        // note: storing RoPE-ed version of K in the KV cache
+        ggml_build_forward_expand(graph, ggml_set_rows(ctx, k_cache, k_rows, inp_kv_idxs));
 
-    if (cparams.flash_attn) {
-        v_cache_view = ggml_view_1d(ctx, kv.v_l[il], n_tokens*n_embd_v_gqa, ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa)*kv_head);
-    } else {
-        // note: the V cache is transposed when not using flash attention
-        v_cache_view = ggml_view_2d(ctx, kv.v_l[il], n_tokens, n_embd_v_gqa,
-                (  n_ctx)*ggml_element_size(kv.v_l[il]),
-                (kv_head)*ggml_element_size(kv.v_l[il]));
+        struct ggml_tensor * v_cache = nullptr;
+
+        if (!kv.v_trans) {
+            v_cache = ggml_view_2d(ctx, kv.v_l[il], n_embd_v_gqa, kv.size,
+                    ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa), 0);
+        } else {
+            // the cells are the columns of the transposed V cache
+            v_cache = ggml_transpose(ctx, ggml_view_2d(ctx, kv.v_l[il], kv.size, n_embd_v_gqa,
+                    kv.size*ggml_element_size(kv.v_l[il]), 0));
+        }
+        cb(v_cache, "v_cache_view", il);
 
-        v_cur = ggml_transpose(ctx, v_cur);
+        ggml_build_forward_expand(graph, ggml_set_rows(ctx, v_cache, v_cur, inp_kv_idxs));
+
+        return;
     }
-    cb(v_cache_view, "v_cache_view", il);
 
-    ggml_build_forward_expand(graph, ggml_cpy(ctx, v_cur, v_cache_view));
+    const std::vector<llama_kv_seg> segs = llama_kv_cache_ubatch_segs(kv, kv_head, n_tokens);
+
+    // the views of the cells are moved to the cells of the next ubatch when the graph is reused
+    auto & views = lctx.graph_cache.views;
+
+    for (uint32_t i_seg = 0; i_seg < segs.size(); ++i_seg) {
+        const auto & seg = segs[i_seg];
+
+        struct ggml_tensor * k_src = k_cur;
+        struct ggml_tensor * v_src = v_cur;
+
+        if (seg.n != (uint32_t) n_tokens) {
+            // the tokens are the outermost dimension of k_cur
+            const int d = k_cur->ne[2] == n_tokens ? 2 : 1;
+            k_src = d == 2
+                ? ggml_view_3d(ctx, k_cur, k_cur->ne[0], k_cur->ne[1], seg.n, k_cur->nb[1], k_cur->nb[2], seg.i_token*k_cur->nb[2])
+                : ggml_view_2d(ctx, k_cur, k_cur->ne[0], seg.n, k_cur->nb[1], seg.i_token*k_cur->nb[1]);
+
+            v_src = ggml_view_2d(ctx, v_cur, n_embd_v_gqa, seg.n, v_cur->nb[1], seg.i_token*v_cur->nb[1]);
+        }
+
+        if (kv.v_trans) {
+            // note: the V cache is transposed when not using flash attention
+            v_src = ggml_transpose(ctx, v_src);
+        }
+
+        const size_t nb_cell_k = ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa);
+        const size_t nb_cell_v = kv.v_trans ? ggml_element_size(kv.v_l[il]) : ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa);
+
+        struct ggml_tensor * k_cache_view = ggml_view_1d(ctx, kv.k_l[il], seg.n*n_embd_k_gqa, nb_cell_k*seg.i_cell);
+        cb(k_cache_view, "k_cache_view", il);
+
+        // note: storing RoPE-ed version of K in the KV cache
+        struct ggml_tensor * k_cpy = ggml_cpy(ctx, k_src, k_cache_view);
+        ggml_build_forward_expand(graph, k_cpy);
+
+        struct ggml_tensor * v_cache_view = nullptr;
+
+        if (!kv.v_trans) {
+            v_cache_view = ggml_view_1d(ctx, kv.v_l[il], seg.n*n_embd_v_gqa, nb_cell_v*seg.i_cell);
+        } else {
+            v_cache_view = ggml_view_2d(ctx, kv.v_l[il], seg.n, n_embd_v_gqa,
+                    (   kv.size)*ggml_element_size(kv.v_l[il]),
+                    (seg.i_cell)*nb_cell_v);
+        }
+        cb(v_cache_view, "v_cache_view", il);
+
+        struct ggml_tensor * v_cpy = ggml_cpy(ctx, v_src, v_cache_view);
+        ggml_build_forward_expand(graph, v_cpy);
+
+        // the result of a copy is a view of its destination
+        views.push_back({ k_cache_view, &kv, i_seg, nb_cell_k });
+        views.push_back({ k_cpy,        &kv, i_seg, nb_cell_k });
+        views.push_back({ v_cache_view, &kv, i_seg, nb_cell_v });
+        views.push_back({ v_cpy,        &kv, i_seg, nb_cell_v });
+    }
 }
 
 // do mat_mul, while optionally apply lora
@@ -9346,12 +10445,12 @@ static struct ggml_tensor * llm_build_kqv(
                     int32_t   n_kv,
                     float     kq_scale,
          const llm_build_cb & cb,
-                    int       il) {
+                    int       il,
+         struct ggml_tensor * k_rope = nullptr) {
     const llama_model   & model   = lctx.model;
     const llama_hparams & hparams = lctx.model.hparams;
     const llama_cparams & cparams = lctx.cparams;
 
-    const int64_t n_ctx         = cparams.n_ctx;
     const int64_t n_head        = hparams.n_head(il);
     const int64_t n_head_kv     = hparams.n_head_kv(il);
     const int64_t n_embd_head_k = hparams.n_embd_head_k;
@@ -9362,7 +10461,8 @@ static struct ggml_tensor * llm_build_kqv(
     struct ggml_tensor * q = ggml_permute(ctx, q_cur, 0, 2, 1, 3);
     cb(q, "q", il);
 
-    struct ggml_tensor * k =
+    // with lazy RoPE, the rotated K of the cached cells is attended to instead of the cache (see build_k_rope)
+    struct ggml_tensor * k = k_rope ? k_rope :
         ggml_view_3d(ctx, kv.k_l[il],
                 n_embd_head_k, n_kv, n_head_kv,
                 ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa),
@@ -9374,7 +10474,6 @@ static struct ggml_tensor * llm_build_kqv(
 
     if (cparams.flash_attn) {
         GGML_UNUSED(model);
-        GGML_UNUSED(n_ctx);
 
         // split cached v into n_head heads (not transposed)
         struct ggml_tensor * v =
@@ -9426,15 +10525,27 @@ static struct ggml_tensor * llm_build_kqv(
         kq = ggml_soft_max_ext(ctx, kq, kq_mask, kq_scale, hparams.f_max_alibi_bias);
         cb(kq, "kq_soft_max_ext", il);
 
-        GGML_ASSERT(kv.size == n_ctx);
+        struct ggml_tensor * v;
 
-        // split cached v into n_head heads
-        struct ggml_tensor * v =
-            ggml_view_3d(ctx, kv.v_l[il],
+        if (kv.v_trans) {
+            // split cached v into n_head heads
+            v = ggml_view_3d(ctx, kv.v_l[il],
                     n_kv, n_embd_head_v, n_head_kv,
-                    ggml_element_size(kv.v_l[il])*n_ctx,
-                    ggml_element_size(kv.v_l[il])*n_ctx*n_embd_head_v,
+                    ggml_element_size(kv.v_l[il])*kv.size,
+                    ggml_element_size(kv.v_l[il])*kv.size*n_embd_head_v,
                     0);
+        } else {
+            // the quantized V cache is not transposed - dequantize the used cells into a transposed F16 copy
+            struct ggml_tensor * v_q =
+                ggml_view_3d(ctx, kv.v_l[il],
+                        n_embd_head_v, n_kv, n_head_kv,
+                        ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa),
+                        ggml_row_size(kv.v_l[il]->type, n_embd_head_v),
+                        0);
+            cb(v_q, "v_q", il);
+
+            v = ggml_cont(ctx, ggml_transpose(ctx, ggml_cast(ctx, v_q, GGML_TYPE_F16)));
+        }
         cb(v, "v", il);
 
         struct ggml_tensor * kqv = ggml_mul_mat(ctx, v, kq);
@@ -9480,7 +10591,8 @@ static struct ggml_tensor * llm_build_kv(
                     int32_t   n_kv,
                     float     kq_scale,
          const llm_build_cb & cb,
-                    int       il) {
+                    int       il,
+         struct ggml_tensor * k_rope = nullptr) {
     const llama_hparams & hparams = lctx.model.hparams;
     const llama_cparams & cparams = lctx.cparams;
 
@@ -9490,11 +10602,11 @@ static struct ggml_tensor * llm_build_kv(
     ggml_build_forward_expand(graph, k_cur);
     ggml_build_forward_expand(graph, v_cur);
 
-    llm_build_kv_store(ctx, hparams, cparams, kv, graph, k_cur, v_cur, n_tokens, kv_head, cb, il);
+    llm_build_kv_store(ctx, lctx, kv, graph, k_cur, v_cur, n_tokens, kv_head, cb, il);
 
     struct ggml_tensor * cur;
 
-    cur  = llm_build_kqv(ctx, lctx, kv, graph, wo, wo_b, q_cur, kq_mask, n_tokens, n_kv, kq_scale, cb, il);
+    cur  = llm_build_kqv(ctx, lctx, kv, graph, wo, wo_b, q_cur, kq_mask, n_tokens, n_kv, kq_scale, cb, il, k_rope);
     cb(cur, "kqv_out", il);
 
     return cur;
@@ -9840,6 +10952,7 @@ struct llm_build_context {
     const llama_cparams  & cparams;
     const llama_ubatch   & batch;
     const llama_kv_cache & kv_self;
+    const llama_kv_cache & kv_swa; // the cache of the sliding-window layers (kv_self if they are not stored separately)
 
     const int64_t n_embd;
     const int64_t n_layer;
@@ -9868,6 +10981,8 @@ struct llm_build_context {
     const int32_t n_outputs;
     const int32_t n_outputs_enc;
     const int32_t kv_head;  // index of where we store new KV data in the cache
+    const int32_t n_kv_swa;
+    const int32_t kv_head_swa;
     const int32_t n_ctx_orig;
 
     const bool flash_attn;
@@ -9893,6 +11008,7 @@ struct llm_build_context {
         cparams          (lctx.cparams),
         batch            (batch),
         kv_self          (lctx.kv_self),
+        kv_swa           (lctx.kv_swa.size > 0 ? lctx.kv_swa : lctx.kv_self),
         n_embd           (hparams.n_embd),
         n_layer          (hparams.n_layer),
         n_rot            (hparams.n_rot),
@@ -9918,6 +11034,8 @@ struct llm_build_context {
         n_outputs        (worst_case ? n_tokens : lctx.n_outputs),
         n_outputs_enc    (worst_case ? n_tokens : lctx.embd_enc.size() / hparams.n_embd),
         kv_head          (worst_case ? (kv_self.recurrent ? 0 : kv_self.size - n_tokens) : kv_self.head),
+        n_kv_swa         (worst_case ? kv_swa.size : kv_swa.n),
+        kv_head_swa      (worst_case ? (kv_swa.recurrent ? 0 : kv_swa.size - n_tokens) : kv_swa.head),
         n_ctx_orig       (cparams.n_ctx_orig_yarn),
         flash_attn       (cparams.flash_attn),
         pooling_type     (cparams.pooling_type),
@@ -9936,6 +11054,9 @@ struct llm_build_context {
 
         ctx0 = ggml_init(params);
 
+        // the new graph takes over buf_compute_meta and the scheduler
+        lctx.graph_cache.clear();
+
         lctx.inp_tokens      = nullptr;
         lctx.inp_embd        = nullptr;
         lctx.inp_pos         = nullptr;
@@ -9943,6 +11064,10 @@ struct llm_build_context {
         lctx.inp_KQ_mask     = nullptr;
         lctx.inp_KQ_mask_swa = nullptr;
         lctx.inp_K_shift     = nullptr;
+        lctx.inp_K_shift_swa = nullptr;
+        lctx.inp_K_pos       = nullptr;
+        lctx.inp_kv_idxs     = nullptr;
+        lctx.inp_kv_idxs_swa = nullptr;
         lctx.inp_mean        = nullptr;
         lctx.inp_cls         = nullptr;
         lctx.inp_s_copy      = nullptr;
@@ -9960,25 +11085,23 @@ struct llm_build_context {
         }
     }
 
-    struct ggml_cgraph * build_k_shift() {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
-
-        GGML_ASSERT(kv_self.size == n_ctx);
-
-        lctx.inp_K_shift = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_ctx);
-        cb(lctx.inp_K_shift, "K_shift", -1);
-        ggml_set_input(lctx.inp_K_shift);
-
+    // rotate the K data of the layers stored in kv by the position deltas of its cells (see llama_set_k_shift)
+    // inp_K_shift holds the deltas of the cells starting at c0
+    void build_k_shift_cache(struct ggml_cgraph * gf, const llama_kv_cache & kv, struct ggml_tensor * inp_K_shift, uint32_t c0) {
         for (int il = 0; il < n_layer; ++il) {
+            if (kv.k_l[il] == nullptr) {
+                continue;
+            }
+
             const int64_t n_head_kv = hparams.n_head_kv(il);
             const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
             struct ggml_tensor * rope_factors = build_rope_factors(il);
             struct ggml_tensor * k =
-                ggml_view_3d(ctx0, kv_self.k_l[il],
-                    n_embd_head_k, n_head_kv, n_ctx,
-                    ggml_row_size(kv_self.k_l[il]->type, n_embd_head_k),
-                    ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
-                    0);
+                ggml_view_3d(ctx0, kv.k_l[il],
+                    n_embd_head_k, n_head_kv, inp_K_shift->ne[0],
+                    ggml_row_size(kv.k_l[il]->type, n_embd_head_k),
+                    ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa),
+                    ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa)*c0);
 
             struct ggml_tensor * tmp;
             if (ggml_is_quantized(k->type)) {
@@ -9993,23 +11116,98 @@ struct llm_build_context {
                     }
                 }
                 tmp = ggml_rope_ext_inplace(ctx0, tmp,
-                        lctx.inp_K_shift, rope_factors, n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
+                        inp_K_shift, rope_factors, n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                         ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(tmp, "K_shifted_f32", il);
                 tmp = ggml_cpy(ctx0, tmp, k);
             } else {
                 // we rotate only the first n_rot dimensions
                 tmp = ggml_rope_ext_inplace(ctx0, k,
-                        lctx.inp_K_shift, rope_factors, n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
+                        inp_K_shift, rope_factors, n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                         ext_factor, attn_factor, beta_fast, beta_slow);
             }
             cb(tmp, "K_shifted", il);
             ggml_build_forward_expand(gf, tmp);
         }
+    }
+
+    struct ggml_cgraph * build_k_shift() {
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+
+        GGML_ASSERT(kv_self.size == n_ctx);
+
+        const auto range = llama_kv_cache_shift_range(kv_self);
+        if (range.first < range.second) {
+            lctx.inp_K_shift = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, range.second - range.first);
+            cb(lctx.inp_K_shift, "K_shift", -1);
+            ggml_set_input(lctx.inp_K_shift);
+
+            build_k_shift_cache(gf, kv_self, lctx.inp_K_shift, range.first);
+        }
+
+        const auto range_swa = llama_kv_cache_shift_range(lctx.kv_swa);
+        if (range_swa.first < range_swa.second) {
+            lctx.inp_K_shift_swa = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, range_swa.second - range_swa.first);
+            cb(lctx.inp_K_shift_swa, "K_shift_swa", -1);
+            ggml_set_input(lctx.inp_K_shift_swa);
+
+            build_k_shift_cache(gf, lctx.kv_swa, lctx.inp_K_shift_swa, range_swa.first);
+        }
 
         return gf;
     }
 
+    // copy the KV data of nm cells starting at cell i to cell id
+    void build_kv_copy(struct ggml_cgraph * gf, const llama_kv_cache & kv, uint32_t i, uint32_t id, uint32_t nm) {
+        for (int il = 0; il < n_layer; ++il) {
+            if (kv.k_l[il] == nullptr) {
+                continue;
+            }
+
+            const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
+            const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
+
+            ggml_tensor * view_k_src = ggml_view_2d(ctx0, kv.k_l[il],
+                    n_embd_k_gqa, nm,
+                    ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa),
+                    ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa*i));
+
+            ggml_tensor * view_k_dst = ggml_view_2d(ctx0, kv.k_l[il],
+                    n_embd_k_gqa, nm,
+                    ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa),
+                    ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa*id));
+
+            ggml_tensor * view_v_src;
+            ggml_tensor * view_v_dst;
+
+            if (!kv.v_trans) {
+                // NOTE: the V cache is not transposed when using flash attention or a quantized V cache
+                view_v_src = ggml_view_2d(ctx0, kv.v_l[il],
+                        n_embd_v_gqa, nm,
+                        ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa),
+                        ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa*i));
+
+                view_v_dst = ggml_view_2d(ctx0, kv.v_l[il],
+                        n_embd_v_gqa, nm,
+                        ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa),
+                        ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa*id));
+            } else {
+                view_v_src = ggml_view_2d(ctx0, kv.v_l[il],
+                        nm, n_embd_v_gqa,
+                        ggml_row_size(kv.v_l[il]->type, kv.size),
+                        ggml_row_size(kv.v_l[il]->type, i));
+
+                view_v_dst = ggml_view_2d(ctx0, kv.v_l[il],
+                        nm, n_embd_v_gqa,
+                        ggml_row_size(kv.v_l[il]->type, kv.size),
+                        ggml_row_size(kv.v_l[il]->type, id));
+            }
+
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, view_k_src, view_k_dst));
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, view_v_src, view_v_dst));
+        }
+    }
+
     struct ggml_cgraph * build_defrag(const std::vector<uint32_t> & ids) {
         struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
 
@@ -10026,55 +11224,23 @@ struct llm_build_context {
                 nm++;
             }
 
-            for (int il = 0; il < n_layer; ++il) {
-                const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
-                const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
-
-                ggml_tensor * view_k_src = ggml_view_2d(ctx0, kv_self.k_l[il],
-                        n_embd_k_gqa, nm,
-                        ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
-                        ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa*i));
-
-                ggml_tensor * view_k_dst = ggml_view_2d(ctx0, kv_self.k_l[il],
-                        n_embd_k_gqa, nm,
-                        ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
-                        ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa*id));
+            build_kv_copy(gf, kv_self, i, id, nm);
 
-                ggml_tensor * view_v_src;
-                ggml_tensor * view_v_dst;
+            i += nm - 1;
+        }
 
-                if (flash_attn) {
-                    // NOTE: the V cache is not transposed when using flash attention
-                    view_v_src = ggml_view_2d(ctx0, kv_self.v_l[il],
-                            n_embd_v_gqa, nm,
-                            ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa),
-                            ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa*i));
+        //LLAMA_LOG_INFO("gf->n_nodes = %d\n", gf->n_nodes);
 
-                    view_v_dst = ggml_view_2d(ctx0, kv_self.v_l[il],
-                            n_embd_v_gqa, nm,
-                            ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa),
-                            ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa*id));
-                } else {
-                    view_v_src = ggml_view_2d(ctx0, kv_self.v_l[il],
-                            nm, n_embd_v_gqa,
-                            ggml_row_size(kv_self.v_l[il]->type, kv_self.size),
-                            ggml_row_size(kv_self.v_l[il]->type, i));
-
-                    view_v_dst = ggml_view_2d(ctx0, kv_self.v_l[il],
-                            nm, n_embd_v_gqa,
-                            ggml_row_size(kv_self.v_l[il]->type, kv_self.size),
-                            ggml_row_size(kv_self.v_l[il]->type, id));
-                }
+        return gf;
+    }
 
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, view_k_src, view_k_dst));
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, view_v_src, view_v_dst));
-            }
+    struct ggml_cgraph * build_kv_copies(const llama_kv_cache & kv, const llama_kv_copy * copies, uint32_t n_copies) {
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
 
-            i += nm - 1;
+        for (uint32_t i = 0; i < n_copies; ++i) {
+            build_kv_copy(gf, kv, copies[i].i_src, copies[i].i_dst, copies[i].n);
         }
 
-        //LLAMA_LOG_INFO("gf->n_nodes = %d\n", gf->n_nodes);
-
         return gf;
     }
 
@@ -10085,6 +11251,43 @@ struct llm_build_context {
         return lctx.inp_pos;
     }
 
+    struct ggml_tensor * build_inp_K_pos() {
+        lctx.inp_K_pos = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_kv);
+        cb(lctx.inp_K_pos, "inp_K_pos", -1);
+        ggml_set_input(lctx.inp_K_pos);
+        return lctx.inp_K_pos;
+    }
+
+    // lazy RoPE: the K cache holds the keys before rotation, the K of the n_kv cells is rotated by the current
+    // positions of the cells (inp_K_pos) every time it is attended to, so a position shift only changes cells.pos
+    struct ggml_tensor * build_k_rope(struct ggml_tensor * inp_K_pos, struct ggml_tensor * rope_factors, int il) {
+        const int64_t n_head_kv    = hparams.n_head_kv(il);
+        const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
+
+        struct ggml_tensor * k =
+            ggml_view_3d(ctx0, kv_self.k_l[il],
+                    n_embd_head_k, n_head_kv, n_kv,
+                    ggml_row_size(kv_self.k_l[il]->type, n_embd_head_k),
+                    ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
+                    0);
+
+        if (k->type != GGML_TYPE_F16 && k->type != GGML_TYPE_F32) {
+            k = ggml_cast(ctx0, k, GGML_TYPE_F32);
+            cb(k, "k_f32", il);
+        }
+
+        k = ggml_rope_ext(ctx0, k, inp_K_pos, rope_factors,
+                n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
+                ext_factor, attn_factor, beta_fast, beta_slow);
+        cb(k, "k_rope", il);
+
+        if (flash_attn && k->type != GGML_TYPE_F16) {
+            k = ggml_cast(ctx0, k, GGML_TYPE_F16);
+        }
+
+        return ggml_permute(ctx0, k, 0, 2, 1, 3);
+    }
+
     struct ggml_tensor * build_rope_factors(int il) {
         // choose long/short freq factors based on the context size
         const auto n_ctx_pre_seq = cparams.n_ctx / cparams.n_seq_max;
@@ -10121,7 +11324,7 @@ struct llm_build_context {
         GGML_ASSERT(hparams.n_swa > 0);
 
         lctx.inp_KQ_mask_swa = causal
-            ? ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_kv,     GGML_PAD(n_tokens, GGML_KQ_MASK_PAD))
+            ? ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_kv_swa, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD))
             : ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_tokens, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD));
         cb(lctx.inp_KQ_mask_swa, "KQ_mask_swa", -1);
         ggml_set_input(lctx.inp_KQ_mask_swa);
@@ -10269,6 +11472,9 @@ struct llm_build_context {
         // KQ_mask (mask for 1 head, it will be broadcasted to all heads)
         struct ggml_tensor * KQ_mask = build_inp_KQ_mask();
 
+        // inp_K_pos - positions of the KV cells, K is rotated when attending
+        struct ggml_tensor * inp_K_pos = cparams.lazy_rope ? build_inp_K_pos() : nullptr;
+
         const float kq_scale = hparams.f_attention_scale == 0.0f ? 1.0f/sqrtf(float(n_embd_head)) : hparams.f_attention_scale;
         for (int il = 0; il < n_layer; ++il) {
             struct ggml_tensor * inpSA = inpL;
@@ -10313,16 +11519,19 @@ struct llm_build_context {
                 );
                 cb(Qcur, "Qcur", il);
 
-                Kcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, rope_factors,
-                    n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
-                    ext_factor, attn_factor, beta_fast, beta_slow
-                );
-                cb(Kcur, "Kcur", il);
+                if (!cparams.lazy_rope) {
+                    Kcur = ggml_rope_ext(
+                        ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, rope_factors,
+                        n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
+                        ext_factor, attn_factor, beta_fast, beta_slow
+                    );
+                    cb(Kcur, "Kcur", il);
+                }
 
                 cur = llm_build_kv(ctx0, lctx, kv_self, gf,
                         model.layers[il].wo, model.layers[il].bo,
-                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, kq_scale, cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask, n_tokens, kv_head, n_kv, kq_scale, cb, il,
+                        cparams.lazy_rope ? build_k_rope(inp_K_pos, rope_factors, il) : nullptr);
             }
 
             if (il == n_layer - 1) {
@@ -12378,9 +13587,9 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, lctx, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, kv_swa, gf,
                         model.layers[il].wo, model.layers[il].bo,
-                        Kcur, Vcur, Qcur, KQ_mask_swa, n_tokens, kv_head, n_kv, 1.0f, cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask_swa, n_tokens, kv_head_swa, n_kv_swa, 1.0f, cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -13477,7 +14686,7 @@ struct llm_build_context {
 
         for (int il = 0; il < n_layer; ++il) {
             // (il % 2) layers use SWA
-            struct ggml_tensor * KQ_mask_l = (il % 2 == 0) ? KQ_mask_swa : KQ_mask;
+            const bool is_swa = hparams.is_swa(il);
 
             // norm
             cur = llm_build_norm(ctx0, inpL, hparams,
@@ -13518,9 +14727,10 @@ struct llm_build_context {
                         ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, lctx, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, is_swa ? kv_swa : kv_self, gf,
                         model.layers[il].wo, NULL,
-                        Kcur, Vcur, Qcur, KQ_mask_l, n_tokens, kv_head, n_kv, 1.0f, cb, il);
+                        Kcur, Vcur, Qcur, is_swa ? KQ_mask_swa : KQ_mask, n_tokens,
+                        is_swa ? kv_head_swa : kv_head, is_swa ? n_kv_swa : n_kv, 1.0f, cb, il);
             }
 
             cur = llm_build_norm(ctx0, cur, hparams,
@@ -15123,7 +16333,7 @@ struct llm_build_context {
                 struct ggml_tensor * Vcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
 
-                llm_build_kv_store(ctx0, hparams, cparams, kv_self, gf, Kcur, Vcur, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, lctx, kv_self, gf, Kcur, Vcur, n_tokens, kv_head, cb, il);
 
                 struct ggml_tensor * k =
                     ggml_view_3d(ctx0, kv_self.k_l[il],
@@ -15867,6 +17077,23 @@ static struct ggml_cgraph * llama_build_graph_defrag(llama_context & lctx, const
     return result;
 }
 
+static struct ggml_cgraph * llama_build_graph_kv_copies(llama_context & lctx, const llama_kv_cache & kv, const llama_kv_copy * copies, uint32_t n_copies) {
+    llama_ubatch dummy = {};
+    dummy.equal_seqs = true;
+
+    llm_build_cb cb = [&](struct ggml_tensor * , const char * , int ) { };
+
+    struct llm_build_context llm(lctx, dummy, cb, false);
+
+    llm.init();
+
+    struct ggml_cgraph * result = llm.build_kv_copies(kv, copies, n_copies);
+
+    llm.free();
+
+    return result;
+}
+
 static struct ggml_cgraph * llama_build_graph_k_shift(llama_context & lctx) {
     llama_ubatch dummy = {};
     dummy.equal_seqs = true;
@@ -15884,6 +17111,38 @@ static struct ggml_cgraph * llama_build_graph_k_shift(llama_context & lctx) {
     return result;
 }
 
+// the layer of a tensor named by llm_build_cb, e.g. "ffn_out-5" or "k_cache_view-5 (copy of Kcur-5)", or -1
+static int llama_tensor_name_layer(const char * name) {
+    const char * p = strrchr(name, '-');
+    if (p == nullptr || !isdigit((unsigned char) p[1])) {
+        return -1;
+    }
+    return atoi(p + 1);
+}
+
+// the pipeline stages compute consecutive ranges of layers
+// the nodes of a layer go to its stage, the other nodes to the stage of the last layer before them
+static void llama_graph_assign_stages(llama_context & lctx, struct ggml_cgraph * gf) {
+    const int n_stages = (int) lctx.backend_stages.size();
+    if (n_stages < 2) {
+        return;
+    }
+
+    const int n_layer = (int) lctx.model.hparams.n_layer;
+
+    int stage = 0;
+    for (int i = 0; i < ggml_graph_n_nodes(gf); i++) {
+        struct ggml_tensor * node = ggml_graph_node(gf, i);
+
+        const int il = llama_tensor_name_layer(ggml_get_name(node));
+        if (il >= 0 && il < n_layer) {
+            stage = il*n_stages/n_layer;
+        }
+
+        ggml_backend_sched_set_tensor_backend(lctx.sched, node, lctx.backend_stages[stage]);
+    }
+}
+
 static struct ggml_cgraph * llama_build_graph(
          llama_context & lctx,
     const llama_ubatch & batch,
@@ -16118,18 +17377,26 @@ static struct ggml_cgraph * llama_build_graph(
 
     llm.free();
 
+    llama_graph_assign_stages(lctx, result);
+
     return result;
 }
 
 static void llama_set_k_shift(llama_context & lctx) {
-    const int64_t kv_size = lctx.kv_self.size;
+    if (lctx.inp_K_shift) {
+        assert(ggml_backend_buffer_is_host(lctx.inp_K_shift->buffer));
+
+        const auto range = llama_kv_cache_shift_range(lctx.kv_self);
 
-    assert(ggml_backend_buffer_is_host(lctx.inp_K_shift->buffer));
+        std::copy(lctx.kv_self.cells.delta.begin() + range.first, lctx.kv_self.cells.delta.begin() + range.second, (int32_t *) lctx.inp_K_shift->data);
+    }
 
-    int32_t * data = (int32_t *) lctx.inp_K_shift->data;
+    if (lctx.inp_K_shift_swa) {
+        assert(ggml_backend_buffer_is_host(lctx.inp_K_shift_swa->buffer));
 
-    for (int i = 0; i < kv_size; ++i) {
-        data[i] = lctx.kv_self.cells[i].delta;
+        const auto range = llama_kv_cache_shift_range(lctx.kv_swa);
+
+        std::copy(lctx.kv_swa.cells.delta.begin() + range.first, lctx.kv_swa.cells.delta.begin() + range.second, (int32_t *) lctx.inp_K_shift_swa->data);
     }
 }
 
@@ -16141,7 +17408,7 @@ static void llama_set_s_copy(llama_context & lctx) {
     int32_t * data = (int32_t *) lctx.inp_s_copy->data;
 
     for (int i = 0; i < kv_size; ++i) {
-        data[i] = lctx.kv_self.cells[i].src;
+        data[i] = lctx.kv_self.cells.src[i];
     }
 }
 
@@ -16169,6 +17436,100 @@ static int32_t llama_relative_position_bucket(llama_pos x, llama_pos y, uint64_t
     return relative_bucket;
 }
 
+// causal KQ mask over the first kv.n cells of a cache, n_swa > 0 also masks the cells outside of the sliding window
+static void llama_set_kq_mask(llama_context & lctx, const llama_kv_cache & kv, const llama_ubatch & batch, float * data, int32_t n_swa) {
+    const int64_t n_kv         = kv.n;
+    const int64_t n_tokens     = batch.n_tokens;
+    const int64_t n_seq_tokens = batch.n_seq_tokens;
+    const int64_t n_seqs       = batch.n_seqs;
+
+    const bool use_alibi = lctx.model.hparams.use_alibi;
+
+    const uint32_t n_seq_words = kv.cells.n_seq_words;
+
+    // one row per distinct sequence of the ubatch
+    std::vector<int32_t>  & seq_row  = lctx.kq_mask_seq_row;
+    std::vector<uint64_t> & seq_bits = lctx.kq_mask_seq_bits;
+    seq_row .assign(64*n_seq_words, -1);
+    seq_bits.assign(n_seq_words, 0);
+
+    int32_t n_rows = 0;
+    for (int s = 0; s < n_seqs; ++s) {
+        const llama_seq_id seq_id = batch.seq_id[s][0];
+        if (seq_id >= 0 && (uint32_t) seq_id < 64*n_seq_words && seq_row[seq_id] < 0) {
+            seq_row[seq_id] = n_rows++;
+            seq_bits[seq_id/64] |= 1ull << (seq_id % 64);
+        }
+    }
+
+    // positions of the KV cells as seen by each sequence, cells of other sequences and empty cells
+    // get a position that is never visible - this way the mask of a token is a single comparison per cell
+    // a single pass over the seq bitset words of the cells fills all the rows, the cells that hold none of the
+    // sequences of the ubatch cost one AND per word
+    std::vector<llama_pos> & seq_pos = lctx.kq_mask_seq_pos;
+    seq_pos.assign((size_t) std::max(n_rows, 1)*n_kv, std::numeric_limits<llama_pos>::max());
+
+    for (int64_t i = 0; i < n_kv; ++i) {
+        for (uint32_t w = 0; w < n_seq_words; ++w) {
+            uint64_t bits = kv.cells.seq[i*n_seq_words + w] & seq_bits[w];
+            while (bits) {
+                const int32_t row = seq_row[64*w + llama_ctz64(bits)];
+                seq_pos[(size_t) row*n_kv + i] = kv.cells.pos[i];
+                bits &= bits - 1;
+            }
+        }
+    }
+
+    // For causal attention, use only the previous KV cells
+    // of the correct sequence for each token of the batch.
+    // It's assumed that if a token in the batch has multiple sequences, they are equivalent.
+    for (int h = 0; h < 1; ++h) {
+        for (int s = 0; s < n_seqs; ++s) {
+            const llama_seq_id seq_id = batch.seq_id[s][0];
+
+            // a seq_id that no cell can hold sees no cell
+            const int32_t row = seq_id >= 0 && (uint32_t) seq_id < 64*n_seq_words ? seq_row[seq_id] : -1;
+            if (row < 0) {
+                std::fill(data + h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens), data + h*(n_kv*n_tokens) + (s + 1)*(n_kv*n_seq_tokens), -INFINITY);
+                continue;
+            }
+
+            const llama_pos * p = seq_pos.data() + (size_t) row*n_kv;
+
+            for (int j = 0; j < n_seq_tokens; ++j) {
+                const llama_pos pos = batch.pos[s*n_seq_tokens + j];
+
+                float * row = data + h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv;
+
+                // branch-free fills, these loops are vectorized
+                if (n_swa == 0) {
+                    if (use_alibi) {
+                        for (int i = 0; i < n_kv; ++i) {
+                            row[i] = p[i] <= pos ? -(float) std::abs(p[i] - pos) : -INFINITY;
+                        }
+                    } else {
+                        for (int i = 0; i < n_kv; ++i) {
+                            row[i] = p[i] <= pos ? 0.0f : -INFINITY;
+                        }
+                    }
+                } else {
+                    if (use_alibi) {
+                        for (int i = 0; i < n_kv; ++i) {
+                            row[i] = p[i] <= pos && pos - p[i] < n_swa ? -(float) std::abs(p[i] - pos) : -INFINITY;
+                        }
+                    } else {
+                        for (int i = 0; i < n_kv; ++i) {
+                            row[i] = p[i] <= pos && pos - p[i] < n_swa ? 0.0f : -INFINITY;
+                        }
+                    }
+                }
+            }
+        }
+
+        std::fill(data + h*(n_kv*n_tokens) + n_tokens*n_kv, data + h*(n_kv*n_tokens) + GGML_PAD(n_tokens, GGML_KQ_MASK_PAD)*n_kv, -INFINITY);
+    }
+}
+
 static void llama_set_inputs(llama_context & lctx, const llama_ubatch & batch) {
     //
     // set input data
@@ -16197,6 +17558,39 @@ static void llama_set_inputs(llama_context & lctx, const llama_ubatch & batch) {
         ggml_backend_tensor_set(lctx.inp_pos, batch.pos, 0, n_tokens*ggml_element_size(lctx.inp_pos));
     }
 
+    if (lctx.inp_K_pos) {
+        const int64_t n_kv = lctx.inp_K_pos->ne[0];
+
+        GGML_ASSERT(ggml_backend_buffer_is_host(lctx.inp_K_pos->buffer));
+        int32_t * data = (int32_t *) lctx.inp_K_pos->data;
+
+        for (int64_t i = 0; i < n_kv; ++i) {
+            // empty cells are masked, any position will do
+            data[i] = std::max(kv_self.cells.pos[i], 0);
+        }
+    }
+
+    // the cells of the paged caches that the tokens are stored in
+    const std::pair<ggml_tensor *, const llama_kv_cache *> kv_idxs[] = {
+        { lctx.inp_kv_idxs,     &kv_self     },
+        { lctx.inp_kv_idxs_swa, &lctx.kv_swa },
+    };
+
+    for (const auto & it : kv_idxs) {
+        if (it.first == nullptr) {
+            continue;
+        }
+
+        GGML_ASSERT(ggml_backend_buffer_is_host(it.first->buffer));
+        int32_t * data = (int32_t *) it.first->data;
+
+        for (const auto & seg : it.second->segs) {
+            for (uint32_t j = 0; j < seg.n; ++j) {
+                data[seg.i_token + j] = seg.i_cell + j;
+            }
+        }
+    }
+
     if (hparams.causal_attn || cparams.pooling_type == LLAMA_POOLING_TYPE_NONE) {
         GGML_ASSERT(lctx.inp_out_ids && "every model that can must skip unused outputs");
         const int64_t n_tokens = batch.n_tokens;
@@ -16235,77 +17629,15 @@ static void llama_set_inputs(llama_context & lctx, const llama_ubatch & batch) {
     if (lctx.inp_KQ_mask || lctx.inp_KQ_mask_swa) {
         // NOTE: hparams.causal_attn indicates the model is capable of generation and uses the kv cache.
         if (cparams.causal_attn && !lctx.is_encoding) {
-            const int64_t n_kv         = kv_self.n;
-            const int64_t n_tokens     = batch.n_tokens;
-            const int64_t n_seq_tokens = batch.n_seq_tokens;
-            const int64_t n_seqs       = batch.n_seqs;
-
-
-            float * data     = nullptr;
-            float * data_swa = nullptr;
-
             if (lctx.inp_KQ_mask) {
                 GGML_ASSERT(ggml_backend_buffer_is_host(lctx.inp_KQ_mask->buffer));
-                data = (float *) lctx.inp_KQ_mask->data;
+                llama_set_kq_mask(lctx, kv_self, batch, (float *) lctx.inp_KQ_mask->data, 0);
             }
 
+            // may need to cut off old tokens for sliding window
             if (lctx.inp_KQ_mask_swa) {
                 GGML_ASSERT(ggml_backend_buffer_is_host(lctx.inp_KQ_mask_swa->buffer));
-                data_swa = (float *) lctx.inp_KQ_mask_swa->data;
-            }
-
-            // For causal attention, use only the previous KV cells
-            // of the correct sequence for each token of the batch.
-            // It's assumed that if a token in the batch has multiple sequences, they are equivalent.
-            for (int h = 0; h < 1; ++h) {
-                for (int s = 0; s < n_seqs; ++s) {
-                    const llama_seq_id seq_id = batch.seq_id[s][0];
-
-                    for (int j = 0; j < n_seq_tokens; ++j) {
-                        const llama_pos pos = batch.pos[s*n_seq_tokens + j];
-
-                        for (int i = 0; i < n_kv; ++i) {
-                            float f;
-                            if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
-                                f = -INFINITY;
-                            } else {
-                                if (hparams.use_alibi) {
-                                    f = -std::abs(kv_self.cells[i].pos - pos);
-                                } else {
-                                    f = 0.0f;
-                                }
-                            }
-
-                            if (data) {
-                                data[h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv + i] = f;
-                            }
-
-                            // may need to cut off old tokens for sliding window
-                            if (data_swa) {
-                                if (pos - kv_self.cells[i].pos >= (int32_t)hparams.n_swa) {
-                                    f = -INFINITY;
-                                }
-                                data_swa[h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv + i] = f;
-                            }
-                        }
-                    }
-                }
-
-                if (data) {
-                    for (int i = n_tokens; i < GGML_PAD(n_tokens, GGML_KQ_MASK_PAD); ++i) {
-                        for (int j = 0; j < n_kv; ++j) {
-                            data[h*(n_kv*n_tokens) + i*n_kv + j] = -INFINITY;
-                        }
-                    }
-                }
-
-                if (data_swa) {
-                    for (int i = n_tokens; i < GGML_PAD(n_tokens, GGML_KQ_MASK_PAD); ++i) {
-                        for (int j = 0; j < n_kv; ++j) {
-                            data_swa[h*(n_kv*n_tokens) + i*n_kv + j] = -INFINITY;
-                        }
-                    }
-                }
+                llama_set_kq_mask(lctx, lctx.kv_swa.size > 0 ? lctx.kv_swa : kv_self, batch, (float *) lctx.inp_KQ_mask_swa->data, hparams.n_swa);
             }
         } else {
             const int64_t n_tokens     = batch.n_tokens;
@@ -16466,14 +17798,14 @@ static void llama_set_inputs(llama_context & lctx, const llama_ubatch & batch) {
 
             // clear unused states
             for (int i = 0; i < n_kv; ++i) {
-                const uint32_t  cell_id = i + kv_self.head;
-                llama_kv_cell & kv_cell = lctx.kv_self.cells[cell_id];
+                const uint32_t cell_id = i + kv_self.head;
+                int32_t & src = lctx.kv_self.cells.src[cell_id];
 
-                data[i] = (float) (kv_cell.src >= 0);
+                data[i] = (float) (src >= 0);
 
                 // only clear once
-                if (kv_cell.src < 0) {
-                    kv_cell.src = cell_id;
+                if (src < 0) {
+                    src = cell_id;
                 }
             }
         }
@@ -16484,19 +17816,19 @@ static void llama_set_inputs(llama_context & lctx, const llama_ubatch & batch) {
 
             // assuming copy destinations ALWAYS happen ONLY on the cells between head and head+n
             for (uint32_t i = 0; i < n_kv; ++i) {
-                const uint32_t  cell_id = i + kv_self.head;
-                llama_kv_cell & kv_cell = lctx.kv_self.cells[cell_id];
+                const uint32_t cell_id = i + kv_self.head;
+                int32_t & src = lctx.kv_self.cells.src[cell_id];
 
                 // prevent out-of-bound sources
-                if (kv_cell.src < 0 || (uint32_t) kv_cell.src >= kv_self.size) {
-                    kv_cell.src = cell_id;
+                if (src < 0 || (uint32_t) src >= kv_self.size) {
+                    src = cell_id;
                 }
 
-                data[i] = kv_cell.src;
+                data[i] = src;
 
                 // ensure copy only happens once
-                if (kv_cell.src != (int32_t) cell_id) {
-                    kv_cell.src = cell_id;
+                if (src != (int32_t) cell_id) {
+                    src = cell_id;
                 }
             }
         }
@@ -16515,7 +17847,7 @@ static void llama_set_inputs(llama_context & lctx, const llama_ubatch & batch) {
             for (int h = 0; h < 1; ++h) {
                 for (int j = 0; j < n_tokens; ++j) {
                     for (int i = 0; i < n_kv; ++i) {
-                        data[h*(n_kv*n_tokens) + j*n_kv + i] = llama_relative_position_bucket(lctx.kv_self.cells[i].pos, batch.pos[j], hparams.n_rel_attn_bkts, lctx.is_encoding);
+                        data[h*(n_kv*n_tokens) + j*n_kv + i] = llama_relative_position_bucket(lctx.kv_self.cells.pos[i], batch.pos[j], hparams.n_rel_attn_bkts, lctx.is_encoding);
                     }
                 }
             }
@@ -16670,35 +18002,232 @@ static void llama_output_reorder(struct llama_context * ctx) {
         for (int32_t i = 0; i < n_outputs; ++i) {
             ctx->output_ids[out_ids[i]] = i;
         }
-        out_ids.clear();
+        out_ids.clear();
+    }
+}
+
+// exchange the outputs of the context with the ones set aside, the buffers are only swapped
+static void llama_output_swap(llama_context & lctx) {
+    auto & prev = lctx.outputs_prev;
+
+    std::swap(lctx.buf_output,    prev.buf_output);
+    std::swap(lctx.logits,        prev.logits);
+    std::swap(lctx.logits_size,   prev.logits_size);
+    std::swap(lctx.embd,          prev.embd);
+    std::swap(lctx.embd_size,     prev.embd_size);
+    std::swap(lctx.output_ids,    prev.output_ids);
+    std::swap(lctx.sbatch.out_ids, prev.out_ids);
+    std::swap(lctx.output_size,   prev.output_size);
+    std::swap(lctx.n_outputs,     prev.n_outputs);
+    std::swap(lctx.embd_seq,      prev.embd_seq);
+}
+
+// the output getters read the outputs of the previous decode while an async decode is in flight
+struct llama_output_scope {
+    llama_context * ctx;
+
+    llama_output_scope(llama_context * ctx) : ctx(ctx) {
+        if (ctx->decode_pending) {
+            llama_output_swap(*ctx);
+        } else {
+            llama_synchronize(ctx);
+        }
+    }
+
+    ~llama_output_scope() {
+        if (ctx->decode_pending) {
+            llama_output_swap(*ctx);
+        }
+    }
+};
+
+// keep the first error of the graphs that the pipeline stages computed since the last call
+static void llama_stages_status(llama_context & lctx) {
+    for (ggml_backend_t backend : lctx.backend_stages) {
+        const enum ggml_status status = ggml_backend_cpu_stage_get_status(backend);
+        if (lctx.compute_status == GGML_STATUS_SUCCESS) {
+            lctx.compute_status = status;
+        }
+    }
+}
+
+// wait for the graphs in flight in the pipeline stages, e.g. before a graph changes the KV cache that they use
+static void llama_synchronize_stages(llama_context & lctx) {
+    if (!lctx.backend_stages.empty()) {
+        ggml_backend_sched_synchronize(lctx.sched);
+        llama_stages_status(lctx);
+    }
+}
+
+// the return value of llama_decode() for the status of a graph
+static int32_t llama_status_ret(enum ggml_status status) {
+    switch (status) {
+        case GGML_STATUS_SUCCESS: return  0;
+        case GGML_STATUS_ABORTED: return  2;
+        default:                  return -3;
+    }
+}
+
+static enum ggml_status llama_graph_compute(
+          llama_context & lctx,
+            ggml_cgraph * gf,
+                    int   n_threads,
+        ggml_threadpool * threadpool) {
+#ifdef GGML_USE_METAL
+    if (ggml_backend_is_metal(lctx.backend_metal)) {
+        ggml_backend_metal_set_n_cb(lctx.backend_metal, n_threads);
+    }
+#endif
+
+    if (lctx.backend_cpu != nullptr && lctx.backend_stages.empty()) {
+        ggml_backend_cpu_set_n_threads(lctx.backend_cpu, n_threads);
+        ggml_backend_cpu_set_threadpool(lctx.backend_cpu, threadpool);
+        ggml_backend_cpu_set_priority(lctx.backend_cpu, lctx.compute_priority);
+        ggml_backend_cpu_set_abort_callback(lctx.backend_cpu, lctx.abort_callback, lctx.abort_callback_data);
+        ggml_backend_cpu_set_profiler(lctx.backend_cpu, lctx.profiler);
+    }
+
+    // the stages compute different ubatches at the same time when the batch is pipelined, and then split the threads
+    // on a NUMA system, each stage always keeps to the threads of its node
+    // an attached threadpool is used by all the stages instead of their own, its lease computes their graphs one at a time
+    const int n_stages = (int) lctx.backend_stages.size();
+    for (int s = 0; s < n_stages; s++) {
+        ggml_backend_t backend = lctx.backend_stages[s];
+        const bool split_threads = threadpool == nullptr && (lctx.stages_pipelined || ggml_is_numa());
+        ggml_backend_cpu_set_n_threads(backend, split_threads ? std::max(1, n_threads / n_stages) : n_threads);
+        ggml_backend_cpu_set_threadpool(backend, threadpool ? threadpool : lctx.threadpool_stages[s]);
+        ggml_backend_cpu_set_priority(backend, lctx.compute_priority);
+        ggml_backend_cpu_set_abort_callback(backend, lctx.abort_callback, lctx.abort_callback_data);
+        ggml_backend_cpu_set_profiler(backend, lctx.profiler);
+    }
+#ifdef GGML_USE_BLAS
+    if (lctx.backend_blas != nullptr) {
+        ggml_backend_blas_set_n_threads(lctx.backend_blas, n_threads);
+    }
+#endif
+
+    // fprintf(stderr, "splits: %d\n", ggml_backend_sched_get_n_splits(lctx.sched));
+
+    // with pipeline stages, the errors of the graphs they computed since the last graph
+    return ggml_backend_sched_graph_compute_async(lctx.sched, gf);
+}
+
+static bool llama_graph_same_runs(const std::vector<llama_kv_seg> & a, const std::vector<llama_kv_seg> & b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (a[i].i_token != b[i].i_token || a[i].n != b[i].n) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// keep the graph that was just built and allocated for the ubatch, if a later ubatch can reuse it
+static void llama_graph_cache_store(llama_context & lctx, const llama_ubatch & ubatch, ggml_cgraph * gf) {
+    auto & gc = lctx.graph_cache;
+
+    // the recurrent state views and the encoder output are not tracked,
+    // and with pipeline parallelism the inputs of the splits rotate between copies
+    if (lctx.kv_self.recurrent || !lctx.cparams.causal_attn || lctx.inp_embd_enc != nullptr ||
+        ggml_backend_sched_get_n_copies(lctx.sched) > 1) {
+        gc.clear();
+        return;
+    }
+
+    gc.gf        = gf;
+    gc.n_tokens  = ubatch.n_tokens;
+    gc.n_seqs    = ubatch.n_seqs;
+    gc.n_outputs = lctx.n_outputs;
+    gc.embd      = ubatch.embd != nullptr;
+    gc.n_kv      = lctx.kv_self.n;
+    gc.n_kv_swa  = lctx.kv_swa.n;
+    gc.segs      = llama_kv_cache_ubatch_segs(lctx.kv_self, lctx.kv_self.head, ubatch.n_tokens);
+    gc.segs_swa  = llama_kv_cache_ubatch_segs(lctx.kv_swa,  lctx.kv_swa.head,  ubatch.n_tokens);
+}
+
+// reuse the graph of the previous ubatch when this one has the same shape: it only differs by the cells it is
+// stored in, so the KV store views are moved to the new cells and the graph is not built, split or allocated again
+// the input tensors are set as usual
+static ggml_cgraph * llama_graph_reuse(llama_context & lctx, const llama_ubatch & ubatch) {
+    auto & gc = lctx.graph_cache;
+
+    if (gc.gf == nullptr) {
+        return nullptr;
+    }
+
+    const auto segs     = llama_kv_cache_ubatch_segs(lctx.kv_self, lctx.kv_self.head, ubatch.n_tokens);
+    const auto segs_swa = llama_kv_cache_ubatch_segs(lctx.kv_swa,  lctx.kv_swa.head,  ubatch.n_tokens);
+
+    if (gc.n_tokens  != ubatch.n_tokens ||
+        gc.n_seqs    != ubatch.n_seqs   ||
+        gc.n_outputs != lctx.n_outputs  ||
+        gc.embd      != (ubatch.embd != nullptr) ||
+        gc.n_kv      != lctx.kv_self.n  ||
+        gc.n_kv_swa  != lctx.kv_swa.n   ||
+        !llama_graph_same_runs(gc.segs,     segs) ||
+        !llama_graph_same_runs(gc.segs_swa, segs_swa)) {
+        return nullptr;
+    }
+
+    for (const auto & view : gc.views) {
+        const auto & seg = view.kv == &lctx.kv_self ? segs[view.i_seg] : segs_swa[view.i_seg];
+
+        const size_t offs = view.nb_cell*seg.i_cell;
+
+        ggml_tensor * t = view.t;
+
+        t->view_offs = offs;
+        t->data      = (char *) t->view_src->data + offs;
+
+        if (t->op == GGML_OP_VIEW) {
+            memcpy(t->op_params, &offs, sizeof(offs));
+        }
     }
+
+    gc.segs     = segs;
+    gc.segs_swa = segs_swa;
+
+    return gc.gf;
 }
 
-static void llama_graph_compute(
-          llama_context & lctx,
-            ggml_cgraph * gf,
-                    int   n_threads,
-        ggml_threadpool * threadpool) {
-#ifdef GGML_USE_METAL
-    if (ggml_backend_is_metal(lctx.backend_metal)) {
-        ggml_backend_metal_set_n_cb(lctx.backend_metal, n_threads);
-    }
-#endif
+static uint32_t llama_kv_cache_defrag_internal(struct llama_context & lctx);
 
-    if (lctx.backend_cpu != nullptr) {
-        ggml_backend_cpu_set_n_threads(lctx.backend_cpu, n_threads);
-        ggml_backend_cpu_set_threadpool(lctx.backend_cpu, threadpool);
-        ggml_backend_cpu_set_abort_callback(lctx.backend_cpu, lctx.abort_callback, lctx.abort_callback_data);
-    }
-#ifdef GGML_USE_BLAS
-    if (lctx.backend_blas != nullptr) {
-        ggml_backend_blas_set_n_threads(lctx.backend_blas, n_threads);
+// apply the pending copy-on-write copies of the paged KV caches
+// the copies are computed in order, in as many graphs as needed to stay within the node limit (as for defrag)
+static void llama_kv_cache_copy_internal(struct llama_context & lctx) {
+    auto & kv_self = lctx.kv_self;
+    auto & kv_swa  = lctx.kv_swa;
+
+    if (kv_self.copies.empty() && kv_swa.copies.empty()) {
+        return;
     }
-#endif
 
-    ggml_backend_sched_graph_compute_async(lctx.sched, gf);
+    const uint32_t n_layer = lctx.model.hparams.n_layer;
 
-    // fprintf(stderr, "splits: %d\n", ggml_backend_sched_get_n_splits(lctx.sched));
+    // each copy is 6 nodes per layer, see llama_kv_cache_defrag_internal
+    const uint32_t max_copies = (llama_model_max_nodes(lctx.model) - 2*n_layer)/(6*n_layer);
+
+    llama_synchronize_stages(lctx);
+
+    for (auto * kv : { &kv_self, &kv_swa }) {
+        for (size_t i = 0; i < kv->copies.size(); i += max_copies) {
+            const uint32_t n_copies = std::min<size_t>(max_copies, kv->copies.size() - i);
+
+            ggml_backend_sched_reset(lctx.sched);
+
+            ggml_cgraph * gf = llama_build_graph_kv_copies(lctx, *kv, kv->copies.data() + i, n_copies);
+
+            llama_graph_compute(lctx, gf, lctx.cparams.n_threads, lctx.threadpool);
+
+            llama_synchronize_stages(lctx);
+        }
+
+        kv->copies.clear();
+    }
 }
 
 // decode a batch of tokens by evaluating the transformer
@@ -16737,6 +18266,17 @@ static int llama_decode_internal(
         }
     }
 
+    if (batch_all.seq_id) {
+        for (uint32_t i = 0; i < n_tokens_all; ++i) {
+            for (int32_t s = 0; s < batch_all.n_seq_id[i]; ++s) {
+                if (batch_all.seq_id[i][s] < 0) {
+                    LLAMA_LOG_ERROR("%s: invalid seq_id[%d][%d] = %d < 0\n", __func__, i, s, batch_all.seq_id[i][s]);
+                    return -1;
+                }
+            }
+        }
+    }
+
     GGML_ASSERT(n_tokens_all <= cparams.n_batch);
 
     GGML_ASSERT((cparams.causal_attn || cparams.n_ubatch >= n_tokens_all) && "non-causal attention requires n_ubatch >= n_tokens");
@@ -16747,6 +18287,7 @@ static int llama_decode_internal(
     lctx.n_queued_tokens += n_tokens_all;
 
     auto & kv_self = lctx.kv_self;
+    auto & kv_swa  = lctx.kv_swa;
 
     const int64_t n_embd  = hparams.n_embd;
     const int64_t n_vocab = hparams.n_vocab;
@@ -16783,6 +18324,8 @@ static int llama_decode_internal(
         return -2;
     };
 
+    lctx.stages_pipelined = n_tokens_all > n_ubatch;
+
     while (lctx.sbatch.n_tokens > 0) {
         llama_ubatch ubatch;
         if (kv_self.recurrent) {
@@ -16831,10 +18374,25 @@ static int llama_decode_internal(
                 kv_self.head = 0;
             }
 
+            // the sliding-window layers first - their cache drops the cells that left the window of the sequences
+            if (kv_swa.size > 0) {
+                llama_kv_cache_swa_prune(kv_swa, ubatch, hparams.n_swa);
+
+                if (!llama_kv_cache_find_slot(kv_swa, ubatch)) {
+                    return 1;
+                }
+            }
+
             if (!llama_kv_cache_find_slot(kv_self, ubatch)) {
+                if (kv_swa.size > 0) {
+                    llama_kv_cache_free_segs(kv_swa);
+                }
                 return 1;
             }
 
+            // shared blocks that the ubatch diverges from
+            llama_kv_cache_copy_internal(lctx);
+
             if (!kv_self.recurrent) {
                 // a heuristic, to avoid attending the full cache if it is not yet utilized
                 // after enough generations, the benefit from this heuristic disappears
@@ -16842,15 +18400,26 @@ static int llama_decode_internal(
                 const uint32_t pad = llama_kv_cache_get_padding(cparams);
                 kv_self.n = std::min(kv_self.size, std::max(pad, GGML_PAD(llama_kv_cache_cell_max(kv_self), pad)));
                 //kv_self.n = llama_kv_cache_cell_max(kv_self);
+
+                kv_swa.n = std::min(kv_swa.size, std::max(pad, GGML_PAD(llama_kv_cache_cell_max(kv_swa), pad)));
             }
         }
 
         //printf("kv_self.n = %5d, kv_self.used = %5d, kv_self.head = %5d\n", kv_self.n, kv_self.used, kv_self.head);
 
-        ggml_backend_sched_reset(lctx.sched);
         ggml_backend_sched_set_eval_callback(lctx.sched, lctx.cparams.cb_eval, lctx.cparams.cb_eval_user_data);
 
-        ggml_cgraph * gf = llama_build_graph(lctx, ubatch, false);
+        ggml_cgraph * gf = llama_graph_reuse(lctx, ubatch);
+
+        if (gf == nullptr) {
+            ggml_backend_sched_reset(lctx.sched);
+
+            gf = llama_build_graph(lctx, ubatch, false);
+
+            ggml_backend_sched_alloc_graph(lctx.sched, gf);
+
+            llama_graph_cache_store(lctx, ubatch, gf);
+        }
 
         // the output is always the last tensor in the graph
         struct ggml_tensor * res  = ggml_graph_node(gf, -1);
@@ -16876,14 +18445,18 @@ static int llama_decode_internal(
         }
         // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
 
-        ggml_backend_sched_alloc_graph(lctx.sched, gf);
-
         llama_set_inputs(lctx, ubatch);
 
-        llama_graph_compute(lctx, gf, n_threads, threadpool);
+        const enum ggml_status compute_status = llama_graph_compute(lctx, gf, n_threads, threadpool);
+        if (compute_status != GGML_STATUS_SUCCESS) {
+            kv_self.segs.clear();
+            kv_swa.segs.clear();
+            LLAMA_LOG_ERROR("%s: graph compute failed with status %d\n", __func__, (int) compute_status);
+            return llama_status_ret(compute_status);
+        }
 
         // update the kv ring buffer
-        {
+        if (kv_self.block_size == 0) {
             kv_self.head += n_tokens;
 
             // Ensure kv cache head points to a valid index.
@@ -16892,6 +18465,9 @@ static int llama_decode_internal(
             }
         }
 
+        kv_self.segs.clear();
+        kv_swa.segs.clear();
+
         // plot the computation graph in dot format (for debugging purposes)
         //if (n_past%100 == 0) {
         //    ggml_graph_dump_dot(gf, NULL, "llama.dot");
@@ -16996,7 +18572,10 @@ static int llama_decode_internal(
 
     // Reset state for the next token before backend sync, to allow the CPU activities in the reset to
     // overlap with device computation.
-    ggml_backend_sched_reset(lctx.sched);
+    // The graph that the next ubatch can reuse stays allocated.
+    if (lctx.graph_cache.gf == nullptr) {
+        ggml_backend_sched_reset(lctx.sched);
+    }
 
     return 0;
 }
@@ -17100,6 +18679,8 @@ static int llama_encode_internal(
 
     llama_set_inputs(lctx, ubatch);
 
+    lctx.stages_pipelined = false;
+
     llama_graph_compute(lctx, gf, n_threads, threadpool);
 
     // extract embeddings
@@ -17166,11 +18747,15 @@ static int llama_encode_internal(
     // overlap with device computation.
     ggml_backend_sched_reset(lctx.sched);
 
+    // the decoder reads the output of the encoder when it sets its inputs
+    llama_synchronize_stages(lctx);
+
     return 0;
 }
 
 // find holes from the beginning of the KV cache and fill them by moving data from the end of the cache
-static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
+// returns the number of moves, one pass moves at most as many runs of cells as fit in a graph
+static uint32_t llama_kv_cache_defrag_internal(struct llama_context & lctx) {
     auto & kv_self = lctx.kv_self;
 
     const auto & hparams = lctx.model.hparams;
@@ -17203,9 +18788,7 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
     std::vector<uint32_t> ids(n_kv, n_kv);
 
     for (uint32_t i0 = 0; i0 < n_used; ++i0) {
-        const auto & cell0 = kv_self.cells[i0];
-
-        if (!cell0.is_empty()) {
+        if (!kv_self.cells.is_empty(i0)) {
             ids[i0] = i0;
 
             continue;
@@ -17216,7 +18799,7 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
         uint32_t nh = 1;
 
         // determine the size of the hole
-        while (i0 + nh < n_used && kv_self.cells[i0 + nh].is_empty()) {
+        while (i0 + nh < n_used && kv_self.cells.is_empty(i0 + nh)) {
             nh++;
         }
 
@@ -17225,9 +18808,7 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
 
         // starting from the end, find nh non-empty cells
         for (; is > i0; --is) {
-            const auto & cell1 = kv_self.cells[is];
-
-            if (cell1.is_empty() || ids[is] != n_kv) {
+            if (kv_self.cells.is_empty(is) || ids[is] != n_kv) {
                 continue;
             }
 
@@ -17254,9 +18835,7 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
 
         // go back and move the nf cells to the hole
         for (; i1 < n_kv; ++i1) {
-            auto & cell1 = kv_self.cells[i1];
-
-            if (cell1.is_empty() || ids[i1] != n_kv) {
+            if (kv_self.cells.is_empty(i1) || ids[i1] != n_kv) {
                 if (n_moves == max_moves) {
                     stop = true;
                     break;
@@ -17269,11 +18848,10 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
             // this cell goes to (i0 + nf)
             ids[i1] = i0 + nf;
 
-            // move the cell meta data
-            kv_self.cells[i0 + nf] = cell1;
+            // move the cell meta data and clear the old cell
+            kv_self.cells.mv(i1, i0 + nf);
 
-            // clear the old cell and move the head there
-            cell1 = llama_kv_cell();
+            // move the head there
             kv_self.head = n_used;
 
             if (!cont) {
@@ -17298,9 +18876,11 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
     }
 
     if (n_moves == 0) {
-        return;
+        return 0;
     }
 
+    llama_kv_cache_rebuild_blocks(kv_self);
+
     //LLAMA_LOG_INFO("(tmp log) KV defrag cell moves: %u\n", n_moves);
 
     //LLAMA_LOG_INFO("expected gf nodes: %u\n", 6*n_moves*n_layer);
@@ -17388,18 +18968,28 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
     //const int64_t t_end = ggml_time_us();
 
     //LLAMA_LOG_INFO("(tmp log) KV defrag time: %.3f ms\n", (t_end - t_start)/1000.0);
+
+    return n_moves;
 }
 
 static void llama_kv_cache_update_internal(struct llama_context & lctx) {
     bool need_reserve = false;
 
+    // the copies of the shared cells come first, the shift and the defrag see the copied data
+    if (!lctx.kv_self.copies.empty() || !lctx.kv_swa.copies.empty()) {
+        llama_kv_cache_copy_internal(lctx);
+    }
+
     // apply K-shift if needed
-    if (lctx.model.hparams.rope_type != LLAMA_ROPE_TYPE_NONE && lctx.kv_self.has_shift) {
+    // with lazy RoPE, the cached K is not rotated - the new positions of the cells are used when attending
+    if (lctx.model.hparams.rope_type != LLAMA_ROPE_TYPE_NONE && (lctx.kv_self.has_shift || lctx.kv_swa.has_shift)) {
         if (lctx.model.arch == LLM_ARCH_DEEPSEEK2) { // not supported due to MLA
             GGML_ABORT("Deepseek2 does not support K-shift");
         }
 
-        {
+        if (!lctx.cparams.lazy_rope) {
+            llama_synchronize_stages(lctx);
+
             ggml_backend_sched_reset(lctx.sched);
 
             ggml_cgraph * gf = llama_build_graph_k_shift(lctx);
@@ -17410,24 +19000,26 @@ static void llama_kv_cache_update_internal(struct llama_context & lctx) {
 
             llama_graph_compute(lctx, gf, lctx.cparams.n_threads, lctx.threadpool);
 
+            llama_synchronize_stages(lctx);
+
             need_reserve = true;
         }
 
-        {
-            auto & kv_self = lctx.kv_self;
-
-            kv_self.has_shift = false;
+        for (auto * kv : { &lctx.kv_self, &lctx.kv_swa }) {
+            kv->has_shift = false;
 
-            for (uint32_t i = 0; i < kv_self.size; ++i) {
-                kv_self.cells[i].delta = 0;
-            }
+            std::fill(kv->cells.delta.begin(), kv->cells.delta.end(), 0);
         }
     }
 
     // defragment the KV cache if needed
     if (lctx.kv_self.do_defrag) {
+        llama_synchronize_stages(lctx);
+
         llama_kv_cache_defrag_internal(lctx);
 
+        llama_synchronize_stages(lctx);
+
         need_reserve = true;
 
         lctx.kv_self.do_defrag = false;
@@ -17441,10 +19033,11 @@ static void llama_kv_cache_update_internal(struct llama_context & lctx) {
         uint32_t n_tokens = std::min(lctx.cparams.n_ctx, lctx.cparams.n_ubatch);
         llama_token token = llama_token_bos(&lctx.model); // not actually used by llama_build_graph, but required to choose between token and embedding inputs graph
         llama_ubatch ubatch = { true, n_tokens, n_tokens / n_seqs, n_seqs, &token, nullptr, nullptr, nullptr, nullptr, nullptr};
+        // the scheduler is reset first, it forgets the backends that the graph assigns to its nodes
+        ggml_backend_sched_reset(lctx.sched);
         ggml_cgraph * gf = llama_build_graph(lctx, ubatch, true);
 
         // initialize scheduler with the worst-case graph
-        ggml_backend_sched_reset(lctx.sched);
         if (!ggml_backend_sched_reserve(lctx.sched, gf)) {
             LLAMA_LOG_ERROR("%s: failed to allocate compute buffers\n", __func__);
         }
@@ -18515,6 +20108,7 @@ int32_t llama_lora_adapter_set(
         return -1;
     }
     ctx->lora_adapters[adapter] = scale;
+    ctx->graph_cache.clear();
     return 0;
 }
 
@@ -18524,6 +20118,7 @@ int32_t llama_lora_adapter_remove(
     auto pos = ctx->lora_adapters.find(adapter);
     if (pos != ctx->lora_adapters.end()) {
         ctx->lora_adapters.erase(pos);
+        ctx->graph_cache.clear();
         return 0;
     }
     return -1;
@@ -18531,6 +20126,7 @@ int32_t llama_lora_adapter_remove(
 
 void llama_lora_adapter_clear(struct llama_context * ctx) {
     ctx->lora_adapters.clear();
+    ctx->graph_cache.clear();
 }
 
 void llama_lora_adapter_free(struct llama_lora_adapter * adapter) {
@@ -18583,6 +20179,9 @@ struct llama_context_params llama_context_default_params() {
         /*.yarn_beta_slow              =*/ 1.0f,
         /*.yarn_orig_ctx               =*/ 0,
         /*.defrag_thold                =*/ -1.0f,
+        /*.kv_block_size               =*/ 0,
+        /*.n_pipeline_stages           =*/ 0,
+        /*.n_swa_keep                  =*/ 0,
         /*.cb_eval                     =*/ nullptr,
         /*.cb_eval_user_data           =*/ nullptr,
         /*.type_k                      =*/ GGML_TYPE_F16,
@@ -18592,6 +20191,9 @@ struct llama_context_params llama_context_default_params() {
         /*.offload_kqv                 =*/ true,
         /*.flash_attn                  =*/ false,
         /*.no_perf                     =*/ true,
+        /*.swa_full                    =*/ false,
+        /*.lazy_rope                   =*/ false,
+        /*.async_decode                =*/ false,
         /*.abort_callback              =*/ nullptr,
         /*.abort_callback_data         =*/ nullptr,
     };
@@ -18691,6 +20293,14 @@ void llama_detach_threadpool(struct llama_context * ctx) {
     ctx->threadpool_batch = nullptr;
 }
 
+void llama_set_compute_priority(struct llama_context * ctx, int32_t priority) {
+    ctx->compute_priority = priority;
+}
+
+void llama_attach_profiler(struct llama_context * ctx, struct ggml_profiler * profiler) {
+    ctx->profiler = profiler;
+}
+
 void llama_backend_free(void) {
     ggml_quantize_free();
 }
@@ -18776,13 +20386,23 @@ struct llama_context * llama_new_context_with_model(
         params.flash_attn = false;
     }
 
+    if (params.lazy_rope && ((model->arch != LLM_ARCH_LLAMA && model->arch != LLM_ARCH_GRANITE) || model->hparams.rope_type == LLAMA_ROPE_TYPE_NONE)) {
+        LLAMA_LOG_WARN("%s: lazy_rope is not supported by this model - forcing off\n", __func__);
+        params.lazy_rope = false;
+    }
+
     if (params.flash_attn && model->hparams.n_embd_head_k != model->hparams.n_embd_head_v) {
         LLAMA_LOG_WARN("%s: flash_attn requires n_embd_head_k == n_embd_head_v - forcing off\n", __func__);
         params.flash_attn = false;
     }
 
-    if (params.type_v != GGML_TYPE_F16 && !params.flash_attn) {
-        LLAMA_LOG_ERROR("%s: V cache quantization requires flash_attn\n", __func__);
+    if (ggml_is_quantized(params.type_v) && model->hparams.n_embd_head_v % ggml_blck_size(params.type_v) != 0) {
+        LLAMA_LOG_ERROR("%s: V cache quantization requires n_embd_head_v to be a multiple of the %s block size\n", __func__, ggml_type_name(params.type_v));
+        return nullptr;
+    }
+
+    if (params.kv_block_size & (params.kv_block_size - 1)) {
+        LLAMA_LOG_ERROR("%s: kv_block_size must be a power of 2\n", __func__);
         return nullptr;
     }
 
@@ -18799,10 +20419,14 @@ struct llama_context * llama_new_context_with_model(
     cparams.yarn_beta_fast   = params.yarn_beta_fast;
     cparams.yarn_beta_slow   = params.yarn_beta_slow;
     cparams.defrag_thold     = params.defrag_thold;
+    cparams.kv_block_size    = params.kv_block_size;
+    cparams.n_swa_keep       = params.n_swa_keep;
+    cparams.n_pipeline_stages = params.n_pipeline_stages > 1 ? std::min(params.n_pipeline_stages, hparams.n_layer) : (params.async_decode ? 1 : 0);
     cparams.embeddings       = params.embeddings;
     cparams.offload_kqv      = params.offload_kqv;
     cparams.flash_attn       = params.flash_attn;
     cparams.no_perf          = params.no_perf;
+    cparams.lazy_rope        = params.lazy_rope;
     cparams.pooling_type     = params.pooling_type;
 
     cparams.n_ctx            = params.n_ctx           == 0    ? hparams.n_ctx_train           : params.n_ctx;
@@ -18810,7 +20434,7 @@ struct llama_context * llama_new_context_with_model(
     cparams.rope_freq_scale  = params.rope_freq_scale == 0.0f ? hparams.rope_freq_scale_train : params.rope_freq_scale;
 
     // this is necessary due to kv_self.n being padded later during inference
-    cparams.n_ctx            = GGML_PAD(cparams.n_ctx, llama_kv_cache_get_padding(cparams));
+    cparams.n_ctx            = GGML_PAD(cparams.n_ctx, std::max(llama_kv_cache_get_padding(cparams), cparams.kv_block_size));
 
     // with causal attention, the batch size is limited by the context size
     cparams.n_batch          = hparams.causal_attn ? std::min(cparams.n_ctx, params.n_batch) : params.n_batch;
@@ -18865,6 +20489,12 @@ struct llama_context * llama_new_context_with_model(
     LLAMA_LOG_INFO("%s: n_batch    = %u\n",     __func__, cparams.n_batch);
     LLAMA_LOG_INFO("%s: n_ubatch   = %u\n",     __func__, cparams.n_ubatch);
     LLAMA_LOG_INFO("%s: flash_attn = %d\n",     __func__, cparams.flash_attn);
+    if (cparams.kv_block_size > 0) {
+        LLAMA_LOG_INFO("%s: kv_block   = %u\n",     __func__, cparams.kv_block_size);
+    }
+    if (cparams.n_pipeline_stages > 0) {
+        LLAMA_LOG_INFO("%s: n_stages   = %u\n",     __func__, cparams.n_pipeline_stages);
+    }
     LLAMA_LOG_INFO("%s: freq_base  = %.1f\n",   __func__, cparams.rope_freq_base);
     LLAMA_LOG_INFO("%s: freq_scale = %g\n",     __func__, cparams.rope_freq_scale);
 
@@ -19032,30 +20662,81 @@ struct llama_context * llama_new_context_with_model(
         }
 #endif
 
-        ctx->backend_cpu = ggml_backend_cpu_init();
-        if (ctx->backend_cpu == nullptr) {
-            LLAMA_LOG_ERROR("%s: failed to initialize CPU backend\n", __func__);
-            llama_free(ctx);
-            return nullptr;
+        if (cparams.n_pipeline_stages > 0 && !ctx->backends.empty()) {
+            LLAMA_LOG_WARN("%s: CPU pipeline stages require the model to run on the CPU backend only - disabling\n", __func__);
+            cparams.n_pipeline_stages = 0;
+        }
+
+        if (cparams.n_pipeline_stages > 0) {
+            // each stage has a thread that submits its graphs to a threadpool of its own, on its NUMA node when there are several
+            const int n_threads_max = std::max(cparams.n_threads, cparams.n_threads_batch);
+
+            for (uint32_t s = 0; s < cparams.n_pipeline_stages; s++) {
+                ggml_backend_t backend = ggml_backend_cpu_stage_init(s);
+                if (backend == nullptr) {
+                    LLAMA_LOG_ERROR("%s: failed to initialize CPU pipeline stage %u\n", __func__, s);
+                    llama_free(ctx);
+                    return nullptr;
+                }
+                ctx->backend_stages.push_back(backend);
+                ctx->backends.push_back(backend);
+
+                struct ggml_threadpool_params tpp = ggml_threadpool_params_default(ggml_is_numa() ? std::max(1, n_threads_max / (int) cparams.n_pipeline_stages) : n_threads_max);
+                tpp.numa_node = s;
+
+                ggml_threadpool_t threadpool = ggml_threadpool_new(&tpp);
+                if (threadpool == nullptr) {
+                    LLAMA_LOG_ERROR("%s: failed to create the threadpool of CPU pipeline stage %u\n", __func__, s);
+                    llama_free(ctx);
+                    return nullptr;
+                }
+                ctx->threadpool_stages.push_back(threadpool);
+            }
+
+            // the last backend of the scheduler is the CPU backend
+            ctx->backend_cpu = ctx->backend_stages.back();
+        } else {
+            ctx->backend_cpu = ggml_backend_cpu_init();
+            if (ctx->backend_cpu == nullptr) {
+                LLAMA_LOG_ERROR("%s: failed to initialize CPU backend\n", __func__);
+                llama_free(ctx);
+                return nullptr;
+            }
+            ctx->backends.push_back(ctx->backend_cpu);
         }
-        ctx->backends.push_back(ctx->backend_cpu);
 
-        if (!llama_kv_cache_init(ctx->kv_self, ctx, type_k, type_v, kv_size, cparams.offload_kqv)) {
+        // the sliding-window layers keep only the cells of the window of each sequence in a cache of their own
+        const uint32_t kv_size_swa = params.swa_full ? 0 : llama_kv_cache_swa_size(hparams, cparams);
+
+        if (!llama_kv_cache_init(ctx->kv_self, ctx, type_k, type_v, kv_size, cparams.offload_kqv,
+                    kv_size_swa > 0 ? LLAMA_KV_LAYERS_FULL : LLAMA_KV_LAYERS_ALL)) {
             LLAMA_LOG_ERROR("%s: llama_kv_cache_init() failed for self-attention cache\n", __func__);
             llama_free(ctx);
             return nullptr;
         }
 
+        if (kv_size_swa > 0) {
+            LLAMA_LOG_INFO("%s: kv_size_swa = %u\n", __func__, kv_size_swa);
+
+            if (!llama_kv_cache_init(ctx->kv_swa, ctx, type_k, type_v, kv_size_swa, cparams.offload_kqv, LLAMA_KV_LAYERS_SWA)) {
+                LLAMA_LOG_ERROR("%s: llama_kv_cache_init() failed for sliding-window attention cache\n", __func__);
+                llama_free(ctx);
+                return nullptr;
+            }
+        }
+
         {
             size_t memory_size_k = 0;
             size_t memory_size_v = 0;
 
-            for (auto & k : ctx->kv_self.k_l) {
-                memory_size_k += ggml_nbytes(k);
-            }
+            for (const auto * kv : { &ctx->kv_self, &ctx->kv_swa }) {
+                for (auto & k : kv->k_l) {
+                    memory_size_k += k ? ggml_nbytes(k) : 0;
+                }
 
-            for (auto & v : ctx->kv_self.v_l) {
-                memory_size_v += ggml_nbytes(v);
+                for (auto & v : kv->v_l) {
+                    memory_size_v += v ? ggml_nbytes(v) : 0;
+                }
             }
 
             LLAMA_LOG_INFO("%s: KV self size  = %7.2f MiB, K (%s): %7.2f MiB, V (%s): %7.2f MiB\n", __func__,
@@ -19083,7 +20764,10 @@ struct llama_context * llama_new_context_with_model(
             // buffer types used for the compute buffer of each backend
             std::vector<ggml_backend_buffer_type_t> backend_buft;
             for (auto * backend : ctx->backends) {
-                if (ggml_backend_is_cpu(backend)) {
+                if (ggml_backend_cpu_is_stage(backend)) {
+                    // each stage has compute buffers of its own
+                    backend_buft.push_back(ggml_backend_get_default_buffer_type(backend));
+                } else if (ggml_backend_is_cpu(backend)) {
                     // use host buffers for the CPU backend compute buffer
                     backend_buft.push_back(llama_default_buffer_type_cpu(true));
                 } else {
@@ -19107,6 +20791,9 @@ struct llama_context * llama_new_context_with_model(
             // currently this is only implemented in the CUDA backend
             pipeline_parallel = false;
 #endif
+            // the CPU stages are async backends, the scheduler keeps several copies of their inputs to pipeline the ubatches
+            pipeline_parallel = pipeline_parallel || cparams.n_pipeline_stages > 0;
+
             ctx->sched = ggml_backend_sched_new(ctx->backends.data(), backend_buft.data(), ctx->backends.size(), max_nodes, pipeline_parallel);
 
             if (pipeline_parallel) {
@@ -19132,9 +20819,10 @@ struct llama_context * llama_new_context_with_model(
                 ggml_backend_buffer_type_t buft = backend_buft[i];
                 size_t size = ggml_backend_sched_get_buffer_size(ctx->sched, backend);
                 if (size > 1) {
-                    LLAMA_LOG_INFO("%s: %10s compute buffer size = %8.2f MiB\n", __func__,
+                    size_t peak = ggml_backend_sched_get_peak_size(ctx->sched, backend);
+                    LLAMA_LOG_INFO("%s: %10s compute buffer size = %8.2f MiB (peak %8.2f MiB)\n", __func__,
                             ggml_backend_buft_name(buft),
-                            size / 1024.0 / 1024.0);
+                            size / 1024.0 / 1024.0, peak / 1024.0 / 1024.0);
                 }
             }
 
@@ -19454,6 +21142,9 @@ int32_t llama_control_vector_apply(struct llama_context * lctx, const float * da
     const llama_model & model = lctx->model;
     llama_control_vector & cvec = lctx->cvec;
 
+    // the layer range is part of the graph
+    lctx->graph_cache.clear();
+
     if (data == nullptr) {
         // disable the current control vector (but leave allocated for later)
         cvec.layer_start = -1;
@@ -19523,7 +21214,7 @@ void llama_kv_cache_view_update(const struct llama_context * ctx, struct llama_k
         view->cells_sequences = (llama_seq_id *)p;
     }
 
-    const std::vector<llama_kv_cell> & kv_cells = ctx->kv_self.cells;
+    const llama_kv_cells & kv_cells = ctx->kv_self.cells;
     llama_kv_cache_view_cell * c_curr = view->cells;
     llama_seq_id * cs_curr = view->cells_sequences;
     int32_t used_cells = 0;
@@ -19533,9 +21224,9 @@ void llama_kv_cache_view_update(const struct llama_context * ctx, struct llama_k
     int32_t max_contig_idx = -1;
 
     for (int32_t i = 0; i < int32_t(ctx->kv_self.size); i++, c_curr++, cs_curr += view->n_seq_max) {
-        const size_t curr_size = kv_cells[i].seq_id.size();
+        const size_t curr_size = kv_cells.seq_count(i);
         token_count += curr_size;
-        c_curr->pos = kv_cells[i].pos + kv_cells[i].delta;
+        c_curr->pos = kv_cells.pos[i] + kv_cells.delta[i];
 
         if (curr_size > 0) {
             if (curr_contig_idx >= 0 && uint32_t(i - curr_contig_idx) > max_contig) {
@@ -19548,7 +21239,7 @@ void llama_kv_cache_view_update(const struct llama_context * ctx, struct llama_k
         }
 
         int seq_idx = 0;
-        for (const llama_seq_id it : kv_cells[i].seq_id) {
+        for (llama_seq_id it = kv_cells.seq_next(i, 0); it >= 0; it = kv_cells.seq_next(i, it + 1)) {
             if (seq_idx >= view->n_seq_max) {
                 break;
             }
@@ -19562,9 +21253,9 @@ void llama_kv_cache_view_update(const struct llama_context * ctx, struct llama_k
             cs_curr[seq_idx] = -1;
         }
     }
-    if (curr_contig_idx >= 0 && kv_cells.size() - curr_contig_idx > max_contig) {
+    if (curr_contig_idx >= 0 && ctx->kv_self.size - curr_contig_idx > max_contig) {
         max_contig_idx = curr_contig_idx;
-        max_contig = kv_cells.size() - curr_contig_idx;
+        max_contig = ctx->kv_self.size - curr_contig_idx;
     }
     view->max_contiguous = max_contig;
     view->max_contiguous_idx = max_contig_idx;
@@ -19580,7 +21271,7 @@ int32_t llama_get_kv_cache_token_count(const struct llama_context * ctx) {
     int result = 0;
 
     for (uint32_t i = 0; i < ctx->kv_self.size; i++) {
-        result += ctx->kv_self.cells[i].seq_id.size();
+        result += ctx->kv_self.cells.seq_count(i);
     }
 
     return result;
@@ -19590,12 +21281,23 @@ int32_t llama_get_kv_cache_used_cells(const struct llama_context * ctx) {
     return ctx->kv_self.used;
 }
 
+// note: the operations on the sequences apply to both caches, the sliding-window cache is empty when it is not used
+
 void llama_kv_cache_clear(struct llama_context * ctx) {
     llama_kv_cache_clear(ctx->kv_self);
+    llama_kv_cache_clear(ctx->kv_swa);
 }
 
 bool llama_kv_cache_seq_rm(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
-    return llama_kv_cache_seq_rm(ctx->kv_self, seq_id, p0, p1);
+    if (ctx->kv_swa.size > 0 && !llama_kv_cache_swa_can_rm(ctx->kv_self, ctx->kv_swa, seq_id, p0, p1, ctx->model.hparams.n_swa)) {
+        return false;
+    }
+
+    if (!llama_kv_cache_seq_rm(ctx->kv_self, seq_id, p0, p1)) {
+        return false;
+    }
+
+    return llama_kv_cache_seq_rm(ctx->kv_swa, seq_id, p0, p1);
 }
 
 void llama_kv_cache_seq_cp(struct llama_context * ctx, llama_seq_id seq_id_src, llama_seq_id seq_id_dst, llama_pos p0, llama_pos p1) {
@@ -19603,10 +21305,12 @@ void llama_kv_cache_seq_cp(struct llama_context * ctx, llama_seq_id seq_id_src,
         return;
     }
     llama_kv_cache_seq_cp(ctx->kv_self, seq_id_src, seq_id_dst, p0, p1);
+    llama_kv_cache_seq_cp(ctx->kv_swa,  seq_id_src, seq_id_dst, p0, p1);
 }
 
 void llama_kv_cache_seq_keep(struct llama_context * ctx, llama_seq_id seq_id) {
     llama_kv_cache_seq_keep(ctx->kv_self, seq_id);
+    llama_kv_cache_seq_keep(ctx->kv_swa,  seq_id);
 }
 
 void llama_kv_cache_seq_add(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos delta) {
@@ -19614,7 +21318,9 @@ void llama_kv_cache_seq_add(struct llama_context * ctx, llama_seq_id seq_id, lla
         return;
     }
 
+    // the copies of the cells shared with other sequences are applied by the next llama_kv_cache_update
     llama_kv_cache_seq_add(ctx->kv_self, seq_id, p0, p1, delta);
+    llama_kv_cache_seq_add(ctx->kv_swa,  seq_id, p0, p1, delta);
 }
 
 void llama_kv_cache_seq_div(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
@@ -19623,6 +21329,7 @@ void llama_kv_cache_seq_div(struct llama_context * ctx, llama_seq_id seq_id, lla
     }
 
     llama_kv_cache_seq_div(ctx->kv_self, seq_id, p0, p1, d);
+    llama_kv_cache_seq_div(ctx->kv_swa,  seq_id, p0, p1, d);
 }
 
 llama_pos llama_kv_cache_seq_pos_max(struct llama_context * ctx, llama_seq_id seq_id) {
@@ -19746,15 +21453,14 @@ struct llama_data_write {
 
         for (const auto & range : cell_ranges) {
             for (uint32_t i = range.first; i < range.second; ++i) {
-                const auto & cell = kv_self.cells[i];
-                const llama_pos pos      = cell.pos;
-                const uint32_t  n_seq_id = seq_id == -1 ? cell.seq_id.size() : 0;
+                const llama_pos pos      = kv_self.cells.pos[i];
+                const uint32_t  n_seq_id = seq_id == -1 ? kv_self.cells.seq_count(i) : 0;
 
                 write(&pos,      sizeof(pos));
                 write(&n_seq_id, sizeof(n_seq_id));
 
                 if (n_seq_id) {
-                    for (auto seq_id : cell.seq_id) {
+                    for (llama_seq_id seq_id = kv_self.cells.seq_next(i, 0); seq_id >= 0; seq_id = kv_self.cells.seq_next(i, seq_id + 1)) {
                         write(&seq_id, sizeof(seq_id));
                     }
                 }
@@ -19762,21 +21468,29 @@ struct llama_data_write {
         }
     }
 
-    void write_kv_cache_data(const struct llama_context * ctx, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges) {
-        const struct llama_kv_cache & kv_self = ctx->kv_self;
+    void write_kv_cache_data(const struct llama_context * ctx, const llama_kv_cache & kv_self, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges) {
         const struct llama_hparams & hparams = ctx->model.hparams;
 
-        const uint32_t v_trans = kv_self.v_trans ? 1 : 0;
-        const uint32_t n_layer = hparams.n_layer;
+        const uint32_t v_trans   = kv_self.v_trans ? 1 : 0;
+        const uint32_t lazy_rope = ctx->cparams.lazy_rope ? 1 : 0;
+        const uint32_t n_layer   = hparams.n_layer;
 
-        write(&v_trans, sizeof(v_trans));
-        write(&n_layer, sizeof(n_layer));
+        // the layers stored in the cache
+        const uint32_t n_layer_kv = std::count_if(kv_self.k_l.begin(), kv_self.k_l.end(), [](const ggml_tensor * k) { return k != nullptr; });
+
+        write(&v_trans,    sizeof(v_trans));
+        write(&lazy_rope,  sizeof(lazy_rope));
+        write(&n_layer_kv, sizeof(n_layer_kv));
 
         std::vector<uint8_t> tmp_buf;
 
         // Iterate and write all the keys first, each row is a cell
         // Get whole range at a time
         for (uint32_t il = 0; il < n_layer; ++il) {
+            if (kv_self.k_l[il] == nullptr) {
+                continue;
+            }
+
             const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa(il) + hparams.n_embd_k_s();
 
             // Write key type
@@ -19797,6 +21511,10 @@ struct llama_data_write {
 
         if (!kv_self.v_trans) {
             for (uint32_t il = 0; il < n_layer; ++il) {
+                if (kv_self.v_l[il] == nullptr) {
+                    continue;
+                }
+
                 const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
 
                 // Write value type
@@ -19818,6 +21536,10 @@ struct llama_data_write {
             // When v is transposed, we also need the element size and get the element ranges from each row
             const uint32_t kv_size = kv_self.size;
             for (uint32_t il = 0; il < n_layer; ++il) {
+                if (kv_self.v_l[il] == nullptr) {
+                    continue;
+                }
+
                 const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
 
                 // Write value type
@@ -19845,8 +21567,7 @@ struct llama_data_write {
         }
     }
 
-    void write_kv_cache(const struct llama_context * ctx, llama_seq_id seq_id = -1) {
-        const struct llama_kv_cache & kv_self = ctx->kv_self;
+    void write_kv_cache(const struct llama_context * ctx, const llama_kv_cache & kv_self, llama_seq_id seq_id) {
         std::vector<std::pair<uint32_t, uint32_t>> cell_ranges; // ranges, from inclusive, to exclusive
         uint32_t cell_count = 0;
 
@@ -19854,8 +21575,7 @@ struct llama_data_write {
         // Find all the ranges of cells with this seq id (or all, when -1)
         uint32_t cell_range_begin = kv_self.size;
         for (uint32_t i = 0; i < kv_self.size; ++i) {
-            const auto & cell = kv_self.cells[i];
-            if ((seq_id == -1 && !cell.is_empty()) || cell.has_seq_id(seq_id)) {
+            if ((seq_id == -1 && !kv_self.cells.is_empty(i)) || kv_self.cells.has_seq_id(i, seq_id)) {
                 ++cell_count;
                 if (cell_range_begin == kv_self.size) {
                     cell_range_begin = i;
@@ -19881,7 +21601,16 @@ struct llama_data_write {
         write(&cell_count, sizeof(cell_count));
 
         write_kv_cache_meta(kv_self, cell_ranges, seq_id);
-        write_kv_cache_data(ctx, cell_ranges);
+        write_kv_cache_data(ctx, kv_self, cell_ranges);
+    }
+
+    void write_kv_cache(const struct llama_context * ctx, llama_seq_id seq_id = -1) {
+        write_kv_cache(ctx, ctx->kv_self, seq_id);
+
+        // the cells of the sliding-window layers follow those of the main cache
+        if (ctx->kv_swa.size > 0) {
+            write_kv_cache(ctx, ctx->kv_swa, seq_id);
+        }
     }
 };
 
@@ -19891,6 +21620,10 @@ struct llama_data_read {
     virtual size_t get_size_read() = 0;
     virtual ~llama_data_read() = default;
 
+    virtual void read_tensor_data(struct ggml_tensor * tensor, size_t offset, size_t size) {
+        ggml_backend_tensor_set(tensor, read(size), offset, size);
+    }
+
     void read_string(std::string & str) {
         uint32_t str_size;
         read_to(&str_size, sizeof(str_size));
@@ -19973,9 +21706,7 @@ struct llama_data_read {
         }
     }
 
-    bool read_kv_cache_meta(struct llama_context * ctx, uint32_t cell_count, llama_seq_id dest_seq_id = -1) {
-        struct llama_kv_cache & kv_self = ctx->kv_self;
-
+    bool read_kv_cache_meta(struct llama_context * ctx, llama_kv_cache & kv_self, uint32_t cell_count, llama_seq_id dest_seq_id) {
         if (dest_seq_id != -1) {
             // single sequence
 
@@ -20007,13 +21738,19 @@ struct llama_data_read {
                 return false;
             }
 
-            // DEBUG CHECK: kv_self.head should be our first cell, kv_self.head + cell_count - 1 should be our last cell (verify seq_id and pos values)
-            // Assume that this is one contiguous block of cells
-            GGML_ASSERT(kv_self.head + cell_count <= kv_self.size);
-            GGML_ASSERT(kv_self.cells[kv_self.head].pos == batch.pos[0]);
-            GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].pos == batch.pos[cell_count - 1]);
-            GGML_ASSERT(kv_self.cells[kv_self.head].has_seq_id(dest_seq_id));
-            GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].has_seq_id(dest_seq_id));
+            if (kv_self.segs.empty() && cell_count > 0) {
+                // the ring buffer stores the sequence in one contiguous block of cells, starting at the head
+                kv_self.segs.push_back({ 0, kv_self.head, cell_count });
+            }
+
+            // DEBUG CHECK: the first and last cell of each run should match the restored pos and seq_id
+            for (const auto & seg : kv_self.segs) {
+                GGML_ASSERT(seg.i_cell + seg.n <= kv_self.size);
+                GGML_ASSERT(kv_self.cells.pos[seg.i_cell] == batch.pos[seg.i_token]);
+                GGML_ASSERT(kv_self.cells.pos[seg.i_cell + seg.n - 1] == batch.pos[seg.i_token + seg.n - 1]);
+                GGML_ASSERT(kv_self.cells.has_seq_id(seg.i_cell, dest_seq_id));
+                GGML_ASSERT(kv_self.cells.has_seq_id(seg.i_cell + seg.n - 1, dest_seq_id));
+            }
         } else {
             // whole KV cache restore
 
@@ -20025,15 +21762,13 @@ struct llama_data_read {
             llama_kv_cache_clear(kv_self);
 
             for (uint32_t i = 0; i < cell_count; ++i) {
-                llama_kv_cell & cell = kv_self.cells[i];
-
                 llama_pos pos;
                 uint32_t  n_seq_id;
 
                 read_to(&pos,      sizeof(pos));
                 read_to(&n_seq_id, sizeof(n_seq_id));
 
-                cell.pos = pos;
+                kv_self.cells.pos[i] = pos;
 
                 for (uint32_t j = 0; j < n_seq_id; ++j) {
                     llama_seq_id seq_id;
@@ -20044,10 +21779,10 @@ struct llama_data_read {
                         return false;
                     }
 
-                    cell.seq_id.insert(seq_id);
+                    kv_self.cells.seq_set(i, seq_id);
 
                     if (kv_self.recurrent) {
-                        int32_t & tail = kv_self.cells[seq_id].tail;
+                        int32_t & tail = kv_self.cells.tail[seq_id];
                         if (tail != -1) {
                             LLAMA_LOG_ERROR("%s: duplicate tail for seq_id %d in cell %d and %d\n", __func__, seq_id, i, tail);
                             return false;
@@ -20059,29 +21794,40 @@ struct llama_data_read {
 
             kv_self.head = 0;
             kv_self.used = cell_count;
+
+            llama_kv_cache_rebuild_blocks(kv_self);
+
+            kv_self.segs.clear();
+            kv_self.segs.push_back({ 0, 0, cell_count });
         }
 
         if (kv_self.recurrent) {
             for (uint32_t i = 0; i < cell_count; ++i) {
                 uint32_t cell_id = kv_self.head + i;
                 // make sure the recurrent states will keep their restored state
-                kv_self.cells[cell_id].src = cell_id;
+                kv_self.cells.src[cell_id] = cell_id;
             }
         }
 
         return true;
     }
 
-    bool read_kv_cache_data(struct llama_context * ctx, uint32_t cell_count) {
+    bool read_kv_cache_data(struct llama_context * ctx, llama_kv_cache & kv_self, uint32_t cell_count) {
         const struct llama_hparams & hparams = ctx->model.hparams;
-        struct llama_kv_cache & kv_self = ctx->kv_self;
-        uint32_t v_trans;
-        uint32_t n_layer;
-        read_to(&v_trans, sizeof(v_trans));
-        read_to(&n_layer, sizeof(n_layer));
+        const uint32_t n_layer = hparams.n_layer;
+
+        // the layers stored in the cache
+        const uint32_t n_layer_kv = std::count_if(kv_self.k_l.begin(), kv_self.k_l.end(), [](const ggml_tensor * k) { return k != nullptr; });
 
-        if (n_layer != hparams.n_layer) {
-            LLAMA_LOG_ERROR("%s: mismatched layer count (%u instead of %u)\n", __func__, n_layer, hparams.n_layer);
+        uint32_t v_trans;
+        uint32_t lazy_rope;
+        uint32_t n_layer_ref;
+        read_to(&v_trans,     sizeof(v_trans));
+        read_to(&lazy_rope,   sizeof(lazy_rope));
+        read_to(&n_layer_ref, sizeof(n_layer_ref));
+
+        if (n_layer_ref != n_layer_kv) {
+            LLAMA_LOG_ERROR("%s: mismatched layer count (%u instead of %u)\n", __func__, n_layer_ref, n_layer_kv);
             return false;
         }
         if (cell_count > kv_self.size) {
@@ -20092,9 +21838,28 @@ struct llama_data_read {
             LLAMA_LOG_ERROR("%s: incompatible V transposition\n", __func__);
             return false;
         }
+        // with lazy_rope the cache holds K before RoPE, the rows of the other mode would be rotated wrongly
+        if (ctx->cparams.lazy_rope != (bool) lazy_rope) {
+            LLAMA_LOG_ERROR("%s: incompatible K rotation (state saved with lazy_rope %s)\n", __func__, lazy_rope ? "on" : "off");
+            return false;
+        }
+
+        // the rows of the cells are stored in token order, each run of cells is read straight into the KV tensors
+        {
+            uint32_t n_seg_tokens = 0;
+            for (const auto & seg : kv_self.segs) {
+                GGML_ASSERT(seg.i_token == n_seg_tokens);
+                n_seg_tokens += seg.n;
+            }
+            GGML_ASSERT(n_seg_tokens == cell_count || cell_count == 0);
+        }
 
         // For each layer, read the keys for each cell, one row is one cell, read as one contiguous block
         for (uint32_t il = 0; il < n_layer; ++il) {
+            if (kv_self.k_l[il] == nullptr) {
+                continue;
+            }
+
             const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa(il) + hparams.n_embd_k_s();
 
             // Read type of key
@@ -20117,12 +21882,18 @@ struct llama_data_read {
 
             if (cell_count) {
                 // Read and set the keys for the whole cell range
-                ggml_backend_tensor_set(kv_self.k_l[il], read(cell_count * k_size_row), kv_self.head * k_size_row, cell_count * k_size_row);
+                for (const auto & seg : kv_self.segs) {
+                    read_tensor_data(kv_self.k_l[il], seg.i_cell * k_size_row, seg.n * k_size_row);
+                }
             }
         }
 
         if (!kv_self.v_trans) {
             for (uint32_t il = 0; il < n_layer; ++il) {
+                if (kv_self.v_l[il] == nullptr) {
+                    continue;
+                }
+
                 const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
 
                 // Read type of value
@@ -20145,12 +21916,18 @@ struct llama_data_read {
 
                 if (cell_count) {
                     // Read and set the values for the whole cell range
-                    ggml_backend_tensor_set(kv_self.v_l[il], read(cell_count * v_size_row), kv_self.head * v_size_row, cell_count * v_size_row);
+                    for (const auto & seg : kv_self.segs) {
+                        read_tensor_data(kv_self.v_l[il], seg.i_cell * v_size_row, seg.n * v_size_row);
+                    }
                 }
             }
         } else {
             // For each layer, read the values for each cell (transposed)
             for (uint32_t il = 0; il < n_layer; ++il) {
+                if (kv_self.v_l[il] == nullptr) {
+                    continue;
+                }
+
                 const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
 
                 // Read type of value
@@ -20180,10 +21957,16 @@ struct llama_data_read {
                 }
 
                 if (cell_count) {
-                    // For each row in the transposed matrix, read the values for the whole cell range
+                    // read all rows of the layer at once, the rows of a cell range are short
+                    const uint8_t * src_layer = read(n_embd_v_gqa * cell_count * v_size_el);
+
+                    // For each row in the transposed matrix, set the values for the whole cell range
                     for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
-                        const size_t dst_offset = (kv_self.head + j * kv_self.size) * v_size_el;
-                        ggml_backend_tensor_set(kv_self.v_l[il], read(cell_count * v_size_el), dst_offset, cell_count * v_size_el);
+                        const uint8_t * src = src_layer + j * cell_count * v_size_el;
+                        for (const auto & seg : kv_self.segs) {
+                            const size_t dst_offset = (seg.i_cell + j * kv_self.size) * v_size_el;
+                            ggml_backend_tensor_set(kv_self.v_l[il], src + seg.i_token * v_size_el, dst_offset, seg.n * v_size_el);
+                        }
                     }
                 }
             }
@@ -20191,11 +21974,24 @@ struct llama_data_read {
         return true;
     }
 
-    void read_kv_cache(struct llama_context * ctx, llama_seq_id seq_id = -1) {
+    bool read_kv_cache(struct llama_context * ctx, llama_kv_cache & kv, llama_seq_id seq_id) {
         uint32_t cell_count;
         read_to(&cell_count, sizeof(cell_count));
 
-        bool res = read_kv_cache_meta(ctx, cell_count, seq_id) && read_kv_cache_data(ctx, cell_count);
+        bool res = read_kv_cache_meta(ctx, kv, cell_count, seq_id) && read_kv_cache_data(ctx, kv, cell_count);
+
+        kv.segs.clear();
+
+        return res;
+    }
+
+    void read_kv_cache(struct llama_context * ctx, llama_seq_id seq_id = -1) {
+        bool res = read_kv_cache(ctx, ctx->kv_self, seq_id);
+
+        // the cells of the sliding-window layers follow those of the main cache
+        if (res && ctx->kv_swa.size > 0) {
+            res = read_kv_cache(ctx, ctx->kv_swa, seq_id);
+        }
 
         if (!res) {
             if (seq_id == -1) {
@@ -20298,6 +22094,11 @@ struct llama_data_write_file : llama_data_write {
     }
 
     void write_tensor_data(const struct ggml_tensor * tensor, size_t offset, size_t size) override {
+        if (ggml_backend_buffer_is_host(tensor->buffer)) {
+            // write straight from the KV cache
+            write((const uint8_t *) tensor->data + offset, size);
+            return;
+        }
         temp_buffer.resize(size);
         ggml_backend_tensor_get(tensor, temp_buffer.data(), offset, size);
         write(temp_buffer.data(), temp_buffer.size());
@@ -20326,6 +22127,15 @@ struct llama_data_read_file : llama_data_read {
         return temp_buffer.data();
     }
 
+    void read_tensor_data(struct ggml_tensor * tensor, size_t offset, size_t size) override {
+        if (ggml_backend_buffer_is_host(tensor->buffer)) {
+            // read straight into the KV cache
+            read_to((uint8_t *) tensor->data + offset, size);
+            return;
+        }
+        llama_data_read::read_tensor_data(tensor, offset, size);
+    }
+
     size_t get_size_read() override {
         return size_read;
     }
@@ -20347,6 +22157,9 @@ struct llama_data_read_file : llama_data_read {
 static size_t llama_state_get_data_internal(struct llama_context * ctx, llama_data_write & data_ctx) {
     llama_synchronize(ctx);
 
+    // the data of the cells that are still to be copied from shared cells
+    llama_kv_cache_copy_internal(*ctx);
+
     data_ctx.write_model_info(ctx);
 
     // copy outputs
@@ -20487,6 +22300,9 @@ bool llama_state_save_file(struct llama_context * ctx, const char * path_session
 static size_t llama_state_seq_get_data_internal(struct llama_context * ctx, llama_data_write & data_ctx, llama_seq_id seq_id) {
     llama_synchronize(ctx);
 
+    // the data of the cells that are still to be copied from shared cells
+    llama_kv_cache_copy_internal(*ctx);
+
     data_ctx.write_kv_cache(ctx, seq_id);
 
     return data_ctx.get_size_written();
@@ -20625,10 +22441,12 @@ void llama_set_abort_callback(struct llama_context * ctx, bool (*abort_callback)
 
 void llama_set_embeddings(struct llama_context * ctx, bool embeddings) {
     ctx->cparams.embeddings = embeddings;
+    ctx->graph_cache.clear();
 }
 
 void llama_set_causal_attn(struct llama_context * ctx, bool causal_attn) {
     ctx->cparams.causal_attn = causal_attn;
+    ctx->graph_cache.clear();
 }
 
 struct llama_batch llama_batch_get_one(
@@ -20700,6 +22518,14 @@ void llama_batch_free(struct llama_batch batch) {
 int32_t llama_encode(
         struct llama_context * ctx,
           struct llama_batch   batch) {
+    if (ctx->decode_pending) {
+        const int32_t ret = llama_decode_wait(ctx);
+        if (ret != 0) {
+            LLAMA_LOG_ERROR("%s: the previous decode failed, ret = %d\n", __func__, ret);
+            return ret;
+        }
+    }
+
     const int ret = llama_encode_internal(*ctx, batch);
     if (ret < 0) {
         LLAMA_LOG_ERROR("%s: failed to encode, ret = %d\n", __func__, ret);
@@ -20711,6 +22537,14 @@ int32_t llama_encode(
 int32_t llama_decode(
         struct llama_context * ctx,
           struct llama_batch   batch) {
+    if (ctx->decode_pending) {
+        const int32_t ret = llama_decode_wait(ctx);
+        if (ret != 0) {
+            LLAMA_LOG_ERROR("%s: the previous decode failed, ret = %d\n", __func__, ret);
+            return ret;
+        }
+    }
+
     const int ret = llama_decode_internal(*ctx, batch);
     if (ret < 0) {
         LLAMA_LOG_ERROR("%s: failed to decode, ret = %d\n", __func__, ret);
@@ -20719,8 +22553,66 @@ int32_t llama_decode(
     return ret;
 }
 
+int32_t llama_decode_async(
+        struct llama_context * ctx,
+          struct llama_batch   batch) {
+    if (ctx->decode_pending) {
+        const int32_t ret = llama_decode_wait(ctx);
+        if (ret != 0) {
+            LLAMA_LOG_ERROR("%s: the previous decode failed, ret = %d\n", __func__, ret);
+            return ret;
+        }
+    }
+
+    // the outputs of the last decode are set aside, the new ones go to the buffers of the decode before it
+    llama_output_swap(*ctx);
+
+    const int ret = llama_decode_internal(*ctx, batch);
+    if (ret != 0) {
+        if (ret < 0) {
+            LLAMA_LOG_ERROR("%s: failed to decode, ret = %d\n", __func__, ret);
+        }
+
+        // nothing to wait for, the outputs of the last decode stay in place
+        ggml_backend_sched_synchronize(ctx->sched);
+        llama_output_swap(*ctx);
+
+        return ret;
+    }
+
+    ctx->decode_pending = true;
+
+    return 0;
+}
+
+bool llama_decode_ready(struct llama_context * ctx) {
+    if (!ctx->decode_pending) {
+        return true;
+    }
+
+    for (ggml_backend_t backend : ctx->backend_stages) {
+        if (!ggml_backend_cpu_stage_is_idle(backend)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int32_t llama_decode_wait(struct llama_context * ctx) {
+    llama_synchronize(ctx);
+
+    const enum ggml_status status = ctx->compute_status;
+    ctx->compute_status = GGML_STATUS_SUCCESS;
+
+    return llama_status_ret(status);
+}
+
 void llama_synchronize(struct llama_context * ctx) {
     ggml_backend_sched_synchronize(ctx->sched);
+    llama_stages_status(*ctx);
+
+    ctx->decode_pending = false;
 
     // FIXME: if multiple single tokens are evaluated without a synchronization,
     // the stats will be added to the prompt evaluation stats
@@ -20750,7 +22642,7 @@ void llama_synchronize(struct llama_context * ctx) {
 }
 
 float * llama_get_logits(struct llama_context * ctx) {
-    llama_synchronize(ctx);
+    llama_output_scope scope(ctx);
 
     // reorder logits for backward compatibility
     // TODO: maybe deprecate this
@@ -20761,7 +22653,7 @@ float * llama_get_logits(struct llama_context * ctx) {
 
 float * llama_get_logits_ith(struct llama_context * ctx, int32_t i) {
     int32_t j = -1;
-    llama_synchronize(ctx);
+    llama_output_scope scope(ctx);
 
     try {
         if (ctx->logits == nullptr) {
@@ -20799,7 +22691,7 @@ float * llama_get_logits_ith(struct llama_context * ctx, int32_t i) {
 }
 
 float * llama_get_embeddings(struct llama_context * ctx) {
-    llama_synchronize(ctx);
+    llama_output_scope scope(ctx);
 
     // reorder embeddings for backward compatibility
     // TODO: maybe deprecate this
@@ -20811,7 +22703,7 @@ float * llama_get_embeddings(struct llama_context * ctx) {
 float * llama_get_embeddings_ith(struct llama_context * ctx, int32_t i) {
     int32_t j = -1;
 
-    llama_synchronize(ctx);
+    llama_output_scope scope(ctx);
 
     try {
         if (ctx->embd == nullptr) {
@@ -20849,7 +22741,7 @@ float * llama_get_embeddings_ith(struct llama_context * ctx, int32_t i) {
 }
 
 float * llama_get_embeddings_seq(struct llama_context * ctx, llama_seq_id seq_id) {
-    llama_synchronize(ctx);
+    llama_output_scope scope(ctx);
 
     auto it = ctx->embd_seq.find(seq_id);
     if (it == ctx->embd_seq.end()) {
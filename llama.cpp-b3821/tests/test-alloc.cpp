@@ -0,0 +1,158 @@
+// allocate graphs with parallel branches and in-place ops with ggml_gallocr and check that the results and the reported
+// memory usage are consistent
+
+#include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+// parallel feed-forward branches of different sizes summed together, followed by in-place ops
+static struct ggml_tensor * build_graph(struct ggml_context * ctx, int n_embd, int n_tokens, int n_branches) {
+    struct ggml_tensor * x = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_tokens);
+    ggml_set_input(x);
+
+    struct ggml_tensor * sum = nullptr;
+    for (int i = 0; i < n_branches; i++) {
+        const int n_ff = n_embd * (i + 1) / 2;
+        struct ggml_tensor * w_up   = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_ff);
+        struct ggml_tensor * w_down = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_ff, n_embd);
+
+        struct ggml_tensor * cur = ggml_silu(ctx, ggml_mul_mat(ctx, w_up, x));
+        cur = ggml_mul_mat(ctx, w_down, cur);
+        sum = sum ? ggml_add(ctx, sum, cur) : cur;
+    }
+
+    // the same parent twice in the last user
+    struct ggml_tensor * out = ggml_mul(ctx, sum, sum);
+    out = ggml_scale(ctx, ggml_rms_norm(ctx, out, 1e-6f), 0.5f);
+    ggml_set_output(out);
+
+    return out;
+}
+
+static float value(int tensor_id, int64_t i) {
+    return (float) ((tensor_id * 131 + i * 7) % 97) / 97.0f - 0.5f;
+}
+
+static std::vector<float> compute_reference(int n_embd, int n_tokens, int n_branches) {
+    struct ggml_init_params params = {
+        /* .mem_size   = */ 128*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+    struct ggml_context * ctx = ggml_init(params);
+
+    struct ggml_tensor * out = build_graph(ctx, n_embd, n_tokens, n_branches);
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, out);
+
+    int id = 0;
+    for (struct ggml_tensor * t = ggml_get_first_tensor(ctx); t != NULL; t = ggml_get_next_tensor(ctx, t)) {
+        if (t->op == GGML_OP_NONE) {
+            for (int64_t j = 0; j < ggml_nelements(t); j++) {
+                ggml_set_f32_1d(t, j, value(id, j));
+            }
+            id++;
+        }
+    }
+
+    ggml_graph_compute_with_ctx(ctx, gf, 2);
+
+    std::vector<float> result((float *) out->data, (float *) out->data + ggml_nelements(out));
+    ggml_free(ctx);
+
+    return result;
+}
+
+static bool test_graph(ggml_backend_t backend, int n_embd, int n_tokens, int n_branches) {
+    struct ggml_init_params params = {
+        /* .mem_size   = */ ggml_tensor_overhead()*GGML_DEFAULT_GRAPH_SIZE + ggml_graph_overhead(),
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ true,
+    };
+    struct ggml_context * ctx = ggml_init(params);
+
+    struct ggml_tensor * out = build_graph(ctx, n_embd, n_tokens, n_branches);
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, out);
+
+    ggml_gallocr_t galloc = ggml_gallocr_new(ggml_backend_get_default_buffer_type(backend));
+    bool ok = ggml_gallocr_reserve(galloc, gf) && ggml_gallocr_alloc_graph(galloc, gf);
+    if (!ok) {
+        fprintf(stderr, "%s: failed to allocate the graph\n", __func__);
+    }
+
+    size_t total = 0;
+    for (struct ggml_tensor * t = ggml_get_first_tensor(ctx); t != NULL; t = ggml_get_next_tensor(ctx, t)) {
+        total += ggml_nbytes(t);
+    }
+
+    const size_t buffer_size = ggml_gallocr_get_buffer_size(galloc, 0);
+    const size_t peak_size   = ggml_gallocr_get_peak_size(galloc, 0);
+
+    size_t max_live = 0;
+    for (int i = 0; i < ggml_graph_n_nodes(gf); i++) {
+        max_live = std::max(max_live, ggml_gallocr_get_live_size(galloc, 0, i));
+    }
+
+    if (ok && (peak_size > buffer_size || max_live != peak_size || buffer_size >= total)) {
+        fprintf(stderr, "%s: inconsistent memory usage: buffer %zu, peak %zu, max live %zu, all tensors %zu\n",
+                __func__, buffer_size, peak_size, max_live, total);
+        ok = false;
+    }
+
+    if (ok) {
+        int id = 0;
+        for (struct ggml_tensor * t = ggml_get_first_tensor(ctx); t != NULL; t = ggml_get_next_tensor(ctx, t)) {
+            if (t->op == GGML_OP_NONE) {
+                std::vector<float> data(ggml_nelements(t));
+                for (size_t j = 0; j < data.size(); j++) {
+                    data[j] = value(id, j);
+                }
+                ggml_backend_tensor_set(t, data.data(), 0, ggml_nbytes(t));
+                id++;
+            }
+        }
+
+        ggml_backend_graph_compute(backend, gf);
+
+        std::vector<float> result(ggml_nelements(out));
+        ggml_backend_tensor_get(out, result.data(), 0, ggml_nbytes(out));
+
+        const std::vector<float> expected = compute_reference(n_embd, n_tokens, n_branches);
+        for (size_t i = 0; i < result.size(); i++) {
+            if (std::fabs(result[i] - expected[i]) > 1e-5f) {
+                fprintf(stderr, "%s: result %zu differs: %f != %f\n", __func__, i, result[i], expected[i]);
+                ok = false;
+                break;
+            }
+        }
+    }
+
+    printf("%s: n_embd = %d, n_tokens = %d, n_branches = %d: buffer %zu, peak %zu, all tensors %zu: %s\n",
+            __func__, n_embd, n_tokens, n_branches, buffer_size, peak_size, total, ok ? "OK" : "FAIL");
+
+    ggml_gallocr_free(galloc);
+    ggml_free(ctx);
+
+    return ok;
+}
+
+int main(void) {
+    ggml_backend_t backend = ggml_backend_cpu_init();
+    ggml_backend_cpu_set_n_threads(backend, 2);
+
+    bool ok = true;
+    ok = test_graph(backend,  64,  8, 1) && ok;
+    ok = test_graph(backend,  64,  8, 4) && ok;
+    ok = test_graph(backend, 128, 32, 6) && ok;
+    ok = test_graph(backend, 256,  3, 3) && ok;
+
+    ggml_backend_free(backend);
+
+    return ok ? 0 : 1;
+}
@@ -68,8 +68,8 @@ int main(void) {
     argv = {"binary_name", "-sm", "hello"};
     assert(false == gpt_params_parse(argv.size(), list_str_to_char(argv).data(), params, LLAMA_EXAMPLE_COMMON));
 
-    // non-existence arg in specific example (--draft cannot be used outside llama-speculative)
-    argv = {"binary_name", "--draft", "123"};
+    // non-existence arg in specific example (--in-prefix cannot be used outside llama-cli and llama-infill)
+    argv = {"binary_name", "--in-prefix", "hello"};
     assert(false == gpt_params_parse(argv.size(), list_str_to_char(argv).data(), params, LLAMA_EXAMPLE_SERVER));
 
 
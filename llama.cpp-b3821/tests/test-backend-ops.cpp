@@ -349,6 +349,38 @@ enum test_mode {
     MODE_GRAD,
 };
 
+// like ggml_backend_compare_graph_backend, but computes the whole graph at once
+// only the outputs and the sentinels are compared, the other nodes may have been fused away
+static bool compare_graph_outputs(ggml_backend_t backend1, ggml_backend_t backend2, ggml_cgraph * graph, ggml_backend_eval_callback callback, void * user_data) {
+    struct ggml_backend_graph_copy copy = ggml_backend_graph_copy(backend2, graph);
+    if (copy.buffer == NULL) {
+        return false;
+    }
+
+    ggml_cgraph * g1 = graph;
+    ggml_cgraph * g2 = copy.graph;
+
+    ggml_backend_graph_compute(backend1, g1);
+    ggml_backend_graph_compute(backend2, g2);
+
+    for (int i = 0; i < ggml_graph_n_nodes(g1); i++) {
+        ggml_tensor * t1 = ggml_graph_node(g1, i);
+        ggml_tensor * t2 = ggml_graph_node(g2, i);
+
+        if (!(t1->flags & GGML_TENSOR_FLAG_OUTPUT) && t1->op != GGML_OP_NONE) {
+            continue;
+        }
+
+        if (!callback(i, t1, t2, user_data)) {
+            break;
+        }
+    }
+
+    ggml_backend_graph_copy_free(copy);
+
+    return true;
+}
+
 struct test_case {
     virtual ~test_case() {}
 
@@ -392,6 +424,11 @@ struct test_case {
         return {};
     }
 
+    // If true, compute the whole graph at once and compare only the outputs, so that the backends can fuse the ops in it.
+    virtual bool run_whole_graph() {
+        return false;
+    }
+
     virtual void initialize_tensors(ggml_context * ctx) {
         for (ggml_tensor * t = ggml_get_first_tensor(ctx); t != nullptr; t = ggml_get_next_tensor(ctx, t)) {
             init_tensor_uniform(t);
@@ -600,7 +637,9 @@ struct test_case {
             GGML_UNUSED(index);
         };
 
-        const bool cmp_ok = ggml_backend_compare_graph_backend(backend1, backend2, gf, callback, &ud);
+        const bool cmp_ok = run_whole_graph() ?
+            compare_graph_outputs(backend1, backend2, gf, callback, &ud) :
+            ggml_backend_compare_graph_backend(backend1, backend2, gf, callback, &ud);
 
         if (!cmp_ok) {
             printf("compare failed ");
@@ -1118,6 +1157,60 @@ struct test_get_rows : public test_case {
     }
 };
 
+// GGML_OP_SET_ROWS
+struct test_set_rows : public test_case {
+    const ggml_type type;
+    const int n; // cols
+    const int m; // rows
+    const int r; // rows to set
+    const bool t; // transposed destination (strided rows)
+
+    std::string vars() override {
+        return VARS_TO_STR5(type, n, m, r, t);
+    }
+
+    test_set_rows(ggml_type type = GGML_TYPE_F32, int n = 10, int m = 5, int r = 3, bool t = false)
+        : type(type), n(n), m(m), r(r), t(t) {}
+
+    ggml_tensor * build_graph(ggml_context * ctx) override {
+        ggml_tensor * dst = t ? ggml_new_tensor_2d(ctx, type, m, n) : ggml_new_tensor_2d(ctx, type, n, m);
+        ggml_set_name(dst, "dst");
+        if (t) {
+            dst = ggml_transpose(ctx, dst);
+            ggml_set_name(dst, "dst_transposed");
+        }
+
+        ggml_tensor * src = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n, r);
+        ggml_set_name(src, "src");
+
+        ggml_tensor * rows = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, r);
+        ggml_set_name(rows, "rows");
+
+        ggml_tensor * out = ggml_set_rows(ctx, dst, src, rows);
+        ggml_set_name(out, "out");
+
+        return out;
+    }
+
+    void initialize_tensors(ggml_context * ctx) override {
+        std::random_device rd;
+        std::default_random_engine rng(rd());
+        for (ggml_tensor * t = ggml_get_first_tensor(ctx); t != NULL; t = ggml_get_next_tensor(ctx, t)) {
+            if (t->type == GGML_TYPE_I32) {
+                // distinct rows, the order of the writes to a row is not defined
+                std::vector<int32_t> data(m);
+                for (int i = 0; i < m; i++) {
+                    data[i] = i;
+                }
+                std::shuffle(data.begin(), data.end(), rng);
+                ggml_backend_tensor_set(t, data.data(), 0, r * sizeof(int32_t));
+            } else if (!ggml_is_view_op(t->op)) {
+                init_tensor_uniform(t);
+            }
+        }
+    }
+};
+
 // GGML_OP_REPEAT
 struct test_repeat : public test_case {
     const ggml_type type;
@@ -2775,6 +2868,205 @@ struct test_opt_step_adamw : public test_case {
     }
 };
 
+// GGML_OP_RMS_NORM + GGML_OP_MUL (fused)
+struct test_rms_norm_mul : public test_case {
+    const ggml_type type;
+    const std::array<int64_t, 4> ne;
+    float eps;
+
+    std::string op_desc(ggml_tensor * t) override {
+        return "RMS_NORM_MUL";
+
+        GGML_UNUSED(t);
+    }
+
+    std::string vars() override {
+        return VARS_TO_STR3(type, ne, eps);
+    }
+
+    bool run_whole_graph() override {
+        return true;
+    }
+
+    test_rms_norm_mul(ggml_type type = GGML_TYPE_F32,
+            std::array<int64_t, 4> ne = {64, 5, 4, 3},
+            float eps = 1e-6f)
+        : type(type), ne(ne), eps(eps) {}
+
+    ggml_tensor * build_graph(ggml_context * ctx) override {
+        ggml_tensor * a = ggml_new_tensor(ctx, type, 4, ne.data());
+        ggml_set_name(a, "a");
+
+        ggml_tensor * w = ggml_new_tensor_1d(ctx, type, ne[0]);
+        ggml_set_name(w, "w");
+
+        ggml_tensor * out = ggml_mul(ctx, ggml_rms_norm(ctx, a, eps), w);
+        ggml_set_name(out, "out");
+        ggml_set_output(out);
+
+        return out;
+    }
+};
+
+// GGML_UNARY_OP_SILU + GGML_OP_MUL (fused)
+struct test_silu_mul : public test_case {
+    const ggml_type type;
+    const std::array<int64_t, 4> ne;
+    const int mid; // 0: MUL right after SILU, 1: up is a MUL_MAT computed in between, 2: a node in between also uses SILU
+
+    std::string op_desc(ggml_tensor * t) override {
+        return "SILU_MUL";
+
+        GGML_UNUSED(t);
+    }
+
+    std::string vars() override {
+        return VARS_TO_STR3(type, ne, mid);
+    }
+
+    bool run_whole_graph() override {
+        return true;
+    }
+
+    test_silu_mul(ggml_type type = GGML_TYPE_F32,
+            std::array<int64_t, 4> ne = {128, 5, 4, 3},
+            int mid = 0)
+        : type(type), ne(ne), mid(mid) {}
+
+    ggml_tensor * build_graph(ggml_context * ctx) override {
+        ggml_tensor * gate = ggml_new_tensor(ctx, type, 4, ne.data());
+        ggml_set_name(gate, "gate");
+
+        ggml_tensor * silu = ggml_silu(ctx, gate);
+        ggml_set_name(silu, "silu");
+
+        ggml_tensor * up = nullptr;
+        if (mid == 1) {
+            // the FFN of llama: SILU(gate), the up projection, MUL
+            ggml_tensor * w = ggml_new_tensor_2d(ctx, type, 32, ne[0]);
+            ggml_set_name(w, "w");
+
+            ggml_tensor * x = ggml_new_tensor_4d(ctx, type, 32, ne[1], ne[2], ne[3]);
+            ggml_set_name(x, "x");
+
+            up = ggml_mul_mat(ctx, w, x);
+        } else {
+            up = ggml_new_tensor(ctx, type, 4, ne.data());
+        }
+        ggml_set_name(up, "up");
+
+        ggml_tensor * out = nullptr;
+        if (mid == 2) {
+            // SILU, SQR(SILU), MUL, ADD - SILU has two users and cannot be fused into MUL
+            ggml_tensor * sqr = ggml_sqr(ctx, silu);
+            ggml_set_name(sqr, "sqr");
+
+            out = ggml_add(ctx, sqr, ggml_mul(ctx, silu, up));
+        } else {
+            out = ggml_mul(ctx, silu, up);
+        }
+        ggml_set_name(out, "out");
+        ggml_set_output(out);
+
+        return out;
+    }
+};
+
+// GGML_OP_MUL_MAT + GGML_OP_ADD (fused)
+struct test_mul_mat_add : public test_case {
+    const ggml_type type_a;
+    const ggml_type type_b;
+    const int64_t m;
+    const int64_t n;
+    const int64_t k;
+
+    std::string op_desc(ggml_tensor * t) override {
+        return "MUL_MAT_ADD";
+
+        GGML_UNUSED(t);
+    }
+
+    std::string vars() override {
+        return VARS_TO_STR5(type_a, type_b, m, n, k);
+    }
+
+    double max_nmse_err() override {
+        return 5e-4;
+    }
+
+    bool run_whole_graph() override {
+        return true;
+    }
+
+    test_mul_mat_add(ggml_type type_a = GGML_TYPE_F32, ggml_type type_b = GGML_TYPE_F32,
+            int64_t m = 32, int64_t n = 32, int64_t k = 32)
+        : type_a(type_a), type_b(type_b), m(m), n(n), k(k) {}
+
+    ggml_tensor * build_graph(ggml_context * ctx) override {
+        ggml_tensor * a = ggml_new_tensor_2d(ctx, type_a, k, m);
+        ggml_set_name(a, "a");
+
+        ggml_tensor * b = ggml_new_tensor_2d(ctx, type_b, k, n);
+        ggml_set_name(b, "b");
+
+        ggml_tensor * bias = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, m);
+        ggml_set_name(bias, "bias");
+
+        ggml_tensor * out = ggml_add(ctx, ggml_mul_mat(ctx, a, b), bias);
+        ggml_set_name(out, "out");
+        ggml_set_output(out);
+
+        return out;
+    }
+};
+
+// GGML_OP_SCALE + GGML_OP_SOFT_MAX (fused)
+struct test_scale_soft_max : public test_case {
+    const ggml_type type;
+    const std::array<int64_t, 4> ne;
+    bool mask;
+    float scale0;
+    float scale1;
+
+    std::string op_desc(ggml_tensor * t) override {
+        return "SCALE_SOFT_MAX";
+
+        GGML_UNUSED(t);
+    }
+
+    std::string vars() override {
+        return VARS_TO_STR5(type, ne, mask, scale0, scale1);
+    }
+
+    bool run_whole_graph() override {
+        return true;
+    }
+
+    test_scale_soft_max(ggml_type type = GGML_TYPE_F32,
+            std::array<int64_t, 4> ne = {32, 16, 4, 1},
+            bool mask = true,
+            float scale0 = 30.0f,
+            float scale1 = 0.1f)
+        : type(type), ne(ne), mask(mask), scale0(scale0), scale1(scale1) {}
+
+    ggml_tensor * build_graph(ggml_context * ctx) override {
+        ggml_tensor * a = ggml_new_tensor(ctx, type, 4, ne.data());
+        ggml_set_name(a, "a");
+
+        ggml_tensor * m = nullptr;
+        if (mask) {
+            m = ggml_new_tensor_2d(ctx, type, ne[0], ne[1]);
+            ggml_set_name(m, "m");
+        }
+
+        ggml_tensor * out = ggml_soft_max_ext(ctx, ggml_scale(ctx, a, scale0), m, scale1, 0.0f);
+        ggml_set_name(out, "out");
+        ggml_set_output(out);
+
+        return out;
+    }
+};
+
 enum llm_norm_type {
     LLM_NORM,
     LLM_NORM_RMS,
@@ -3226,6 +3518,13 @@ static bool test_backend(ggml_backend_t backend, test_mode mode, const char * op
         }
     }
 
+    for (ggml_type type : {GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_BF16, GGML_TYPE_Q8_0, GGML_TYPE_Q4_0}) {
+        test_cases.emplace_back(new test_set_rows(type, 256, 16, 5, false));
+    }
+    for (ggml_type type : {GGML_TYPE_F32, GGML_TYPE_F16}) {
+        test_cases.emplace_back(new test_set_rows(type, 64, 16, 5, true));
+    }
+
     for (ggml_type type_input : {GGML_TYPE_F32}) {
         for (ggml_op_pool pool_type : {GGML_OP_POOL_AVG, GGML_OP_POOL_MAX}) {
             for (int k0 : {1, 3}) {
@@ -3304,6 +3603,11 @@ static bool test_backend(ggml_backend_t backend, test_mode mode, const char * op
             test_cases.emplace_back(new test_cpy(type_src, type_dst, {256, 2, 3, 4}, {1, 0, 2, 3})); // cpy not-contiguous
         }
     }
+    for (ggml_type type_src : {GGML_TYPE_Q4_0, GGML_TYPE_Q8_0}) {
+        for (ggml_type type_dst : {GGML_TYPE_F16, GGML_TYPE_F32}) {
+            test_cases.emplace_back(new test_cpy(type_src, type_dst, {256, 4, 4, 4})); // dequantize
+        }
+    }
 
     test_cases.emplace_back(new test_cont());
     test_cases.emplace_back(new test_cont(GGML_TYPE_F32, {2, 1, 1 ,1}));
@@ -3616,6 +3920,23 @@ static bool test_backend(ggml_backend_t backend, test_mode mode, const char * op
         test_cases.emplace_back(new test_opt_step_adamw(GGML_TYPE_F32, {10, 5, 4, 3}, 1.0f, 1e-3f, 0.9f, 0.999f, wd));
     }
 
+    // fused ops
+    for (float eps : {1e-6f, 1e-5f}) {
+        test_cases.emplace_back(new test_rms_norm_mul(GGML_TYPE_F32, {64, 5, 4, 3}, eps));
+    }
+    test_cases.emplace_back(new test_rms_norm_mul(GGML_TYPE_F32, {4096, 1, 1, 1}));
+    test_cases.emplace_back(new test_silu_mul(GGML_TYPE_F32, {128, 5, 4, 3}));
+    test_cases.emplace_back(new test_silu_mul(GGML_TYPE_F32, {11008, 1, 1, 1}));
+    test_cases.emplace_back(new test_silu_mul(GGML_TYPE_F32, {128, 5, 4, 3}, 1));
+    test_cases.emplace_back(new test_silu_mul(GGML_TYPE_F32, {128, 5, 4, 3}, 2));
+    for (ggml_type type_a : {GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_Q4_0, GGML_TYPE_Q8_0}) {
+        for (int n : {1, 7, 32}) {
+            test_cases.emplace_back(new test_mul_mat_add(type_a, GGML_TYPE_F32, 64, n, 256));
+        }
+    }
+    test_cases.emplace_back(new test_scale_soft_max(GGML_TYPE_F32, {32, 16, 4, 1}, true));
+    test_cases.emplace_back(new test_scale_soft_max(GGML_TYPE_F32, {32, 16, 4, 1}, false));
+
     // these tests are disabled to save execution time, but they can be handy for debugging
 #if 0
     test_cases.emplace_back(new test_llama(1));
@@ -3640,6 +3961,13 @@ static bool test_backend(ggml_backend_t backend, test_mode mode, const char * op
     if (mode == MODE_TEST) {
         ggml_backend_t backend_cpu = ggml_backend_cpu_init();
 
+        if (ggml_backend_is_cpu(backend)) {
+            // the CPU backend is tested against itself: compare the fused kernels with the unfused ops
+            ggml_backend_cpu_set_fuse_ops(backend_cpu, false);
+            test_cases.erase(std::remove_if(test_cases.begin(), test_cases.end(),
+                [](const std::unique_ptr<test_case> & test) { return !test->run_whole_graph(); }), test_cases.end());
+        }
+
         size_t n_ok = 0;
         for (auto & test : test_cases) {
             if (test->eval(backend, backend_cpu, op_name)) {
@@ -3721,7 +4049,7 @@ int main(int argc, char ** argv) {
         ggml_backend_t backend = ggml_backend_reg_init_backend(i, NULL);
         GGML_ASSERT(backend != NULL);
 
-        if (backend_filter == NULL && ggml_backend_is_cpu(backend) && mode != MODE_GRAD) {
+        if (backend_filter == NULL && ggml_backend_is_cpu(backend) && mode == MODE_PERF) {
             printf("  Skipping CPU backend\n");
             ggml_backend_free(backend);
             n_ok++;
@@ -0,0 +1,210 @@
+// context shift with the KV cache of the sliding-window layers
+//
+// a tiny random gemma2 model is written to a temporary file and run with the sliding-window cache and with the full
+// cache - after a context shift that brings the n_keep cells back into the window, both have to give the same logits
+
+#include "llama.h"
+#include "ggml.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+static const int n_vocab = 64;
+static const int n_swa   = 32;
+
+static void write_model(const char * fname) {
+    const int n_embd    = 32;
+    const int n_head    = 2;
+    const int n_head_kv = 1;
+    const int n_ff      = 32;
+    const int n_layer   = 26; // gemma2 2B, the only layer counts that the graph knows how to scale Q for
+
+    gguf_context * gguf = gguf_init_empty();
+
+    gguf_set_val_str(gguf, "general.architecture",                   "gemma2");
+    gguf_set_val_str(gguf, "tokenizer.ggml.model",                   "no_vocab");
+    gguf_set_val_u32(gguf, "gemma2.vocab_size",                      n_vocab);
+    gguf_set_val_u32(gguf, "gemma2.context_length",                  4096);
+    gguf_set_val_u32(gguf, "gemma2.embedding_length",                n_embd);
+    gguf_set_val_u32(gguf, "gemma2.block_count",                     n_layer);
+    gguf_set_val_u32(gguf, "gemma2.feed_forward_length",             n_ff);
+    gguf_set_val_u32(gguf, "gemma2.attention.head_count",            n_head);
+    gguf_set_val_u32(gguf, "gemma2.attention.head_count_kv",         n_head_kv);
+    gguf_set_val_u32(gguf, "gemma2.attention.key_length",            n_embd/n_head);
+    gguf_set_val_u32(gguf, "gemma2.attention.value_length",          n_embd/n_head);
+    gguf_set_val_u32(gguf, "gemma2.attention.sliding_window",        n_swa);
+    gguf_set_val_f32(gguf, "gemma2.attention.layer_norm_rms_epsilon", 1e-6f);
+    gguf_set_val_f32(gguf, "gemma2.attn_logit_softcapping",          50.0f);
+    gguf_set_val_f32(gguf, "gemma2.final_logit_softcapping",         30.0f);
+
+    ggml_init_params params = {
+        /*.mem_size   =*/ 16*1024*1024,
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ false,
+    };
+
+    ggml_context * ctx = ggml_init(params);
+
+    std::mt19937 rng(42);
+    std::normal_distribution<float> dist(0.0f, 0.2f);
+
+    auto add = [&](const std::string & name, int64_t ne0, int64_t ne1) {
+        ggml_tensor * t = ne1 > 0 ? ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1) : ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne0);
+        ggml_set_name(t, name.c_str());
+
+        float * data = (float *) t->data;
+        for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+            // the norm weights are 1-D
+            data[i] = ne1 > 0 ? dist(rng) : 1.0f;
+        }
+
+        gguf_add_tensor(gguf, t);
+    };
+
+    add("token_embd.weight",  n_embd, n_vocab);
+    add("output_norm.weight", n_embd, 0);
+
+    for (int il = 0; il < n_layer; ++il) {
+        const std::string blk = "blk." + std::to_string(il) + ".";
+
+        add(blk + "attn_norm.weight",           n_embd, 0);
+        add(blk + "attn_q.weight",              n_embd, n_embd);
+        add(blk + "attn_k.weight",              n_embd, n_embd/n_head*n_head_kv);
+        add(blk + "attn_v.weight",              n_embd, n_embd/n_head*n_head_kv);
+        add(blk + "attn_output.weight",         n_embd, n_embd);
+        add(blk + "post_attention_norm.weight", n_embd, 0);
+        add(blk + "ffn_norm.weight",            n_embd, 0);
+        add(blk + "ffn_gate.weight",            n_embd, n_ff);
+        add(blk + "ffn_up.weight",              n_embd, n_ff);
+        add(blk + "ffn_down.weight",            n_ff,   n_embd);
+        add(blk + "post_ffw_norm.weight",       n_embd, 0);
+    }
+
+    gguf_write_to_file(gguf, fname, false);
+
+    gguf_free(gguf);
+    ggml_free(ctx);
+}
+
+static llama_context * new_context(llama_model * model, bool swa_full, uint32_t n_swa_keep) {
+    llama_context_params cparams = llama_context_default_params();
+
+    cparams.n_ctx           = 512;
+    cparams.n_batch         = 16;
+    cparams.n_ubatch        = 16;
+    cparams.n_threads       = 2;
+    cparams.n_threads_batch = 2;
+    cparams.swa_full        = swa_full;
+    cparams.n_swa_keep      = n_swa_keep;
+
+    return llama_new_context_with_model(model, cparams);
+}
+
+static void decode(llama_context * ctx, llama_batch & batch, const std::vector<llama_token> & tokens, llama_pos pos) {
+    for (size_t i = 0; i < tokens.size(); i += 16) {
+        batch.n_tokens = 0;
+        for (size_t j = i; j < std::min(tokens.size(), i + 16); ++j) {
+            const int k = batch.n_tokens++;
+
+            batch.token   [k]    = tokens[j];
+            batch.pos     [k]    = pos + j;
+            batch.n_seq_id[k]    = 1;
+            batch.seq_id  [k][0] = 0;
+            batch.logits  [k]    = j + 1 == tokens.size();
+        }
+
+        const int ret = llama_decode(ctx, batch);
+        assert(ret == 0);
+    }
+}
+
+int main(int argc, char ** argv) {
+    const char * fname = argc > 1 ? argv[1] : "test-kv-cache-swa.gguf";
+
+    write_model(fname);
+
+    llama_backend_init();
+
+    llama_model * model = llama_load_model_from_file(fname, llama_model_default_params());
+    assert(model != nullptr);
+
+    const int n_keep    = 4;
+    const int n_prompt  = 200;
+    const int n_discard = 180; // the shifted context is shorter than n_swa + n_keep
+
+    llama_context * ctx_swa  = new_context(model, false, n_keep);
+    llama_context * ctx_full = new_context(model, true,  0);
+    llama_context * ctx_rm   = new_context(model, false, 0);
+
+    llama_batch batch = llama_batch_init(16, 0, 1);
+
+    std::mt19937 rng(1);
+    std::vector<llama_token> prompt(n_prompt);
+    for (auto & t : prompt) {
+        t = rng() % n_vocab;
+    }
+
+    for (auto * ctx : { ctx_swa, ctx_full, ctx_rm }) {
+        decode(ctx, batch, prompt, 0);
+    }
+
+    // without the n_keep cells, the sliding-window cache refuses the shift and stays as it was
+    {
+        const bool ok = llama_kv_cache_seq_rm(ctx_rm, 0, n_keep, n_keep + n_discard);
+        printf("shift without the n_keep cells: %s\n", ok ? "accepted" : "refused");
+        assert(!ok);
+        assert(llama_kv_cache_seq_pos_max(ctx_rm, 0) == n_prompt - 1);
+        assert(llama_get_kv_cache_used_cells(ctx_rm) == n_prompt);
+    }
+
+    for (auto * ctx : { ctx_swa, ctx_full }) {
+        const bool ok = llama_kv_cache_seq_rm(ctx, 0, n_keep, n_keep + n_discard);
+        assert(ok);
+        llama_kv_cache_seq_add(ctx, 0, n_keep + n_discard, n_prompt, -n_discard);
+    }
+
+    llama_pos pos = n_prompt - n_discard;
+
+    // the shifted context is generated greedily, its window reaches back to the n_keep cells at first
+    double max_diff = 0.0;
+    for (int i = 0; i < 2*n_swa; ++i) {
+        const float * logits_swa  = llama_get_logits_ith(ctx_swa,  -1);
+        const float * logits_full = llama_get_logits_ith(ctx_full, -1);
+
+        for (int j = 0; j < n_vocab; ++j) {
+            max_diff = std::max(max_diff, (double) std::fabs(logits_swa[j] - logits_full[j]));
+        }
+
+        const llama_token id = std::max_element(logits_full, logits_full + n_vocab) - logits_full;
+
+        for (auto * ctx : { ctx_swa, ctx_full }) {
+            decode(ctx, batch, { id }, pos);
+        }
+        pos++;
+    }
+
+    // the caches hold the cells in another order, which only changes the rounding of the sums - a window with missing
+    // or misplaced cells changes the logits by more than 1
+    printf("max abs diff of the logits after the shift: %g\n", max_diff);
+    assert(max_diff < 1e-2);
+
+    llama_batch_free(batch);
+
+    llama_free(ctx_swa);
+    llama_free(ctx_full);
+    llama_free(ctx_rm);
+    llama_free_model(model);
+
+    llama_backend_free();
+
+    std::remove(fname);
+
+    return 0;
+}
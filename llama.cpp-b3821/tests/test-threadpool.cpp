@@ -0,0 +1,208 @@
+// compute graphs from several threads on a shared threadpool and check that the results do not change
+
+#include "ggml.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+struct test_graph {
+    struct ggml_context * ctx;
+    struct ggml_cgraph  * gf;
+    struct ggml_tensor  * out;
+    struct ggml_cplan     cplan;
+
+    std::vector<uint8_t> work_data;
+    std::vector<float>   expected;
+};
+
+static void init_graph(test_graph & g, int n_layers, int n_embd, int n_threads, int32_t priority, struct ggml_threadpool * threadpool) {
+    struct ggml_init_params params = {
+        /* .mem_size   = */ 256*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+
+    g.ctx = ggml_init(params);
+
+    struct ggml_tensor * x = ggml_new_tensor_2d(g.ctx, GGML_TYPE_F32, n_embd, 4);
+    for (int64_t i = 0; i < ggml_nelements(x); i++) {
+        ggml_set_f32_1d(x, i, (float) (rand() % 100) / 100.0f);
+    }
+
+    g.out = x;
+    for (int il = 0; il < n_layers; il++) {
+        struct ggml_tensor * w = ggml_new_tensor_2d(g.ctx, GGML_TYPE_F32, n_embd, n_embd);
+        for (int64_t i = 0; i < ggml_nelements(w); i++) {
+            ggml_set_f32_1d(w, i, (float) (rand() % 100 - 50) / (50.0f * n_embd));
+        }
+        g.out = ggml_silu(g.ctx, ggml_mul_mat(g.ctx, w, g.out));
+    }
+
+    g.gf = ggml_new_graph(g.ctx);
+    ggml_build_forward_expand(g.gf, g.out);
+
+    g.cplan = ggml_graph_plan(g.gf, n_threads, threadpool);
+    g.work_data.resize(g.cplan.work_size);
+    g.cplan.work_data = g.work_data.data();
+    g.cplan.priority  = priority;
+}
+
+static bool compute_and_check(test_graph & g) {
+    if (ggml_graph_compute(g.gf, &g.cplan) != GGML_STATUS_SUCCESS) {
+        return false;
+    }
+    return memcmp(g.out->data, g.expected.data(), ggml_nbytes(g.out)) == 0;
+}
+
+// the threads go on to the next node without a barrier only when it does not read what the previous nodes write
+static bool test_barrier_plan(int n_threads, struct ggml_threadpool * threadpool) {
+    struct ggml_init_params params = {
+        /* .mem_size   = */ 16*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+
+    struct ggml_context * ctx = ggml_init(params);
+
+    struct ggml_tensor * src[4];
+    for (auto & t : src) {
+        t = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 4096, 16);
+        for (int64_t i = 0; i < ggml_nelements(t); i++) {
+            ggml_set_f32_1d(t, i, (float) (rand() % 100) / 100.0f);
+        }
+    }
+
+    // a and b are independent: no barrier after a
+    // c reads a and b, d reads c that was written one node back: barriers after b and c
+    struct ggml_tensor * a = ggml_add(ctx, src[0], src[1]);
+    struct ggml_tensor * b = ggml_mul(ctx, src[2], src[3]);
+    struct ggml_tensor * c = ggml_add(ctx, a, b);
+    struct ggml_tensor * d = ggml_sqr(ctx, c);
+
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, d);
+
+    const struct ggml_tensor * nodes[] = { a, b, c, d };
+    const bool                 synced[] = { false, true, true, true };
+
+    bool ok = ggml_graph_n_nodes(gf) == 4;
+
+    std::vector<float> result[2];
+    for (int k = 0; k < 2 && ok; k++) {
+        struct ggml_cplan cplan = ggml_graph_plan(gf, k == 0 ? n_threads : 1, threadpool);
+        std::vector<uint8_t> work_data(cplan.work_size);
+        cplan.work_data = work_data.data();
+
+        ok = ggml_graph_compute(gf, &cplan) == GGML_STATUS_SUCCESS;
+
+        for (int i = 0; k == 0 && i < 4 && ok; i++) {
+            ok = ggml_graph_node(gf, i) == nodes[i] && ggml_threadpool_node_synced(threadpool, i) == (synced[i] || n_threads == 1);
+            if (!ok) {
+                fprintf(stderr, "barrier plan: node %d (%s) %s synchronized\n", i, ggml_op_desc(nodes[i]), synced[i] ? "not" : "is");
+            }
+        }
+
+        const float * data = (const float *) d->data;
+        result[k].assign(data, data + ggml_nelements(d));
+    }
+
+    if (ok && result[0] != result[1]) {
+        fprintf(stderr, "barrier plan: the result with %d threads differs from the single thread one\n", n_threads);
+        ok = false;
+    }
+
+    ggml_free(ctx);
+
+    return ok;
+}
+
+int main(int argc, char ** argv) {
+    int n_threads = 4;
+    int n_rounds  = 50;
+
+    if (argc > 1) {
+        n_threads = std::atoi(argv[1]);
+    }
+
+    if (argc > 2) {
+        n_rounds  = std::atoi(argv[2]);
+    }
+
+    struct ggml_threadpool_params tpp = ggml_threadpool_params_default(n_threads);
+    struct ggml_threadpool * threadpool = ggml_threadpool_new(&tpp);
+    if (!threadpool) {
+        fprintf(stderr, "threadpool create failed : n_threads %d\n", n_threads);
+        return 1;
+    }
+
+    // one graph per caller, e.g. a high priority decode and a low priority batch job
+    std::vector<test_graph> graphs(3);
+    init_graph(graphs[0], 4,  64, n_threads,     1, threadpool);
+    init_graph(graphs[1], 8, 256, n_threads,     0, threadpool);
+    init_graph(graphs[2], 2, 128, n_threads / 2 + 1, 0, threadpool);
+
+    // reference results, computed one caller at a time
+    for (auto & g : graphs) {
+        ggml_graph_compute(g.gf, &g.cplan);
+        const float * data = (const float *) g.out->data;
+        g.expected.assign(data, data + ggml_nelements(g.out));
+    }
+
+    std::vector<int> n_failed(graphs.size(), 0);
+    std::vector<std::thread> callers;
+    for (size_t i = 0; i < graphs.size(); i++) {
+        callers.emplace_back([&, i]() {
+            for (int r = 0; r < n_rounds; r++) {
+                n_failed[i] += !compute_and_check(graphs[i]);
+            }
+        });
+    }
+    for (auto & t : callers) {
+        t.join();
+    }
+
+    // pausing from another thread must wait for the graph being computed
+    std::thread caller([&]() {
+        for (int r = 0; r < n_rounds; r++) {
+            n_failed[0] += !compute_and_check(graphs[0]);
+        }
+    });
+    for (int r = 0; r < n_rounds; r++) {
+        ggml_threadpool_pause(threadpool);
+        ggml_threadpool_resume(threadpool);
+    }
+    caller.join();
+
+    struct ggml_threadpool_stats stats;
+    ggml_threadpool_get_stats(threadpool, &stats);
+
+    int ret = 0;
+    for (size_t i = 0; i < graphs.size(); i++) {
+        if (n_failed[i] > 0) {
+            fprintf(stderr, "graph %zu: %d of its computations gave different results\n", i, n_failed[i]);
+            ret = 1;
+        }
+        ggml_free(graphs[i].ctx);
+    }
+
+    const int64_t n_graphs_expected = (int64_t) graphs.size() * (n_rounds + 1) + n_rounds;
+    if (stats.n_graphs != n_graphs_expected) {
+        fprintf(stderr, "threadpool computed %lld graphs, expected %lld\n", (long long) stats.n_graphs, (long long) n_graphs_expected);
+        ret = 1;
+    }
+
+    if (!test_barrier_plan(n_threads, threadpool)) {
+        ret = 1;
+    }
+
+    ggml_threadpool_free(threadpool);
+
+    if (ret == 0) {
+        printf("OK\n");
+    }
+
+    return ret;
+}